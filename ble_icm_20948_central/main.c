@@ -40,6 +40,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "nordic_common.h"
 #include "app_error.h"
@@ -68,6 +69,7 @@
 #include "nrf_log_default_backends.h"
 
 #include "imu.h"
+#include "imu_wire.h"
 #ifdef BOARD_PCA10059_USBD_SUPPORTED
 #include "usbd.h"
 #else
@@ -82,14 +84,17 @@
 
 #define ECHOBACK_BLE_UART_DATA  0                                       /**< Echo the UART data that is received over the Nordic UART Service (NUS) back to the sender. */
 
+#define IMU_WIRE_SAMPLES_MAX    UINT8_MAX                               /**< Most samples in one IMU packet, packed ones can hold that many. */
 
-// the following holds the current settings for the accel, gyro, and mag full scale resolutions
-static uint8_t mems_fsr_array[4] = {0x00, 0x00, 0x00, 0x00};
+
+// the following holds the current settings for the accel, gyro, and mag full scale resolutions,
+// a spare byte and the sample rate in Hz (little endian)
+static uint8_t mems_fsr_array[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 // retrieve the fsr settings from the peripheral and update saved values
 static void ble_nus_chars_received_fsr(uint8_t const * p_data, uint16_t data_len)
 {
     uint32_t i;
-    for (i = 0; i < data_len; i++)
+    for (i = 0; (i < data_len) && (i < sizeof(mems_fsr_array)); i++)
     {
         mems_fsr_array[i] = p_data[i];
     }
@@ -260,6 +265,79 @@ static void ble_nus_chars_received_uart_print(uint8_t const * p_data, uint16_t d
 }
 
 
+/**@brief Function for printing a packet of IMU samples.
+ *
+ * @details The peripheral packs as many samples into a notification as the ATT MTU allows,
+ *          in the imu_wire format.  Each sample is decoded and printed on its own line,
+ *          with only the channels the peripheral sent.
+ */
+static void ble_nus_samples_received_uart_print(uint8_t const * p_data, uint16_t data_len)
+{
+    static union
+    {
+        IMU_DATA data[IMU_WIRE_SAMPLES_MAX];
+        IMU_QUAT quat[IMU_WIRE_SAMPLES_MAX];
+    } samples;
+    imu_wire_header header;
+    char line[128];
+    int count, i, n;
+
+    if (imu_wire_decode_header(p_data, data_len, &header) != 0)
+    {
+        NRF_LOG_INFO("Unknown IMU packet, %d bytes", data_len);
+        return;
+    }
+
+    if (header.channels & IMU_WIRE_QUAT)
+    {
+        count = imu_wire_decode_quat(p_data, data_len, samples.quat, IMU_WIRE_SAMPLES_MAX);
+    }
+    else
+    {
+        count = imu_wire_decode_data(p_data, data_len, samples.data, IMU_WIRE_SAMPLES_MAX);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (header.channels & IMU_WIRE_QUAT)
+        {
+            IMU_QUAT const * q = &samples.quat[i];
+
+            n = snprintf(line, sizeof(line), "%d %lu q %ld %ld %ld %ld", q->sensor, (unsigned long)q->time_stamp,
+                         (long)q->q0, (long)q->q1, (long)q->q2, (long)q->q3);
+            if (header.channels & IMU_WIRE_ACCURACY)
+            {
+                n += snprintf(&line[n], sizeof(line) - n, " acc %d", q->accuracy);
+            }
+        }
+        else
+        {
+            IMU_DATA const * d = &samples.data[i];
+
+            n = snprintf(line, sizeof(line), "%d %lu", d->sensor, (unsigned long)d->time_stamp);
+            if (header.channels & IMU_WIRE_ACCEL)
+            {
+                n += snprintf(&line[n], sizeof(line) - n, " a %d %d %d", d->ax, d->ay, d->az);
+            }
+            if (header.channels & IMU_WIRE_GYRO)
+            {
+                n += snprintf(&line[n], sizeof(line) - n, " g %d %d %d", d->gx, d->gy, d->gz);
+            }
+            if (header.channels & IMU_WIRE_MAGN)
+            {
+                n += snprintf(&line[n], sizeof(line) - n, " m %d %d %d", d->mx, d->my, d->mz);
+            }
+            if (header.channels & IMU_WIRE_TEMP)
+            {
+                n += snprintf(&line[n], sizeof(line) - n, " t %d", d->temperature);
+            }
+        }
+        n += snprintf(&line[n], sizeof(line) - n, "\r\n");
+        output_string((uint8_t *)line, n);
+    }
+}
+
+
 void ble_process_input_string_handler(uint8_t *data_array, uint32_t length)
 {
     uint16_t index = length;
@@ -295,6 +373,22 @@ void ble_process_input_string_handler(uint8_t *data_array, uint32_t length)
         ret_val += ble_nus_c_string_send(&m_ble_nus_c, mems_fsr_array, 4);
         ret_val += ble_nus_c_rx_notif_enable(&m_ble_nus_c, false);
     }
+    else if ((index >= 3) && ((data_array[0] == 'f') || (data_array[0] == 'F'))
+                          && (data_array[1] >= '0') && (data_array[1] <= '9'))
+    {
+        // sample rate in Hz, the peripheral fits the connection to it
+        uint32_t rate = 0;
+        for (uint16_t i = 1; (i < index) && (data_array[i] >= '0') && (data_array[i] <= '9'); i++)
+        {
+            rate = MIN(rate * 10 + (data_array[i] - '0'), UINT16_MAX);
+        }
+        mems_fsr_array[4] = (uint8_t)(rate >> 0);
+        mems_fsr_array[5] = (uint8_t)(rate >> 8);
+
+        ret_val  = ble_nus_c_rx_notif_enable(&m_ble_nus_c, true);
+        ret_val += ble_nus_c_string_send(&m_ble_nus_c, mems_fsr_array, sizeof(mems_fsr_array));
+        ret_val += ble_nus_c_rx_notif_enable(&m_ble_nus_c, false);
+    }
     else if ((index >= 3) && ((data_array[0] == 'i') || (data_array[0] == 'I'))
                           && ((data_array[1] == 'd') || (data_array[1] == 'D')))
     {
@@ -337,7 +431,7 @@ static void ble_nus_c_evt_handler(ble_nus_c_t * p_ble_nus_c, ble_nus_c_evt_t con
             break;
 
         case BLE_NUS_C_EVT_NUS_TX_EVT:
-            ble_nus_chars_received_uart_print(p_ble_nus_evt->p_data, p_ble_nus_evt->data_len);
+            ble_nus_samples_received_uart_print(p_ble_nus_evt->p_data, p_ble_nus_evt->data_len);
             break;
 
         case BLE_NUS_C_EVT_READ_RSP:
@@ -397,8 +491,7 @@ static void on_read_response(ble_nus_c_t * p_ble_nus_c, ble_evt_t const * p_ble_
     NRF_LOG_INFO("conn_handle: 0x%04x", p_ble_evt->evt.gattc_evt.conn_handle);
 
     // Check if this is a AMT RCB read response.
-    if (    (p_ble_evt->evt.gattc_evt.params.read_rsp.handle == p_ble_nus_c->handles.nus_id_handle)
-         || (p_ble_evt->evt.gattc_evt.params.read_rsp.handle == p_ble_nus_c->handles.nus_tx_handle) )
+    if (p_ble_evt->evt.gattc_evt.params.read_rsp.handle == p_ble_nus_c->handles.nus_id_handle)
     {
         ble_nus_c_evt_t ble_nus_evt;
         ble_nus_evt.evt_type             = BLE_NUS_C_EVT_READ_RSP;
@@ -407,6 +500,16 @@ static void on_read_response(ble_nus_c_t * p_ble_nus_c, ble_evt_t const * p_ble_
         ble_nus_evt.data_len = p_ble_evt->evt.gattc_evt.params.read_rsp.len;
         p_ble_nus_c->evt_handler(p_ble_nus_c, &ble_nus_evt);
     }
+    else if (p_ble_evt->evt.gattc_evt.params.read_rsp.handle == p_ble_nus_c->handles.nus_tx_handle)
+    {
+        // the last packet of samples, printed the same way as when it was notified
+        ble_nus_c_evt_t ble_nus_evt;
+        ble_nus_evt.evt_type             = BLE_NUS_C_EVT_NUS_TX_EVT;
+        ble_nus_evt.conn_handle = p_ble_evt->evt.gattc_evt.conn_handle;
+        ble_nus_evt.p_data = p_ble_evt->evt.gattc_evt.params.read_rsp.data;
+        ble_nus_evt.data_len = p_ble_evt->evt.gattc_evt.params.read_rsp.len;
+        p_ble_nus_c->evt_handler(p_ble_nus_c, &ble_nus_evt);
+    }
     else if (p_ble_evt->evt.gattc_evt.params.read_rsp.handle == p_ble_nus_c->handles.nus_rx_handle)
     {
         ble_nus_c_evt_t ble_nus_evt;
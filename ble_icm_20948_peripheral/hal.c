@@ -21,25 +21,76 @@
 /***********************************************************************/
 /*                                                                     */
 /* HAL -- These are the callback functions required by the InvenSense  */
-/*        IMC-20948 driver.                                            */
+/*        IMC-20948 driver.  The registers are reached over I2C        */
+/*        (twi.c), or over SPI (spi.c) when the board sets             */
+/*        IMU_SPI_ENABLED in app_config.h.  The functions keep their   */
+/*        i2c names either way.                                        */
 /*                                                                     */
 /***********************************************************************/
 
+#include <string.h>
+
 #include "nrf_delay.h"
-#include "nrf_drv_rtc.h"
 
 #include "imu.h"
+#include "imu_int.h"
 #include "hal.h"
+
+#if IMU_SPI_ENABLED
+#include "spi.h"
+
+typedef spi_xfer_t bus_xfer_t;
+#define BUS_MAX_READ            SPI_MAX_READ
+#define BUS_MAX_WRITE           SPI_MAX_WRITE
+#define BUS_MAX_PREFIXED        SPI_MAX_PREFIXED
+#define bus_init                spi_init
+#define bus_schedule_list       spi_schedule_list
+#define bus_transfer_list       spi_transfer_list
+#define bus_check               spi_check
+#define BUS_CAPTURE_OFFSET      1       // the byte clocked in with the register address
+#define BUS_BYTE_US             2       // at the 4MHz read clock, rounded up
+#define bus_capture_arm(addr, reg, buffer, len, task, event) \
+                                ((addr) != IMU_ADDR ? NRF_ERROR_INVALID_PARAM : \
+                                spi_capture_arm(reg, buffer, len, task, event))
+#define bus_capture_rearm       spi_capture_rearm
+#define bus_capture_disarm      spi_capture_disarm
+#else
 #include "twi.h"
 
+typedef twi_xfer_t bus_xfer_t;
+#define BUS_MAX_READ            UINT8_MAX
+#define BUS_MAX_WRITE           TWI_MAX_WRITE
+#define BUS_MAX_PREFIXED        TWI_MAX_PREFIXED
+#define bus_init                twi_init
+#define bus_schedule_list       twi_schedule_list
+#define bus_transfer_list       twi_transfer_list
+#define bus_check               twi_check
+#define BUS_CAPTURE_OFFSET      0
+#define BUS_BYTE_US             36      // 9 bits at 250kHz
+#define bus_capture_arm(addr, reg, buffer, len, task, event) \
+                                twi_capture_arm(addr, reg, buffer, len, task, event)
+#define bus_capture_rearm       twi_capture_rearm
+#define bus_capture_disarm      twi_capture_disarm
+#endif
+
 
-static bool verbose = false;	// For debugging I2C issues.
+// Blocking writes too long to be copied into the transfer queue go out of
+// here as prefixed writes.
+static uint8_t write_buffer[1 + BUS_MAX_PREFIXED];
 
-const nrf_drv_rtc_t rtc = NRF_DRV_RTC_INSTANCE(0); /**< Declaring an instance of nrf_drv_rtc for RTC0. */
+static uint32_t capture_len;
+static bool     bus_ready;
 
+// Both times come from the 1MHz timer in imu_int.c, which runs once
+// imu_int_init() has been called.
 uint32_t inv_icm20948_get_time_us(void)
 {
-    return nrf_drv_rtc_counter_get(&rtc);
+    return imu_int_time_us();
+}
+
+uint32_t inv_icm20948_get_int_time_us(void)
+{
+    return imu_int_edge_us();
 }
 
 void inv_icm20948_sleep_us(uint32_t us)
@@ -47,73 +98,176 @@ void inv_icm20948_sleep_us(uint32_t us)
     nrf_delay_us(us);
 }
 
-int inv_icm20948_i2c_init(void)
+// Fill in a transfer of the register access, false if the transport cannot
+// move that many bytes in one go or does not reach the sensor at addr.
+static bool inv_icm20948_bus_xfer(bus_xfer_t *p_xfer, uint8_t addr, uint8_t reg, uint8_t * buffer, uint32_t len, bool read,
+                                  bool prefixed, inv_icm20948_i2c_callback_t callback, void *context)
 {
-    return 0;
+    if (len > (read ? BUS_MAX_READ : prefixed ? BUS_MAX_PREFIXED : BUS_MAX_WRITE))
+        return false;
+
+#if IMU_SPI_ENABLED
+    // a single chip select
+    if (addr != IMU_ADDR)
+        return false;
+#else
+    p_xfer->addr      = addr;
+#endif
+    p_xfer->reg       = reg;
+    p_xfer->p_data    = buffer;
+    p_xfer->length    = len;
+    p_xfer->read      = read;
+    p_xfer->prefixed  = prefixed && !read;
+    p_xfer->callback  = callback;
+    p_xfer->p_context = context;
+    return true;
 }
 
-int inv_icm20948_i2c_read_reg(uint8_t reg, uint8_t *value)
+static int inv_icm20948_bus_transfer(uint8_t addr, uint8_t reg, uint8_t * buffer, uint32_t len, bool read)
 {
-    if (verbose)
-        printf("Executing %s(0x%02x)\r\n", __func__, reg);
+    bus_xfer_t xfer;
+    bool       prefixed = !read && (len > BUS_MAX_WRITE);
 
-    *value = twi_read_register(IMU_ADDR, reg);
-
-    if (verbose)
+    if (prefixed && (len <= BUS_MAX_PREFIXED))
     {
-        printf("0x%02x\r\n", *value);
+        memcpy(&write_buffer[1], buffer, len);
+        buffer = write_buffer;
     }
+    if (!inv_icm20948_bus_xfer(&xfer, addr, reg, buffer, len, read, prefixed, NULL, NULL))
+        return -1;
+    return (bus_transfer_list(&xfer, 1) == NRF_SUCCESS) ? 0 : -1;
+}
 
+// The clock is started here already so that trace.c can time the
+// transfers of the bring-up.  Every sensor's bring-up calls this, the bus
+// is only set up once.
+int inv_icm20948_i2c_init(void)
+{
+    if (bus_ready)
+        return 0;
+    imu_int_clock_init();
+    bus_init();
+    bus_ready = true;
     return 0;
 }
 
-int inv_icm20948_i2c_read_reg_block(uint8_t reg, uint8_t * rbuffer, uint32_t rlen)
+int inv_icm20948_i2c_read_reg(uint8_t addr, uint8_t reg, uint8_t *value)
 {
-    int i;
+    return inv_icm20948_bus_transfer(addr, reg, value, 1, true);
+}
 
-    if (verbose)
-        printf("Executing %s(0x%02x, %ld)\r\n", __func__, reg, rlen);
+int inv_icm20948_i2c_read_reg_block(uint8_t addr, uint8_t reg, uint8_t * rbuffer, uint32_t rlen)
+{
+    return inv_icm20948_bus_transfer(addr, reg, rbuffer, rlen, true);
+}
 
-    twi_read_register_block(IMU_ADDR, reg, rbuffer, rlen);
+int inv_icm20948_i2c_write_reg(uint8_t addr, uint8_t reg, uint8_t value)
+{
+    return inv_icm20948_bus_transfer(addr, reg, &value, 1, false);
+}
 
-    if (verbose)
-    {
-        for (i = 0; i < rlen; i++)
-            printf(" val[%d]:0x%02x%s", i, rbuffer[i], (i%4==3?"\r\n":", "));
-        printf("\r\n");
-    }
+int inv_icm20948_i2c_write_reg_block(uint8_t addr, uint8_t reg, uint8_t *wbuffer, uint32_t wlen)
+{
+    return inv_icm20948_bus_transfer(addr, reg, wbuffer, wlen, false);
+}
 
-    return 0;
+int inv_icm20948_i2c_check(void)
+{
+    return bus_check() ? 1 : 0;
 }
 
-int inv_icm20948_i2c_write_reg(uint8_t reg, uint8_t value)
+void inv_icm20948_i2c_get_errors(inv_icm20948_i2c_errors *errors)
 {
-    if (verbose)
-    {
-        printf("Executing %s(0x%02x, 0x%02x)\r\n", __func__, reg, value);
-    }
+#if IMU_SPI_ENABLED
+    spi_errors_t bus;
 
-    twi_write_register(IMU_ADDR, reg, value);
+    spi_errors_get(&bus);
+    errors->nacks = 0;
+#else
+    twi_errors_t bus;
 
-    return 0;
+    twi_errors_get(&bus);
+    errors->nacks = bus.nacks;
+#endif
+    errors->timeouts    = bus.timeouts;
+    errors->recoveries  = bus.recoveries;
+    errors->recovery_us = bus.recovery_us;
+}
+
+static int inv_icm20948_i2c_schedule(uint8_t addr, uint8_t reg, uint8_t * buffer, uint32_t len, bool read,
+                                     inv_icm20948_i2c_callback_t callback, void *context)
+{
+    bus_xfer_t xfer;
+
+    if (!inv_icm20948_bus_xfer(&xfer, addr, reg, buffer, len, read, false, callback, context))
+        return -1;
+    return (bus_schedule_list(&xfer, 1) == NRF_SUCCESS) ? 0 : -1;
+}
+
+int inv_icm20948_i2c_read_reg_block_async(uint8_t addr, uint8_t reg, uint8_t * rbuffer, uint32_t rlen,
+                                          inv_icm20948_i2c_callback_t callback, void *context)
+{
+    return inv_icm20948_i2c_schedule(addr, reg, rbuffer, rlen, true, callback, context);
+}
+
+int inv_icm20948_i2c_write_reg_block_async(uint8_t addr, uint8_t reg, uint8_t * wbuffer, uint32_t wlen,
+                                           inv_icm20948_i2c_callback_t callback, void *context)
+{
+    return inv_icm20948_i2c_schedule(addr, reg, wbuffer, wlen, false, callback, context);
 }
 
-int inv_icm20948_i2c_write_reg_block(uint8_t reg, uint8_t *wbuffer, uint32_t wlen)
+int inv_icm20948_i2c_xfer_list(uint8_t addr, const inv_icm20948_i2c_op *ops, uint32_t count,
+                               inv_icm20948_i2c_callback_t callback, void *context)
 {
-    int i;
+    bus_xfer_t list[INV_ICM20948_I2C_MAX_OPS];
+    uint32_t i;
 
-    if (verbose)
+    if ((count == 0) || (count > INV_ICM20948_I2C_MAX_OPS))
+        return -1;
+
+    for (i = 0; i < count; i++)
     {
-        printf("Executing %s(0x%02x, 0x%02x, %ld)", __func__, reg, wbuffer[0], wlen);
-        if (wlen > 1)
-        {
-            printf("\r\n");
-            for (i = 0; i < wlen; i++)
-                printf(" val[%d]:0x%02x%s", i, wbuffer[i], (i%4==3?"\r\n":((i==(wlen-1)?"\r\n":","))));
-        }
+        if (!inv_icm20948_bus_xfer(&list[i], addr, ops[i].reg, ops[i].buffer, ops[i].len, ops[i].read, ops[i].prefixed, NULL, NULL))
+            return -1;
     }
 
-    twi_write_register_block(IMU_ADDR, reg, wbuffer, wlen);
+    if (callback == NULL)
+        return (bus_transfer_list(list, count) == NRF_SUCCESS) ? 0 : -1;
+
+    list[count - 1].callback  = callback;
+    list[count - 1].p_context = context;
+    return (bus_schedule_list(list, count) == NRF_SUCCESS) ? 0 : -1;
+}
+
+// The read is started by imu_int.c's INT event, and the same counter that
+// batches INT pulses counts the finished reads instead.
+int inv_icm20948_i2c_capture_arm(uint8_t addr, uint8_t reg, uint8_t *buffer, uint32_t len, uint16_t count,
+                                 inv_icm20948_i2c_capture *capture)
+{
+    uint32_t start_task, done_event;
+
+    if (len > BUS_MAX_READ)
+        return -1;
+    if (bus_capture_arm(addr, reg, buffer, len, &start_task, &done_event) != NRF_SUCCESS)
+        return -1;
+    imu_int_capture_start(start_task, done_event, count);
 
+    capture_len = len;
+    capture->offset = BUS_CAPTURE_OFFSET;
+    capture->stride = len + BUS_CAPTURE_OFFSET;
     return 0;
 }
+
+int inv_icm20948_i2c_capture_rearm(uint8_t *buffer)
+{
+    bus_capture_rearm(buffer);
+    return imu_int_capture_late() ? -1 : 0;
+}
+
+void inv_icm20948_i2c_capture_disarm(void)
+{
+    imu_int_capture_stop();
+    // a read the last pulse started may still be on the bus
+    nrf_delay_us((capture_len + 4) * BUS_BYTE_US);
+    bus_capture_disarm();
+}
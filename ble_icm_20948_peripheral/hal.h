@@ -35,12 +35,78 @@
 
 
 uint32_t inv_icm20948_get_time_us(void);
+uint32_t inv_icm20948_get_int_time_us(void);
 void inv_icm20948_sleep_us(uint32_t us);
 
+// addr selects the sensor, IMU_ADDR or IMU_ADDR_AD0.  Over SPI there is
+// only the one at IMU_ADDR.  Calling init again does nothing.
 int inv_icm20948_i2c_init(void);
-int inv_icm20948_i2c_read_reg(uint8_t reg, uint8_t *value);
-int inv_icm20948_i2c_read_reg_block(uint8_t reg, uint8_t * rbuffer, uint32_t rlen);
-int inv_icm20948_i2c_write_reg(uint8_t reg, uint8_t value);
-int inv_icm20948_i2c_write_reg_block(uint8_t reg, uint8_t * wbuffer, uint32_t wlen);
+int inv_icm20948_i2c_read_reg(uint8_t addr, uint8_t reg, uint8_t *value);
+int inv_icm20948_i2c_read_reg_block(uint8_t addr, uint8_t reg, uint8_t * rbuffer, uint32_t rlen);
+int inv_icm20948_i2c_write_reg(uint8_t addr, uint8_t reg, uint8_t value);
+int inv_icm20948_i2c_write_reg_block(uint8_t addr, uint8_t reg, uint8_t * wbuffer, uint32_t wlen);
+
+// Every access returns 0, or -1 if the sensor did not acknowledge it or
+// the bus stalled.  A stalled transfer is retired after about twice its
+// time on the wire and the bus is recovered, which takes well under 1ms.
+typedef struct {
+        uint32_t nacks;             // transfers the sensor did not acknowledge (I2C)
+        uint32_t timeouts;          // transfers that stalled and were retired
+        uint32_t recoveries;        // bus recoveries
+        uint32_t recovery_us;       // longest recovery
+} inv_icm20948_i2c_errors;
+
+// The blocking functions check for a stall while they wait.  Call this
+// while waiting for a non-blocking transfer; returns 1 if the bus had
+// stalled and was recovered.
+int  inv_icm20948_i2c_check(void);
+void inv_icm20948_i2c_get_errors(inv_icm20948_i2c_errors *errors);
+
+// Non-blocking variants.  They return once the transfer is queued and call
+// callback with 0 (or an error code) when it has completed, possibly before
+// they return.  Write data is copied, a read buffer has to stay valid until
+// the callback.
+typedef void (*inv_icm20948_i2c_callback_t)(uint32_t result, void *context);
+
+int inv_icm20948_i2c_read_reg_block_async(uint8_t addr, uint8_t reg, uint8_t * rbuffer, uint32_t rlen,
+                                          inv_icm20948_i2c_callback_t callback, void *context);
+int inv_icm20948_i2c_write_reg_block_async(uint8_t addr, uint8_t reg, uint8_t * wbuffer, uint32_t wlen,
+                                           inv_icm20948_i2c_callback_t callback, void *context);
+
+// One register access of a list.  A prefixed write leaves buffer[0] free for
+// the register address, the len bytes of data follow it, and is sent straight
+// from buffer without a copy.  Its buffer has to stay valid like a read's.
+typedef struct {
+        uint8_t  reg;
+        uint8_t *buffer;
+        uint32_t len;
+        bool     read;
+        bool     prefixed;
+} inv_icm20948_i2c_op;
+
+#define INV_ICM20948_I2C_MAX_OPS        8       // longest list accepted
+#define INV_ICM20948_I2C_MAX_PREFIXED   254     // longest prefixed write
+
+// Run the accesses back to back, with nothing else on the bus in between.
+// The list stops at the first failure.  callback is called once at the end;
+// without one the function waits for the list to complete.
+int inv_icm20948_i2c_xfer_list(uint8_t addr, const inv_icm20948_i2c_op *ops, uint32_t count,
+                               inv_icm20948_i2c_callback_t callback, void *context);
+
+// Capture -- a read of len bytes from reg that is armed once and then started
+// by the INT pulse in hardware, each time into the next slot of buffer.  The
+// INT handler runs once every count reads.  A slot is stride bytes with the
+// data from offset on.  Nothing else may use the bus until it is disarmed.
+// capture_rearm() points the next read at buffer again, it returns -1 when a
+// read had already started into the old place.
+typedef struct {
+        uint32_t stride;
+        uint32_t offset;
+} inv_icm20948_i2c_capture;
+
+int  inv_icm20948_i2c_capture_arm(uint8_t addr, uint8_t reg, uint8_t *buffer, uint32_t len, uint16_t count,
+                                  inv_icm20948_i2c_capture *capture);
+int  inv_icm20948_i2c_capture_rearm(uint8_t *buffer);
+void inv_icm20948_i2c_capture_disarm(void);
 
 #endif // _HAL_H_
@@ -18,12 +18,14 @@
  * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
+#include <math.h>
+
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
 #include "nrf_log_default_backends.h"
 
 #include "imu.h"
-#include "twi.h"
 #include "hal.h"
 
 char *INV_ICM20948_ACCEL_FSR_ASCII [] = {
@@ -42,31 +44,115 @@ char *INV_ICM20948_GYRO_FSR_ASCII [] = {
 };
 
 
-inv_icm20948_chip_config chip_config_20948 = {
+static const inv_icm20948_chip_config inv_icm20948_default_config = {
 	.accl_fsr = INV_ICM20948_ACCEL_FSR_04G,
 	.gyro_fsr = INV_ICM20948_GYRO_FSR_2000DPS,
 	.magn_fsr = INV_ICM20948_MAGN_FSR_4900UT,
 	.accl_fifo_enable = true,
 	.gyro_fifo_enable = true,
-	.magn_fifo_enable = false,
+	.magn_fifo_enable = true,
 	.temp_fifo_enable = true,
 	.enable = false,
 	.bytes_per_datum = 0,
 	.sample_rate = INV_ICM20948_INIT_SAMPLE_RATE,
 	.accel_dlpf = INV_ICM20948_ACCEL_FILTER_246HZ,	// normal default
-	.gyro_dlpf = INV_ICM20948_GYRO_FILTER_197HZ     // normal default
+	.gyro_dlpf = INV_ICM20948_GYRO_FILTER_197HZ,    // normal default
+	.dmp_mode = INV_ICM20948_DMP_OFF,
+	.power_profile = INV_ICM20948_POWER_FULL,
+	.accel_avg = INV_ICM20948_ACCEL_AVG_4,
+	.fifo_watermark = 1
 };
 
-inv_icm20948_state st = {
-        .chip_type   = INV_ICM20948,
-        .chip_config = &chip_config_20948
+// Set up the state of one sensor, before its bring-up.  addr is IMU_ADDR, or
+// IMU_ADDR_AD0 for a sensor with its AD0 pin high.  index is carried into
+// every sample read from it.  int_pin tells whether the sensor's INT is the
+// one the MCU captures the time of; the samples of a sensor without it are
+// timed from when its FIFO count is read.
+void inv_icm20948_init_state(inv_icm20948_state *st, inv_icm20948_chip_config *chip_config,
+                             uint8_t addr, uint8_t index, bool int_pin)
+{
+    memset(st, 0, sizeof(*st));
+    *chip_config = inv_icm20948_default_config;
+    st->chip_config = chip_config;
+    st->chip_type = INV_ICM20948;
+    st->addr = addr;
+    st->bank = 0xff;
+    st->index = index;
+    st->int_pin = int_pin;
+}
+
+static void inv_icm20948_stage_gyro_dlpf(inv_icm20948_state *st, inv_icm20948_gyro_filter_e rate);
+static void inv_icm20948_stage_accel_dlpf(inv_icm20948_state *st, inv_icm20948_accel_filter_e rate);
+static void inv_icm20948_stage_gyro_fsr(inv_icm20948_state *st, uint8_t full_scale_select);
+static void inv_icm20948_stage_accel_fsr(inv_icm20948_state *st, uint8_t full_scale_select);
+static int16_t inv_icm20948_setup_fifo(inv_icm20948_state *st);
+static void inv_icm20948_reset(inv_icm20948_state *st);
+static int16_t inv_icm20948_configure(inv_icm20948_state *st);
+static int16_t inv_icm20948_stage_sample_frequency(inv_icm20948_state *st, uint16_t rate);
+static void inv_icm20948_update_rates(inv_icm20948_state *st);
+static uint8_t inv_icm20948_init_gyro_div(const inv_icm20948_state *st);
+static uint8_t inv_icm20948_init_gyro_config(const inv_icm20948_state *st);
+static uint8_t inv_icm20948_init_accel_div_1(const inv_icm20948_state *st);
+static uint8_t inv_icm20948_init_accel_div_2(const inv_icm20948_state *st);
+static uint8_t inv_icm20948_init_accel_config(const inv_icm20948_state *st);
+static int16_t inv_icm20948_magn_write(inv_icm20948_state *st, uint8_t reg, uint8_t value);
+static uint8_t inv_icm20948_magn_mode(uint16_t rate);
+static uint32_t inv_icm20948_list_op(inv_icm20948_state *st, inv_icm20948_i2c_op *ops, uint32_t n, uint16_t reg,
+                                     uint8_t *block, uint32_t count, bool read);
+static void inv_icm20948_forget_bank(inv_icm20948_state *st);
+
+// A register sequence on its way to the bus.  The accesses are collected
+// into transfer lists of up to INV_ICM20948_I2C_MAX_OPS, so a sequence
+// costs one blocking call per list instead of one per register.  Values
+// are copied in, and the shadow can be staged again while it is built.
+// st->bank follows the list, so a blocking access in the middle of a
+// sequence sends the list first, see inv_icm20948_set_bank().
+typedef struct _inv_icm20948_config_list {
+    inv_icm20948_state *st;
+    inv_icm20948_i2c_op ops[INV_ICM20948_I2C_MAX_OPS];
+    uint8_t data[32];
+    uint32_t n;
+    uint32_t used;
+    uint32_t start_us;
+    int16_t result;
+    bool paused;
+} inv_icm20948_config_list;
+
+static void inv_icm20948_config_begin(inv_icm20948_state *st, inv_icm20948_config_list *list);
+static void inv_icm20948_config_flush(inv_icm20948_config_list *list);
+static void inv_icm20948_config_write(inv_icm20948_config_list *list, uint16_t reg, const uint8_t *value, uint32_t count);
+static void inv_icm20948_config_staged(inv_icm20948_state *st, inv_icm20948_config_list *list);
+static int16_t inv_icm20948_config_end(inv_icm20948_state *st, inv_icm20948_config_list *list);
+
+// Bring-up configuration, as (register, bits, value) with the value either
+// fixed or derived from chip_config.  Entries are in bank|register order, and
+// the whole script goes out as one sequence with a single switch to bank 2
+// and back.
+typedef struct {
+    uint16_t reg;
+    uint8_t  mask;
+    uint8_t  value;
+    uint8_t  (*derive)(const inv_icm20948_state *st);
+} inv_icm20948_init_entry;
+
+static const inv_icm20948_init_entry inv_icm20948_init_script[] = {
+#if IMU_SPI_ENABLED
+    // SPI only; keeps the sensor from taking SPI traffic for I2C, the reset clears it
+    { IMU_USER_CTRL,          IMU_BIT_I2C_IF_DIS, IMU_BIT_I2C_IF_DIS, NULL },
+#endif
+    { IMU_PWR_MGMT_1,         IMU_BIT_SLEEP | 0x07, 0x01, NULL },   // awake, auto select the clock
+    { IMU_GYRO_SMPLRT_DIV,    0xff, 0x00, inv_icm20948_init_gyro_div },
+    { IMU_GYRO_CONFIG_1,      0x3f, 0x00, inv_icm20948_init_gyro_config },
+    { IMU_ACCEL_SMPLRT_DIV_1, 0x0f, 0x00, inv_icm20948_init_accel_div_1 },
+    { IMU_ACCEL_SMPLRT_DIV_2, 0xff, 0x00, inv_icm20948_init_accel_div_2 },
+    { IMU_ACCEL_CONFIG,       0x3f, 0x00, inv_icm20948_init_accel_config },
 };
 
 int16_t inv_icm20948_set_power(inv_icm20948_state *st, bool power_on)
 {
     int result;
     if (st->chip_config->enable != power_on) {
-        result = inv_icm20948_set_sleep_mode(power_on == true ? false : true);
+        result = inv_icm20948_set_sleep_mode(st, power_on == true ? false : true);
         if (result)
             return result;
         st->chip_config->enable = power_on;
@@ -76,335 +162,743 @@ int16_t inv_icm20948_set_power(inv_icm20948_state *st, bool power_on)
     return 0;
 }
 
+// The whole bring-up in one call, sleeping through the waits.
 int16_t inv_check_and_setup_chip(inv_icm20948_state *st)
 {
+    int32_t wait_us;
+
+    wait_us = inv_icm20948_bringup_start(st);
+    while (wait_us > 0) {
+        inv_icm20948_sleep_us(wait_us);
+        wait_us = inv_icm20948_bringup_step(st);
+    }
+    return (wait_us == 0) ? 0 : -1;
+}
+
+// Reset the device and start a bring-up that is then run one step at a time
+// by inv_icm20948_bringup_step(), so that the reset and start-up waits can be
+// spent on something else.  Returns the time to wait before the first step,
+// in us, or -1.
+int32_t inv_icm20948_bringup_start(inv_icm20948_state *st)
+{
+    if (inv_icm20948_i2c_init())
+        return -1;
+
+    st->bringup.start_us = inv_icm20948_get_time_us();
+    st->bringup.time_us = 0;
+    st->bringup.tries = 0;
+    st->bringup.state = INV_ICM20948_BRINGUP_RESET;
+    inv_icm20948_reset(st);
+    return INV_ICM20948_RESET_POLL_US;
+}
+
+// Returns the time to wait before the next step in us, 0 once the device is
+// configured, or -1 if it failed.
+int32_t inv_icm20948_bringup_step(inv_icm20948_state *st)
+{
+    inv_icm20948_bringup *up = &st->bringup;
     int16_t result;
 
-    twi_init();
+    switch (up->state) {
+    case INV_ICM20948_BRINGUP_RESET:
+        // the bit clears itself at the end of the reset; carry on regardless
+        // once the polls are used up, WHO_AM_I tells whether it worked
+        if (   (inv_icm20948_read_register(st, IMU_PWR_MGMT_1) & IMU_BIT_DEVICE_RESET)
+            && (++up->tries < INV_ICM20948_RESET_POLLS))
+            return INV_ICM20948_RESET_POLL_US;
+        up->tries = 0;
+        up->state = INV_ICM20948_BRINGUP_WHOAMI;
+        return INV_ICM20948_STARTUP_US;
+
+    case INV_ICM20948_BRINGUP_WHOAMI:
+        if (inv_icm20948_get_device_id(st) != IMU_EXPECTED_WHOAMI) {
+            if (++up->tries < INV_ICM20948_WHOAMI_POLLS)
+                return INV_ICM20948_WHOAMI_POLL_US;
+            up->state = INV_ICM20948_BRINGUP_FAILED;
+            return -1;
+        }
+        break;
+
+    case INV_ICM20948_BRINGUP_DONE:
+        return 0;
+
+    default:
+        return -1;
+    }
 
-    result = inv_icm20948_init(st);
-    if (result)
+    // configure, power up the sensors and start the FIFO
+    up->state = INV_ICM20948_BRINGUP_FAILED;
+    if (inv_icm20948_configure(st))
+        return -1;
+    if (inv_icm20948_set_power(st, true))
         return -1;
 
-    result = inv_icm20948_set_power(st, true);
-    if (result)
+    if (st->chip_config->magn_fifo_enable == true) {
+        result = inv_icm20948_setup_magn(st);
+        if (result) {
+            NRF_LOG_INFO("Magnetometer is not responding, disabling it");
+            st->chip_config->magn_fifo_enable = false;
+        }
+    }
+
+    // the device reset powered everything up again
+    if (st->chip_config->power_profile != INV_ICM20948_POWER_FULL) {
+        if (inv_icm20948_set_power_profile(st, st->chip_config->power_profile, st->chip_config->accel_avg))
+            return -1;
+    } else if (inv_icm20948_setup_fifo(st)) {
         return -1;
+    }
+
+    up->time_us = inv_icm20948_get_time_us() - up->start_us;
+    up->state = INV_ICM20948_BRINGUP_DONE;
+    return 0;
+}
+
+// FIFO frame layouts, one bit per sensor that writes into the FIFO.  The
+// sensors always appear in this order, which is also the register order
+// from ACCEL_XOUT_H to EXT_SLV_SENS_DATA_05.
+#define IMU_FIFO_LAYOUT_ACCEL   0x01
+#define IMU_FIFO_LAYOUT_GYRO    0x02
+#define IMU_FIFO_LAYOUT_TEMP    0x04
+#define IMU_FIFO_LAYOUT_MAGN    0x08
+#define IMU_FIFO_LAYOUT_ALL     0x0f
+
+#define IMU_FIFO_LAYOUT_BYTES(n)  ((((n) & IMU_FIFO_LAYOUT_ACCEL) ? 6 : 0) + \
+                                   (((n) & IMU_FIFO_LAYOUT_GYRO)  ? 6 : 0) + \
+                                   (((n) & IMU_FIFO_LAYOUT_TEMP)  ? 2 : 0) + \
+                                   (((n) & IMU_FIFO_LAYOUT_MAGN)  ? 6 : 0))
+
+#if defined(__arm__)
+#include "nrf.h"                // __REV16
+#define INV_ICM20948_REV16(x)   __REV16(x)
+#else
+// host builds, the same swap of the bytes within each halfword
+#define INV_ICM20948_REV16(x)   ((((x) & 0xff00ff00UL) >> 8) | (((x) & 0x00ff00ffUL) << 8))
+#endif
+
+// Three big endian values, two of them swapped by a single REV16.
+static inline void inv_icm20948_be16x3(const uint8_t *p, int16_t *x, int16_t *y, int16_t *z)
+{
+    uint32_t xy;
+    uint16_t zz;
+
+    memcpy(&xy, p, sizeof(xy));
+    memcpy(&zz, p + 4, sizeof(zz));
+    xy = INV_ICM20948_REV16(xy);
+    *x = (int16_t)(xy & 0xffff);
+    *y = (int16_t)(xy >> 16);
+    *z = (int16_t)INV_ICM20948_REV16((uint32_t)zz);
+}
+
+static inline void inv_icm20948_be16x1(const uint8_t *p, int16_t *x)
+{
+    uint16_t xx;
 
-    if (   st->chip_config->accl_fifo_enable == true
-        || st->chip_config->gyro_fifo_enable == true
-        || st->chip_config->magn_fifo_enable == true
-        || st->chip_config->temp_fifo_enable == true )
+    memcpy(&xx, p, sizeof(xx));
+    *x = (int16_t)INV_ICM20948_REV16((uint32_t)xx);
+}
+
+// One decoder per layout.  The layout is a constant in each of them, so
+// the compiler drops the tests and the offsets are fixed.
+#define IMU_FIFO_DECODER(n)                                                             \
+static void inv_icm20948_decode_fifo_##n(const uint8_t *p, IMU_DATA *imu_data)         \
+{                                                                                       \
+    if ((n) & IMU_FIFO_LAYOUT_ACCEL) {                                                  \
+        inv_icm20948_be16x3(p, &imu_data->ax, &imu_data->ay, &imu_data->az);            \
+        p += 6;                                                                         \
+    }                                                                                   \
+    if ((n) & IMU_FIFO_LAYOUT_GYRO) {                                                   \
+        inv_icm20948_be16x3(p, &imu_data->gx, &imu_data->gy, &imu_data->gz);            \
+        p += 6;                                                                         \
+    }                                                                                   \
+    if ((n) & IMU_FIFO_LAYOUT_TEMP) {                                                   \
+        inv_icm20948_be16x1(p, &imu_data->temperature);                                 \
+        p += 2;                                                                         \
+    }                                                                                   \
+    if ((n) & IMU_FIFO_LAYOUT_MAGN)                                                     \
+        inv_icm20948_be16x3(p, &imu_data->mx, &imu_data->my, &imu_data->mz);            \
+    (void)p;                                                                            \
+}
+
+IMU_FIFO_DECODER(0)  IMU_FIFO_DECODER(1)  IMU_FIFO_DECODER(2)  IMU_FIFO_DECODER(3)
+IMU_FIFO_DECODER(4)  IMU_FIFO_DECODER(5)  IMU_FIFO_DECODER(6)  IMU_FIFO_DECODER(7)
+IMU_FIFO_DECODER(8)  IMU_FIFO_DECODER(9)  IMU_FIFO_DECODER(10) IMU_FIFO_DECODER(11)
+IMU_FIFO_DECODER(12) IMU_FIFO_DECODER(13) IMU_FIFO_DECODER(14) IMU_FIFO_DECODER(15)
+
+#define IMU_FIFO_LAYOUT(n)      { inv_icm20948_decode_fifo_##n, IMU_FIFO_LAYOUT_BYTES(n) }
+
+static const struct {
+    inv_icm20948_fifo_decoder_t decode;
+    uint8_t bytes;
+} inv_icm20948_fifo_layouts[] = {
+    IMU_FIFO_LAYOUT(0),  IMU_FIFO_LAYOUT(1),  IMU_FIFO_LAYOUT(2),  IMU_FIFO_LAYOUT(3),
+    IMU_FIFO_LAYOUT(4),  IMU_FIFO_LAYOUT(5),  IMU_FIFO_LAYOUT(6),  IMU_FIFO_LAYOUT(7),
+    IMU_FIFO_LAYOUT(8),  IMU_FIFO_LAYOUT(9),  IMU_FIFO_LAYOUT(10), IMU_FIFO_LAYOUT(11),
+    IMU_FIFO_LAYOUT(12), IMU_FIFO_LAYOUT(13), IMU_FIFO_LAYOUT(14), IMU_FIFO_LAYOUT(15)
+};
+
+// Size the FIFO frame for the sensors that are enabled, pick its decoder
+// and restart the FIFO.  Returns 0, or -1 if the bus failed.
+static int16_t inv_icm20948_setup_fifo(inv_icm20948_state *st)
+{
+    uint8_t layout = 0;
+
+    if (st->chip_config->accl_fifo_enable == true)
+        layout |= IMU_FIFO_LAYOUT_ACCEL;
+    if (st->chip_config->gyro_fifo_enable == true)
+        layout |= IMU_FIFO_LAYOUT_GYRO;
+    if (st->chip_config->temp_fifo_enable == true)
+        layout |= IMU_FIFO_LAYOUT_TEMP;
+    if (st->chip_config->magn_fifo_enable == true)
+        layout |= IMU_FIFO_LAYOUT_MAGN;
+
+    st->decode_fifo = inv_icm20948_fifo_layouts[layout].decode;
+    if (layout != 0)
     {
-        st->chip_config->bytes_per_datum = 0;
-        if (st->chip_config->accl_fifo_enable == true)
-            st->chip_config->bytes_per_datum += 6;
-        if (st->chip_config->gyro_fifo_enable == true)
-            st->chip_config->bytes_per_datum += 6;
-        if (st->chip_config->magn_fifo_enable == true)
-            st->chip_config->bytes_per_datum += 6;
-        if (st->chip_config->temp_fifo_enable == true)
-            st->chip_config->bytes_per_datum += 2;
-        inv_icm20948_reset_fifo(st);
+        st->chip_config->bytes_per_datum = inv_icm20948_fifo_layouts[layout].bytes;
+        return inv_icm20948_reset_fifo(st);
     }
     else
     {
-        inv_icm20948_write_register(IMU_INT_ENABLE_1, IMU_BIT_RAW_DATA_0_RDY_EN);
+        inv_icm20948_write_config(st, IMU_INT_ENABLE_1, IMU_BIT_RAW_DATA_0_RDY_EN);
+        return 0;
+    }
+}
+
+// Start a device reset.  Every configuration register goes back to its
+// power-on value, and the DMP is unloaded.
+static void inv_icm20948_reset(inv_icm20948_state *st)
+{
+    // the MCU may have been reset with the sensor in any bank
+    inv_icm20948_forget_bank(st);
+    inv_icm20948_write_register(st, IMU_PWR_MGMT_1, IMU_BIT_DEVICE_RESET);
+    inv_icm20948_shadow_reset(st);
+    st->chip_config->dmp_mode = INV_ICM20948_DMP_OFF;
+    st->chip_config->enable = false;
+}
+
+// Run the init script on a device that has just been reset.
+static int16_t inv_icm20948_configure(inv_icm20948_state *st)
+{
+    inv_icm20948_config_list list;
+    uint16_t i;
+
+    if (st->chip_config->sample_rate == 0)
+        return -1;
+
+    // wake up, set clock, filters, ranges and rates, and go back to sleep
+    inv_icm20948_config_begin(st, &list);
+    for (i = 0; i < sizeof(inv_icm20948_init_script) / sizeof(inv_icm20948_init_script[0]); i++) {
+        const inv_icm20948_init_entry *entry = &inv_icm20948_init_script[i];
+        inv_icm20948_stage_config(st, entry->reg, entry->mask,
+                                  (entry->derive != NULL) ? entry->derive(st) : entry->value);
     }
+    inv_icm20948_config_staged(st, &list);
+    inv_icm20948_stage_config(st, IMU_PWR_MGMT_1, IMU_BIT_SLEEP, IMU_BIT_SLEEP);
+    inv_icm20948_config_staged(st, &list);
+    if (inv_icm20948_config_end(st, &list))
+        return -1;
 
+    inv_icm20948_update_rates(st);
+    NRF_LOG_INFO("Accelerometer FSR: %s, gyroscope FSR: %s, applied in %d us",
+                 INV_ICM20948_ACCEL_FSR_ASCII[st->chip_config->accl_fsr],
+                 INV_ICM20948_GYRO_FSR_ASCII[st->chip_config->gyro_fsr], st->config_apply_us);
     return 0;
 }
 
-int16_t inv_icm20948_init(inv_icm20948_state *st)
+int16_t inv_icm20948_set_sleep_mode(inv_icm20948_state *st, bool sleep_mode)
 {
-     uint8_t result, counter, temp, imu_device_id;
+    // set or clear the sleep enable bit
+    inv_icm20948_stage_config(st, IMU_PWR_MGMT_1, IMU_BIT_SLEEP, (sleep_mode == false) ? 0 : IMU_BIT_SLEEP);
+    return inv_icm20948_commit_config(st);
+}
 
-    // let's start by resetting the device
-    counter = 0;
-    inv_icm20948_write_register(IMU_PWR_MGMT_1, IMU_BIT_DEVICE_RESET);
-    do {
-        inv_icm20948_sleep_us(10); // 10uS delay
-        temp = inv_icm20948_read_register(IMU_PWR_MGMT_1);
-    } while ((temp & IMU_BIT_DEVICE_RESET) && (counter++ < 1000));
+// Nearest divider for ODR = 1125Hz / (1 + divider), clamped to the register width.
+static uint16_t inv_icm20948_rate_divider(uint16_t rate, uint16_t max)
+{
+    uint32_t divider = (INV_ICM20948_INTERNAL_SAMPLE_RATE + rate / 2) / rate;
 
-    // device requires 100mS delay after power-up/reset
-    inv_icm20948_sleep_us(100000);    // 100mS delay
+    if (divider > 0)
+        divider--;
+    return (divider > max) ? max : (uint16_t)divider;
+}
 
-    imu_device_id = inv_icm20948_get_device_id();
-    if (imu_device_id != IMU_EXPECTED_WHOAMI)
-        return -1;
+// Dividers for rate.  While the gyro runs both sensors share the FIFO frame,
+// so they have to run in step; the 12 bit accel divider only reaches lower
+// rates once the gyro is off.
+static void inv_icm20948_sample_dividers(const inv_icm20948_state *st, uint16_t rate,
+                                         uint16_t *gyro_div, uint16_t *accel_div)
+{
+    *gyro_div  = inv_icm20948_rate_divider(rate, IMU_GYRO_SMPLRT_DIV_MAX);
+    *accel_div = inv_icm20948_rate_divider(rate, IMU_ACCEL_SMPLRT_DIV_MAX);
+    if (st->chip_config->power_profile == INV_ICM20948_POWER_FULL)
+        *accel_div = *gyro_div;
+}
 
-    // clear the sleep enable bit
-    result = inv_icm20948_set_sleep_mode(false);
-    if (result)
-        return result;
+// Work out the output data rates from the dividers in the shadow; they are
+// cached, so this costs no bus access.
+static void inv_icm20948_update_rates(inv_icm20948_state *st)
+{
+    uint16_t gyro_div, accel_div;
 
-    // setup low pass filters 
-    result = inv_icm20948_set_gyro_dlpf(st->chip_config->gyro_dlpf);
-    result = inv_icm20948_set_accel_dlpf(st->chip_config->accel_dlpf);
+    gyro_div  = inv_icm20948_read_config(st, IMU_GYRO_SMPLRT_DIV);
+    accel_div = ((inv_icm20948_read_config(st, IMU_ACCEL_SMPLRT_DIV_1) & 0x0f) << 8)
+              | inv_icm20948_read_config(st, IMU_ACCEL_SMPLRT_DIV_2);
 
-    // setup sample rate
-    result = inv_icm20948_set_sample_frequency(st->chip_config->sample_rate);
-    if (result)
-        return result;
+    st->chip_config->gyro_rate_mhz  = (INV_ICM20948_INTERNAL_SAMPLE_RATE * 1000UL) / (1 + gyro_div);
+    st->chip_config->accel_rate_mhz = (INV_ICM20948_INTERNAL_SAMPLE_RATE * 1000UL) / (1 + accel_div);
+    st->chip_config->fifo_rate_mhz = (st->chip_config->power_profile == INV_ICM20948_POWER_FULL) ?
+                                     st->chip_config->gyro_rate_mhz : st->chip_config->accel_rate_mhz;
 
-    // set the clock source
-    temp = inv_icm20948_read_register(IMU_PWR_MGMT_1);
-    temp &= 0xf8;
-    temp |= 0x01;
-    inv_icm20948_write_register(IMU_PWR_MGMT_1, temp);
+    NRF_LOG_INFO("Sample rate: gyro %d.%03d Hz, accel %d.%03d Hz",
+                 st->chip_config->gyro_rate_mhz / 1000, st->chip_config->gyro_rate_mhz % 1000,
+                 st->chip_config->accel_rate_mhz / 1000, st->chip_config->accel_rate_mhz % 1000);
+}
 
-    // set the gyro full scale range
-    inv_icm20948_config_gyro(st->chip_config->gyro_fsr);
+static void inv_icm20948_stage_dividers(inv_icm20948_state *st, uint8_t gyro_div, uint16_t accel_div)
+{
+    inv_icm20948_stage_config(st, IMU_GYRO_SMPLRT_DIV, 0xff, gyro_div);
+    inv_icm20948_stage_config(st, IMU_ACCEL_SMPLRT_DIV_1, 0x0f, (uint8_t)(accel_div >> 8));
+    inv_icm20948_stage_config(st, IMU_ACCEL_SMPLRT_DIV_2, 0xff, (uint8_t)(accel_div & 0xff));
+    inv_icm20948_update_rates(st);
+}
 
-    // set the accelerometer full scale range
-    inv_icm20948_config_accel(st->chip_config->accl_fsr);
+static int16_t inv_icm20948_stage_sample_frequency(inv_icm20948_state *st, uint16_t rate)
+{
+    uint16_t gyro_div, accel_div;
 
-    // set the sleep enable bit
-    inv_icm20948_set_sleep_mode(true);
+    if (rate == 0)
+        return -1;
 
+    inv_icm20948_sample_dividers(st, rate, &gyro_div, &accel_div);
+    inv_icm20948_stage_dividers(st, (uint8_t)gyro_div, accel_div);
+    st->chip_config->sample_rate = rate;
     return 0;
 }
 
-int16_t inv_icm20948_set_sleep_mode(bool sleep_mode)
+// Program the nearest output data rate to rate (in Hz) and report the rates
+// achieved in chip_config->gyro_rate_mhz and accel_rate_mhz.
+int16_t inv_icm20948_set_sample_frequency(inv_icm20948_state *st, uint16_t rate)
 {
-    uint8_t temp, temp2;
+    int16_t result;
 
-    // get the sleep enable bit
-    temp = inv_icm20948_read_register(IMU_PWR_MGMT_1);
-    if (sleep_mode == false)
-        temp &= ~(IMU_BIT_SLEEP);    // clear the sleep bit
-    else
-        temp |= IMU_BIT_SLEEP;       // set the sleep bit
-    inv_icm20948_write_register(IMU_PWR_MGMT_1, temp);
-    temp2 = inv_icm20948_read_register(IMU_PWR_MGMT_1);
-    if (temp != temp2)
-    {
+    // the DMP runs its sensors at a fixed rate
+    if (st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF)
         return -1;
-    }
 
+    result = inv_icm20948_stage_sample_frequency(st, rate);
+    if (result)
+        return result;
+    result = inv_icm20948_commit_config(st);
+    if (result)
+        return result;
+
+    // keep the magnetometer's measurement rate in line
+    if (st->chip_config->magn_fifo_enable)
+        return inv_icm20948_magn_write(st, AK09916_CNTL2, inv_icm20948_magn_mode(rate));
     return 0;
 }
 
-int16_t inv_icm20948_set_sample_frequency(uint16_t rate)
+// FCHOICE and DLPFCFG bits of GYRO_CONFIG_1 and ACCEL_CONFIG.
+static uint8_t inv_icm20948_dlpf_bits(uint8_t rate, uint8_t no_lpf)
 {
-    uint8_t divider;
-    divider = (uint8_t)(1100 / rate) - 1;    // from ICM-20948 data sheet
-    inv_icm20948_write_register(IMU_GYRO_SMPLRT_DIV, divider);
-    return 0;
+    if (rate == no_lpf)
+        return 0x00;
+    return 0x01 | ((rate & 0x07) << 3);
 }
 
-int16_t inv_icm20948_set_gyro_dlpf(inv_icm20948_gyro_filter_e rate)
+static void inv_icm20948_stage_gyro_dlpf(inv_icm20948_state *st, inv_icm20948_gyro_filter_e rate)
 {
-    uint8_t temp;
-    temp = inv_icm20948_read_register(IMU_GYRO_CONFIG_1);  // get current reg value
-    temp &= 0xc6;                                          // clear all dlpf bit
-    if (rate != INV_ICM20948_GYRO_FILTER_12106HZ_NOLPF) {
-        temp |= 0x01;                                      // set FCHOICE bit
-        temp |= (rate & 0x07) << 3;                        // set DLPFCFG bits
-    }
-    inv_icm20948_write_register(IMU_GYRO_CONFIG_1, temp);           // set new value
-    return 0;
+    inv_icm20948_stage_config(st, IMU_GYRO_CONFIG_1, 0x39,
+                              inv_icm20948_dlpf_bits(rate, INV_ICM20948_GYRO_FILTER_12106HZ_NOLPF));
 }
 
-int16_t inv_icm20948_set_accel_dlpf(inv_icm20948_accel_filter_e rate)
+static void inv_icm20948_stage_accel_dlpf(inv_icm20948_state *st, inv_icm20948_accel_filter_e rate)
 {
-    uint8_t temp;
-    temp = inv_icm20948_read_register(IMU_ACCEL_CONFIG);            // get current reg value
-    temp &= 0xc6;                                          // clear all dlpf bits
-    if (rate != INV_ICM20948_ACCEL_FILTER_1209HZ_NOLPF) {
-        temp |= 0x01;                                      // set FCHOICE bit
-        temp |= (rate & 0x07) << 3;                        // set DLPFCFG bits
-    }
-    inv_icm20948_write_register(IMU_ACCEL_CONFIG, temp);            // set new value
-    return 0;
+    inv_icm20948_stage_config(st, IMU_ACCEL_CONFIG, 0x39,
+                              inv_icm20948_dlpf_bits(rate, INV_ICM20948_ACCEL_FILTER_1209HZ_NOLPF));
 }
 
-void inv_icm20948_config_gyro(uint8_t full_scale_select)
+static void inv_icm20948_stage_gyro_fsr(inv_icm20948_state *st, uint8_t full_scale_select)
 {
-    uint8_t temp;
-    // set the gyro full scale range
-    temp = inv_icm20948_read_register(IMU_GYRO_CONFIG_1);   // get current value of register
-    temp &= 0xf9;                                  // clear bit4 and bit3
-    temp |= ((full_scale_select & 0x03) << 1);     // set desired bits to set range
-    inv_icm20948_write_register(IMU_GYRO_CONFIG_1, temp);
+    // bit2 and bit1 select the range
+    inv_icm20948_stage_config(st, IMU_GYRO_CONFIG_1, 0x06, (full_scale_select & 0x03) << 1);
     NRF_LOG_INFO("Gyroscope FSR: %s", INV_ICM20948_GYRO_FSR_ASCII[(full_scale_select & 0x03)]);
 }
 
-void inv_icm20948_config_accel(uint8_t full_scale_select)
+static void inv_icm20948_stage_accel_fsr(inv_icm20948_state *st, uint8_t full_scale_select)
 {
-    uint8_t temp;
-    // set the accelerometer full scale range
-    temp = inv_icm20948_read_register(IMU_ACCEL_CONFIG);    // get current value of register
-    temp &= 0xf9;                                  // clear bit2 and bit1
-    temp |= ((full_scale_select & 0x03) << 1);     // set desired bits to set range
-    inv_icm20948_write_register(IMU_ACCEL_CONFIG, temp);
+    // bit2 and bit1 select the range
+    inv_icm20948_stage_config(st, IMU_ACCEL_CONFIG, 0x06, (full_scale_select & 0x03) << 1);
     NRF_LOG_INFO("Accelerometer FSR: %s", INV_ICM20948_ACCEL_FSR_ASCII[(full_scale_select & 0x03)]);
 }
 
-uint8_t inv_icm20948_get_device_id(void)
+// Values of the init script that follow chip_config.
+static uint8_t inv_icm20948_init_gyro_div(const inv_icm20948_state *st)
+{
+    uint16_t gyro_div, accel_div;
+    inv_icm20948_sample_dividers(st, st->chip_config->sample_rate, &gyro_div, &accel_div);
+    return (uint8_t)gyro_div;
+}
+
+static uint8_t inv_icm20948_init_accel_div_1(const inv_icm20948_state *st)
+{
+    uint16_t gyro_div, accel_div;
+    inv_icm20948_sample_dividers(st, st->chip_config->sample_rate, &gyro_div, &accel_div);
+    return (uint8_t)(accel_div >> 8);
+}
+
+static uint8_t inv_icm20948_init_accel_div_2(const inv_icm20948_state *st)
+{
+    uint16_t gyro_div, accel_div;
+    inv_icm20948_sample_dividers(st, st->chip_config->sample_rate, &gyro_div, &accel_div);
+    return (uint8_t)(accel_div & 0xff);
+}
+
+static uint8_t inv_icm20948_init_gyro_config(const inv_icm20948_state *st)
+{
+    return inv_icm20948_dlpf_bits(st->chip_config->gyro_dlpf, INV_ICM20948_GYRO_FILTER_12106HZ_NOLPF)
+         | ((st->chip_config->gyro_fsr & 0x03) << 1);
+}
+
+static uint8_t inv_icm20948_init_accel_config(const inv_icm20948_state *st)
+{
+    return inv_icm20948_dlpf_bits(st->chip_config->accel_dlpf, INV_ICM20948_ACCEL_FILTER_1209HZ_NOLPF)
+         | ((st->chip_config->accl_fsr & 0x03) << 1);
+}
+
+int16_t inv_icm20948_set_gyro_dlpf(inv_icm20948_state *st, inv_icm20948_gyro_filter_e rate)
+{
+    inv_icm20948_stage_gyro_dlpf(st, rate);
+    return inv_icm20948_commit_config(st);
+}
+
+int16_t inv_icm20948_set_accel_dlpf(inv_icm20948_state *st, inv_icm20948_accel_filter_e rate)
+{
+    inv_icm20948_stage_accel_dlpf(st, rate);
+    return inv_icm20948_commit_config(st);
+}
+
+void inv_icm20948_config_gyro(inv_icm20948_state *st, uint8_t full_scale_select)
+{
+    // set the gyro full scale range
+    inv_icm20948_stage_gyro_fsr(st, full_scale_select);
+    inv_icm20948_commit_config(st);
+}
+
+void inv_icm20948_config_accel(inv_icm20948_state *st, uint8_t full_scale_select)
+{
+    // set the accelerometer full scale range
+    inv_icm20948_stage_accel_fsr(st, full_scale_select);
+    inv_icm20948_commit_config(st);
+}
+
+int16_t inv_icm20948_set_fsr(inv_icm20948_state *st, uint8_t accl_fsr, uint8_t gyro_fsr)
+{
+    // both ranges go out in a single commit
+    inv_icm20948_stage_accel_fsr(st, accl_fsr);
+    inv_icm20948_stage_gyro_fsr(st, gyro_fsr);
+    return inv_icm20948_commit_config(st);
+}
+
+uint8_t inv_icm20948_get_device_id(inv_icm20948_state *st)
 {
-    return (inv_icm20948_read_register(IMU_WHO_AM_I));
+    return (inv_icm20948_read_register(st, IMU_WHO_AM_I));
 }
 
-void inv_icm20948_read_accel_xyz(int16_t *ax, int16_t *ay, int16_t *az)
+void inv_icm20948_read_accel_xyz(inv_icm20948_state *st, int16_t *ax, int16_t *ay, int16_t *az)
 {
   uint8_t  data_blk[6];
 
-    inv_icm20948_read_register_block(IMU_ACCEL_XOUT_H, data_blk, 6);
+    if (inv_icm20948_read_register_block(st, IMU_ACCEL_XOUT_H, data_blk, 6))
+        return;
     *ax = (data_blk[0] << 8) + data_blk[1];
     *ay = (data_blk[2] << 8) + data_blk[3];
     *az = (data_blk[4] << 8) + data_blk[5];
 }
 
-void inv_icm20948_read_gyro_xyz(int16_t *gx, int16_t *gy, int16_t *gz)
+void inv_icm20948_read_gyro_xyz(inv_icm20948_state *st, int16_t *gx, int16_t *gy, int16_t *gz)
 {
     uint8_t  data_blk[6];
 
-    inv_icm20948_read_register_block(IMU_GYRO_XOUT_H, data_blk, 6);
+    if (inv_icm20948_read_register_block(st, IMU_GYRO_XOUT_H, data_blk, 6))
+        return;
     *gx = (data_blk[0] << 8) + data_blk[1];
     *gy = (data_blk[2] << 8) + data_blk[3];
     *gz = (data_blk[4] << 8) + data_blk[5];
 }
 
-void inv_icm20948_read_magn_xyz(int16_t *mx, int16_t *my, int16_t *mz)
+void inv_icm20948_read_magn_xyz(inv_icm20948_state *st, int16_t *mx, int16_t *my, int16_t *mz)
 {
     uint8_t  data_blk[6];
 
-    inv_icm20948_read_register_block(IMU_GYRO_XOUT_H, data_blk, 6);
+    // the I2C master stores the AK09916 samples byte swapped (big endian)
+    if (inv_icm20948_read_register_block(st, IMU_EXT_SLV_SENS_DATA_00, data_blk, 6))
+        return;
     *mx = (data_blk[0] << 8) + data_blk[1];
     *my = (data_blk[2] << 8) + data_blk[3];
     *mz = (data_blk[4] << 8) + data_blk[5];
 }
 
-void inv_icm20948_temperature(int16_t *temperature)
+void inv_icm20948_temperature(inv_icm20948_state *st, int16_t *temperature)
 {
     uint8_t  data_blk[2];
 
-    inv_icm20948_read_register_block(IMU_TEMP_OUT_H, data_blk, 2);
+    if (inv_icm20948_read_register_block(st, IMU_TEMP_OUT_H, data_blk, 2))
+        return;
     *temperature = (data_blk[0] << 8) + data_blk[1];
 }
 
-void inv_icm20948_read_imu(IMU_DATA *imu_data)
+void inv_icm20948_read_imu(inv_icm20948_state *st, IMU_DATA *imu_data)
 {
     // This function reads the axis data directly from the registers.
     uint8_t data_blk[20];
 
-    // burst read starts at register ACCEL_XOUT_H for 14 8 bit registers
-    inv_icm20948_read_register_block(IMU_ACCEL_XOUT_H, data_blk, 20);
+    // burst read starts at register ACCEL_XOUT_H for 20 8 bit registers,
+    // the last 6 being the magnetometer data in EXT_SLV_SENS_DATA_00
+    if (inv_icm20948_read_register_block(st, IMU_ACCEL_XOUT_H, data_blk, 20))
+        return;
     imu_data->time_stamp = inv_icm20948_get_time_us();
-    //imu_data->deviceid = (uint32_t)inv_icm20948_get_device_id();
-
-    imu_data->ax = (data_blk[0] << 8) + data_blk[1];
-    imu_data->ay = (data_blk[2] << 8) + data_blk[3];
-    imu_data->az = (data_blk[4] << 8) + data_blk[5];
-
-    imu_data->gx = (data_blk[6]  << 8) + data_blk[7];
-    imu_data->gy = (data_blk[8]  << 8) + data_blk[9];
-    imu_data->gz = (data_blk[10] << 8) + data_blk[11];
-
-    imu_data->temperature = (data_blk[12] << 8) + data_blk[13];
+    imu_data->sensor = st->index;
+    //imu_data->deviceid = (uint32_t)inv_icm20948_get_device_id(st);
 
-    imu_data->mx = 1; //(data_blk[14] << 8) + data_blk[15];
-    imu_data->my = 2; //(data_blk[16] << 8) + data_blk[17];
-    imu_data->mz = 3; //(data_blk[18] << 8) + data_blk[19];
+    // the registers are laid out like a FIFO frame with every sensor enabled
+    inv_icm20948_fifo_layouts[IMU_FIFO_LAYOUT_ALL].decode(data_blk, imu_data);
 
     //printk("ax %d ay %d az %d\n", imu_data->ax, imu_data->ay, imu_data->az);
     //printk("gx %d gy %d gz %d\n", imu_data->gx, imu_data->gy, imu_data->gz);
     //printk("mx %d my %d mz %d\n", imu_data->mx, imu_data->my, imu_data->mz);
 }
 
-int16_t inv_icm20948_get_fifo_counter(void)
+// Bytes in the FIFO, or -1 if the bus failed.
+int16_t inv_icm20948_get_fifo_counter(inv_icm20948_state *st)
 {
     uint8_t data_blk[2];
-    inv_icm20948_read_register_block(IMU_FIFO_COUNTH, data_blk, 2);
+    if (inv_icm20948_read_register_block(st, IMU_FIFO_COUNTH, data_blk, 2))
+        return -1;
     return ((data_blk[0] << 8) | data_blk[1]);
 }
 
+// Time taken by the given number of frames to enter the FIFO, in us.
+static uint32_t inv_icm20948_frames_to_us(inv_icm20948_state *st, uint16_t frames)
+{
+    if (st->chip_config->fifo_rate_mhz == 0)
+        return 0;
+    return (uint32_t)(((uint64_t)frames * 1000000000ULL + st->chip_config->fifo_rate_mhz / 2) / st->chip_config->fifo_rate_mhz);
+}
+
+// Stands in for the INT pulse time of a sensor whose INT the MCU does not
+// see.  Its newest frame came in at most a frame period ago, half of one is
+// the best guess.
+static uint32_t inv_icm20948_estimated_int_time(inv_icm20948_state *st)
+{
+    return inv_icm20948_get_time_us() - inv_icm20948_frames_to_us(st, 1) / 2;
+}
+
+// FIFO count along with the time of the INT pulse for the newest frame in
+// it.  The MCU captures the time of every pulse in hardware; if one arrives
+// between reading the capture and the count, both are read again.
+static int16_t inv_icm20948_get_fifo_counter_at(inv_icm20948_state *st, uint32_t *int_time)
+{
+    int16_t fifo_count;
+
+    if (!st->int_pin) {
+        fifo_count = inv_icm20948_get_fifo_counter(st);
+        *int_time = inv_icm20948_estimated_int_time(st);
+        return fifo_count;
+    }
+    do {
+        *int_time = inv_icm20948_get_int_time_us();
+        fifo_count = inv_icm20948_get_fifo_counter(st);
+    } while ((fifo_count >= 0) && (*int_time != inv_icm20948_get_int_time_us()));
+    return fifo_count;
+}
+
+// A FIFO_R_W read failed part way, the frame boundaries are lost.
+static void inv_icm20948_fifo_lost(inv_icm20948_state *st)
+{
+    inv_icm20948_write_register(st, IMU_FIFO_RST, 0x1F);
+    inv_icm20948_write_register(st, IMU_FIFO_RST, 0x00);
+}
+
 void inv_icm20948_read_imu_fifo(inv_icm20948_state *st, IMU_DATA *imu_data)
 {
     uint8_t data_blk[32];
-    uint16_t i, fifo_count, bytes_per_datum;
+    int16_t fifo_count;
+    uint16_t bytes_per_datum;
+    uint32_t int_time;
 
-    fifo_count = inv_icm20948_get_fifo_counter();
+    // imu_data keeps the last sample if the bus fails
+    fifo_count = inv_icm20948_get_fifo_counter_at(st, &int_time);
+    if (fifo_count < 0)
+        return;
 
     bytes_per_datum = st->chip_config->bytes_per_datum;
     if (fifo_count >= bytes_per_datum) {
-        inv_icm20948_read_register_block(IMU_FIFO_R_W, data_blk, bytes_per_datum);
-        imu_data->time_stamp = inv_icm20948_get_time_us();
+        if (inv_icm20948_read_register_block(st, IMU_FIFO_R_W, data_blk, bytes_per_datum)) {
+            inv_icm20948_fifo_lost(st);
+            return;
+        }
+        imu_data->time_stamp = int_time - inv_icm20948_frames_to_us(st, fifo_count / bytes_per_datum - 1);
+        imu_data->sensor = st->index;
         fifo_count -= bytes_per_datum;
     }
     if (fifo_count) {    // I only want the first set of data
         // reset FIFO
-        inv_icm20948_write_register(IMU_FIFO_RST, 0x1F);
-        inv_icm20948_write_register(IMU_FIFO_RST, 0x00);
+        inv_icm20948_write_register(st, IMU_FIFO_RST, 0x1F);
+        inv_icm20948_write_register(st, IMU_FIFO_RST, 0x00);
     }
 
-    i = 0;
-    if (st->chip_config->accl_fifo_enable) {
-        imu_data->ax = (data_blk[i+0] << 8) + data_blk[i+1];
-        imu_data->ay = (data_blk[i+2] << 8) + data_blk[i+3];
-        imu_data->az = (data_blk[i+4] << 8) + data_blk[i+5];
-        i += 6;
-    }
-    if (st->chip_config->gyro_fifo_enable) {
-        imu_data->gx = (data_blk[i+0] << 8) + data_blk[i+1];
-        imu_data->gy = (data_blk[i+2] << 8) + data_blk[i+3];
-        imu_data->gz = (data_blk[i+4] << 8) + data_blk[i+5];
-        i += 6;
-    }
-    if (st->chip_config->temp_fifo_enable) {
-        imu_data->temperature = (data_blk[i+0] << 8) + data_blk[i+1];
-        i += 2;
+    st->decode_fifo(data_blk, imu_data);
+}
+
+// Number of complete frames waiting in the FIFO, at most max, or -1 if the
+// bus failed.  time_stamp receives the time the oldest of them was sampled,
+// the frames after it follow at the FIFO rate.
+static int16_t inv_icm20948_fifo_frames(inv_icm20948_state *st, size_t max, uint32_t *time_stamp)
+{
+    int16_t fifo_count, frames;
+    uint32_t int_time;
+
+    if ((st->chip_config->bytes_per_datum == 0) || (max == 0))
+        return 0;
+
+    fifo_count = inv_icm20948_get_fifo_counter_at(st, &int_time);
+    if (fifo_count < 0)
+        return -1;
+    if (fifo_count >= IMU_FIFO_SIZE) {
+        // the FIFO overflowed and the oldest bytes were overwritten, so the
+        // frame boundaries are lost; start over with an empty FIFO
+        inv_icm20948_write_register(st, IMU_FIFO_RST, 0x1F);
+        inv_icm20948_write_register(st, IMU_FIFO_RST, 0x00);
+        inv_icm20948_read_register(st, IMU_INT_STATUS_2);   // clear the overflow status
+        st->fifo_overflows++;
+        return 0;
     }
-    if (st->chip_config->magn_fifo_enable) {
-        imu_data->mx = 1; //(data_blk[i+0] << 8) + data_blk[i+1];
-        imu_data->my = 2; //(data_blk[i+2] << 8) + data_blk[i+3];
-        imu_data->mz = 3; //(data_blk[i+4] << 8) + data_blk[i+5];
-        i += 6;
+
+    frames = fifo_count / st->chip_config->bytes_per_datum;
+    if (frames > 0)
+        *time_stamp = int_time - inv_icm20948_frames_to_us(st, frames - 1);
+    if ((size_t)frames > max)
+        frames = (int16_t)max;
+    return frames;
+}
+
+// Largest batch that still leaves a quarter of the FIFO to absorb the
+// latency between the wake-up and the read.
+static uint16_t inv_icm20948_max_fifo_watermark(inv_icm20948_state *st)
+{
+    uint16_t frames;
+
+    if (st->chip_config->bytes_per_datum == 0)
+        return 1;
+    frames = (IMU_FIFO_SIZE * 3 / 4) / st->chip_config->bytes_per_datum;
+    return (frames > 0) ? frames : 1;
+}
+
+// Set the number of frames (DMP packets in DMP mode) to collect before the
+// MCU is woken up.  Returns the watermark in effect for the current FIFO
+// layout, which the MCU programs into its INT pulse counter.
+uint16_t inv_icm20948_set_fifo_watermark(inv_icm20948_state *st, uint16_t frames)
+{
+    st->chip_config->fifo_watermark = (frames > 0) ? frames : 1;
+    return inv_icm20948_get_fifo_watermark(st);
+}
+
+uint16_t inv_icm20948_get_fifo_watermark(inv_icm20948_state *st)
+{
+    uint16_t max = inv_icm20948_max_fifo_watermark(st);
+    return (st->chip_config->fifo_watermark > max) ? max : st->chip_config->fifo_watermark;
+}
+
+int16_t inv_icm20948_read_imu_fifo_batch(inv_icm20948_state *st, IMU_DATA *imu_data, size_t max)
+{
+    // This function drains every complete frame in the FIFO (up to max) using
+    // as few burst reads of FIFO_R_W as the transport allows.
+    uint8_t data_blk[IMU_FIFO_MAX_BURST];
+    uint16_t i, bytes_per_datum, burst_frames;
+    uint32_t time_stamp;
+    int16_t frames, count = 0;
+
+    bytes_per_datum = st->chip_config->bytes_per_datum;
+    frames = inv_icm20948_fifo_frames(st, max, &time_stamp);
+    if (frames < 0)
+        return -1;
+
+    while (frames) {
+        burst_frames = sizeof(data_blk) / bytes_per_datum;
+        if (burst_frames > frames)
+            burst_frames = frames;
+
+        // the frames already decoded are good, the rest of the FIFO is not
+        if (inv_icm20948_read_register_block(st, IMU_FIFO_R_W, data_blk, burst_frames * bytes_per_datum)) {
+            inv_icm20948_fifo_lost(st);
+            return (count > 0) ? count : -1;
+        }
+
+        for (i = 0; i < burst_frames; i++, count++) {
+            st->decode_fifo(&data_blk[i * bytes_per_datum], &imu_data[count]);
+            imu_data[count].time_stamp = time_stamp + inv_icm20948_frames_to_us(st, count);
+            imu_data[count].sensor = st->index;
+        }
+        frames -= burst_frames;
     }
 
-    //printk("ax %d ay %d az %d\n", imu_data->ax, imu_data->ay, imu_data->az);
-    //printk("gx %d gy %d gz %d\n", imu_data->gx, imu_data->gy, imu_data->gz);
-    //printk("mx %d my %d mz %d\n", imu_data->mx, imu_data->my, imu_data->mz);
+    return count;
 }
 
 int16_t inv_icm20948_reset_fifo(inv_icm20948_state *st)
 {
+    static const uint8_t fifo_rst[] = { 0x1F, 0x00 };
+    inv_icm20948_config_list list;
     uint8_t temp;
 
-    // disable interrupts
-    inv_icm20948_write_register(IMU_INT_ENABLE, 0x00);
-    inv_icm20948_write_register(IMU_INT_ENABLE_1, 0x00);
-    inv_icm20948_write_register(IMU_INT_ENABLE_2, 0x00);
-    inv_icm20948_write_register(IMU_INT_ENABLE_3, 0x00);
+    inv_icm20948_config_begin(st, &list);
 
+    // disable interrupts
+    inv_icm20948_stage_config(st, IMU_INT_ENABLE, 0xff, 0x00);
+    inv_icm20948_stage_config(st, IMU_INT_ENABLE_1, 0xff, 0x00);
+    inv_icm20948_stage_config(st, IMU_INT_ENABLE_2, 0xff, 0x00);
+    inv_icm20948_stage_config(st, IMU_INT_ENABLE_3, 0xff, 0x00);
 
     // disable the sensor output to FIFO
-    inv_icm20948_write_register(IMU_FIFO_EN_1, 0x00);
-    inv_icm20948_write_register(IMU_FIFO_EN_2, 0x00);
-
-
-    // disable fifo reading
-    inv_icm20948_write_register(IMU_USER_CTRL, 0x00);
+    inv_icm20948_stage_config(st, IMU_FIFO_EN_1, 0xff, 0x00);
+    inv_icm20948_stage_config(st, IMU_FIFO_EN_2, 0xff, 0x00);
 
+    // disable fifo reading and the DMP, the I2C master keeps running
+    inv_icm20948_stage_config(st, IMU_USER_CTRL, IMU_BIT_FIFO_EN | IMU_BIT_DMP_EN, 0x00);
+    inv_icm20948_config_staged(st, &list);
 
     // reset FIFO
-    inv_icm20948_write_register(IMU_FIFO_RST, 0x1F);
-    inv_icm20948_write_register(IMU_FIFO_RST, 0x00);
+    inv_icm20948_config_write(&list, IMU_FIFO_RST, &fifo_rst[0], 1);
+    inv_icm20948_config_write(&list, IMU_FIFO_RST, &fifo_rst[1], 1);
+
+    // an overflow also pulses INT, so the MCU comes to drain the FIFO
+    inv_icm20948_stage_config(st, IMU_INT_ENABLE_2, 0xff, IMU_BIT_FIFO_OVERFLOW_EN_0);
+
+    if (st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF) {
+        // the DMP writes its packets into the FIFO and raises the interrupt
+        inv_icm20948_stage_config(st, IMU_INT_ENABLE, 0xff, IMU_BIT_DMP_INT1_EN);
+        inv_icm20948_stage_config(st, IMU_USER_CTRL, (uint8_t)~IMU_BIT_I2C_IF_DIS, IMU_BIT_FIFO_EN | IMU_BIT_DMP_EN | IMU_BIT_DMP_RST
+                                  | (st->chip_config->magn_fifo_enable ? IMU_BIT_I2C_MST_EN : 0));
+        inv_icm20948_config_staged(st, &list);
+        return inv_icm20948_config_end(st, &list);
+    }
 
     // enable interrupt
     if (   st->chip_config->accl_fifo_enable
         || st->chip_config->gyro_fifo_enable
         || st->chip_config->magn_fifo_enable
         || st->chip_config->temp_fifo_enable) {
-        inv_icm20948_write_register(IMU_INT_ENABLE_1, IMU_BIT_RAW_DATA_0_RDY_EN);
+        inv_icm20948_stage_config(st, IMU_INT_ENABLE_1, 0xff, IMU_BIT_RAW_DATA_0_RDY_EN);
     }
-    //inv_icm20948_write_register(IMU_INT_ENABLE_2, 0x01);    // enable for testing
 
-    // enable FIFO reading and I2C master interface
-    inv_icm20948_write_register(IMU_USER_CTRL, IMU_BIT_FIFO_EN);
+    // enable FIFO reading and I2C master interface, I2C_IF_DIS stays as the
+    // init script left it
+    inv_icm20948_stage_config(st, IMU_USER_CTRL, (uint8_t)~IMU_BIT_I2C_IF_DIS, IMU_BIT_FIFO_EN | (st->chip_config->magn_fifo_enable ? IMU_BIT_I2C_MST_EN : 0));
 
-    // enable sensor output to FIFO
+    // enable sensor output to FIFO; SLV0 carries the magnetometer data
+    inv_icm20948_stage_config(st, IMU_FIFO_EN_1, 0xff, st->chip_config->magn_fifo_enable ? IMU_BIT_SLV_0_FIFO_EN : 0x00);
     temp = 0;
     if (st->chip_config->gyro_fifo_enable)
         temp |= IMU_BIT_GYRO_FIFO_EN;
@@ -412,52 +906,1200 @@ int16_t inv_icm20948_reset_fifo(inv_icm20948_state *st)
         temp |= IMU_BIT_ACCEL_FIFO_EN;
     if (st->chip_config->temp_fifo_enable)
         temp |= IMU_BIT_TEMP_FIFO_EN;
-    inv_icm20948_write_register(IMU_FIFO_EN_2, temp);
+    inv_icm20948_stage_config(st, IMU_FIFO_EN_2, 0xff, temp);
+
+    inv_icm20948_config_staged(st, &list);
+    return inv_icm20948_config_end(st, &list);
+}
+
+/***********************************************************************/
+/*                                                                     */
+/* Magnetometer -- the AK09916 sits behind the ICM-20948's auxiliary   */
+/*        I2C master.  SLV4 is used for one-off register accesses and  */
+/*        SLV0/SLV1 read the samples at the sensor's sample rate.      */
+/*                                                                     */
+/***********************************************************************/
+
+static int16_t inv_icm20948_magn_transfer(inv_icm20948_state *st, uint8_t addr, uint8_t reg, uint8_t *value)
+{
+    uint8_t block[3], status;
+    uint16_t counter = 0;
+
+    if (!(addr & IMU_BIT_I2C_SLV_READ) && inv_icm20948_write_register(st, IMU_I2C_SLV4_DO, *value))
+        return -1;
+
+    // SLV4_ADDR, SLV4_REG and SLV4_CTRL are adjacent, so start the transfer in one write
+    block[0] = addr;
+    block[1] = reg;
+    block[2] = IMU_BIT_I2C_SLV_EN;
+    if (inv_icm20948_write_register_block(st, IMU_I2C_SLV4_ADDR, block, 3))
+        return -1;
+
+    do {
+        inv_icm20948_sleep_us(100);
+        status = inv_icm20948_read_register(st, IMU_I2C_MST_STATUS);
+    } while (!(status & IMU_BIT_I2C_SLV4_DONE) && (counter++ < 100));
+
+    if (!(status & IMU_BIT_I2C_SLV4_DONE) || (status & IMU_BIT_I2C_SLV4_NACK))
+        return -1;
 
-    // need to add support for temperature and magnetometer
+    if (addr & IMU_BIT_I2C_SLV_READ)
+        return inv_icm20948_read_register_block(st, IMU_I2C_SLV4_DI, value, 1);
 
     return 0;
 }
 
+static int16_t inv_icm20948_magn_read(inv_icm20948_state *st, uint8_t reg, uint8_t *value)
+{
+    return inv_icm20948_magn_transfer(st, AK09916_ADDR | IMU_BIT_I2C_SLV_READ, reg, value);
+}
+
+static int16_t inv_icm20948_magn_write(inv_icm20948_state *st, uint8_t reg, uint8_t value)
+{
+    return inv_icm20948_magn_transfer(st, AK09916_ADDR, reg, &value);
+}
+
+static uint8_t inv_icm20948_magn_mode(uint16_t rate)
+{
+    // the AK09916 tops out at 100Hz; faster IMU rates repeat the last sample
+    if (rate >= 100)
+        return AK09916_MODE_CONT_100HZ;
+    if (rate >= 50)
+        return AK09916_MODE_CONT_50HZ;
+    if (rate >= 20)
+        return AK09916_MODE_CONT_20HZ;
+    return AK09916_MODE_CONT_10HZ;
+}
+
+int16_t inv_icm20948_setup_magn(inv_icm20948_state *st)
+{
+    uint8_t value;
+
+    // reset and enable the I2C master, running it at the sensor rate instead of duty cycled
+    inv_icm20948_stage_config(st, IMU_USER_CTRL, IMU_BIT_I2C_MST_EN | IMU_BIT_I2C_MST_RST, IMU_BIT_I2C_MST_EN | IMU_BIT_I2C_MST_RST);
+    inv_icm20948_stage_config(st, IMU_LP_CONFIG, IMU_I2C_MST_CYCLE, 0x00);
+    inv_icm20948_stage_config(st, IMU_I2C_MST_CTRL, 0xff, IMU_BIT_I2C_MST_P_NSR | IMU_I2C_MST_CLK_345KHZ);
+    inv_icm20948_commit_config(st);
+
+    if (inv_icm20948_magn_read(st, AK09916_WIA2, &value) || (value != AK09916_EXPECTED_WIA2))
+        return -1;
+
+    if (inv_icm20948_magn_write(st, AK09916_CNTL3, AK09916_BIT_SRST))
+        return -1;
+    inv_icm20948_sleep_us(1000);
+    if (inv_icm20948_magn_write(st, AK09916_CNTL2, inv_icm20948_magn_mode(st->chip_config->sample_rate)))
+        return -1;
+
+    // SLV0 reads HXL..HZH, byte swapped to big endian like the other sensors,
+    // into EXT_SLV_SENS_DATA_00 and the FIFO.  SLV1 reads ST2 so that the
+    // AK09916 releases its data registers for the next measurement.
+    inv_icm20948_stage_config(st, IMU_I2C_SLV0_ADDR, 0xff, AK09916_ADDR | IMU_BIT_I2C_SLV_READ);
+    inv_icm20948_stage_config(st, IMU_I2C_SLV0_REG, 0xff, AK09916_HXL);
+    inv_icm20948_stage_config(st, IMU_I2C_SLV0_CTRL, 0xff, IMU_BIT_I2C_SLV_EN | IMU_BIT_I2C_SLV_BYTE_SW | IMU_BIT_I2C_SLV_GRP | 6);
+    inv_icm20948_stage_config(st, IMU_I2C_SLV1_ADDR, 0xff, AK09916_ADDR | IMU_BIT_I2C_SLV_READ);
+    inv_icm20948_stage_config(st, IMU_I2C_SLV1_REG, 0xff, AK09916_ST2);
+    inv_icm20948_stage_config(st, IMU_I2C_SLV1_CTRL, 0xff, IMU_BIT_I2C_SLV_EN | 1);
+    return inv_icm20948_commit_config(st);
+}
+
 /***********************************************************************/
 /*                                                                     */
-/* Support functions                                                   */
+/* Power profiles -- battery powered tags mostly need low rate accel   */
+/*        data.  The accel-only profiles power down the gyro, the      */
+/*        temperature sensor and the magnetometer, and the low power   */
+/*        profile also duty cycles the accelerometer, averaging a few  */
+/*        samples per output instead of running it continuously.       */
+/*                                                                     */
+/***********************************************************************/
+
+// The chip has to be awake (inv_icm20948_set_power()) when the magnetometer
+// is switched on or off.
+int16_t inv_icm20948_set_power_profile(inv_icm20948_state *st, uint8_t profile, uint8_t accel_avg)
+{
+    bool accel_only = (profile != INV_ICM20948_POWER_FULL);
+    bool cycle = (profile == INV_ICM20948_POWER_ACCEL_LP);
+    bool was_accel_only = (st->chip_config->power_profile != INV_ICM20948_POWER_FULL);
+
+    // the DMP fuses the gyro data
+    if (accel_only && (st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF))
+        return -1;
+
+    if (accel_only && st->chip_config->magn_fifo_enable) {
+        // stop the I2C master polling the AK09916 and power it down
+        inv_icm20948_magn_write(st, AK09916_CNTL2, AK09916_MODE_POWER_DOWN);
+        inv_icm20948_stage_config(st, IMU_I2C_SLV0_CTRL, 0xff, 0x00);
+        inv_icm20948_stage_config(st, IMU_I2C_SLV1_CTRL, 0xff, 0x00);
+        inv_icm20948_stage_config(st, IMU_USER_CTRL, IMU_BIT_I2C_MST_EN, 0x00);
+        st->chip_config->magn_fifo_enable = false;
+    }
+    st->chip_config->gyro_fifo_enable = !accel_only;
+    st->chip_config->temp_fifo_enable = !accel_only;
+
+    inv_icm20948_stage_config(st, IMU_PWR_MGMT_2, IMU_BIT_DISABLE_GYRO, accel_only ? IMU_BIT_DISABLE_GYRO : 0x00);
+    inv_icm20948_stage_config(st, IMU_PWR_MGMT_1, IMU_BIT_TEMP_DIS, accel_only ? IMU_BIT_TEMP_DIS : 0x00);
+    inv_icm20948_stage_config(st, IMU_PWR_MGMT_1, IMU_BIT_LP_EN, cycle ? IMU_BIT_LP_EN : 0x00);
+    inv_icm20948_stage_config(st, IMU_LP_CONFIG, IMU_ACCEL_CYCLE | IMU_GYRO_CYCLE, cycle ? IMU_ACCEL_CYCLE : 0x00);
+    inv_icm20948_stage_config(st, IMU_ACCEL_CONFIG_2, 0x03, accel_avg & 0x03);
+
+    // with the gyro off, the accelerometer's own divider sets the FIFO rate
+    st->chip_config->power_profile = profile;
+    st->chip_config->accel_avg = accel_avg & 0x03;
+    inv_icm20948_stage_sample_frequency(st, st->chip_config->sample_rate);
+    if (inv_icm20948_commit_config(st))
+        return -1;
+
+    if (!accel_only && was_accel_only)
+        st->chip_config->magn_fifo_enable = (inv_icm20948_setup_magn(st) == 0);
+
+    return inv_icm20948_setup_fifo(st);
+}
+
+/***********************************************************************/
+/*                                                                     */
+/* Digital Motion Processor -- the DMP runs InvenSense's sensor fusion */
+/*        firmware on the ICM-20948 itself.  The image is uploaded     */
+/*        into DMP memory after every reset, through MEM_BANK_SEL,     */
+/*        MEM_START_ADDR and MEM_R_W, and the fused orientation then   */
+/*        comes out of the FIFO as quaternion packets.                 */
 /*                                                                     */
 /***********************************************************************/
 
-static uint8_t current_bank = 0xff;
+// The image normally lives in flash, which EasyDMA cannot read, so every
+// chunk is copied into one of two RAM buffers and sent from there as a
+// prefixed write.  The next chunk is copied while the last one is on the bus.
+static uint8_t dmp_chunk[2][1 + DMP_MAX_SERIAL_WRITE];     // register byte, then the data
+static volatile bool dmp_chunk_busy[2];
+static volatile bool dmp_write_failed;
 
-static void inv_icm20948_set_bank(uint16_t reg)
+static void inv_icm20948_write_mems_done(uint32_t result, void *context)
 {
-    uint8_t bank = (reg & 0xff00) >> 4;
-    if (bank != current_bank) {
-        inv_icm20948_i2c_write_reg(IMU_REG_BANK_SEL, bank);
-        current_bank = bank;
+    if (result)
+        dmp_write_failed = true;
+    *(volatile bool *)context = false;
+}
+
+int16_t inv_icm20948_write_mems(inv_icm20948_state *st, uint16_t addr, const uint8_t *data, uint32_t size)
+{
+    inv_icm20948_i2c_op ops[4];
+    uint8_t bank_sel, start_addr;
+    uint16_t bank = 0xffff;
+    uint32_t len, n;
+    int i = 0;
+
+    dmp_write_failed = false;
+    while (size && !dmp_write_failed) {
+        // a transfer must not cross a DMP memory bank
+        len = DMP_MEM_BANK_SIZE - (addr & 0xff);
+        if (len > DMP_MAX_SERIAL_WRITE)
+            len = DMP_MAX_SERIAL_WRITE;
+        if (len > size)
+            len = size;
+
+        while (dmp_chunk_busy[i])
+            inv_icm20948_i2c_check();
+        memcpy(&dmp_chunk[i][1], data, len);
+
+        // the list copies the one byte writes when it is queued
+        n = 0;
+        if ((addr >> 8) != bank) {
+            bank = addr >> 8;
+            bank_sel = (uint8_t)bank;
+            n = inv_icm20948_list_op(st, ops, n, IMU_MEM_BANK_SEL, &bank_sel, 1, false);
+        }
+        start_addr = (uint8_t)(addr & 0xff);
+        n = inv_icm20948_list_op(st, ops, n, IMU_MEM_START_ADDR, &start_addr, 1, false);
+        n = inv_icm20948_list_op(st, ops, n, IMU_MEM_R_W, dmp_chunk[i], len, false);
+        ops[n - 1].prefixed = true;
+
+        dmp_chunk_busy[i] = true;
+        if (inv_icm20948_i2c_xfer_list(st->addr, ops, n, inv_icm20948_write_mems_done, (void *)&dmp_chunk_busy[i])) {
+            dmp_chunk_busy[i] = false;
+            dmp_write_failed = true;
+        }
+        i ^= 1;
+
+        addr += len;
+        data += len;
+        size -= len;
     }
+
+    while (dmp_chunk_busy[0] || dmp_chunk_busy[1])
+        inv_icm20948_i2c_check();
+    return dmp_write_failed ? -1 : 0;
 }
 
-void inv_icm20948_write_register(uint16_t reg, uint8_t value)
+int16_t inv_icm20948_read_mems(inv_icm20948_state *st, uint16_t addr, uint8_t *data, uint32_t size)
 {
-    inv_icm20948_set_bank(reg);
-    inv_icm20948_i2c_write_reg((uint8_t)(reg&0xff), value);
+    uint16_t bank = 0xffff;
+    uint32_t len;
+
+    while (size) {
+        len = DMP_MEM_BANK_SIZE - (addr & 0xff);
+        if (len > DMP_MAX_SERIAL_WRITE)
+            len = DMP_MAX_SERIAL_WRITE;
+        if (len > size)
+            len = size;
+
+        if ((addr >> 8) != bank) {
+            bank = addr >> 8;
+            if (inv_icm20948_write_register(st, IMU_MEM_BANK_SEL, (uint8_t)bank))
+                return -1;
+        }
+        if (   inv_icm20948_write_register(st, IMU_MEM_START_ADDR, (uint8_t)(addr & 0xff))
+            || inv_icm20948_read_register_block(st, IMU_MEM_R_W, data, (uint8_t)len))
+            return -1;
+
+        addr += len;
+        data += len;
+        size -= len;
+    }
+    return 0;
 }
 
-void inv_icm20948_write_register_block(uint16_t reg, uint8_t *block, uint8_t count)
+static int16_t inv_icm20948_write_mems_16(inv_icm20948_state *st, uint16_t addr, uint16_t value)
 {
-    inv_icm20948_set_bank(reg);
-    inv_icm20948_i2c_write_reg_block((uint8_t)(reg&0xff), block, count);
+    uint8_t data[2] = { (uint8_t)(value >> 8), (uint8_t)value };
+    return inv_icm20948_write_mems(st, addr, data, sizeof(data));
 }
 
-uint8_t inv_icm20948_read_register(uint16_t reg)
+static int16_t inv_icm20948_write_mems_32(inv_icm20948_state *st, uint16_t addr, uint32_t value)
 {
-    uint8_t value;
-    inv_icm20948_set_bank(reg);
-    inv_icm20948_i2c_read_reg((uint8_t)(reg&0xff), &value);
-    return value;
+    uint8_t data[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+    return inv_icm20948_write_mems(st, addr, data, sizeof(data));
 }
 
-void inv_icm20948_read_register_block(uint16_t reg, uint8_t *block, uint8_t count)
+int16_t inv_icm20948_load_dmp(inv_icm20948_state *st, const uint8_t *image, uint32_t size)
 {
-    inv_icm20948_set_bank(reg);
-    inv_icm20948_i2c_read_reg_block((uint8_t)(reg&0xff), block, count);
+    uint8_t block[DMP_MAX_SERIAL_WRITE];
+    uint32_t offset, len;
+    int16_t result;
+
+    if ((image == NULL) || (size == 0) || (DMP_LOAD_START + size > 0x10000))
+        return -1;
+
+    // DMP memory can only be accessed while the chip is awake and not duty cycled
+    result = inv_icm20948_set_power(st, true);
+    if (result)
+        return result;
+    inv_icm20948_stage_config(st, IMU_PWR_MGMT_1, IMU_BIT_LP_EN, 0x00);
+    if (inv_icm20948_commit_config(st))
+        return -1;
+
+    if (inv_icm20948_write_mems(st, DMP_LOAD_START, image, size))
+        return -1;
+
+    // read the image back, a corrupted DMP program does not fail gracefully
+    for (offset = 0; offset < size; offset += len) {
+        len = size - offset;
+        if (len > sizeof(block))
+            len = sizeof(block);
+        if (inv_icm20948_read_mems(st, DMP_LOAD_START + offset, block, len))
+            return -1;
+        if (memcmp(block, &image[offset], len) != 0) {
+            NRF_LOG_INFO("DMP image verify failed at 0x%04x", DMP_LOAD_START + offset);
+            return -1;
+        }
+    }
+
+    // where the DMP starts executing after DMP_RST
+    block[0] = DMP_START_ADDRESS >> 8;
+    block[1] = DMP_START_ADDRESS & 0xff;
+    if (inv_icm20948_write_register_block(st, IMU_PRGM_START_ADDRH, block, 2))
+        return -1;
+
+    NRF_LOG_INFO("DMP image loaded, %d bytes", size);
+    return 0;
+}
+
+static uint16_t inv_icm20948_dmp_header(uint8_t mode)
+{
+    return (mode == INV_ICM20948_DMP_RV) ? DMP_HEADER_QUAT9 : DMP_HEADER_QUAT6;
+}
+
+// Gyro scale factor for the DMP; it corrects the gyro integration for the
+// sample rate divider and the trimmed PLL frequency of this part.
+static uint32_t inv_icm20948_dmp_gyro_sf(inv_icm20948_state *st, uint8_t divider)
+{
+    const uint64_t magic_constant = 264446880937391ULL;
+    const uint64_t magic_constant_scale = 100000ULL;
+    const uint8_t gyro_level = 4;
+    uint8_t pll = inv_icm20948_read_register(st, IMU_TIMEBASE_CORRECTION_PLL);
+    uint64_t result;
+
+    if (pll & 0x80)
+        result = magic_constant * (1ULL << gyro_level) * (1 + divider) / (1270 - (pll & 0x7f)) / magic_constant_scale;
+    else
+        result = magic_constant * (1ULL << gyro_level) * (1 + divider) / (1270 + pll) / magic_constant_scale;
+
+    return (result > 0x7fffffff) ? 0x7fffffff : (uint32_t)result;
+}
+
+int16_t inv_icm20948_enable_dmp(inv_icm20948_state *st, inv_icm20948_dmp_mode_e mode)
+{
+    const uint8_t divider = (INV_ICM20948_INTERNAL_SAMPLE_RATE / DMP_RATE_HZ) - 1;
+    uint16_t output, odr;
+
+    // a new bring-up goes back to raw samples
+    if (mode == INV_ICM20948_DMP_OFF)
+        return -1;
+    if (st->chip_config->power_profile != INV_ICM20948_POWER_FULL)
+        return -1;      // the DMP fuses the gyro data
+    if ((mode == INV_ICM20948_DMP_RV) && !st->chip_config->magn_fifo_enable)
+        return -1;      // the 9-axis vector needs the magnetometer
+
+    // stop the FIFO while the DMP is configured, it fills the FIFO itself later on
+    inv_icm20948_stage_config(st, IMU_USER_CTRL, IMU_BIT_FIFO_EN | IMU_BIT_DMP_EN, 0x00);
+    inv_icm20948_stage_config(st, IMU_FIFO_EN_1, 0xff, 0x00);
+    inv_icm20948_stage_config(st, IMU_FIFO_EN_2, 0xff, 0x00);
+    if (inv_icm20948_commit_config(st))
+        return -1;
+
+    // the scale constants below assume +/-4g, +/-2000dps and 56Hz sensor data
+    st->chip_config->accl_fsr = INV_ICM20948_ACCEL_FSR_04G;
+    st->chip_config->gyro_fsr = INV_ICM20948_GYRO_FSR_2000DPS;
+    inv_icm20948_stage_accel_fsr(st, st->chip_config->accl_fsr);
+    inv_icm20948_stage_gyro_fsr(st, st->chip_config->gyro_fsr);
+    inv_icm20948_stage_dividers(st, divider, divider);
+    inv_icm20948_stage_config(st, IMU_HW_FIX_DISABLE, 0xff, 0x48);
+    if (   inv_icm20948_commit_config(st)
+        || inv_icm20948_write_register(st, IMU_SINGLE_FIFO_PRIORITY_SEL, 0xe4))
+        return -1;
+
+    if (   inv_icm20948_write_mems_32(st, DMP_ACC_SCALE, 0x04000000)
+        || inv_icm20948_write_mems_32(st, DMP_ACC_SCALE2, 0x00040000)
+        || inv_icm20948_write_mems_32(st, DMP_GYRO_FULLSCALE, 0x10000000)
+        || inv_icm20948_write_mems_32(st, DMP_GYRO_SF, inv_icm20948_dmp_gyro_sf(st, divider))
+        || inv_icm20948_write_mems_32(st, DMP_ACCEL_ONLY_GAIN, 0x03a49249)
+        || inv_icm20948_write_mems_32(st, DMP_ACCEL_ALPHA_VAR, 0x34924925)
+        || inv_icm20948_write_mems_32(st, DMP_ACCEL_A_VAR, 0x0b6db6db)
+        || inv_icm20948_write_mems_16(st, DMP_ACCEL_CAL_RATE, 0x0000))
+        return -1;
+
+    // the sensor axes are the body axes
+    if (   inv_icm20948_write_mems_32(st, DMP_B2S_MTX_00, 0x40000000)
+        || inv_icm20948_write_mems_32(st, DMP_B2S_MTX_11, 0x40000000)
+        || inv_icm20948_write_mems_32(st, DMP_B2S_MTX_22, 0x40000000))
+        return -1;
+
+    if (mode == INV_ICM20948_DMP_RV) {
+        // AK09916 to ICM-20948 axes (y and z are inverted), with the
+        // compass sensitivity folded in
+        if (   inv_icm20948_write_mems_32(st, DMP_CPASS_MTX_00, 0x09999999)
+            || inv_icm20948_write_mems_32(st, DMP_CPASS_MTX_11, 0xf6666667)
+            || inv_icm20948_write_mems_32(st, DMP_CPASS_MTX_22, 0xf6666667)
+            || inv_icm20948_write_mems_16(st, DMP_CPASS_TIME_BUFFER, 69))
+            return -1;
+
+        // the DMP expects RSV2, ST1, HXL..HZH, TMPS and ST2 from SLV0, with
+        // SLV1 triggering a single measurement for every sensor sample
+        inv_icm20948_magn_write(st, AK09916_CNTL2, AK09916_MODE_POWER_DOWN);
+        inv_icm20948_stage_config(st, IMU_I2C_MST_ODR_CONFIG, 0x0f, 0x04);
+        inv_icm20948_stage_config(st, IMU_I2C_SLV0_REG, 0xff, AK09916_RSV2);
+        inv_icm20948_stage_config(st, IMU_I2C_SLV0_CTRL, 0xff, IMU_BIT_I2C_SLV_EN | IMU_BIT_I2C_SLV_BYTE_SW | IMU_BIT_I2C_SLV_GRP | 10);
+        inv_icm20948_stage_config(st, IMU_I2C_SLV1_ADDR, 0xff, AK09916_ADDR);
+        inv_icm20948_stage_config(st, IMU_I2C_SLV1_REG, 0xff, AK09916_CNTL2);
+        inv_icm20948_stage_config(st, IMU_I2C_SLV1_CTRL, 0xff, IMU_BIT_I2C_SLV_EN | 1);
+        inv_icm20948_stage_config(st, IMU_I2C_SLV1_DO, 0xff, AK09916_MODE_SINGLE);
+        if (inv_icm20948_commit_config(st))
+            return -1;
+    }
+
+    // select the output and its rate as a divider of the DMP rate
+    output = inv_icm20948_dmp_header(mode);
+    odr = (st->chip_config->sample_rate < DMP_RATE_HZ) ? (DMP_RATE_HZ / st->chip_config->sample_rate) - 1 : 0;
+    if (   inv_icm20948_write_mems_16(st, DMP_DATA_OUT_CTL1, output)
+        || inv_icm20948_write_mems_16(st, DMP_DATA_OUT_CTL2, 0x0000)
+        || inv_icm20948_write_mems_16(st, DMP_DATA_INTR_CTL, output))
+        return -1;
+    if (mode == INV_ICM20948_DMP_RV) {
+        if (   inv_icm20948_write_mems_16(st, DMP_MOTION_EVENT_CTL, DMP_MOTION_9AXIS | DMP_MOTION_ACCEL_CALIBR | DMP_MOTION_GYRO_CALIBR | DMP_MOTION_COMPASS_CALIBR)
+            || inv_icm20948_write_mems_16(st, DMP_DATA_RDY_STATUS, DMP_DATA_RDY_GYRO | DMP_DATA_RDY_ACCEL | DMP_DATA_RDY_COMPASS)
+            || inv_icm20948_write_mems_16(st, DMP_ODR_QUAT9, odr))
+            return -1;
+    } else {
+        if (   inv_icm20948_write_mems_16(st, DMP_MOTION_EVENT_CTL, DMP_MOTION_ACCEL_CALIBR | DMP_MOTION_GYRO_CALIBR)
+            || inv_icm20948_write_mems_16(st, DMP_DATA_RDY_STATUS, DMP_DATA_RDY_GYRO | DMP_DATA_RDY_ACCEL)
+            || inv_icm20948_write_mems_16(st, DMP_ODR_QUAT6, odr))
+            return -1;
+    }
+
+    st->chip_config->dmp_mode = mode;
+    st->chip_config->fifo_rate_mhz = st->chip_config->gyro_rate_mhz / (odr + 1);
+    st->chip_config->bytes_per_datum = DMP_HEADER_BYTES + DMP_FOOTER_BYTES
+                                     + ((mode == INV_ICM20948_DMP_RV) ? DMP_QUAT9_BYTES : DMP_QUAT6_BYTES);
+
+    // start the DMP on an empty FIFO
+    return inv_icm20948_reset_fifo(st);
+}
+
+static int32_t inv_icm20948_be32(const uint8_t *p)
+{
+    return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static void inv_icm20948_decode_dmp_packet(inv_icm20948_state *st, uint8_t *data_blk, IMU_QUAT *imu_quat)
+{
+    const float q30 = 1073741824.0f;
+    float x, y, z, w2;
+
+    data_blk += DMP_HEADER_BYTES;
+    imu_quat->q1 = inv_icm20948_be32(&data_blk[0]);
+    imu_quat->q2 = inv_icm20948_be32(&data_blk[4]);
+    imu_quat->q3 = inv_icm20948_be32(&data_blk[8]);
+    if (st->chip_config->dmp_mode == INV_ICM20948_DMP_RV)
+        imu_quat->accuracy = (data_blk[12] << 8) + data_blk[13];
+    else
+        imu_quat->accuracy = 0;
+
+    // the DMP only sends the vector part, w follows from |q| = 1
+    x = imu_quat->q1 / q30;
+    y = imu_quat->q2 / q30;
+    z = imu_quat->q3 / q30;
+    w2 = 1.0f - (x * x + y * y + z * z);
+    imu_quat->q0 = (w2 > 0.0f) ? (int32_t)(sqrtf(w2) * q30) : 0;
+}
+
+int16_t inv_icm20948_read_dmp_fifo_batch(inv_icm20948_state *st, IMU_QUAT *imu_quat, size_t max)
+{
+    // Same as inv_icm20948_read_imu_fifo_batch() for DMP packets, which have
+    // a fixed size for the single output that is enabled.
+    uint8_t data_blk[IMU_FIFO_MAX_BURST];
+    uint16_t i, header, expected, bytes_per_datum, burst_frames;
+    uint32_t time_stamp;
+    int16_t frames, count = 0;
+
+    if (st->chip_config->dmp_mode == INV_ICM20948_DMP_OFF)
+        return 0;
+
+    expected = inv_icm20948_dmp_header(st->chip_config->dmp_mode);
+    bytes_per_datum = st->chip_config->bytes_per_datum;
+    frames = inv_icm20948_fifo_frames(st, max, &time_stamp);
+    if (frames < 0)
+        return -1;
+
+    while (frames) {
+        burst_frames = sizeof(data_blk) / bytes_per_datum;
+        if (burst_frames > frames)
+            burst_frames = frames;
+
+        if (inv_icm20948_read_register_block(st, IMU_FIFO_R_W, data_blk, burst_frames * bytes_per_datum)) {
+            inv_icm20948_fifo_lost(st);
+            return (count > 0) ? count : -1;
+        }
+
+        for (i = 0; i < burst_frames; i++, count++) {
+            header = (data_blk[i * bytes_per_datum] << 8) + data_blk[i * bytes_per_datum + 1];
+            if (header != expected) {
+                // out of step with the packet stream, drop whatever is left
+                inv_icm20948_write_register(st, IMU_FIFO_RST, 0x1F);
+                inv_icm20948_write_register(st, IMU_FIFO_RST, 0x00);
+                return count;
+            }
+            inv_icm20948_decode_dmp_packet(st, &data_blk[i * bytes_per_datum], &imu_quat[count]);
+            imu_quat[count].time_stamp = time_stamp + inv_icm20948_frames_to_us(st, count);
+            imu_quat[count].sensor = st->index;
+        }
+        frames -= burst_frames;
+    }
+
+    return count;
+}
+
+/***********************************************************************/
+/*                                                                     */
+/* Non-blocking FIFO drain -- the same reads as the batch functions    */
+/*        above, chained through the bus callbacks so that the MCU is  */
+/*        free (or asleep) while the FIFO is read.  It takes two lists */
+/*        of transfers: the bank select and FIFO count, then every     */
+/*        FIFO_R_W burst needed for the frames that count reported.    */
+/*                                                                     */
+/***********************************************************************/
+
+static void inv_icm20948_async_count(uint32_t result, void *context);
+static void inv_icm20948_async_data(uint32_t result, void *context);
+
+static void inv_icm20948_async_done(inv_icm20948_state *st, int16_t count)
+{
+    st->fifo_read.busy = false;
+    st->fifo_read.callback(st, count);
+}
+
+static void inv_icm20948_async_reset(uint32_t result, void *context)
+{
+    inv_icm20948_state *st = context;
+
+    if (result)
+        inv_icm20948_forget_bank(st);
+    inv_icm20948_async_done(st, st->fifo_read.result);
+}
+
+// Drop everything in the FIFO and finish the drain with count once that is
+// done; after an overflow INT_STATUS_2 is read back too, which clears it.
+// The bank change goes in the same list, so nothing can get in between.
+static void inv_icm20948_async_reset_fifo(inv_icm20948_state *st, int16_t count, bool overflow)
+{
+    inv_icm20948_fifo_read *rd = &st->fifo_read;
+    uint8_t rst[2] = { 0x1F, 0x00 };
+    inv_icm20948_i2c_op ops[5];
+    uint32_t n;
+
+    rd->result = count;
+    n = inv_icm20948_list_op(st, ops, 0, IMU_FIFO_RST, &rst[0], 1, false);
+    n = inv_icm20948_list_op(st, ops, n, IMU_FIFO_RST, &rst[1], 1, false);
+    if (overflow)
+        n = inv_icm20948_list_op(st, ops, n, IMU_INT_STATUS_2, rd->count, 1, true);
+    if (inv_icm20948_i2c_xfer_list(st->addr, ops, n, inv_icm20948_async_reset, st))
+        inv_icm20948_async_reset(1, st);
+}
+
+// The bus failed during a drain.  The bank the device has selected is not
+// known any more, and after a failed FIFO_R_W read neither are the frame
+// boundaries.
+static void inv_icm20948_async_failed(inv_icm20948_state *st, bool fifo_lost)
+{
+    inv_icm20948_forget_bank(st);
+    if (fifo_lost)
+        inv_icm20948_async_reset_fifo(st, -1, false);
+    else
+        inv_icm20948_async_done(st, -1);
+}
+
+static void inv_icm20948_async_read_count(inv_icm20948_state *st)
+{
+    inv_icm20948_i2c_op ops[2];
+    uint32_t n;
+
+    st->fifo_read.int_time = inv_icm20948_get_int_time_us();
+    n = inv_icm20948_list_op(st, ops, 0, IMU_FIFO_COUNTH, st->fifo_read.count, 2, true);
+    if (inv_icm20948_i2c_xfer_list(st->addr, ops, n, inv_icm20948_async_count, st))
+        inv_icm20948_async_failed(st, false);
+}
+
+// Read all the frames in one list, in bursts the transport can handle.
+static void inv_icm20948_async_read_data(inv_icm20948_state *st)
+{
+    inv_icm20948_i2c_op ops[1 + (IMU_FIFO_SIZE + IMU_FIFO_MAX_BURST - 1) / IMU_FIFO_MAX_BURST];
+    inv_icm20948_fifo_read *rd = &st->fifo_read;
+    uint32_t n = 0, offset, bytes, burst;
+
+    bytes = rd->total * st->chip_config->bytes_per_datum;
+    for (offset = 0; offset < bytes; offset += burst) {
+        burst = (bytes - offset > IMU_FIFO_MAX_BURST) ? IMU_FIFO_MAX_BURST : bytes - offset;
+        n = inv_icm20948_list_op(st, ops, n, IMU_FIFO_R_W, &rd->data_blk[offset], burst, true);
+    }
+    if (inv_icm20948_i2c_xfer_list(st->addr, ops, n, inv_icm20948_async_data, st))
+        inv_icm20948_async_failed(st, false);
+}
+
+static void inv_icm20948_async_count(uint32_t result, void *context)
+{
+    inv_icm20948_state *st = context;
+    inv_icm20948_fifo_read *rd = &st->fifo_read;
+    uint16_t fifo_count, frames;
+
+    if (result) {
+        inv_icm20948_async_failed(st, false);
+        return;
+    }
+
+    // an INT pulse during the read, the count may not match the capture
+    if (!st->int_pin) {
+        rd->int_time = inv_icm20948_estimated_int_time(st);
+    } else if (rd->int_time != inv_icm20948_get_int_time_us()) {
+        inv_icm20948_async_read_count(st);
+        return;
+    }
+
+    fifo_count = (rd->count[0] << 8) | rd->count[1];
+    if (fifo_count >= IMU_FIFO_SIZE) {
+        // same recovery as inv_icm20948_fifo_frames(); this runs in the
+        // bus interrupt, which cannot wait for a transfer
+        st->fifo_overflows++;
+        inv_icm20948_async_reset_fifo(st, 0, true);
+        return;
+    }
+
+    frames = fifo_count / st->chip_config->bytes_per_datum;
+    if (frames == 0) {
+        inv_icm20948_async_done(st, 0);
+        return;
+    }
+    rd->time_stamp = rd->int_time - inv_icm20948_frames_to_us(st, frames - 1);
+    rd->total = (frames > rd->max) ? rd->max : frames;
+    rd->done = 0;
+    inv_icm20948_async_read_data(st);
+}
+
+static void inv_icm20948_async_data(uint32_t result, void *context)
+{
+    inv_icm20948_state *st = context;
+    inv_icm20948_fifo_read *rd = &st->fifo_read;
+    uint16_t i, bytes_per_datum = st->chip_config->bytes_per_datum;
+    uint16_t expected = inv_icm20948_dmp_header(st->chip_config->dmp_mode);
+    uint32_t time_stamp;
+    uint8_t *frame;
+
+    if (result) {
+        inv_icm20948_async_failed(st, true);
+        return;
+    }
+
+    for (i = 0; i < rd->total; i++, rd->done++) {
+        frame = &rd->data_blk[i * bytes_per_datum];
+        time_stamp = rd->time_stamp + inv_icm20948_frames_to_us(st, rd->done);
+        if (st->chip_config->dmp_mode == INV_ICM20948_DMP_OFF) {
+            IMU_DATA *imu_data = (IMU_DATA *)rd->frames + rd->done;
+            st->decode_fifo(frame, imu_data);
+            imu_data->time_stamp = time_stamp;
+            imu_data->sensor = st->index;
+        } else {
+            IMU_QUAT *imu_quat = (IMU_QUAT *)rd->frames + rd->done;
+            if (((frame[0] << 8) + frame[1]) != expected) {
+                // out of step with the packet stream, drop whatever is left
+                inv_icm20948_async_reset_fifo(st, rd->done, false);
+                return;
+            }
+            inv_icm20948_decode_dmp_packet(st, frame, imu_quat);
+            imu_quat->time_stamp = time_stamp;
+            imu_quat->sensor = st->index;
+        }
+    }
+
+    inv_icm20948_async_done(st, rd->done);
+}
+
+static int16_t inv_icm20948_async_start(inv_icm20948_state *st, void *frames, size_t max,
+                                        inv_icm20948_fifo_callback_t callback)
+{
+    inv_icm20948_fifo_read *rd = &st->fifo_read;
+
+    if (rd->busy || (callback == NULL))
+        return -1;
+    if ((st->chip_config->bytes_per_datum == 0) || (max == 0))
+        return -1;
+
+    rd->busy = true;
+    rd->frames = frames;
+    rd->max = max;
+    rd->callback = callback;
+    inv_icm20948_async_read_count(st);
+    return 0;
+}
+
+// Start draining up to max frames from the FIFO without waiting for the bus.
+// callback receives the count from the bus interrupt, imu_data must stay
+// valid until then.  Returns -1 if a drain is already running.
+int16_t inv_icm20948_read_imu_fifo_batch_async(inv_icm20948_state *st, IMU_DATA *imu_data, size_t max,
+                                               inv_icm20948_fifo_callback_t callback)
+{
+    if (st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF)
+        return -1;
+    return inv_icm20948_async_start(st, imu_data, max, callback);
+}
+
+int16_t inv_icm20948_read_dmp_fifo_batch_async(inv_icm20948_state *st, IMU_QUAT *imu_quat, size_t max,
+                                               inv_icm20948_fifo_callback_t callback)
+{
+    if (st->chip_config->dmp_mode == INV_ICM20948_DMP_OFF)
+        return -1;
+    return inv_icm20948_async_start(st, imu_quat, max, callback);
+}
+
+/***********************************************************************/
+/*                                                                     */
+/* Drain scheduler -- several sensors share one bus.  Their FIFOs are  */
+/*        drained one after the other, each drain started from the     */
+/*        completion of the one before it, so the bus goes from one    */
+/*        sensor to the next without waking the MCU.  Every round      */
+/*        starts one sensor further on, so that none of them is always */
+/*        the last to be read.                                         */
+/*                                                                     */
+/***********************************************************************/
+
+static void inv_icm20948_sched_next(inv_icm20948_sched *sched);
+
+static void inv_icm20948_sched_done(inv_icm20948_state *st, int16_t count)
+{
+    inv_icm20948_sched *sched = st->fifo_read.context;
+
+    sched->count[st->index] = count;
+    sched->done++;
+    inv_icm20948_sched_next(sched);
+}
+
+static void inv_icm20948_sched_next(inv_icm20948_sched *sched)
+{
+    inv_icm20948_state *st;
+    uint8_t i;
+    int16_t result;
+
+    while (sched->done < sched->num) {
+        i = (sched->first + sched->done) % sched->num;
+        st = sched->sensors[i];
+        st->fifo_read.context = sched;
+        if (st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF)
+            result = inv_icm20948_read_dmp_fifo_batch_async(st, sched->frames[i], sched->max, inv_icm20948_sched_done);
+        else
+            result = inv_icm20948_read_imu_fifo_batch_async(st, sched->frames[i], sched->max, inv_icm20948_sched_done);
+        if (result == 0)
+            return;
+        // not set up or still busy, it is skipped this round
+        sched->count[i] = -1;
+        sched->done++;
+    }
+
+    sched->first = (sched->first + 1) % sched->num;
+    sched->busy = false;
+    sched->callback(sched);
+}
+
+void inv_icm20948_sched_init(inv_icm20948_sched *sched, size_t max, inv_icm20948_sched_callback_t callback)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->max = max;
+    sched->callback = callback;
+}
+
+// Add the sensor with the next index; frames is its IMU_DATA array, or
+// IMU_QUAT in DMP mode, of the max given to inv_icm20948_sched_init().
+int16_t inv_icm20948_sched_add(inv_icm20948_sched *sched, inv_icm20948_state *st, void *frames)
+{
+    if ((sched->num >= INV_ICM20948_SENSORS_MAX) || (st->index != sched->num))
+        return -1;
+    sched->sensors[sched->num] = st;
+    sched->frames[sched->num] = frames;
+    sched->count[sched->num] = -1;
+    sched->num++;
+    return 0;
+}
+
+// Drain every sensor once.  The callback runs from the bus interrupt after
+// the last one, with the frames read from each in sched->count, -1 for a
+// sensor whose drain failed.  Returns -1 if a round is still running.
+int16_t inv_icm20948_sched_start(inv_icm20948_sched *sched)
+{
+    if (sched->busy || (sched->num == 0) || (sched->callback == NULL))
+        return -1;
+    sched->busy = true;
+    sched->done = 0;
+    inv_icm20948_sched_next(sched);
+    return 0;
+}
+
+/***********************************************************************/
+/*                                                                     */
+/* Capture -- every INT pulse starts a read of one frame from FIFO_R_W */
+/*        in hardware, into the next slot of a buffer with two halves. */
+/*        The MCU only wakes up once a half is full, re-arms the read  */
+/*        and decodes that half while the other one fills.  The bus   */
+/*        belongs to the capture until it is stopped; register writes  */
+/*        through the shadow cache pause it and start it again.        */
+/*                                                                     */
+/***********************************************************************/
+
+// The FIFO is emptied first, so that every read gets the frame its pulse
+// announced.  FIFO_RST is in bank 0 like FIFO_R_W.
+static int16_t inv_icm20948_capture_arm(inv_icm20948_state *st)
+{
+    inv_icm20948_capture *cap = &st->capture;
+    inv_icm20948_i2c_capture capture;
+
+    inv_icm20948_write_register(st, IMU_FIFO_RST, 0x1F);
+    inv_icm20948_write_register(st, IMU_FIFO_RST, 0x00);
+
+    cap->filled = 0;
+    cap->consumed = 0;
+    cap->late = false;
+    if (inv_icm20948_i2c_capture_arm(st->addr, IMU_FIFO_R_W & 0xff, cap->data_blk, st->chip_config->bytes_per_datum,
+                                     cap->frames, &capture))
+        return -1;
+    cap->stride = capture.stride;
+    cap->offset = capture.offset;
+    cap->active = true;
+    return 0;
+}
+
+static bool inv_icm20948_capture_pause(inv_icm20948_state *st)
+{
+    if (!st->capture.active)
+        return false;
+    inv_icm20948_i2c_capture_disarm();
+    st->capture.active = false;
+    return true;
+}
+
+// Frames sampled while paused are dropped with the FIFO reset.
+static void inv_icm20948_capture_resume(inv_icm20948_state *st, bool paused)
+{
+    if (paused)
+        inv_icm20948_capture_arm(st);
+}
+
+// Read every frame as it arrives and wake the MCU every frames frames.
+// The MCU's INT handler calls inv_icm20948_capture_next().  Raw samples
+// only; returns -1 in DMP mode.
+int16_t inv_icm20948_capture_start(inv_icm20948_state *st, uint16_t frames)
+{
+    if (st->capture.active || st->fifo_read.busy || !st->int_pin)
+        return -1;
+    if (st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF)
+        return -1;
+    if ((st->chip_config->bytes_per_datum == 0) || (st->chip_config->bytes_per_datum > IMU_FIFO_FRAME_MAX))
+        return -1;
+    if ((frames == 0) || (frames > IMU_CAPTURE_FRAMES_MAX))
+        return -1;
+
+    st->capture.frames = frames;
+    st->capture.overruns = 0;
+    st->capture.late_rearms = 0;
+    return inv_icm20948_capture_arm(st);
+}
+
+// Called from the MCU's INT handler once a half has been filled.  The reads
+// continue into the other half on their own, only the wrap back to the
+// start of the buffer needs the MCU.  It has one frame period for that; a
+// read that starts before the wrap goes to the spare slot, and the halves
+// are a frame out of step until inv_icm20948_capture_read() arms the
+// capture again.  Meanwhile every half goes back to the start, so that the
+// reads stay inside the buffer, and no half is counted.
+void inv_icm20948_capture_next(inv_icm20948_state *st)
+{
+    inv_icm20948_capture *cap = &st->capture;
+
+    if (!cap->active)
+        return;
+    if (cap->late) {
+        inv_icm20948_i2c_capture_rearm(cap->data_blk);
+        return;
+    }
+    if ((cap->filled & 1) && inv_icm20948_i2c_capture_rearm(cap->data_blk))
+        cap->late = true;
+    cap->time_stamp = inv_icm20948_get_int_time_us();
+    cap->filled++;
+}
+
+// Decode the newest full half into imu_data, which has room for frames
+// samples.  Returns the number of samples, 0 if there is no new half.  The
+// half is overwritten one half period after it was filled.  After a late
+// re-arm the capture is armed again, which empties the FIFO.
+int16_t inv_icm20948_capture_read(inv_icm20948_state *st, IMU_DATA *imu_data)
+{
+    inv_icm20948_capture *cap = &st->capture;
+    uint32_t filled, time_stamp;
+    uint8_t *half;
+    uint16_t i, count = 0;
+
+    do {
+        filled = cap->filled;
+        time_stamp = cap->time_stamp;
+    } while (filled != cap->filled);
+
+    if (filled != cap->consumed) {
+        cap->overruns += filled - cap->consumed - 1;
+        cap->consumed = filled;
+
+        half = &cap->data_blk[((filled - 1) & 1) * cap->frames * cap->stride + cap->offset];
+        for (i = 0; i < cap->frames; i++) {
+            st->decode_fifo(&half[i * cap->stride], &imu_data[i]);
+            imu_data[i].time_stamp = time_stamp - inv_icm20948_frames_to_us(st, cap->frames - 1 - i);
+            imu_data[i].sensor = st->index;
+        }
+        count = cap->frames;
+    }
+
+    if (cap->late && cap->active) {
+        cap->late_rearms++;
+        inv_icm20948_capture_pause(st);
+        inv_icm20948_capture_arm(st);
+    }
+    return count;
+}
+
+void inv_icm20948_capture_stop(inv_icm20948_state *st)
+{
+    inv_icm20948_capture_pause(st);
+}
+
+/***********************************************************************/
+/*                                                                     */
+/* Support functions                                                   */
+/*                                                                     */
+/***********************************************************************/
+
+// After a failed transfer the bank the device has selected is not known,
+// the next access selects it again.
+static void inv_icm20948_forget_bank(inv_icm20948_state *st)
+{
+    st->bank = 0xff;
+}
+
+static int16_t inv_icm20948_set_bank(inv_icm20948_state *st, uint16_t reg)
+{
+    uint8_t bank = (reg & 0xff00) >> 4;
+
+    // what a sequence has queued goes first, and leaves the bank it selects
+    if (st->config_list != NULL)
+        inv_icm20948_config_flush(st->config_list);
+    if (bank != st->bank) {
+        if (inv_icm20948_i2c_write_reg(st->addr, IMU_REG_BANK_SEL, bank)) {
+            inv_icm20948_forget_bank(st);
+            return -1;
+        }
+        st->bank = bank;
+    }
+    return 0;
+}
+
+// The register accesses return 0, or -1 if the bus failed.
+int16_t inv_icm20948_write_register(inv_icm20948_state *st, uint16_t reg, uint8_t value)
+{
+    if (inv_icm20948_set_bank(st, reg))
+        return -1;
+    return inv_icm20948_i2c_write_reg(st->addr, (uint8_t)(reg&0xff), value) ? -1 : 0;
+}
+
+int16_t inv_icm20948_write_register_block(inv_icm20948_state *st, uint16_t reg, uint8_t *block, uint8_t count)
+{
+    if (inv_icm20948_set_bank(st, reg))
+        return -1;
+    return inv_icm20948_i2c_write_reg_block(st->addr, (uint8_t)(reg&0xff), block, count) ? -1 : 0;
+}
+
+// 0 if the read failed.
+uint8_t inv_icm20948_read_register(inv_icm20948_state *st, uint16_t reg)
+{
+    uint8_t value;
+    if (inv_icm20948_read_register_block(st, reg, &value, 1))
+        return 0;
+    return value;
+}
+
+int16_t inv_icm20948_read_register_block(inv_icm20948_state *st, uint16_t reg, uint8_t *block, uint8_t count)
+{
+    if (inv_icm20948_set_bank(st, reg))
+        return -1;
+    return inv_icm20948_i2c_read_reg_block(st->addr, (uint8_t)(reg&0xff), block, count) ? -1 : 0;
+}
+
+// Append an access to reg to a transfer list, behind a bank change if the
+// register is in another bank than the one the list leaves selected.
+static uint32_t inv_icm20948_list_op(inv_icm20948_state *st, inv_icm20948_i2c_op *ops, uint32_t n, uint16_t reg,
+                                     uint8_t *block, uint32_t count, bool read)
+{
+    static uint8_t banks[] = { 0x00, 0x10, 0x20, 0x30 };
+    uint8_t bank = (reg & 0xff00) >> 4;
+
+    if (bank != st->bank) {
+        ops[n].reg = IMU_REG_BANK_SEL;
+        ops[n].buffer = &banks[bank >> 4];
+        ops[n].len = 1;
+        ops[n].read = false;
+        ops[n].prefixed = false;
+        n++;
+        st->bank = bank;
+    }
+    ops[n].reg = (uint8_t)(reg&0xff);
+    ops[n].buffer = block;
+    ops[n].len = count;
+    ops[n].read = read;
+    ops[n].prefixed = false;
+    return n + 1;
+}
+
+/***********************************************************************/
+/*                                                                     */
+/* Shadow register cache -- write-through copy of the configuration    */
+/*        registers, so that read-modify-write updates cost a single   */
+/*        write and unchanged values cost nothing.                     */
+/*                                                                     */
+/***********************************************************************/
+
+#define IMU_SHADOW_ENTRY(reg, reset, clear)     { reg, reset, clear },
+
+static const struct {
+    uint16_t reg;
+    uint8_t  reset;
+    uint8_t  self_clear;
+} inv_icm20948_shadow_regs[IMU_SHADOW_NUM_REGS] = {
+    IMU_SHADOW_REGISTERS(IMU_SHADOW_ENTRY)
+};
+
+static int16_t inv_icm20948_shadow_index(uint16_t reg)
+{
+    int16_t i;
+    for (i = 0; i < IMU_SHADOW_NUM_REGS; i++) {
+        if (inv_icm20948_shadow_regs[i].reg == reg)
+            return i;
+    }
+    return -1;
+}
+
+// Load the power-on values, used right after a device reset.
+void inv_icm20948_shadow_reset(inv_icm20948_state *st)
+{
+    int16_t i;
+    for (i = 0; i < IMU_SHADOW_NUM_REGS; i++)
+        st->shadow.value[i] = inv_icm20948_shadow_regs[i].reset;
+    st->shadow.valid = (1UL << IMU_SHADOW_NUM_REGS) - 1;
+    st->shadow.dirty = 0;
+}
+
+// Forget everything; each register is read again on first use.
+void inv_icm20948_shadow_invalidate(inv_icm20948_state *st)
+{
+    st->shadow.valid = 0;
+    st->shadow.dirty = 0;
+}
+
+uint8_t inv_icm20948_read_config(inv_icm20948_state *st, uint16_t reg)
+{
+    int16_t i = inv_icm20948_shadow_index(reg);
+
+    if (i < 0)
+        return inv_icm20948_read_register(st, reg);
+
+    // a failed read is not cached, the next access tries again
+    if (   !(st->shadow.valid & (1UL << i))
+        && (inv_icm20948_read_register_block(st, reg, &st->shadow.value[i], 1) == 0))
+        st->shadow.valid |= (1UL << i);
+    return st->shadow.value[i];
+}
+
+void inv_icm20948_write_config(inv_icm20948_state *st, uint16_t reg, uint8_t value)
+{
+    int16_t i = inv_icm20948_shadow_index(reg);
+    bool paused;
+
+    if (i >= 0) {
+        st->shadow.dirty &= ~(1UL << i);
+        if ((st->shadow.valid & (1UL << i)) && (st->shadow.value[i] == value))
+            return;
+    }
+
+    paused = inv_icm20948_capture_pause(st);
+    if (inv_icm20948_write_register(st, reg, value)) {
+        // the register may or may not have changed
+        if (i >= 0)
+            st->shadow.valid &= ~(1UL << i);
+        inv_icm20948_capture_resume(st, paused);
+        return;
+    }
+    inv_icm20948_capture_resume(st, paused);
+
+    if (i >= 0) {
+        st->shadow.value[i] = value & ~inv_icm20948_shadow_regs[i].self_clear;
+        st->shadow.valid |= (1UL << i);
+    }
+}
+
+void inv_icm20948_stage_config(inv_icm20948_state *st, uint16_t reg, uint8_t mask, uint8_t value)
+{
+    int16_t i = inv_icm20948_shadow_index(reg);
+    uint8_t temp;
+
+    if (i < 0) {
+        // not a cached register, so apply the change right away
+        temp = inv_icm20948_read_register(st, reg);
+        inv_icm20948_write_register(st, reg, (temp & ~mask) | (value & mask));
+        return;
+    }
+
+    temp = inv_icm20948_read_config(st, reg);
+    if (!(st->shadow.valid & (1UL << i)))
+        return;
+    temp = (temp & ~mask) | (value & mask);
+    if (temp != st->shadow.value[i]) {
+        st->shadow.value[i] = temp;
+        st->shadow.dirty |= (1UL << i);
+    }
+}
+
+// Start a sequence.  A running capture is paused until the sequence ends.
+static void inv_icm20948_config_begin(inv_icm20948_state *st, inv_icm20948_config_list *list)
+{
+    list->st = st;
+    list->n = 0;
+    list->used = 0;
+    list->result = 0;
+    list->paused = inv_icm20948_capture_pause(st);
+    list->start_us = inv_icm20948_get_time_us();
+    st->config_list = list;
+}
+
+static void inv_icm20948_config_flush(inv_icm20948_config_list *list)
+{
+    if (list->n && inv_icm20948_i2c_xfer_list(list->st->addr, list->ops, list->n, NULL, NULL)) {
+        // the list stopped somewhere, so the bank is not known any more
+        inv_icm20948_forget_bank(list->st);
+        list->result = -1;
+    }
+    list->n = 0;
+    list->used = 0;
+}
+
+static void inv_icm20948_config_write(inv_icm20948_config_list *list, uint16_t reg, const uint8_t *value, uint32_t count)
+{
+    // room for a bank change and the write
+    if ((list->n + 2 > INV_ICM20948_I2C_MAX_OPS) || (list->used + count > sizeof(list->data)))
+        inv_icm20948_config_flush(list);
+
+    memcpy(&list->data[list->used], value, count);
+    list->n = inv_icm20948_list_op(list->st, list->ops, list->n, reg, &list->data[list->used], count, false);
+    list->used += count;
+}
+
+// Add every staged register to the sequence.  The table is in bank|register
+// order, so the bank changes at most once per bank, and runs of adjacent
+// registers go out as a single burst write.
+static void inv_icm20948_config_staged(inv_icm20948_state *st, inv_icm20948_config_list *list)
+{
+    int16_t i, run;
+
+    i = 0;
+    while (st->shadow.dirty) {
+        if (!(st->shadow.dirty & (1UL << i))) {
+            i++;
+            continue;
+        }
+
+        run = 1;
+        while (   (i + run < IMU_SHADOW_NUM_REGS)
+               && (st->shadow.dirty & (1UL << (i + run)))
+               && (inv_icm20948_shadow_regs[i + run].reg == inv_icm20948_shadow_regs[i].reg + run))
+            run++;
+
+        inv_icm20948_config_write(list, inv_icm20948_shadow_regs[i].reg, &st->shadow.value[i], run);
+
+        for (; run > 0; run--, i++) {
+            st->shadow.value[i] &= ~inv_icm20948_shadow_regs[i].self_clear;
+            st->shadow.dirty &= ~(1UL << i);
+        }
+    }
+}
+
+// Send what is left and resume the capture.  The time from the first list
+// to the last is kept in st->config_apply_us.
+static int16_t inv_icm20948_config_end(inv_icm20948_state *st, inv_icm20948_config_list *list)
+{
+    inv_icm20948_config_flush(list);
+    st->config_list = NULL;
+    st->config_apply_us = inv_icm20948_get_time_us() - list->start_us;
+    // which writes made it is not known, read the registers back next time
+    if (list->result)
+        st->shadow.valid = 0;
+    inv_icm20948_capture_resume(st, list->paused);
+    return list->result;
+}
+
+// Write every staged register, in as few transfer lists as they fit in.
+int16_t inv_icm20948_commit_config(inv_icm20948_state *st)
+{
+    inv_icm20948_config_list list;
+
+    if (st->shadow.dirty == 0)
+        return 0;
+
+    inv_icm20948_config_begin(st, &list);
+    inv_icm20948_config_staged(st, &list);
+    return inv_icm20948_config_end(st, &list);
 }
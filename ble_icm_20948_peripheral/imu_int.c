@@ -0,0 +1,232 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* IMU interrupt -- the ICM-20948 pulses INT for every sample (or DMP  */
+/*        packet) written into its FIFO.  Instead of waking the CPU    */
+/*        for each pulse, the GPIOTE IN event is routed through PPI to */
+/*        the COUNT task of a timer in counter mode.  The CPU only     */
+/*        gets an interrupt when the count reaches the batch size, at  */
+/*        which point the compare event also clears the counter.       */
+/*                                                                     */
+/*        The same PPI channel forks to the CAPTURE task of a second,  */
+/*        free running 1MHz timer, so the time of the latest pulse is  */
+/*        latched without any software latency.  That timer is also    */
+/*        the driver's microsecond clock.                              */
+/*                                                                     */
+/*        In capture mode the pulse starts a pre-armed bus read of one */
+/*        FIFO frame instead, and the counter counts the reads that    */
+/*        have completed, so the CPU sleeps until a batch is in RAM.   */
+/*        The end of every read is timed as well, so the handler can   */
+/*        tell whether the next read started before it was re-armed.   */
+/*                                                                     */
+/***********************************************************************/
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "nrf_drv_gpiote.h"
+#include "nrf_drv_ppi.h"
+#include "nrf_drv_timer.h"
+#include "app_error.h"
+#include "app_util_platform.h"
+
+#include "imu_int.h"
+
+static const nrf_drv_timer_t m_timer = NRF_DRV_TIMER_INSTANCE(IMU_INT_TIMER_INSTANCE);
+static const nrf_drv_timer_t m_clock = NRF_DRV_TIMER_INSTANCE(IMU_INT_CLOCK_INSTANCE);
+static nrf_ppi_channel_t m_ppi_channel;
+static nrf_ppi_channel_t m_done_channel;    // end of a capture read to the counter
+static uint32_t m_int_event;
+static uint16_t m_count;                    // batch size outside capture
+static imu_int_handler_t m_handler;
+static bool m_clock_running;
+
+#define IMU_INT_CC_EDGE     NRF_TIMER_CC_CHANNEL0   // captured by PPI on every INT pulse
+#define IMU_INT_CC_NOW      NRF_TIMER_CC_CHANNEL1   // captured by software to read the time
+#define IMU_INT_CC_DONE     NRF_TIMER_CC_CHANNEL2   // captured by PPI at the end of a capture read
+#define IMU_INT_CC_COUNT    NRF_TIMER_CC_CHANNEL1   // of the counter, captured by software to read it
+
+static void timer_event_handler(nrf_timer_event_t event_type, void * p_context)
+{
+    if ((event_type == NRF_TIMER_EVENT_COMPARE0) && (m_handler != NULL))
+    {
+        m_handler();
+    }
+}
+
+static void clock_event_handler(nrf_timer_event_t event_type, void * p_context)
+{
+    // no compare events are enabled, the clock only captures
+}
+
+void imu_int_init(uint32_t pin, uint16_t count, imu_int_handler_t handler)
+{
+    ret_code_t err_code;
+    nrf_drv_timer_config_t timer_config = NRF_DRV_TIMER_DEFAULT_CONFIG;
+    nrf_drv_gpiote_in_config_t in_config = GPIOTE_CONFIG_IN_SENSE_LOTOHI(true);
+
+    m_handler = handler;
+
+    timer_config.mode      = NRF_TIMER_MODE_COUNTER;
+    timer_config.bit_width = NRF_TIMER_BIT_WIDTH_16;
+    // in capture mode the handler re-arms the read, within one frame period
+    timer_config.interrupt_priority = APP_IRQ_PRIORITY_HIGH;
+    err_code = nrf_drv_timer_init(&m_timer, &timer_config, timer_event_handler);
+    APP_ERROR_CHECK(err_code);
+    imu_int_set_count(count);
+
+    imu_int_clock_init();
+
+    // the pin only feeds PPI, it does not interrupt the CPU itself
+    in_config.pull = NRF_GPIO_PIN_PULLUP;
+    err_code = nrf_drv_gpiote_in_init(pin, &in_config, NULL);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = nrf_drv_ppi_init();
+    if (err_code != NRF_ERROR_MODULE_ALREADY_INITIALIZED)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+    err_code = nrf_drv_ppi_channel_alloc(&m_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_alloc(&m_done_channel);
+    APP_ERROR_CHECK(err_code);
+    m_int_event = nrf_drv_gpiote_in_event_addr_get(pin);
+    err_code = nrf_drv_ppi_channel_assign(m_ppi_channel, m_int_event,
+                                          nrf_drv_timer_task_address_get(&m_timer, NRF_TIMER_TASK_COUNT));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_fork_assign(m_ppi_channel,
+                                               nrf_drv_timer_capture_task_address_get(&m_clock, IMU_INT_CC_EDGE));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(m_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+
+    nrf_drv_gpiote_in_event_enable(pin, false);
+    nrf_drv_timer_enable(&m_timer);
+}
+
+// Start the microsecond clock on its own, so that bus transfers can be
+// timed before the INT pulses are set up.  imu_int_init() does it as well.
+void imu_int_clock_init(void)
+{
+    ret_code_t err_code;
+    nrf_drv_timer_config_t timer_config = NRF_DRV_TIMER_DEFAULT_CONFIG;
+
+    if (m_clock_running)
+    {
+        return;
+    }
+
+    timer_config.mode      = NRF_TIMER_MODE_TIMER;
+    timer_config.frequency = NRF_TIMER_FREQ_1MHz;
+    timer_config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+    err_code = nrf_drv_timer_init(&m_clock, &timer_config, clock_event_handler);
+    APP_ERROR_CHECK(err_code);
+    nrf_drv_timer_enable(&m_clock);
+    m_clock_running = true;
+}
+
+// Free running microsecond time, wraps after 2^32 us.
+uint32_t imu_int_time_us(void)
+{
+    return nrf_drv_timer_capture(&m_clock, IMU_INT_CC_NOW);
+}
+
+// Time of the most recent INT pulse, on the imu_int_time_us() time base.
+uint32_t imu_int_edge_us(void)
+{
+    return nrf_drv_timer_capture_get(&m_clock, IMU_INT_CC_EDGE);
+}
+
+static void imu_int_compare(uint16_t count)
+{
+    if (count == 0)
+    {
+        count = 1;
+    }
+    nrf_drv_timer_clear(&m_timer);
+    nrf_drv_timer_extended_compare(&m_timer, NRF_TIMER_CC_CHANNEL0, count, NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
+}
+
+// Wake the CPU once every count pulses, counting from zero again.
+void imu_int_set_count(uint16_t count)
+{
+    m_count = count;
+    imu_int_compare(count);
+}
+
+// Route INT to start_task, which starts the bus read, and count done_event
+// instead of the pulses.  The handler runs once every count reads.  The
+// timestamp capture stays on the INT pulse.
+void imu_int_capture_start(uint32_t start_task, uint32_t done_event, uint16_t count)
+{
+    ret_code_t err_code;
+
+    err_code = nrf_drv_ppi_channel_disable(m_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    imu_int_compare(count);
+    err_code = nrf_drv_ppi_channel_assign(m_done_channel, done_event,
+                                          nrf_drv_timer_task_address_get(&m_timer, NRF_TIMER_TASK_COUNT));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_fork_assign(m_done_channel,
+                                               nrf_drv_timer_capture_task_address_get(&m_clock, IMU_INT_CC_DONE));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(m_done_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_assign(m_ppi_channel, m_int_event, start_task);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(m_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+}
+
+// Count the INT pulses again, in batches of the last imu_int_set_count().
+// A read the last pulse started may still be on the bus.
+void imu_int_capture_stop(void)
+{
+    ret_code_t err_code;
+
+    err_code = nrf_drv_ppi_channel_disable(m_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_disable(m_done_channel);
+    APP_ERROR_CHECK(err_code);
+    imu_int_compare(m_count);
+    err_code = nrf_drv_ppi_channel_assign(m_ppi_channel, m_int_event,
+                                          nrf_drv_timer_task_address_get(&m_timer, NRF_TIMER_TASK_COUNT));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(m_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+}
+
+// Whether a read has started since the one that woke the handler, called
+// once the handler has pointed the reads somewhere new.  Such a read has
+// either finished and been counted, or its INT pulse came after the end of
+// the last read.  A pulse right after the handler's change counts as well.
+bool imu_int_capture_late(void)
+{
+    uint32_t done_us = nrf_drv_timer_capture_get(&m_clock, IMU_INT_CC_DONE);
+
+    if (nrf_drv_timer_capture(&m_timer, IMU_INT_CC_COUNT) > 0)
+    {
+        return true;
+    }
+    return ((int32_t)(imu_int_edge_us() - done_us) >= 0);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* IMU interrupt -- batches the ICM-20948's INT pulses in hardware     */
+/*                                                                     */
+/***********************************************************************/
+
+#ifndef IMU_INT_H__
+#define IMU_INT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IMU_INT_TIMER_INSTANCE  1       // TIMER0 belongs to the SoftDevice
+#define IMU_INT_CLOCK_INSTANCE  2
+
+typedef void (*imu_int_handler_t)(void);
+
+void imu_int_init(uint32_t pin, uint16_t count, imu_int_handler_t handler);
+void imu_int_clock_init(void);
+void imu_int_set_count(uint16_t count);
+uint32_t imu_int_time_us(void);
+uint32_t imu_int_edge_us(void);
+void imu_int_capture_start(uint32_t start_task, uint32_t done_event, uint16_t count);
+void imu_int_capture_stop(void);
+bool imu_int_capture_late(void);
+
+#endif // IMU_INT_H__
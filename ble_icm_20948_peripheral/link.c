@@ -0,0 +1,301 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Link manager -- a connection event sends at most the notifications  */
+/*        the SoftDevice has queued, the main loop refills the queue   */
+/*        in between.  The interval is chosen so that the samples of   */
+/*        one interval fill LINK_QUEUE_PERCENT of the queue, the rest  */
+/*        is left for the retransmissions and for catching up.  The    */
+/*        BLE events are handled in the SoftDevice interrupt, the      */
+/*        requests are made from the main loop.                        */
+/*                                                                     */
+/***********************************************************************/
+
+#include <string.h>
+
+#include "sdk_config.h"
+#include "app_util.h"
+#include "app_error.h"
+#include "ble_conn_params.h"
+#include "ble_hci.h"
+
+#include "nrf_log.h"
+#include "nrf_log_ctrl.h"
+#include "nrf_log_default_backends.h"
+
+#include "imu_wire.h"
+#include "link.h"
+
+#define LINK_QUEUE_PERCENT      50      // of the notification queue the samples of an interval take up
+#define LINK_T_IFS_US           150     // inter frame space
+#define LINK_PDU_OVERHEAD       13      // access address, header, MIC and CRC
+#define LINK_EMPTY_PDU          9       // the central's acknowledgement
+#define LINK_L2CAP_ATT_HEADER   7       // in front of a notification's payload
+#define LINK_DATA_LENGTH_MIN    27      // before a data length update
+#define LINK_PHYS               BLE_GAP_PHY_2MBPS
+
+typedef struct
+{
+    uint32_t rate_mhz;
+    uint16_t sample_size;
+} link_stream_t;
+
+static struct
+{
+    ble_gap_conn_params_t   idle_params;            // without a stream
+    ble_gap_conn_params_t   params;                 // last requested
+    uint8_t                 queue_size;
+    link_stream_t           streams[LINK_STREAMS];
+    volatile uint16_t       conn_handle;
+    volatile uint8_t        phy;
+    volatile uint16_t       data_length;
+    volatile uint16_t       packet_len;
+    volatile bool           changed;                // params may need a new request
+} m_link;
+
+
+// Time on air of bytes, the preamble included, in us.
+static uint32_t link_air_us(uint8_t phy, uint32_t bytes)
+{
+    switch (phy)
+    {
+        case BLE_GAP_PHY_2MBPS:
+            return (2 + bytes) * 4;
+        case BLE_GAP_PHY_CODED:
+            // S=8, preamble and coding indicator come to about 100 us
+            return 100 + bytes * 64;
+        default:
+            return (1 + bytes) * 8;
+    }
+}
+
+// One link layer packet of payload bytes and the empty packet that
+// acknowledges it, with the inter frame spaces, in us.
+static uint32_t link_exchange_us(uint8_t phy, uint32_t payload)
+{
+    return link_air_us(phy, LINK_PDU_OVERHEAD + payload) + LINK_T_IFS_US +
+           link_air_us(phy, LINK_EMPTY_PDU) + LINK_T_IFS_US;
+}
+
+// A notification as long as the ATT MTU allows, cut into as many link
+// layer packets as the data length asks for, in us.
+static uint32_t link_notification_us(void)
+{
+    uint32_t bytes = m_link.packet_len + LINK_L2CAP_ATT_HEADER;
+    uint32_t us    = (bytes / m_link.data_length) * link_exchange_us(m_link.phy, m_link.data_length);
+
+    if (bytes % m_link.data_length)
+    {
+        us += link_exchange_us(m_link.phy, bytes % m_link.data_length);
+    }
+    return us;
+}
+
+// Notifications the streams fill each second, in mHz.
+static uint32_t link_notifications_mhz(void)
+{
+    uint32_t notifications_mhz = 0;
+
+    for (uint8_t s = 0; s < LINK_STREAMS; s++)
+    {
+        link_stream_t const * p_stream = &m_link.streams[s];
+        uint32_t              samples;
+
+        if ((p_stream->rate_mhz == 0) || (p_stream->sample_size == 0))
+        {
+            continue;
+        }
+        // unpacked, packing only ever gets more samples into a notification
+        samples = 1;
+        if (m_link.packet_len > IMU_WIRE_HEADER_SIZE + p_stream->sample_size)
+        {
+            samples = (m_link.packet_len - IMU_WIRE_HEADER_SIZE) / p_stream->sample_size;
+        }
+        notifications_mhz += (p_stream->rate_mhz + samples - 1) / samples;
+    }
+    return notifications_mhz;
+}
+
+// The connection parameters that carry the streams.
+static void link_params_get(ble_gap_conn_params_t * p_params)
+{
+    uint32_t notifications_mhz = link_notifications_mhz();
+    uint32_t per_event, interval_us, event_us;
+    uint16_t interval;
+
+    *p_params = m_link.idle_params;
+    if (notifications_mhz == 0)
+    {
+        return;
+    }
+
+    per_event   = MAX(1, (m_link.queue_size * LINK_QUEUE_PERCENT) / 100);
+    interval_us = (uint32_t)(((uint64_t)per_event * 1000000000ULL) / notifications_mhz);
+    interval    = (uint16_t)MIN(interval_us / 1250, m_link.idle_params.max_conn_interval);
+    interval    = MAX(interval, BLE_GAP_CP_MIN_CONN_INTVL_MIN);
+
+    // the central picks the interval, anything shorter carries the samples too
+    p_params->max_conn_interval = interval;
+    p_params->min_conn_interval = MAX(interval / 2, BLE_GAP_CP_MIN_CONN_INTVL_MIN);
+    p_params->slave_latency     = 0;
+
+    // the longest the radio has to be on for the samples of an interval,
+    // connection event length extension runs the event past
+    // NRF_SDH_BLE_GAP_EVENT_LENGTH as long as there is more to send
+    event_us = (uint32_t)(((uint64_t)notifications_mhz * interval * 1250 + 999999999ULL) / 1000000000ULL) *
+               link_notification_us();
+    NRF_LOG_INFO("link: %d mHz of notifications, interval %d us, %d us of %d on air",
+                 notifications_mhz, interval * 1250, event_us, NRF_SDH_BLE_GAP_EVENT_LENGTH * 1250);
+    if (event_us > interval * 1250)
+    {
+        NRF_LOG_WARNING("link: the samples need more air time than the connection has");
+    }
+}
+
+
+void link_init(ble_gap_conn_params_t const * p_idle_params, uint8_t queue_size)
+{
+    ret_code_t err_code;
+    ble_opt_t  opt;
+
+    memset(&m_link, 0, sizeof(m_link));
+    m_link.idle_params = *p_idle_params;
+    m_link.queue_size  = queue_size;
+    m_link.conn_handle = BLE_CONN_HANDLE_INVALID;
+
+    // let a connection event carry on for as long as there are notifications
+    memset(&opt, 0, sizeof(opt));
+    opt.common_opt.conn_evt_ext.enable = 1;
+    err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+    APP_ERROR_CHECK(err_code);
+}
+
+void link_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
+{
+    ble_gap_evt_t const * p_gap_evt = &p_ble_evt->evt.gap_evt;
+    ret_code_t            err_code;
+    ble_gap_phys_t const  phys =
+    {
+        .rx_phys = LINK_PHYS,
+        .tx_phys = LINK_PHYS,
+    };
+
+    switch (p_ble_evt->header.evt_id)
+    {
+        case BLE_GAP_EVT_CONNECTED:
+            m_link.phy         = BLE_GAP_PHY_1MBPS;
+            m_link.data_length = LINK_DATA_LENGTH_MIN;
+            m_link.packet_len  = BLE_GATT_ATT_MTU_DEFAULT - 3;
+            memset(&m_link.params, 0, sizeof(m_link.params));
+            m_link.conn_handle = p_gap_evt->conn_handle;
+            m_link.changed     = true;
+            // a central that cannot do 2M leaves the link on 1M
+            err_code = sd_ble_gap_phy_update(p_gap_evt->conn_handle, &phys);
+            if (err_code != NRF_SUCCESS)
+            {
+                NRF_LOG_INFO("link: PHY update not started, error 0x%04x", err_code);
+            }
+            break;
+
+        case BLE_GAP_EVT_DISCONNECTED:
+            m_link.conn_handle = BLE_CONN_HANDLE_INVALID;
+            break;
+
+        case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
+            err_code = sd_ble_gap_phy_update(p_gap_evt->conn_handle, &phys);
+            APP_ERROR_CHECK(err_code);
+            break;
+
+        case BLE_GAP_EVT_PHY_UPDATE:
+            if (p_gap_evt->params.phy_update.status == BLE_HCI_STATUS_CODE_SUCCESS)
+            {
+                m_link.phy     = p_gap_evt->params.phy_update.tx_phy;
+                m_link.changed = true;
+            }
+            NRF_LOG_INFO("link: PHY tx 0x%x rx 0x%x, status 0x%x", p_gap_evt->params.phy_update.tx_phy,
+                         p_gap_evt->params.phy_update.rx_phy, p_gap_evt->params.phy_update.status);
+            break;
+
+        case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
+            m_link.data_length = MAX(p_gap_evt->params.data_length_update.effective_params.max_tx_octets,
+                                     LINK_DATA_LENGTH_MIN);
+            m_link.changed     = true;
+            break;
+
+        default:
+            // no implementation needed
+            break;
+    }
+}
+
+void link_packet_len_set(uint16_t packet_len)
+{
+    m_link.packet_len = packet_len;
+    m_link.changed    = true;
+}
+
+void link_stream_set(uint8_t stream, uint32_t rate_mhz, uint16_t sample_size)
+{
+    if (stream < LINK_STREAMS)
+    {
+        m_link.streams[stream].rate_mhz    = rate_mhz;
+        m_link.streams[stream].sample_size = sample_size;
+        m_link.changed                     = true;
+    }
+}
+
+void link_update(void)
+{
+    ble_gap_conn_params_t params;
+    ret_code_t            err_code;
+    uint16_t              conn_handle = m_link.conn_handle;
+
+    if (!m_link.changed || (conn_handle == BLE_CONN_HANDLE_INVALID))
+    {
+        return;
+    }
+    // cleared first, an event that comes in meanwhile brings it back
+    m_link.changed = false;
+
+    link_params_get(&params);
+    if (memcmp(&params, &m_link.params, sizeof(params)) == 0)
+    {
+        return;
+    }
+
+    err_code = ble_conn_params_change_conn_params(conn_handle, &params);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_link.params = params;
+        NRF_LOG_INFO("link: requested a %d to %d us interval",
+                     params.min_conn_interval * 1250, params.max_conn_interval * 1250);
+    }
+    else if (err_code == NRF_ERROR_BUSY)
+    {
+        // another procedure is running, its completion wakes the main loop
+        m_link.changed = true;
+    }
+    else
+    {
+        NRF_LOG_INFO("link: connection parameter update failed, error 0x%04x", err_code);
+    }
+}
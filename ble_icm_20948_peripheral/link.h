@@ -0,0 +1,63 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Link manager -- fits the connection to the sample stream.  Asks     */
+/*        for the 2M PHY and, from the sample rates, the size of a     */
+/*        sample on air and the notification queue, works out the     */
+/*        connection interval that carries the samples and requests    */
+/*        it again whenever one of them changes.                       */
+/*                                                                     */
+/***********************************************************************/
+
+#ifndef LINK_H__
+#define LINK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ble.h"
+#include "ble_gap.h"
+
+#define LINK_STREAMS            2       // sample streams, one per sensor
+
+// p_idle_params are the connection parameters without a stream, queue_size
+// is the hvn_tx_queue_size the SoftDevice was configured with.  Turns on
+// connection event length extension, call once the SoftDevice is enabled.
+void link_init(ble_gap_conn_params_t const * p_idle_params, uint8_t queue_size);
+
+// BLE event observer, starts the PHY update on a new connection and
+// follows the PHY and the data length the link ends up with.
+void link_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context);
+
+// The payload of a notification, after an ATT MTU exchange.
+void link_packet_len_set(uint16_t packet_len);
+
+// A stream of rate_mhz samples of sample_size bytes each; a rate of 0
+// removes the stream.
+void link_stream_set(uint8_t stream, uint32_t rate_mhz, uint16_t sample_size);
+
+// Request the connection parameters for the streams if they have changed
+// since the last request.  Called from the main loop, tries again on the
+// next call while the SoftDevice is busy with another procedure.
+void link_update(void);
+
+#endif // LINK_H__
@@ -91,6 +91,10 @@
 
 #include "services.h"
 #include "imu.h"
+#include "imu_int.h"
+#include "trace.h"
+#include "sample_ring.h"
+#include "link.h"
 #include "twi.h"
 #include "hal.h"
 
@@ -102,8 +106,8 @@
 #define APP_BLE_OBSERVER_PRIO           3                                       // Application's BLE observer priority. You shouldn't need to modify this value
 #define APP_BLE_CONN_CFG_TAG            1                                       // A tag identifying the SoftDevice BLE configuration
 
-#define MIN_CONN_INTERVAL               MSEC_TO_UNITS(100, UNIT_1_25_MS)        // Minimum acceptable connection interval (0.1 seconds)
-#define MAX_CONN_INTERVAL               MSEC_TO_UNITS(200, UNIT_1_25_MS)        // Maximum acceptable connection interval (0.2 second)
+#define MIN_CONN_INTERVAL               MSEC_TO_UNITS(100, UNIT_1_25_MS)        // Minimum acceptable connection interval (0.1 seconds), link.c shortens it while samples are sent
+#define MAX_CONN_INTERVAL               MSEC_TO_UNITS(200, UNIT_1_25_MS)        // Maximum acceptable connection interval (0.2 second), also the longest link.c asks for
 #define SLAVE_LATENCY                   0                                       // Slave latency
 #define CONN_SUP_TIMEOUT                MSEC_TO_UNITS(4000, UNIT_10_MS)         // Connection supervisory timeout (4 seconds)
 
@@ -122,22 +126,50 @@
 
 #define DEAD_BEEF                       0xDEADBEEF                              // Value used as error code on stack dump, can be used to identify stack location on stack unwind
 
+#define IMU_FIFO_BATCH_SIZE             32                                      // Maximum number of samples drained from the IMU FIFO per read
+#define IMU_FIFO_WATERMARK              5                                       // Samples collected in the IMU FIFO before the MCU wakes up
+
+#if IMU_SPI_ENABLED && (IMU_SENSORS > 1)
+#error "only one ICM-20948 can be reached over SPI, see app_config.h"
+#endif
+
+#if IMU_DMP_ENABLED
+// InvenSense DMP3 firmware image, see app_config.h
+static const uint8_t dmp3_image[] = {
+#include "icm20948_img.dmp3a.h"
+};
+#endif
+
 
 NRF_BLE_GATT_DEF(m_gatt);                                                       // GATT module instance
 NRF_BLE_QWR_DEF(m_qwr);                                                         // Context for the Queued Write module
 BLE_ADVERTISING_DEF(m_advertising);                                             // Advertising module instance
 
-static int16_t imu_init(void);
+static void imu_bringup_start(void);
+static void imu_start(void);
+static void imu_link_streams_set(void);
+static void gpio_init(void);
 void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action);
 
 static uint16_t m_conn_handle = BLE_CONN_HANDLE_INVALID;                        // Handle of the current connection
 ble_os_t m_service;   // declare a service structure for the application
-extern inv_icm20948_state st;
+
+// The ICM-20948s on the bus.  The first is at IMU_ADDR with its INT pin on
+// INV_INT_PIN, a second one at IMU_ADDR_AD0 is read along with it.
+inv_icm20948_chip_config imu_config[IMU_SENSORS];
+inv_icm20948_state imu_sensor[IMU_SENSORS];
 
 // Declare an app_timer id variable and define the timer interval and define a timer interval.
 //APP_TIMER_DEF(m_char_timer_id);
 #define CHAR_TIMER_INTERVAL     APP_TIMER_TICKS(1000) // 1000 ms intervals
 
+APP_TIMER_DEF(m_imu_timer_id);                                                  // Paces the steps of the IMU bring-up
+static volatile bool m_imu_bringup_due = false;                                 // A bring-up step is waiting for the main loop
+static uint8_t m_imu_bringup_sensor = 0;                                        // The sensor being brought up
+static bool m_imu_dmp_failed = false;                                           // Its DMP failed to start, it is brought up again without it
+static uint8_t m_imu_sensors = 0;                                               // Sensors brought up
+static uint32_t m_boot_to_adv_ms = 0;                                           // Boot to first advertising packet, in ms
+
 
 // Use UUIDs for service(s) used in your application.
 static ble_uuid_t m_adv_uuids[] =                                               // Universally unique service identifiers
@@ -268,11 +300,27 @@ static void pm_evt_handler(pm_evt_t const * p_evt)
 // Initializes the timer module. This creates and starts application timers.
 // Application timers are required by softdevice.
 //
+static void imu_timer_handler(void * p_context)
+{
+    m_imu_bringup_due = true;
+}
+
 static void timers_init(void)
 {
     // initialize timer module
     ret_code_t err_code = app_timer_init();
     APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_imu_timer_id, APP_TIMER_MODE_SINGLE_SHOT, imu_timer_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+// Milliseconds since boot.  The RTC only runs while an app_timer does, so
+// the time comes from the IMU clock that main() starts first thing.
+static uint32_t boot_ms(void)
+{
+    return inv_icm20948_get_time_us() / 1000;
 }
 
 
@@ -303,13 +351,38 @@ static void gap_params_init(void)
 
     err_code = sd_ble_gap_ppcp_set(&gap_conn_params);
     APP_ERROR_CHECK(err_code);
+
+    // the preferred parameters hold until there are samples to send
+    link_init(&gap_conn_params, IMU_HVN_TX_QUEUE_SIZE);
+}
+
+
+// Function for handling events from the GATT library.  The IMU samples are
+// packed into notifications as long as the negotiated ATT MTU.
+static void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const * p_evt)
+{
+    if ((p_evt->evt_id == NRF_BLE_GATT_EVT_ATT_MTU_UPDATED) && (p_evt->conn_handle == m_conn_handle))
+    {
+        m_service.max_data_len = p_evt->params.att_mtu_effective - 3;
+        link_packet_len_set(m_service.max_data_len);
+        NRF_LOG_INFO("ATT MTU %d, %d bytes of samples per notification",
+                     p_evt->params.att_mtu_effective, m_service.max_data_len - IMU_WIRE_HEADER_SIZE);
+    }
+    else if (p_evt->evt_id == NRF_BLE_GATT_EVT_DATA_LENGTH_UPDATED)
+    {
+        NRF_LOG_INFO("data length %d", p_evt->params.data_length);
+    }
 }
 
 
 // Function for initializing the GATT module.
 static void gatt_init(void)
 {
-    ret_code_t err_code = nrf_ble_gatt_init(&m_gatt, NULL);
+    ret_code_t err_code = nrf_ble_gatt_init(&m_gatt, gatt_evt_handler);
+    APP_ERROR_CHECK(err_code);
+
+    // every new link asks for the longest link layer packets
+    err_code = nrf_ble_gatt_data_length_set(&m_gatt, BLE_CONN_HANDLE_INVALID, NRF_SDH_BLE_GAP_DATA_LENGTH);
     APP_ERROR_CHECK(err_code);
 }
 
@@ -442,6 +515,11 @@ static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
     switch (ble_adv_evt)
     {
         case BLE_ADV_EVT_FAST:
+            if (m_boot_to_adv_ms == 0)
+            {
+                m_boot_to_adv_ms = boot_ms();
+                NRF_LOG_INFO("Advertising %d ms after boot.", m_boot_to_adv_ms);
+            }
             NRF_LOG_INFO("Fast advertising.");
             err_code = bsp_indication_set(BSP_INDICATE_ADVERTISING);
             APP_ERROR_CHECK(err_code);
@@ -471,7 +549,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
     {
         case BLE_GAP_EVT_DISCONNECTED:
             NRF_LOG_INFO("Disconnected.");
-            inv_icm20948_set_sleep_mode(true);
+            // the main loop puts the sensors to sleep
             m_service.is_imu_data_notification_enabled = false;
             nrf_gpio_pin_clear(PIN_OUT);
             // LED indication will be changed when advertising starts
@@ -479,7 +557,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
 
         case BLE_GAP_EVT_CONNECTED:
             NRF_LOG_INFO("Connected.");
-            //inv_icm20948_set_sleep_mode(false);
+            //inv_icm20948_set_sleep_mode(&imu_sensor[0], false);
             err_code = bsp_indication_set(BSP_INDICATE_CONNECTED);
             APP_ERROR_CHECK(err_code);
             m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
@@ -487,18 +565,6 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             APP_ERROR_CHECK(err_code);
             break;
 
-        case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
-        {
-            NRF_LOG_DEBUG("PHY update request.");
-            ble_gap_phys_t const phys =
-            {
-                .rx_phys = BLE_GAP_PHY_AUTO,
-                .tx_phys = BLE_GAP_PHY_AUTO,
-            };
-            err_code = sd_ble_gap_phy_update(p_ble_evt->evt.gap_evt.conn_handle, &phys);
-            APP_ERROR_CHECK(err_code);
-        } break;
-
         case BLE_GATTC_EVT_TIMEOUT:
             // disconnect on GATT Client timeout event
             NRF_LOG_DEBUG("GATT Client Timeout.");
@@ -539,6 +605,15 @@ static void ble_stack_init(void)
     err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
     APP_ERROR_CHECK(err_code);
 
+    // queue more than the default single notification, so that a connection
+    // event can carry several packets of samples
+    ble_cfg_t ble_cfg;
+    memset(&ble_cfg, 0, sizeof(ble_cfg));
+    ble_cfg.conn_cfg.conn_cfg_tag                            = APP_BLE_CONN_CFG_TAG;
+    ble_cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = IMU_HVN_TX_QUEUE_SIZE;
+    err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &ble_cfg, ram_start);
+    APP_ERROR_CHECK(err_code);
+
     // enable BLE stack
     err_code = nrf_sdh_ble_enable(&ram_start);
     APP_ERROR_CHECK(err_code);
@@ -548,6 +623,9 @@ static void ble_stack_init(void)
 
     // call ble_service_on_ble_evt() to do housekeeping of ble connections related to the service and characteristics
     NRF_SDH_BLE_OBSERVER(m_service_observer, APP_BLE_OBSERVER_PRIO, ble_service_on_ble_evt, (void*) &m_service);
+
+    // the link manager answers the PHY requests, see link.c
+    NRF_SDH_BLE_OBSERVER(m_link_observer, APP_BLE_OBSERVER_PRIO, link_on_ble_evt, NULL);
 }
 
 
@@ -731,55 +809,345 @@ static void advertising_start(bool erase_bonds)
 }
 
 
-static int16_t imu_init(void)
+// Wait wait_us before the next step of the IMU bring-up; the main loop
+// runs it.
+static void imu_bringup_schedule(int32_t wait_us)
 {
+    uint32_t   ticks = APP_TIMER_TICKS((wait_us + 999) / 1000);
+    ret_code_t err_code;
+
+    if (ticks < APP_TIMER_MIN_TIMEOUT_TICKS)
+    {
+        ticks = APP_TIMER_MIN_TIMEOUT_TICKS;
+    }
+    err_code = app_timer_start(m_imu_timer_id, ticks, NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+// Reset the IMU.  The rest of its bring-up runs from the main loop while
+// the SoftDevice, the services and advertising are started.  The sensors
+// are brought up one after the other.
+static void imu_bringup_start(void)
+{
+    int32_t wait_us;
+
+    if (m_imu_bringup_sensor == 0)
+    {
+        for (uint8_t i = 0; i < IMU_SENSORS; i++)
+        {
+            inv_icm20948_init_state(&imu_sensor[i], &imu_config[i], (i == 0) ? IMU_ADDR : IMU_ADDR_AD0, i, i == 0);
+        }
+    }
+
+    m_imu_dmp_failed = false;
+    NRF_LOG_INFO("calling inv_icm20948_bringup_start() on sensor %d", m_imu_bringup_sensor);
+    wait_us = inv_icm20948_bringup_start(&imu_sensor[m_imu_bringup_sensor]);
+    if (wait_us < 0)
+    {
+        NRF_LOG_INFO("IMU %d failed to initialize", m_imu_bringup_sensor);
+        if (m_imu_sensors > 0)
+        {
+            imu_start();
+        }
+        return;
+    }
+    imu_bringup_schedule(wait_us);
+}
+
+static IMU_DATA imu_data[IMU_SENSORS][IMU_FIFO_BATCH_SIZE];
+static IMU_QUAT imu_quat[IMU_SENSORS][IMU_FIFO_BATCH_SIZE];
+static inv_icm20948_sched imu_sched;
+static sample_ring_t imu_tx_ring[IMU_SENSORS];            // samples waiting for the radio
+
+static void imu_fifo_read_handler(inv_icm20948_sched *p_sched);
+
+// The IMU is configured.  Load the DMP if there is one, false if it failed
+// to start and the sensor has to be brought up again for the raw samples.
+static bool imu_ready(inv_icm20948_state *p_st)
+{
+#if IMU_DMP_ENABLED
     int16_t result;
-    uint8_t counter = 0;
-    uint8_t device_id;
 
-    NRF_LOG_INFO("calling inv_check_and_setup_chip()");
-    do 
+    if (!m_imu_dmp_failed)
     {
-        result = inv_check_and_setup_chip(&st);
+        NRF_LOG_INFO("loading the DMP image");
+        result = inv_icm20948_load_dmp(p_st, dmp3_image, sizeof(dmp3_image));
+        if (result == 0)
+            result = inv_icm20948_enable_dmp(p_st, IMU_DMP_MODE);
         if (result)
         {
-            NRF_LOG_INFO("IMU failed to initialize");
-            return result;
+            NRF_LOG_INFO("DMP failed to start");
+            m_imu_dmp_failed = true;
+            return false;
         }
-    } while (result);
+    }
+#endif
+
+    NRF_LOG_INFO("IMU %d is responding on I2C bus, ready %d ms after boot (%d us from reset)",
+                 p_st->index, boot_ms(), p_st->bringup.time_us);
+
+    // start imu once notifications are enabled
+    inv_icm20948_set_sleep_mode(p_st, !m_service.is_imu_data_notification_enabled);
+    return true;
+}
 
-    NRF_LOG_INFO("calling inv_icm20948_get_device_id()");
-    do
+// Every sensor that came up is drained on the first one's interrupt.
+static void imu_start(void)
+{
+    inv_icm20948_sched_init(&imu_sched, IMU_FIFO_BATCH_SIZE, imu_fifo_read_handler);
+    for (uint8_t i = 0; i < m_imu_sensors; i++)
     {
-        device_id = inv_icm20948_get_device_id();
-    } while ((device_id != IMU_ID) && (counter++ < 10));
+        if (imu_config[i].dmp_mode != INV_ICM20948_DMP_OFF)
+        {
+            inv_icm20948_sched_add(&imu_sched, &imu_sensor[i], imu_quat[i]);
+            sample_ring_init(&imu_tx_ring[i], sizeof(IMU_QUAT), IMU_TX_RING_POLICY);
+        }
+        else
+        {
+            inv_icm20948_sched_add(&imu_sched, &imu_sensor[i], imu_data[i]);
+            sample_ring_init(&imu_tx_ring[i], sizeof(IMU_DATA), IMU_TX_RING_POLICY);
+        }
+    }
+    // the sample rates are known once the sensors are up
+    imu_link_streams_set();
+    gpio_init();
+}
+
+static void imu_bringup_step(void)
+{
+    inv_icm20948_state *p_st = &imu_sensor[m_imu_bringup_sensor];
+    int32_t wait_us;
 
-    if (device_id == IMU_ID)
+    wait_us = inv_icm20948_bringup_step(p_st);
+    if ((wait_us == 0) && !imu_ready(p_st))
+    {
+        // reset the sensor on the timer again and fall back to the raw samples
+        wait_us = inv_icm20948_bringup_start(p_st);
+    }
+    if (wait_us > 0)
     {
-        NRF_LOG_INFO("IMU is responding on I2C bus");
+        imu_bringup_schedule(wait_us);
+        return;
+    }
+
+    if (wait_us == 0)
+    {
+        m_imu_sensors++;
     }
     else
     {
-        NRF_LOG_INFO("IMU failed to respond on I2C bus");
-        return -1;
+        NRF_LOG_INFO("IMU %d failed to respond on I2C bus", m_imu_bringup_sensor);
+    }
+
+    // carry on with the sensors that are up, as long as the first one is
+    if ((m_imu_sensors == m_imu_bringup_sensor + 1) && (++m_imu_bringup_sensor < IMU_SENSORS))
+    {
+        imu_bringup_start();
     }
+    else if (m_imu_sensors > 0)
+    {
+        imu_start();
+    }
+}
 
-    return 0;
+volatile bool data_ready = false;
+static bool             imu_capture = false;
+static volatile bool    imu_read_pending = false;
+static volatile bool    imu_read_done = false;
+static int16_t          imu_read_count[IMU_SENSORS];
+
+// Called once IMU_FIFO_WATERMARK samples have been counted on INV_INT_PIN,
+// or in capture mode once that many have been read.
+static void imu_batch_handler(void)
+{
+    if (imu_capture)
+    {
+        inv_icm20948_capture_next(&imu_sensor[0]);
+    }
+    data_ready = true;
 }
 
-bool data_ready = false;
+// Called from the TWI interrupt once the FIFOs of all sensors are drained.
+static void imu_fifo_read_handler(inv_icm20948_sched *p_sched)
+{
+    memcpy(imu_read_count, p_sched->count, sizeof(imu_read_count));
+    imu_read_done = true;
+    imu_read_pending = false;
+}
 
-void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+// Start a non-blocking drain of the IMU FIFOs, the CPU sleeps while it runs.
+static void imu_fifo_read_start(void)
 {
-    if (data_ready == false)
+    imu_read_pending = true;
+    if (inv_icm20948_sched_start(&imu_sched))
     {
-        data_ready = true;
+        imu_read_pending = false;
+    }
+}
+
+
+// The channels of a sensor that go on air, only those its FIFO holds.
+static uint8_t imu_wire_channels(inv_icm20948_chip_config const *p_config)
+{
+    if (p_config->dmp_mode != INV_ICM20948_DMP_OFF)
+    {
+        return IMU_WIRE_QUAT | ((p_config->dmp_mode == INV_ICM20948_DMP_RV) ? IMU_WIRE_ACCURACY : 0);
+    }
+    return (p_config->accl_fifo_enable ? IMU_WIRE_ACCEL : 0)
+         | (p_config->gyro_fifo_enable ? IMU_WIRE_GYRO : 0)
+         | (p_config->magn_fifo_enable ? IMU_WIRE_MAGN : 0)
+         | (p_config->temp_fifo_enable ? IMU_WIRE_TEMP : 0);
+}
+
+// The time between samples of a sensor, in us.
+static uint32_t imu_wire_period_us(inv_icm20948_chip_config const *p_config)
+{
+    if (p_config->fifo_rate_mhz == 0)
+    {
+        return 0;
+    }
+    return 1000000000UL / p_config->fifo_rate_mhz;
+}
+
+// Tell the link manager how fast each sensor sends and how long its
+// samples are, no stream while notifications are off.
+static void imu_link_streams_set(void)
+{
+    for (uint8_t s = 0; s < m_imu_sensors; s++)
+    {
+        link_stream_set(s, m_service.is_imu_data_notification_enabled ? imu_config[s].fifo_rate_mhz : 0,
+                        imu_wire_sample_size(imu_wire_channels(&imu_config[s]), true));
+    }
+}
+
+// The sample rate a client has asked for, in Hz.  A sensor that is not up
+// yet finds it in its chip_config, its init script programs it.
+static void imu_sample_rate_set(uint16_t rate)
+{
+    for (uint8_t i = 0; i < IMU_SENSORS; i++)
+    {
+        if (imu_sensor[i].bringup.state != INV_ICM20948_BRINGUP_DONE)
+        {
+            imu_config[i].sample_rate = rate;
+        }
+        else if (inv_icm20948_set_sample_frequency(&imu_sensor[i], rate))
+        {
+            NRF_LOG_INFO("IMU %d keeps its sample rate of %d Hz", i, imu_config[i].sample_rate);
+        }
+        else
+        {
+            NRF_LOG_INFO("IMU %d samples at %d mHz", i, imu_config[i].fifo_rate_mhz);
+        }
+    }
+}
+
+// Fill every free slot of the SoftDevice's notification queue from the
+// sample rings, one sensor after the other.  Runs again once
+// BLE_GATTS_EVT_HVN_TX_COMPLETE has made room.
+static void imu_tx_send(void)
+{
+    bool more = true;
+
+    if ((m_conn_handle == BLE_CONN_HANDLE_INVALID) || !m_service.is_imu_data_notification_enabled)
+    {
+        for (uint8_t s = 0; s < m_imu_sensors; s++)
+        {
+            sample_ring_flush(&imu_tx_ring[s]);
+        }
+        return;
+    }
+
+    while (more && m_service.is_imu_data_transfer_complete)
+    {
+        more = false;
+        for (uint8_t s = 0; s < m_imu_sensors; s++)
+        {
+            void const * p_records;
+            uint32_t     count = sample_ring_peek(&imu_tx_ring[s], &p_records);
+            uint16_t     sent;
+
+            if (count == 0)
+            {
+                continue;
+            }
+            sent = characteristic_update_imu_data(&m_service, p_records, count, imu_wire_channels(&imu_config[s]),
+                                                  imu_wire_period_us(&imu_config[s]));
+            sample_ring_consume(&imu_tx_ring[s], sent);
+            if (sent == 0)
+            {
+                // the queue is full, or the link refused the notification
+                return;
+            }
+            more = more || (sample_ring_count(&imu_tx_ring[s]) > 0);
+        }
+    }
+}
+
+// Log the ring drops whenever one of the counters has moved.
+static void imu_tx_drops_log(void)
+{
+    static uint32_t dropped_oldest = 0, dropped_newest = 0;
+    uint32_t oldest = 0, newest = 0;
+
+    for (uint8_t s = 0; s < m_imu_sensors; s++)
+    {
+        oldest += imu_tx_ring[s].dropped_oldest;
+        newest += imu_tx_ring[s].dropped_newest;
+    }
+    if ((oldest != dropped_oldest) || (newest != dropped_newest))
+    {
+        dropped_oldest = oldest;
+        dropped_newest = newest;
+        NRF_LOG_INFO("IMU TX ring full, %d oldest and %d newest samples dropped so far", oldest, newest);
+    }
+}
+
+// Log the bus error counters whenever one of them has moved.
+static void imu_bus_errors_log(void)
+{
+    static uint32_t bus_errors = 0;
+    inv_icm20948_i2c_errors errors;
+
+    inv_icm20948_i2c_get_errors(&errors);
+    if ((errors.nacks + errors.timeouts) != bus_errors)
+    {
+        bus_errors = errors.nacks + errors.timeouts;
+        NRF_LOG_INFO("IMU bus errors: %d NACKs, %d timeouts, %d recoveries, longest %d us",
+                     errors.nacks, errors.timeouts, errors.recoveries, errors.recovery_us);
+    }
+}
+
+// Send the bus trace to a client that subscribed to it, as many records per
+// notification as the MTU allows.  Records stay in the ring until the
+// SoftDevice has taken them.
+static void trace_send(void)
+{
+    trace_record_t records[(NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3) / sizeof(trace_record_t)];
+    uint32_t       count, max;
+
+    if ((m_conn_handle == BLE_CONN_HANDLE_INVALID) || !m_service.is_trace_notification_enabled)
+    {
+        return;
+    }
+
+    max = (nrf_ble_gatt_eff_mtu_get(&m_gatt, m_conn_handle) - 3) / sizeof(trace_record_t);
+    if (max > ARRAY_SIZE(records))
+    {
+        max = ARRAY_SIZE(records);
+    }
+    while ((count = trace_peek(records, max)) > 0)
+    {
+        if (characteristic_update_trace(&m_service, records, count * sizeof(trace_record_t)) != NRF_SUCCESS)
+        {
+            break;
+        }
+        trace_consume(count);
     }
 }
 
 
 // Function for configuring: INV_INT_PIN pin for input, PIN_OUT pin for output,
-// and configures GPIOTE to give an interrupt on pin change.
+// and counts the IMU interrupt pulses to give one interrupt per batch.
 static void gpio_init(void)
 {
     ret_code_t err_code;
@@ -795,13 +1163,17 @@ static void gpio_init(void)
     err_code = nrf_drv_gpiote_out_init(PIN_OUT, &out_config);
     APP_ERROR_CHECK(err_code);
 
-    nrf_drv_gpiote_in_config_t in_config = GPIOTE_CONFIG_IN_SENSE_LOTOHI(true);
-    in_config.pull = NRF_GPIO_PIN_PULLUP;
-
-    err_code = nrf_drv_gpiote_in_init(INV_INT_PIN, &in_config, in_pin_handler);
-    APP_ERROR_CHECK(err_code);
+    // the other sensors fill their FIFOs at the same rate
+    for (uint8_t i = 1; i < m_imu_sensors; i++)
+    {
+        inv_icm20948_set_fifo_watermark(&imu_sensor[i], IMU_FIFO_WATERMARK);
+    }
+    imu_int_init(INV_INT_PIN, inv_icm20948_set_fifo_watermark(&imu_sensor[0], IMU_FIFO_WATERMARK), imu_batch_handler);
 
-    nrf_drv_gpiote_in_event_enable(INV_INT_PIN, true);
+#if IMU_CAPTURE_ENABLED && (IMU_SENSORS == 1)
+    // falls back to the FIFO drain in DMP mode
+    imu_capture = (inv_icm20948_capture_start(&imu_sensor[0], IMU_FIFO_WATERMARK) == 0);
+#endif
 }
 
 
@@ -809,14 +1181,15 @@ static void gpio_init(void)
 int main(void)
 {
     bool erase_bonds;
+    bool imu_streaming = false;
 
     // initialize
+    imu_int_clock_init();
     log_init();
     timers_init();
     buttons_leds_init(&erase_bonds);
     power_management_init();
-    imu_init();
-    inv_icm20948_set_sleep_mode(true);  // start imu once connection is made
+    imu_bringup_start();
     ble_stack_init();
     gap_params_init();
     gatt_init();
@@ -835,21 +1208,99 @@ int main(void)
 
     advertising_start(erase_bonds);
 
-    gpio_init();
-
     // enter main loop
     while (1)
     {
-        if (data_ready == true)
+        if (m_imu_bringup_due == true)
+        {
+            m_imu_bringup_due = false;
+            imu_bringup_step();
+        }
+        if ((data_ready == true) && imu_capture)
+        {
+            // the samples are already in RAM
+            data_ready = false;
+            imu_read_count[0] = inv_icm20948_capture_read(&imu_sensor[0], imu_data[0]);
+            imu_read_done = true;
+        }
+        // the finished batch is queued before another drain can reuse
+        // imu_data[] and imu_read_count[]
+        if ((imu_read_pending == false) && (imu_read_done == true))
+        {
+            static uint32_t fifo_overflows = 0;
+            uint32_t overflows = 0;
+            int16_t count;
+
+            imu_read_done = false;
+            for (uint8_t s = 0; s < m_imu_sensors; s++)
+            {
+                count = imu_read_count[s];
+                // orientation computed on the sensor, or the raw samples, queued for the radio
+                if (m_service.is_imu_data_notification_enabled && (count > 0))
+                {
+                    sample_ring_push(&imu_tx_ring[s],
+                                     (imu_config[s].dmp_mode != INV_ICM20948_DMP_OFF) ?
+                                         (void const *)imu_quat[s] : (void const *)imu_data[s],
+                                     count);
+                }
+                // drain every complete sample from the FIFO, not just the first batch
+                if ((count == IMU_FIFO_BATCH_SIZE) && !imu_capture)
+                {
+                    data_ready = true;
+                }
+                overflows += imu_sensor[s].fifo_overflows;
+            }
+            if (overflows != fifo_overflows)
+            {
+                fifo_overflows = overflows;
+                NRF_LOG_INFO("IMU FIFO overflow, %d so far", fifo_overflows);
+            }
+        }
+        if ((data_ready == true) && (imu_read_pending == false) && !imu_capture)
         {
-            IMU_DATA imu_data;
-            //inv_icm20948_read_imu(&imu_data);
-            inv_icm20948_read_imu_fifo(&st, &imu_data);
             data_ready = false;
-            imu_data.deviceid = m_service.deviceid;
             nrf_gpio_pin_set(PIN_OUT);
-            characteristic_update_imu_data(&m_service, &imu_data, sizeof(IMU_DATA));
+            imu_fifo_read_start();
+        }
+        else if (imu_read_pending == true)
+        {
+            // retires the drain with an error if the bus has stalled
+            inv_icm20948_i2c_check();
+        }
+        // the sensors are only configured from here, while no drain is using
+        // the bus, the BLE handlers just record what a client asked for
+        if ((imu_read_pending == false) &&
+            ((m_service.is_imu_data_notification_enabled != imu_streaming) || m_service.is_sample_rate_changed))
+        {
+            if (m_service.is_imu_data_notification_enabled != imu_streaming)
+            {
+                // the sensors only run while a client listens
+                imu_streaming = m_service.is_imu_data_notification_enabled;
+                for (uint8_t s = 0; s < m_imu_sensors; s++)
+                {
+                    inv_icm20948_set_sleep_mode(&imu_sensor[s], !imu_streaming);
+                }
+            }
+            if (m_service.is_sample_rate_changed)
+            {
+                // cleared first, a write that comes in meanwhile brings it back
+                m_service.is_sample_rate_changed = false;
+                imu_sample_rate_set(m_service.sample_rate);
+            }
+            // renegotiate the link for the new sample stream
+            imu_link_streams_set();
+        }
+        if ((imu_read_pending == false) && m_service.is_resolution_changed)
+        {
+            // after the sample rate, the notification carries the new one
+            m_service.is_resolution_changed = false;
+            characteristic_update_imu_resolution(&m_service, m_service.resolution);
         }
+        link_update();
+        imu_tx_send();
+        imu_tx_drops_log();
+        imu_bus_errors_log();
+        trace_send();
         idle_state_handle();
     }
 }
@@ -0,0 +1,92 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Sample ring -- filled after each FIFO drain and emptied into        */
+/*        notifications, both from the main loop.  A record is copied  */
+/*        in once and encoded straight out of the ring.                */
+/*                                                                     */
+/***********************************************************************/
+
+#include <string.h>
+
+#include "sample_ring.h"
+
+void sample_ring_init(sample_ring_t * p_ring, uint16_t size, sample_ring_policy_t policy)
+{
+    p_ring->size           = size;
+    p_ring->policy         = policy;
+    p_ring->head           = 0;
+    p_ring->tail           = 0;
+    p_ring->dropped_oldest = 0;
+    p_ring->dropped_newest = 0;
+}
+
+uint32_t sample_ring_push(sample_ring_t * p_ring, void const * p_records, uint32_t count)
+{
+    uint8_t const * p_record = p_records;
+    uint32_t        i;
+
+    for (i = 0; i < count; i++, p_record += p_ring->size)
+    {
+        if (p_ring->head - p_ring->tail >= SAMPLE_RING_SIZE)
+        {
+            if (p_ring->policy == SAMPLE_RING_DROP_NEWEST)
+            {
+                p_ring->dropped_newest += count - i;
+                break;
+            }
+            p_ring->dropped_oldest++;
+            p_ring->tail++;
+        }
+        memcpy(&p_ring->records[(p_ring->head % SAMPLE_RING_SIZE) * p_ring->size], p_record, p_ring->size);
+        p_ring->head++;
+    }
+    return i;
+}
+
+uint32_t sample_ring_peek(sample_ring_t const * p_ring, void const ** pp_records)
+{
+    uint32_t first = p_ring->tail % SAMPLE_RING_SIZE;
+    uint32_t count = p_ring->head - p_ring->tail;
+
+    if (count > SAMPLE_RING_SIZE - first)
+    {
+        count = SAMPLE_RING_SIZE - first;
+    }
+    *pp_records = &p_ring->records[first * p_ring->size];
+    return count;
+}
+
+void sample_ring_consume(sample_ring_t * p_ring, uint32_t count)
+{
+    p_ring->tail += count;
+}
+
+uint32_t sample_ring_count(sample_ring_t const * p_ring)
+{
+    return p_ring->head - p_ring->tail;
+}
+
+void sample_ring_flush(sample_ring_t * p_ring)
+{
+    p_ring->tail = p_ring->head;
+}
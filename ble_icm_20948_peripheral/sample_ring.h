@@ -0,0 +1,72 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Sample ring -- holds the samples of one sensor between the FIFO     */
+/*        drain and the radio, so that a burst the SoftDevice cannot   */
+/*        take yet waits for the next free notification instead of    */
+/*        being lost.                                                  */
+/*                                                                     */
+/***********************************************************************/
+
+#ifndef SAMPLE_RING_H__
+#define SAMPLE_RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "imu.h"
+
+#define SAMPLE_RING_SIZE        256     // records, a power of two
+
+// What sample_ring_push() does when the ring is full.
+typedef enum
+{
+    SAMPLE_RING_DROP_OLDEST,    // make room, the newest samples matter most
+    SAMPLE_RING_DROP_NEWEST     // keep what is queued, the stream stays gap free up to the drop
+} sample_ring_policy_t;
+
+typedef struct
+{
+    uint8_t              records[SAMPLE_RING_SIZE * sizeof(IMU_DATA)];
+    uint16_t             size;              // of one record, IMU_DATA or IMU_QUAT
+    uint8_t              policy;            // sample_ring_policy_t
+    uint32_t             head;              // next record to write
+    uint32_t             tail;              // next record to send
+    uint32_t             dropped_oldest;
+    uint32_t             dropped_newest;
+} sample_ring_t;
+
+void     sample_ring_init(sample_ring_t * p_ring, uint16_t size, sample_ring_policy_t policy);
+
+// Queue count records of the ring's size.  Returns the records queued,
+// fewer than count only when the newest are dropped.
+uint32_t sample_ring_push(sample_ring_t * p_ring, void const * p_records, uint32_t count);
+
+// The oldest records that lie in one piece in the ring, *pp_records points
+// at the first of them.  They stay queued until sample_ring_consume().
+uint32_t sample_ring_peek(sample_ring_t const * p_ring, void const ** pp_records);
+void     sample_ring_consume(sample_ring_t * p_ring, uint32_t count);
+
+uint32_t sample_ring_count(sample_ring_t const * p_ring);
+void     sample_ring_flush(sample_ring_t * p_ring);
+
+#endif // SAMPLE_RING_H__
@@ -71,7 +71,15 @@
 
 #include "imu.h"
 
-extern inv_icm20948_state st;
+extern inv_icm20948_chip_config imu_config[IMU_SENSORS];
+extern inv_icm20948_state imu_sensor[IMU_SENSORS];
+
+// The IMUs are brought up in the background after boot.  Until one is done,
+// settings are only kept in its chip_config, where its init script finds them.
+static bool imu_ready(uint8_t sensor)
+{
+    return (imu_sensor[sensor].bringup.state == INV_ICM20948_BRINGUP_DONE);
+}
 
 /**@brief Function for handling the @ref BLE_GATTS_EVT_WRITE event from the SoftDevice.
  *
@@ -90,19 +98,23 @@ static void on_write(ble_os_t * p_service, ble_evt_t const * p_ble_evt)
         (p_evt_write->len == 2))
     {
         NRF_LOG_INFO("data cccd write");
-        if (ble_srv_is_notification_enabled(p_evt_write->data))
+        // the main loop wakes the sensors or puts them to sleep
+        p_service->is_imu_data_notification_enabled = ble_srv_is_notification_enabled(p_evt_write->data);
+        if (p_service->is_imu_data_notification_enabled)
         {
-            inv_icm20948_set_sleep_mode(false);
-            p_service->is_imu_data_notification_enabled = true;
             NRF_LOG_INFO("notification enabled");
         }
         else
         {
-            inv_icm20948_set_sleep_mode(true);
-            p_service->is_imu_data_notification_enabled = false;
             NRF_LOG_INFO("notification disabled");
         }
     }
+    else if ((p_evt_write->handle == p_service->char_handle_trace.cccd_handle) &&
+             (p_evt_write->len == 2))
+    {
+        p_service->is_trace_notification_enabled = ble_srv_is_notification_enabled(p_evt_write->data);
+        NRF_LOG_INFO("trace notification %s", p_service->is_trace_notification_enabled ? "enabled" : "disabled");
+    }
     //else if (p_evt_write->handle == p_service->char_handle_deviceid.value_handle)
     //{
     //    NRF_LOG_INFO("device id write");
@@ -113,13 +125,22 @@ static void on_write(ble_os_t * p_service, ble_evt_t const * p_ble_evt)
         NRF_LOG_INFO("resolution write");
         uint16_t length = p_evt_write->len;
         uint32_t value = 0;
+        uint16_t rate = 0;
         switch (length)
         {
+        case IMU_RESOLUTION_LEN:
+                rate = (uint16_t)((p_evt_write->data[5] << 8) | p_evt_write->data[4]);
+                if (rate != 0)
+                {
+                    characteristic_update_imu_sample_rate(p_service, rate);
+                }
         case 4: value += ((p_evt_write->data[3] << 24) & 0xff000000);
         case 3: value += ((p_evt_write->data[2] << 16) & 0x00ff0000);
         case 2: value += ((p_evt_write->data[1] <<  8) & 0x0000ff00);
         case 1: value += ((p_evt_write->data[0] <<  0) & 0x000000ff);
-                characteristic_update_imu_resolution(p_service, value);
+                // applied by the main loop, see characteristic_update_imu_resolution()
+                p_service->resolution = value;
+                p_service->is_resolution_changed = true;
                 break;
         default:
                 break;
@@ -142,16 +163,21 @@ void ble_service_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
     {
         case BLE_GAP_EVT_CONNECTED:
             p_service->conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+            p_service->is_imu_data_transfer_complete = true;
+            // until the ATT MTU exchange, see gatt_evt_handler() in main.c
+            p_service->max_data_len = BLE_GATT_ATT_MTU_DEFAULT - 3;
             break;
         case BLE_GAP_EVT_DISCONNECTED:
             p_service->conn_handle = BLE_CONN_HANDLE_INVALID;
+            p_service->is_trace_notification_enabled = false;
             break;
         case BLE_GATTS_EVT_WRITE:
             //NRF_LOG_INFO("BLE_GATTS_EVT_WRITE");
             on_write(p_service, p_ble_evt);
             break;
         case BLE_GATTS_EVT_HVN_TX_COMPLETE:
-            //NRF_LOG_INFO("BLE_GATTS_EVT_HVN_TX_COMPLETE");
+            // the SoftDevice has room for more notifications, the main loop
+            // refills the queue from the sample rings
             p_service->is_imu_data_transfer_complete = true;
             break;
         default:
@@ -193,6 +219,8 @@ static uint32_t char_add_data(ble_os_t * p_service)
     ble_gatts_attr_md_t attr_md;
     memset(&attr_md, 0, sizeof(attr_md));
     attr_md.vloc        = BLE_GATTS_VLOC_STACK;
+    // the notifications carry as many records as the MTU has room for
+    attr_md.vlen        = 1;
 
     // set read/write security levels to the characteristic
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
@@ -204,11 +232,10 @@ static uint32_t char_add_data(ble_os_t * p_service)
     attr_char_value.p_uuid      = &char_uuid;
     attr_char_value.p_attr_md   = &attr_md;
 
-    // set characteristic length in number of bytes
-    // This is where I need to adjust the size of the characteristic data.  JTN
-    attr_char_value.max_len     = sizeof(IMU_DATA);
-    attr_char_value.init_len    = sizeof(IMU_DATA);
-    uint8_t value[sizeof(IMU_DATA)]            = {0x12,0x34,0x56,0x78};
+    // set characteristic length in number of bytes, an empty packet to start with
+    attr_char_value.max_len     = IMU_PACKET_MAX_LEN;
+    attr_char_value.init_len    = IMU_WIRE_HEADER_SIZE;
+    uint8_t value[IMU_WIRE_HEADER_SIZE] = {IMU_WIRE_VERSION};
     attr_char_value.p_value     = value;
 
     // add the new characteristic to the service
@@ -320,6 +347,8 @@ static uint32_t char_add_resolution(ble_os_t * p_service)
     ble_gatts_attr_md_t attr_md;
     memset(&attr_md, 0, sizeof(attr_md));
     attr_md.vloc        = BLE_GATTS_VLOC_STACK;
+    // older clients write the ranges alone
+    attr_md.vlen        = 1;
 
     // set read/write security levels to the characteristic
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
@@ -333,13 +362,15 @@ static uint32_t char_add_resolution(ble_os_t * p_service)
 
     // set characteristic length in number of bytes
     // This is where I need to adjust the size of the characteristic data.  JTN
-    attr_char_value.max_len     = sizeof(uint32_t);
-    attr_char_value.init_len    = sizeof(uint32_t);
-    uint8_t value[sizeof(uint32_t)];
-    memset(&value, 0, sizeof(uint32_t));
-    value[0] = st.chip_config->accl_fsr;
-    value[1] = st.chip_config->gyro_fsr;
-    value[2] = st.chip_config->magn_fsr;
+    attr_char_value.max_len     = IMU_RESOLUTION_LEN;
+    attr_char_value.init_len    = IMU_RESOLUTION_LEN;
+    uint8_t value[IMU_RESOLUTION_LEN];
+    memset(&value, 0, sizeof(value));
+    value[0] = imu_config[0].accl_fsr;
+    value[1] = imu_config[0].gyro_fsr;
+    value[2] = imu_config[0].magn_fsr;
+    value[4] = (uint8_t)(imu_config[0].sample_rate >> 0);
+    value[5] = (uint8_t)(imu_config[0].sample_rate >> 8);
     attr_char_value.p_value     = value;
 
     // add the new characteristic to the service
@@ -352,6 +383,56 @@ static uint32_t char_add_resolution(ble_os_t * p_service)
     return NRF_SUCCESS;
 }
 
+// Function for adding the bus trace characteristic, notify only.  Each
+// notification carries as many trace_record_t as fit into the MTU.
+//
+//     p_service  our Service structure
+//
+static uint32_t char_add_trace(ble_os_t * p_service)
+{
+    uint32_t            err_code;
+    ble_uuid_t          char_uuid;
+    ble_uuid128_t       base_uuid = BLE_UUID_BASE_UUID;
+    char_uuid.uuid      = BLE_UUID_CHARACTERISTC_IMU_TRACE;
+    err_code = sd_ble_uuid_vs_add(&base_uuid, &char_uuid.type);
+    APP_ERROR_CHECK(err_code);
+
+    ble_gatts_char_md_t char_md;
+    memset(&char_md, 0, sizeof(char_md));
+    char_md.char_props.read = 0;
+    char_md.char_props.write = 0;
+
+    ble_gatts_attr_md_t cccd_md;
+    memset(&cccd_md, 0, sizeof(cccd_md));
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc                = BLE_GATTS_VLOC_STACK;
+    char_md.p_cccd_md           = &cccd_md;
+    char_md.char_props.notify   = 1;
+
+    ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc        = BLE_GATTS_VLOC_STACK;
+    attr_md.vlen        = 1;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+
+    ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+    attr_char_value.max_len     = NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3;
+    attr_char_value.init_len    = 0;
+
+    err_code = sd_ble_gatts_characteristic_add(p_service->service_handle,
+                                               &char_md,
+                                               &attr_char_value,
+                                               &p_service->char_handle_trace);
+    APP_ERROR_CHECK(err_code);
+
+    return NRF_SUCCESS;
+}
+
 
 // Function for initiating the new service.
 //
@@ -374,6 +455,11 @@ void service_init(ble_os_t * p_service)
     // indicate that imu data notification is disabled
     p_service->is_imu_data_notification_enabled = false;
     p_service->is_imu_data_transfer_complete = true;
+    p_service->is_trace_notification_enabled = false;
+    p_service->is_sample_rate_changed = false;
+    p_service->is_resolution_changed = false;
+    p_service->sample_rate = 0;
+    p_service->max_data_len = BLE_GATT_ATT_MTU_DEFAULT - 3;
 
     // add the service
     err_code = sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY,
@@ -386,43 +472,94 @@ void service_init(ble_os_t * p_service)
     char_add_data(p_service);
     char_add_deviceid(p_service);
     char_add_resolution(p_service);
+    char_add_trace(p_service);
 }
 
 // Function to be called when updating characteristic value with IMU data
-void characteristic_update_imu_data(ble_os_t *p_service, IMU_DATA *imu_data, int16_t length)
+uint16_t characteristic_update_imu_data(ble_os_t *p_service, void const *p_records, uint16_t count,
+                                        uint8_t channels, uint32_t period_us)
 {
-    uint32_t err_code;
+    uint8_t             packet[IMU_PACKET_MAX_LEN];
+    uint16_t            sent = 0;
+    uint32_t            err_code;
 
-    // wait for last transfer to complete before transferring more data
-    // this prevents the NRF_ERROR_RESOURCES error but slows down data transfer to a trickle.
-    //do {} while (p_service->is_imu_data_transfer_complete == false);
-    // this works better but still misses about half of the data transfer
-    //if (p_service->is_imu_data_transfer_complete == false) return;
+    if ((p_service->conn_handle == BLE_CONN_HANDLE_INVALID) || (p_service->is_imu_data_notification_enabled == false))
+    {
+        return 0;
+    }
 
-    // update characteristic value
-    if ((p_service->conn_handle != BLE_CONN_HANDLE_INVALID) && (p_service->is_imu_data_notification_enabled == true))
+    while (sent < count)
     {
-        uint16_t               len = length;
+        uint16_t               len, used;
         ble_gatts_hvx_params_t hvx_params;
-        memset(&hvx_params, 0, sizeof(hvx_params));
 
+        if (channels & IMU_WIRE_QUAT)
+        {
+            len = imu_wire_encode_quat(packet, MIN(p_service->max_data_len, sizeof(packet)), channels, period_us,
+                                       (IMU_QUAT const *)p_records + sent, count - sent, &used);
+        }
+        else
+        {
+            len = imu_wire_encode_data(packet, MIN(p_service->max_data_len, sizeof(packet)), channels, period_us,
+                                       (IMU_DATA const *)p_records + sent, count - sent, &used);
+        }
+        if (len == 0)
+        {
+            NRF_LOG_INFO("a sample does not fit the ATT MTU");
+            break;
+        }
+
+        memset(&hvx_params, 0, sizeof(hvx_params));
         hvx_params.handle = p_service->char_handle_data.value_handle;
         hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
         hvx_params.offset = 0;
         hvx_params.p_len  = &len;
-        hvx_params.p_data = (uint8_t*)imu_data;  
+        hvx_params.p_data = packet;
 
+        // cleared before the call, so that a BLE_GATTS_EVT_HVN_TX_COMPLETE
+        // that comes in while it runs is not lost
         p_service->is_imu_data_transfer_complete = false;
         err_code = sd_ble_gatts_hvx(p_service->conn_handle, &hvx_params);
-        if (err_code == NRF_SUCCESS)
+        if (err_code == NRF_ERROR_RESOURCES)
         {
-            nrf_gpio_pin_clear(PIN_OUT);
+            // the queue is full, the event sets it again
+            break;
         }
-        else
+        p_service->is_imu_data_transfer_complete = true;
+        if (err_code != NRF_SUCCESS)
         {
             NRF_LOG_INFO("sd_ble_gatts_hvx(imu-data) returned error code 0x%04x", err_code);
+            break;
         }
+        sent += used;
+    }
+
+    if (sent > 0)
+    {
+        nrf_gpio_pin_clear(PIN_OUT);
+    }
+    return sent;
+}
+
+
+uint32_t characteristic_update_trace(ble_os_t *p_service, void const *p_records, uint16_t length)
+{
+    uint16_t               len = length;
+    ble_gatts_hvx_params_t hvx_params;
+
+    if ((p_service->conn_handle == BLE_CONN_HANDLE_INVALID) || !p_service->is_trace_notification_enabled)
+    {
+        return NRF_ERROR_INVALID_STATE;
     }
+
+    memset(&hvx_params, 0, sizeof(hvx_params));
+    hvx_params.handle = p_service->char_handle_trace.value_handle;
+    hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
+    hvx_params.offset = 0;
+    hvx_params.p_len  = &len;
+    hvx_params.p_data = (uint8_t const *)p_records;
+
+    return sd_ble_gatts_hvx(p_service->conn_handle, &hvx_params);
 }
 
 
@@ -459,15 +596,21 @@ void characteristic_update_imu_resolution(ble_os_t *p_service, uint32_t resoluti
     // update characteristic value
     if (p_service->conn_handle != BLE_CONN_HANDLE_INVALID)
     {
-        uint16_t               len = sizeof(uint32_t);
+        uint16_t               len = IMU_RESOLUTION_LEN;
+        uint8_t                value[IMU_RESOLUTION_LEN];
         ble_gatts_hvx_params_t hvx_params;
         memset(&hvx_params, 0, sizeof(hvx_params));
 
+        // the sample rate goes along, so that the value always holds it
+        memcpy(value, &resolution, sizeof(uint32_t));
+        value[4] = (uint8_t)(imu_config[0].sample_rate >> 0);
+        value[5] = (uint8_t)(imu_config[0].sample_rate >> 8);
+
         hvx_params.handle = p_service->char_handle_resolution.value_handle;
         hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
         hvx_params.offset = 0;
         hvx_params.p_len  = &len;
-        hvx_params.p_data = (uint8_t*)&(resolution);  
+        hvx_params.p_data = value;
 
         err_code = sd_ble_gatts_hvx(p_service->conn_handle, &hvx_params);
         if (err_code != NRF_SUCCESS)
@@ -478,11 +621,24 @@ void characteristic_update_imu_resolution(ble_os_t *p_service, uint32_t resoluti
 
     if (err_code == NRF_SUCCESS)
     {
-        st.chip_config->accl_fsr = ((resolution & 0x00000003) >> 0);
-        st.chip_config->gyro_fsr = ((resolution & 0x00000300) >> 8);
-        // set the accelerometer full scale range
-        inv_icm20948_config_accel(st.chip_config->accl_fsr);
-        // set the gyro full scale range
-        inv_icm20948_config_gyro(st.chip_config->gyro_fsr);
+        // every sensor has the same ranges
+        for (uint8_t i = 0; i < IMU_SENSORS; i++)
+        {
+            imu_config[i].accl_fsr = ((resolution & 0x00000003) >> 0);
+            imu_config[i].gyro_fsr = ((resolution & 0x00000300) >> 8);
+            // set the accelerometer and gyro full scale ranges in one commit
+            if (imu_ready(i))
+            {
+                inv_icm20948_set_fsr(&imu_sensor[i], imu_config[i].accl_fsr, imu_config[i].gyro_fsr);
+                NRF_LOG_INFO("ranges applied in %d us", imu_sensor[i].config_apply_us);
+            }
+        }
     }
 }
+
+void characteristic_update_imu_sample_rate(ble_os_t *p_service, uint16_t rate)
+{
+    // applied by the main loop
+    p_service->sample_rate = rate;
+    p_service->is_sample_rate_changed = true;
+}
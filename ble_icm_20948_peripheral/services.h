@@ -66,6 +66,7 @@
 #include "ble_srv_common.h"
 
 #include "imu.h"
+#include "imu_wire.h"
 
 // Defining 16-bit service and 128-bit base UUIDs
 // 5c1aa4bc-0e70-4a20-a88e-3259e2e8bad9
@@ -78,6 +79,7 @@
 #define BLE_UUID_CHARACTERISTC_IMU_DATA          0xfade // IMU Data
 #define BLE_UUID_CHARACTERISTC_IMU_DEVICEID      0xbead // IMU Device ID
 #define BLE_UUID_CHARACTERISTC_IMU_RESOLUTION    0xfeed // IMU MEMS Resolution
+#define BLE_UUID_CHARACTERISTC_IMU_TRACE         0xdeb6 // Sensor bus trace (diagnostics)
 
 // This structure contains various status information for the service. 
 // The name is based on the naming convention used in Nordics SDKs. 
@@ -91,11 +93,27 @@ typedef struct
     ble_gatts_char_handles_t    char_handle_data;
     ble_gatts_char_handles_t    char_handle_deviceid;
     ble_gatts_char_handles_t    char_handle_resolution;
+    ble_gatts_char_handles_t    char_handle_trace;
     bool                        is_imu_data_notification_enabled;
-    bool                        is_imu_data_transfer_complete;
+    bool                        is_trace_notification_enabled;
+    volatile bool               is_imu_data_transfer_complete;  // The SoftDevice may have room for another notification.
+    volatile bool               is_sample_rate_changed;         // A client has set the sample rate, the main loop renegotiates the link.
+    volatile bool               is_resolution_changed;          // A client has written the resolution, the main loop applies it.
+    uint32_t                    resolution;                     // As written, see IMU_RESOLUTION_LEN.
+    volatile uint16_t           sample_rate;                    // As written, in Hz.
+    uint16_t                    max_data_len;   // Notification payload the ATT MTU allows.
     uint32_t                    deviceid;
 } ble_os_t;
 
+// The resolution characteristic: accelerometer, gyroscope and magnetometer
+// full scale ranges, a spare byte and the sample rate in Hz (2 bytes, little
+// endian).  A client writes the first 4 bytes to set the ranges, all 6 to
+// also set the sample rate.
+#define IMU_RESOLUTION_LEN      6
+
+// Longest IMU data notification, with the largest ATT MTU.
+#define IMU_PACKET_MAX_LEN      (NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3)
+
 // Function for handling BLE Stack events related to the service and characteristic.
 //
 // Handles all events from the BLE stack of interest to Our Service.
@@ -113,15 +131,49 @@ void service_init(ble_os_t * p_service);
 
 // Function for updating and sending new characteristic values
 //
-// The application calls this function whenever the timer_timeout_handler triggers
+// The records are encoded in the imu_wire format (see imu_wire.h), as
+// many to a notification as max_data_len allows.
+//
+//     p_service       our Service structure
+//     p_records       IMU_DATA, or IMU_QUAT if channels holds IMU_WIRE_QUAT
+//     count           number of records
+//     channels        IMU_WIRE_* channels that are enabled
+//     period_us       the nominal time between records
+//
+// Returns the number of records sent.  When the rest did not fit in the
+// SoftDevice's queue, is_imu_data_transfer_complete is cleared until a
+// BLE_GATTS_EVT_HVN_TX_COMPLETE frees a slot.
+//
+uint16_t characteristic_update_imu_data(ble_os_t *p_service, void const *p_records, uint16_t count,
+                                        uint8_t channels, uint32_t period_us);
+
+// Function for sending bus trace records (trace_record_t, see trace.h)
 //
 //     p_service       our Service structure
-//     imu_data        new characteristic value
-//     length          length of characteristic value
+//     p_records       records to send
+//     length          length in bytes, at most the ATT MTU less 3
 //
-void characteristic_update_imu_data(ble_os_t *p_service, IMU_DATA *imu_data, int16_t length);
+// Returns the sd_ble_gatts_hvx() result, the records have not been sent
+// unless it is NRF_SUCCESS.
+//
+uint32_t characteristic_update_trace(ble_os_t *p_service, void const *p_records, uint16_t length);
 
 void characteristic_update_imu_deviceid(ble_os_t *p_service);
+
+// Function for setting the full scale ranges of every sensor
+//
+// Notifies the new value and sets the ranges with blocking bus accesses,
+// so it is called from the main loop while no FIFO drain is running.
+//
 void characteristic_update_imu_resolution(ble_os_t *p_service, uint32_t resolution);
 
+// Function for setting the sample rate of every sensor, rate in Hz
+//
+// Called from the BLE write handler, only records the rate and sets
+// is_sample_rate_changed.  The main loop programs the sensors, the commit
+// and the magnetometer poll block, and fits the connection to the new
+// rate.  The DMP runs at a fixed rate and keeps it.
+//
+void characteristic_update_imu_sample_rate(ble_os_t *p_service, uint16_t rate);
+
 #endif  // _SERVICES_H__
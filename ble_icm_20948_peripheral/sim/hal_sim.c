@@ -0,0 +1,292 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* HAL -- Host implementation of the callback functions required by    */
+/*        the InvenSense IMC-20948 driver.  Every bus access is routed */
+/*        to the register level simulator and accounted for as an I2C  */
+/*        or SPI transaction on the simulated bus.                     */
+/*                                                                     */
+/***********************************************************************/
+
+#include "imu.h"
+#include "hal.h"
+#include "trace.h"
+#include "icm20948_sim.h"
+
+// bytes on the wire for the address and register phases of a transaction
+#define I2C_WRITE_OVERHEAD      2       // address+W, register
+#define I2C_READ_OVERHEAD       3       // address+W, register, address+R (repeated start)
+#define SPI_OVERHEAD            1       // register and read bit
+
+// the read armed by inv_icm20948_i2c_capture_arm(), replayed per INT pulse
+static bool     capture_armed;
+static uint8_t  capture_addr;
+static uint8_t  capture_reg;
+static uint8_t *capture_ptr;
+static uint32_t capture_len;
+static uint32_t capture_offset;
+static uint16_t capture_count;
+static uint16_t capture_done;
+static uint8_t *capture_rearm_ptr;      // where the reads go after a late one
+
+// every late_every'th re-arm of the capture is late, see hal_sim_late_every()
+static uint32_t late_every;
+static uint32_t late_countdown;
+
+// every fail_every'th transfer is not acknowledged, see hal_sim_fail_every()
+static uint32_t fail_every;
+static uint32_t fail_countdown;
+static inv_icm20948_i2c_errors errors;
+
+uint32_t inv_icm20948_get_time_us(void)
+{
+    return (uint32_t)(icm20948_sim_time_ns() / 1000);
+}
+
+uint32_t inv_icm20948_get_int_time_us(void)
+{
+    return (uint32_t)(icm20948_sim_int_time_ns() / 1000);
+}
+
+void inv_icm20948_sleep_us(uint32_t us)
+{
+    icm20948_sim_advance_ns((uint64_t)us * 1000);
+}
+
+int inv_icm20948_i2c_init(void)
+{
+    return 0;
+}
+
+int inv_icm20948_i2c_read_reg(uint8_t addr, uint8_t reg, uint8_t *value)
+{
+    return inv_icm20948_i2c_read_reg_block(addr, reg, value, 1);
+}
+
+// A NACKed transfer ends after the address byte and never reaches the
+// device.  SPI has no acknowledge, a failure there stands for a stall.
+static bool sim_fail(void)
+{
+    if ((fail_every == 0) || (--fail_countdown > 0))
+        return false;
+    fail_countdown = fail_every;
+    icm20948_sim_bus_transaction(1);
+    if (icm20948_sim_bus() == SIM_BUS_SPI)
+        errors.timeouts++;
+    else
+        errors.nacks++;
+    return true;
+}
+
+// Address the sensor for the transfer, false if it does not take place.
+// As on the target, SPI reaches nothing but the sensor at IMU_ADDR, and on
+// I2C nothing acknowledges an address no sensor has.
+static bool sim_start(uint8_t addr)
+{
+    if ((icm20948_sim_bus() == SIM_BUS_SPI) && (addr != IMU_ADDR))
+        return false;
+    if (sim_fail())
+        return false;
+    if (!icm20948_sim_select(addr)) {
+        icm20948_sim_bus_transaction(1);
+        errors.nacks++;
+        return false;
+    }
+    return true;
+}
+
+static void sim_read(uint8_t reg, uint8_t * rbuffer, uint32_t rlen)
+{
+    icm20948_sim_bus_transaction(((icm20948_sim_bus() == SIM_BUS_SPI) ? SPI_OVERHEAD : I2C_READ_OVERHEAD) + rlen);
+    icm20948_sim_read_block(reg, rbuffer, rlen);
+}
+
+// Every transfer the CPU starts is traced, as twi.c and spi.c do on the target.
+static void sim_trace(uint8_t addr, uint8_t reg, const uint8_t *data, uint32_t len, uint8_t flags, uint32_t start_us)
+{
+    if (icm20948_sim_bus() == SIM_BUS_SPI)
+        flags |= TRACE_FLAG_SPI;
+    trace_bus(addr, reg, data, len, flags, start_us, inv_icm20948_get_time_us(), 0);
+}
+
+int inv_icm20948_i2c_read_reg_block(uint8_t addr, uint8_t reg, uint8_t * rbuffer, uint32_t rlen)
+{
+    uint32_t start_us = inv_icm20948_get_time_us();
+
+    if (!sim_start(addr))
+        return -1;
+    sim_read(reg, rbuffer, rlen);
+    sim_trace(addr, reg, NULL, rlen, TRACE_FLAG_READ, start_us);
+    return 0;
+}
+
+int inv_icm20948_i2c_write_reg(uint8_t addr, uint8_t reg, uint8_t value)
+{
+    return inv_icm20948_i2c_write_reg_block(addr, reg, &value, 1);
+}
+
+static int sim_write(uint8_t addr, uint8_t reg, uint8_t *wbuffer, uint32_t wlen, uint8_t flags)
+{
+    uint32_t start_us = inv_icm20948_get_time_us();
+
+    if (!sim_start(addr))
+        return -1;
+    icm20948_sim_bus_transaction(((icm20948_sim_bus() == SIM_BUS_SPI) ? SPI_OVERHEAD : I2C_WRITE_OVERHEAD) + wlen);
+    icm20948_sim_write_block(reg, wbuffer, wlen);
+    sim_trace(addr, reg, wbuffer, wlen, flags, start_us);
+    return 0;
+}
+
+int inv_icm20948_i2c_write_reg_block(uint8_t addr, uint8_t reg, uint8_t *wbuffer, uint32_t wlen)
+{
+    return sim_write(addr, reg, wbuffer, wlen, 0);
+}
+
+// The simulated bus completes every transfer on the spot, so the callback
+// runs before these return.  That can happen on the target as well when
+// the bus is idle, so the driver must not rely on the order.
+int inv_icm20948_i2c_read_reg_block_async(uint8_t addr, uint8_t reg, uint8_t * rbuffer, uint32_t rlen,
+                                          inv_icm20948_i2c_callback_t callback, void *context)
+{
+    int result = inv_icm20948_i2c_read_reg_block(addr, reg, rbuffer, rlen);
+
+    if (callback != NULL)
+        callback(result, context);
+    return 0;
+}
+
+int inv_icm20948_i2c_write_reg_block_async(uint8_t addr, uint8_t reg, uint8_t * wbuffer, uint32_t wlen,
+                                           inv_icm20948_i2c_callback_t callback, void *context)
+{
+    int result = inv_icm20948_i2c_write_reg_block(addr, reg, wbuffer, wlen);
+
+    if (callback != NULL)
+        callback(result, context);
+    return 0;
+}
+
+int inv_icm20948_i2c_xfer_list(uint8_t addr, const inv_icm20948_i2c_op *ops, uint32_t count,
+                               inv_icm20948_i2c_callback_t callback, void *context)
+{
+    uint32_t i;
+    int result = 0;
+
+    if ((count == 0) || (count > INV_ICM20948_I2C_MAX_OPS))
+        return -1;
+
+    // like the target, the rest of the list is dropped after a failure
+    for (i = 0; (i < count) && (result == 0); i++) {
+        if (ops[i].read)
+            result = inv_icm20948_i2c_read_reg_block(addr, ops[i].reg, ops[i].buffer, ops[i].len);
+        else if (ops[i].prefixed)
+            result = sim_write(addr, ops[i].reg, &ops[i].buffer[1], ops[i].len, TRACE_FLAG_PREFIXED);
+        else
+            result = inv_icm20948_i2c_write_reg_block(addr, ops[i].reg, ops[i].buffer, ops[i].len);
+    }
+    if (callback != NULL)
+        callback(result, context);
+    return 0;
+}
+
+// Transfers complete on the spot, nothing can be left stalled.
+int inv_icm20948_i2c_check(void)
+{
+    return 0;
+}
+
+void inv_icm20948_i2c_get_errors(inv_icm20948_i2c_errors *p_errors)
+{
+    *p_errors = errors;
+}
+
+int inv_icm20948_i2c_capture_arm(uint8_t addr, uint8_t reg, uint8_t *buffer, uint32_t len, uint16_t count,
+                                 inv_icm20948_i2c_capture *capture)
+{
+    if (!icm20948_sim_select(addr) || ((icm20948_sim_bus() == SIM_BUS_SPI) && (addr != IMU_ADDR)))
+        return -1;
+    capture_addr = addr;
+    capture_reg = reg;
+    capture_ptr = buffer;
+    capture_len = len;
+    capture_offset = (icm20948_sim_bus() == SIM_BUS_SPI) ? 1 : 0;
+    capture_count = (count > 0) ? count : 1;
+    capture_done = 0;
+    capture_rearm_ptr = NULL;
+    capture_armed = true;
+
+    capture->offset = capture_offset;
+    capture->stride = len + capture_offset;
+    return 0;
+}
+
+// A late re-arm is modelled as a read that had already started when the
+// pointer was changed: the next read still goes to the old place.
+int inv_icm20948_i2c_capture_rearm(uint8_t *buffer)
+{
+    if ((late_every == 0) || (--late_countdown > 0)) {
+        capture_ptr = buffer;
+        return 0;
+    }
+    late_countdown = late_every;
+    capture_rearm_ptr = buffer;
+    return -1;
+}
+
+void inv_icm20948_i2c_capture_disarm(void)
+{
+    capture_armed = false;
+}
+
+// What PPI and the INT pulse counter do on the target: run the armed read
+// into the next slot, and report when count of them have completed.
+bool hal_sim_capture_pulse(void)
+{
+    if (!capture_armed)
+        return false;
+
+    // started by PPI on the target, so the CPU never sees it to trace it
+    icm20948_sim_select(capture_addr);
+    sim_read(capture_reg, capture_ptr + capture_offset, capture_len);
+    capture_ptr += capture_len + capture_offset;
+    if (capture_rearm_ptr != NULL) {
+        capture_ptr = capture_rearm_ptr;
+        capture_rearm_ptr = NULL;
+    }
+    if (++capture_done < capture_count)
+        return false;
+    capture_done = 0;
+    return true;
+}
+
+// Fail every n'th transfer from now on, 0 to stop.
+void hal_sim_fail_every(uint32_t n)
+{
+    fail_every = n;
+    fail_countdown = n;
+}
+
+// Make every n'th capture re-arm late, 0 to stop.
+void hal_sim_late_every(uint32_t n)
+{
+    late_every = n;
+    late_countdown = n;
+}
@@ -0,0 +1,725 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* ICM-20948 register level simulator -- models the four register      */
+/*        banks, the 512 byte FIFO, the auxiliary I2C master with an   */
+/*        AK09916 behind it, the DMP memory and a slowly rocking       */
+/*        sensor so that imu.c can be exercised on a desktop.  Up to   */
+/*        INV_ICM20948_SENSORS_MAX of them can share the bus.          */
+/*                                                                     */
+/***********************************************************************/
+
+#include <math.h>
+#include <string.h>
+
+#include "imu.h"
+#include "icm20948_sim.h"
+
+#define SIM_BANKS               4
+#define SIM_BANK_SIZE           128
+#define SIM_INTERNAL_RATE_HZ    1125            // gyro/accel internal sample rate
+#define SIM_I2C_START_STOP_BITS 2               // START and STOP conditions, roughly one bit time each
+#define SIM_I2C_BITS_PER_BYTE   9               // 8 data bits plus ACK
+#define SIM_SPI_CS_BITS         2               // nCS setup and hold, roughly one clock each
+#define SIM_SPI_BITS_PER_BYTE   8
+
+#define SIM_MOTION_FREQ_HZ      0.5             // rocking frequency of the synthetic motion
+#define SIM_MOTION_AMPL_RAD     0.6             // rocking amplitude
+#define SIM_TEMPERATURE_C       25.0
+#define SIM_EARTH_FIELD_X_UT    20.0            // earth magnetic field in the world frame
+#define SIM_EARTH_FIELD_Z_UT    (-40.0)
+#define SIM_MAGN_UT_PER_LSB     0.15
+#define SIM_I2C_SLAVES          4               // SLV0..SLV3 are read every sample
+#define SIM_DMP_MEM_SIZE        0x4000          // DMP program and data memory
+#define SIM_DMP_ACCURACY        3               // heading accuracy reported with the 9-axis vector
+#define SIM_PI                  3.14159265358979323846
+
+#define REG(r)                  ((uint8_t)((r) & 0xff))
+#define BANK(r)                 ((uint8_t)(((r) & 0xff00) >> 8))
+
+// One sensor on the bus, everything but the clock and the bus is its own.
+typedef struct _sim_device {
+        uint8_t  regs[SIM_BANKS][SIM_BANK_SIZE];
+        uint8_t  bank_sel;
+
+        uint8_t  fifo[IMU_FIFO_SIZE];
+        uint16_t fifo_head;                     // next byte to read
+        uint16_t fifo_count;
+
+        uint64_t next_sample_ns;
+        bool     int_pending;
+        uint64_t int_time_ns;                   // last INT pulse, as captured by the MCU's timer
+
+        uint8_t  ak09916_mode;
+        uint8_t  ak09916_data[6];               // HXL..HZH
+
+        uint8_t  dmp_mem[SIM_DMP_MEM_SIZE];
+        uint32_t dmp_samples;                   // sensor samples seen since DMP_RST
+} sim_device;
+
+static sim_device devices[INV_ICM20948_SENSORS_MAX];
+static sim_device *dev = &devices[0];           // the one addressed by the transaction on the bus
+static uint8_t  device_count = 1;
+
+static uint64_t now_ns;
+static uint64_t bit_time_ns;
+static icm20948_sim_bus_e bus;
+static uint32_t noise_seed = 1;
+
+static icm20948_sim_stats stats;
+
+
+/***********************************************************************/
+/*                                                                     */
+/* Register file                                                       */
+/*                                                                     */
+/***********************************************************************/
+
+static uint8_t *reg_ptr(uint16_t bank_reg)
+{
+    return &dev->regs[BANK(bank_reg)][REG(bank_reg)];
+}
+
+static void sim_reset(void)
+{
+    memset(dev->regs, 0, sizeof(dev->regs));
+    dev->bank_sel = 0;
+
+    // power-on values from the ICM-20948 data sheet register map
+    *reg_ptr(IMU_WHO_AM_I)      = IMU_EXPECTED_WHOAMI;
+    *reg_ptr(IMU_LP_CONFIG)     = IMU_I2C_MST_CYCLE;
+    *reg_ptr(IMU_PWR_MGMT_1)    = IMU_BIT_SLEEP | 0x01;
+    *reg_ptr(IMU_GYRO_CONFIG_1) = 0x01;
+    *reg_ptr(IMU_ACCEL_CONFIG)  = 0x01;
+
+    dev->fifo_head = 0;
+    dev->fifo_count = 0;
+    dev->int_pending = false;
+    dev->ak09916_mode = AK09916_MODE_POWER_DOWN;
+
+    // the DMP program has to be uploaded again after every reset
+    memset(dev->dmp_mem, 0, sizeof(dev->dmp_mem));
+    dev->dmp_samples = 0;
+}
+
+static uint8_t current_bank(void)
+{
+    return (dev->bank_sel >> 4) & 0x03;
+}
+
+static bool sensor_awake(void)
+{
+    return (*reg_ptr(IMU_PWR_MGMT_1) & IMU_BIT_SLEEP) == 0;
+}
+
+static uint64_t sample_period_ns(void)
+{
+    uint32_t divider = *reg_ptr(IMU_GYRO_SMPLRT_DIV);
+
+    // with the gyro powered down the accelerometer's divider sets the rate
+    if ((*reg_ptr(IMU_PWR_MGMT_2) & IMU_BIT_DISABLE_GYRO) == IMU_BIT_DISABLE_GYRO)
+        divider = ((*reg_ptr(IMU_ACCEL_SMPLRT_DIV_1) & 0x0f) << 8) | *reg_ptr(IMU_ACCEL_SMPLRT_DIV_2);
+    return ((uint64_t)(divider + 1) * 1000000000ULL) / SIM_INTERNAL_RATE_HZ;
+}
+
+
+/***********************************************************************/
+/*                                                                     */
+/* Synthetic motion                                                    */
+/*                                                                     */
+/***********************************************************************/
+
+static int16_t noise(void)
+{
+    // small deterministic LCG noise of +/- 4 LSB
+    noise_seed = noise_seed * 1103515245 + 12345;
+    return (int16_t)((noise_seed >> 16) % 9) - 4;
+}
+
+static int16_t saturate(double value)
+{
+    if (value > 32767.0)
+        return 32767;
+    if (value < -32768.0)
+        return -32768;
+    return (int16_t)value;
+}
+
+static void put_be16(uint8_t *p, int16_t value)
+{
+    p[0] = (uint8_t)((uint16_t)value >> 8);
+    p[1] = (uint8_t)((uint16_t)value & 0xff);
+}
+
+static double motion_angle(void)
+{
+    double t = (double)now_ns / 1e9;
+    return SIM_MOTION_AMPL_RAD * sin(2.0 * SIM_PI * SIM_MOTION_FREQ_HZ * t);
+}
+
+// The sensor rocks about its X axis; gravity is rotated accordingly and
+// the gyro reports the angular rate of the rocking.
+static void update_data_registers(void)
+{
+    double t = (double)now_ns / 1e9;
+    double w = 2.0 * SIM_PI * SIM_MOTION_FREQ_HZ;
+    double angle = motion_angle();
+    double rate_dps = SIM_MOTION_AMPL_RAD * w * cos(w * t) * 180.0 / SIM_PI;
+    uint8_t accel_fsr = (*reg_ptr(IMU_ACCEL_CONFIG)  >> 1) & 0x03;
+    uint8_t gyro_fsr  = (*reg_ptr(IMU_GYRO_CONFIG_1) >> 1) & 0x03;
+    double lsb_per_g   = 16384.0 / (1 << accel_fsr);
+    double lsb_per_dps = 131.0 / (1 << gyro_fsr);
+    uint8_t *accel = reg_ptr(IMU_ACCEL_XOUT_H);
+    uint8_t *gyro  = reg_ptr(IMU_GYRO_XOUT_H);
+    uint8_t *temp  = reg_ptr(IMU_TEMP_OUT_H);
+
+    put_be16(&accel[0], noise());
+    put_be16(&accel[2], saturate(sin(angle) * lsb_per_g) + noise());
+    put_be16(&accel[4], saturate(cos(angle) * lsb_per_g) + noise());
+
+    put_be16(&gyro[0], saturate(rate_dps * lsb_per_dps) + noise());
+    put_be16(&gyro[2], noise());
+    put_be16(&gyro[4], noise());
+
+    put_be16(&temp[0], saturate((SIM_TEMPERATURE_C - 21.0) * 333.87) + noise());
+
+    if (dev->ak09916_mode != AK09916_MODE_POWER_DOWN) {
+        // the earth field seen from the rocking sensor, little endian like the real part
+        int16_t hx = saturate(SIM_EARTH_FIELD_X_UT / SIM_MAGN_UT_PER_LSB) + noise();
+        int16_t hy = saturate(SIM_EARTH_FIELD_Z_UT * sin(angle) / SIM_MAGN_UT_PER_LSB) + noise();
+        int16_t hz = saturate(SIM_EARTH_FIELD_Z_UT * cos(angle) / SIM_MAGN_UT_PER_LSB) + noise();
+        int i;
+
+        put_be16(&dev->ak09916_data[0], hx);
+        put_be16(&dev->ak09916_data[2], hy);
+        put_be16(&dev->ak09916_data[4], hz);
+        for (i = 0; i < 6; i += 2) {
+            uint8_t swap = dev->ak09916_data[i];
+            dev->ak09916_data[i] = dev->ak09916_data[i + 1];
+            dev->ak09916_data[i + 1] = swap;
+        }
+    }
+}
+
+
+/***********************************************************************/
+/*                                                                     */
+/* AK09916 and the auxiliary I2C master                                */
+/*                                                                     */
+/***********************************************************************/
+
+static uint8_t ak09916_read(uint8_t reg)
+{
+    if (reg == AK09916_WIA2)
+        return AK09916_EXPECTED_WIA2;
+    if ((reg >= AK09916_HXL) && (reg < AK09916_HXL + sizeof(dev->ak09916_data)))
+        return dev->ak09916_data[reg - AK09916_HXL];
+    if (reg == AK09916_CNTL2)
+        return dev->ak09916_mode;
+    return 0;
+}
+
+static void ak09916_write(uint8_t reg, uint8_t value)
+{
+    if (reg == AK09916_CNTL2)
+        dev->ak09916_mode = value & 0x1f;
+    else if ((reg == AK09916_CNTL3) && (value & AK09916_BIT_SRST))
+        dev->ak09916_mode = AK09916_MODE_POWER_DOWN;
+}
+
+static bool i2c_master_enabled(void)
+{
+    return (*reg_ptr(IMU_USER_CTRL) & IMU_BIT_I2C_MST_EN) != 0;
+}
+
+static uint8_t slave_len(uint8_t slave)
+{
+    uint8_t ctrl = *reg_ptr(IMU_I2C_SLV0_CTRL + 4 * slave);
+    return (ctrl & IMU_BIT_I2C_SLV_EN) ? (ctrl & 0x0f) : 0;
+}
+
+// Read SLV0..SLV3 into consecutive EXT_SLV_SENS_DATA registers, applying the
+// byte swap and grouping options of each slave.
+static void i2c_master_read_slaves(void)
+{
+    uint8_t *ext = reg_ptr(IMU_EXT_SLV_SENS_DATA_00);
+    uint8_t slave, i, len, addr, reg, ctrl;
+
+    for (slave = 0; slave < SIM_I2C_SLAVES; slave++) {
+        len = slave_len(slave);
+        if (len == 0)
+            continue;
+        addr = *reg_ptr(IMU_I2C_SLV0_ADDR + 4 * slave);
+        reg  = *reg_ptr(IMU_I2C_SLV0_REG  + 4 * slave);
+        ctrl = *reg_ptr(IMU_I2C_SLV0_CTRL + 4 * slave);
+        if (!(addr & IMU_BIT_I2C_SLV_READ) || ((addr & 0x7f) != AK09916_ADDR))
+            continue;
+
+        for (i = 0; i < len; i++) {
+            // a burst read from RSV2 continues at ST1, just below HXL
+            if ((reg == AK09916_RSV2) && (i > 0))
+                ext[i] = ak09916_read(AK09916_HXL - 2 + i);
+            else
+                ext[i] = ak09916_read(reg + i);
+        }
+
+        if (ctrl & IMU_BIT_I2C_SLV_BYTE_SW) {
+            for (i = 0; i + 1 < len; i++) {
+                // pairs end on an odd register, or on an even one with GRP set
+                bool pair_start = ((reg + i) & 1) == ((ctrl & IMU_BIT_I2C_SLV_GRP) ? 1 : 0);
+                if (pair_start) {
+                    uint8_t swap = ext[i];
+                    ext[i] = ext[i + 1];
+                    ext[i + 1] = swap;
+                    i++;
+                }
+            }
+        }
+        ext += len;
+    }
+}
+
+// A write to I2C_SLV4_CTRL with the enable bit set runs one transaction.
+static void i2c_master_slv4_transfer(void)
+{
+    uint8_t addr = *reg_ptr(IMU_I2C_SLV4_ADDR);
+    uint8_t reg  = *reg_ptr(IMU_I2C_SLV4_REG);
+    uint8_t status = IMU_BIT_I2C_SLV4_DONE;
+
+    *reg_ptr(IMU_I2C_SLV4_CTRL) &= ~IMU_BIT_I2C_SLV_EN;
+    if (!i2c_master_enabled())
+        return;
+
+    if ((addr & 0x7f) != AK09916_ADDR)
+        status |= IMU_BIT_I2C_SLV4_NACK;
+    else if (addr & IMU_BIT_I2C_SLV_READ)
+        *reg_ptr(IMU_I2C_SLV4_DI) = ak09916_read(reg);
+    else
+        ak09916_write(reg, *reg_ptr(IMU_I2C_SLV4_DO));
+
+    *reg_ptr(IMU_I2C_MST_STATUS) |= status;
+}
+
+
+/***********************************************************************/
+/*                                                                     */
+/* FIFO                                                                */
+/*                                                                     */
+/***********************************************************************/
+
+static uint16_t dmp_mem_be16(uint16_t addr)
+{
+    return (uint16_t)((dev->dmp_mem[addr] << 8) | dev->dmp_mem[addr + 1]);
+}
+
+static bool dmp_enabled(void)
+{
+    return (*reg_ptr(IMU_USER_CTRL) & IMU_BIT_DMP_EN) != 0;
+}
+
+static uint16_t dmp_packet_size(void)
+{
+    uint16_t output = dmp_mem_be16(DMP_DATA_OUT_CTL1);
+
+    if (output & DMP_HEADER_QUAT9)
+        return DMP_HEADER_BYTES + DMP_QUAT9_BYTES + DMP_FOOTER_BYTES;
+    if (output & DMP_HEADER_QUAT6)
+        return DMP_HEADER_BYTES + DMP_QUAT6_BYTES + DMP_FOOTER_BYTES;
+    return 0;
+}
+
+uint16_t icm20948_sim_frame_size(void)
+{
+    uint8_t fifo_en_2 = *reg_ptr(IMU_FIFO_EN_2);
+    uint16_t size = 0;
+
+    if (dmp_enabled())
+        return dmp_packet_size();
+
+    if (fifo_en_2 & IMU_BIT_ACCEL_FIFO_EN)
+        size += 6;
+    if (fifo_en_2 & IMU_BIT_GYRO_FIFO_EN)
+        size += 6;
+    if (fifo_en_2 & IMU_BIT_TEMP_FIFO_EN)
+        size += 2;
+    if (*reg_ptr(IMU_FIFO_EN_1) & IMU_BIT_SLV_0_FIFO_EN)
+        size += slave_len(0);
+    return size;
+}
+
+static void raise_int(void)
+{
+    dev->int_pending = true;
+    dev->int_time_ns = now_ns;
+    if (dev == &devices[0])
+        stats.interrupts++;
+}
+
+static void fifo_push(uint8_t value)
+{
+    if (dev->fifo_count == IMU_FIFO_SIZE) {
+        // stream mode: the oldest byte is overwritten
+        dev->fifo_head = (dev->fifo_head + 1) % IMU_FIFO_SIZE;
+        dev->fifo_count--;
+        stats.fifo_bytes_lost++;
+        // the status latches until it is read, INT pulses once per overflow
+        if (!(*reg_ptr(IMU_INT_STATUS_2) & IMU_BIT_FIFO_OVERFLOW_INT_0) &&
+            (*reg_ptr(IMU_INT_ENABLE_2) & IMU_BIT_FIFO_OVERFLOW_EN_0))
+            raise_int();
+        *reg_ptr(IMU_INT_STATUS_2) |= IMU_BIT_FIFO_OVERFLOW_INT_0;
+    }
+    dev->fifo[(dev->fifo_head + dev->fifo_count) % IMU_FIFO_SIZE] = value;
+    dev->fifo_count++;
+}
+
+static uint8_t fifo_pop(void)
+{
+    uint8_t value;
+
+    if (dev->fifo_count == 0)
+        return 0xff;
+    value = dev->fifo[dev->fifo_head];
+    dev->fifo_head = (dev->fifo_head + 1) % IMU_FIFO_SIZE;
+    dev->fifo_count--;
+    stats.fifo_bytes_read++;
+    return value;
+}
+
+static void fifo_push_block(uint16_t reg, uint16_t count)
+{
+    uint8_t *p = reg_ptr(reg);
+    while (count--)
+        fifo_push(*p++);
+}
+
+static void fifo_push_be(uint32_t value, uint8_t bytes)
+{
+    while (bytes--)
+        fifo_push((uint8_t)(value >> (8 * bytes)));
+}
+
+
+/***********************************************************************/
+/*                                                                     */
+/* DMP -- the firmware itself is not modelled.  Once enabled, the DMP  */
+/*        writes a quaternion packet for the selected output at the    */
+/*        configured ODR, holding the exact orientation of the rocking */
+/*        sensor.                                                      */
+/*                                                                     */
+/***********************************************************************/
+
+static uint8_t *dmp_mem_ptr(void)
+{
+    uint16_t addr = (*reg_ptr(IMU_MEM_BANK_SEL) << 8) | *reg_ptr(IMU_MEM_START_ADDR);
+    return &dev->dmp_mem[addr % SIM_DMP_MEM_SIZE];
+}
+
+static void dmp_mem_next(void)
+{
+    // the address increments within the selected bank
+    (*reg_ptr(IMU_MEM_START_ADDR))++;
+}
+
+static void dmp_produce(void)
+{
+    uint16_t output = dmp_mem_be16(DMP_DATA_OUT_CTL1);
+    uint16_t odr;
+    double half_angle = motion_angle() / 2.0;
+
+    if (output & DMP_HEADER_QUAT9) {
+        output = DMP_HEADER_QUAT9;
+        odr = dmp_mem_be16(DMP_ODR_QUAT9);
+    } else if (output & DMP_HEADER_QUAT6) {
+        output = DMP_HEADER_QUAT6;
+        odr = dmp_mem_be16(DMP_ODR_QUAT6);
+    } else {
+        return;
+    }
+    if (dev->dmp_samples++ % (odr + 1))
+        return;
+
+    fifo_push_be(output, DMP_HEADER_BYTES);
+    fifo_push_be((uint32_t)(int32_t)(sin(half_angle) * 1073741824.0), 4);
+    fifo_push_be(0, 4);
+    fifo_push_be(0, 4);
+    if (output == DMP_HEADER_QUAT9)
+        fifo_push_be(SIM_DMP_ACCURACY, 2);
+    fifo_push_be(dev->dmp_samples, DMP_FOOTER_BYTES);
+    stats.frames_produced++;
+
+    if (*reg_ptr(IMU_INT_ENABLE) & IMU_BIT_DMP_INT1_EN)
+        raise_int();
+}
+
+static void produce_sample(void)
+{
+    uint8_t fifo_en_2 = *reg_ptr(IMU_FIFO_EN_2);
+
+    update_data_registers();
+    if (i2c_master_enabled())
+        i2c_master_read_slaves();
+
+    if ((*reg_ptr(IMU_USER_CTRL) & IMU_BIT_FIFO_EN) && dmp_enabled()) {
+        dmp_produce();
+    } else if ((*reg_ptr(IMU_USER_CTRL) & IMU_BIT_FIFO_EN) && (icm20948_sim_frame_size() != 0)) {
+        // frames are written in register address order
+        if (fifo_en_2 & IMU_BIT_ACCEL_FIFO_EN)
+            fifo_push_block(IMU_ACCEL_XOUT_H, 6);
+        if (fifo_en_2 & IMU_BIT_GYRO_FIFO_EN)
+            fifo_push_block(IMU_GYRO_XOUT_H, 6);
+        if (fifo_en_2 & IMU_BIT_TEMP_FIFO_EN)
+            fifo_push_block(IMU_TEMP_OUT_H, 2);
+        if (*reg_ptr(IMU_FIFO_EN_1) & IMU_BIT_SLV_0_FIFO_EN)
+            fifo_push_block(IMU_EXT_SLV_SENS_DATA_00, slave_len(0));
+        stats.frames_produced++;
+    }
+
+    *reg_ptr(IMU_INT_STATUS_1) |= IMU_BIT_RAW_DATA_0_RDY_INT;
+    if (*reg_ptr(IMU_INT_ENABLE_1) & IMU_BIT_RAW_DATA_0_RDY_EN)
+        raise_int();
+}
+
+
+/***********************************************************************/
+/*                                                                     */
+/* Public interface                                                    */
+/*                                                                     */
+/***********************************************************************/
+
+void icm20948_sim_init(uint32_t bus_hz, icm20948_sim_bus_e bus_type, uint8_t count)
+{
+    uint8_t i;
+
+    memset(&stats, 0, sizeof(stats));
+    now_ns = 0;
+    bit_time_ns = 1000000000ULL / bus_hz;
+    bus = bus_type;
+    device_count = (count < 1) ? 1 : (count > INV_ICM20948_SENSORS_MAX) ? INV_ICM20948_SENSORS_MAX : count;
+    for (i = 0; i < device_count; i++) {
+        dev = &devices[i];
+        dev->next_sample_ns = 0;
+        sim_reset();
+    }
+    dev = &devices[0];
+}
+
+// The sensors are at IMU_ADDR and up, as set by their AD0 pins.  Nothing
+// answers at any other address.
+bool icm20948_sim_select(uint8_t addr)
+{
+    if ((addr < IMU_ADDR) || (addr >= IMU_ADDR + device_count))
+        return false;
+    dev = &devices[addr - IMU_ADDR];
+    return true;
+}
+
+// Every sensor samples on its own clock; each is run up to the end in turn,
+// which is the same thing as they do not see each other.
+void icm20948_sim_advance_ns(uint64_t ns)
+{
+    sim_device *selected = dev;
+    uint64_t start_ns = now_ns;
+    uint64_t end_ns = now_ns + ns;
+
+    for (dev = &devices[0]; dev < &devices[device_count]; dev++) {
+        now_ns = start_ns;
+        while (sensor_awake() && (dev->next_sample_ns <= end_ns)) {
+            if (dev->next_sample_ns > now_ns)
+                now_ns = dev->next_sample_ns;
+            produce_sample();
+            dev->next_sample_ns = now_ns + sample_period_ns();
+        }
+        now_ns = end_ns;
+        if (!sensor_awake() || (dev->next_sample_ns < now_ns))
+            dev->next_sample_ns = now_ns + sample_period_ns();
+    }
+    dev = selected;
+}
+
+uint64_t icm20948_sim_time_ns(void)
+{
+    return now_ns;
+}
+
+// The next sample of any of the sensors.
+uint64_t icm20948_sim_next_sample_ns(void)
+{
+    uint64_t next_ns = devices[0].next_sample_ns;
+    uint8_t i;
+
+    for (i = 1; i < device_count; i++)
+        if (devices[i].next_sample_ns < next_ns)
+            next_ns = devices[i].next_sample_ns;
+    return next_ns;
+}
+
+// Only the INT pin of the sensor at IMU_ADDR is wired to the MCU.
+uint64_t icm20948_sim_int_time_ns(void)
+{
+    return devices[0].int_time_ns;
+}
+
+icm20948_sim_bus_e icm20948_sim_bus(void)
+{
+    return bus;
+}
+
+bool icm20948_sim_int_pending(void)
+{
+    bool pending = devices[0].int_pending;
+    devices[0].int_pending = false;
+    return pending;
+}
+
+void icm20948_sim_bus_transaction(uint32_t bytes)
+{
+    uint64_t ns;
+
+    if (bus == SIM_BUS_SPI)
+        ns = (SIM_SPI_CS_BITS + (uint64_t)bytes * SIM_SPI_BITS_PER_BYTE) * bit_time_ns;
+    else
+        ns = (SIM_I2C_START_STOP_BITS + (uint64_t)bytes * SIM_I2C_BITS_PER_BYTE) * bit_time_ns;
+
+    stats.transactions++;
+    stats.bus_bytes += bytes;
+    stats.bus_time_ns += ns;
+    icm20948_sim_advance_ns(ns);
+}
+
+uint8_t icm20948_sim_read(uint8_t reg)
+{
+    uint8_t value;
+
+    if (reg == IMU_REG_BANK_SEL)
+        return dev->bank_sel;
+    if (reg >= SIM_BANK_SIZE)
+        return 0;
+
+    if (current_bank() == 0) {
+        switch (reg) {
+        case REG(IMU_FIFO_R_W):
+            return fifo_pop();
+        case REG(IMU_MEM_R_W):
+            value = *dmp_mem_ptr();
+            dmp_mem_next();
+            return value;
+        case REG(IMU_FIFO_COUNTH):
+            return (uint8_t)(dev->fifo_count >> 8);
+        case REG(IMU_FIFO_COUNTL):
+            return (uint8_t)(dev->fifo_count & 0xff);
+        case REG(IMU_INT_STATUS_1):
+        case REG(IMU_INT_STATUS_2):
+        case REG(IMU_I2C_MST_STATUS):
+            // cleared on read
+            value = dev->regs[0][reg];
+            dev->regs[0][reg] = 0;
+            return value;
+        default:
+            break;
+        }
+    }
+
+    return dev->regs[current_bank()][reg];
+}
+
+void icm20948_sim_write(uint8_t reg, uint8_t value)
+{
+    if (reg == IMU_REG_BANK_SEL) {
+        dev->bank_sel = value & 0x30;
+        return;
+    }
+    if (reg >= SIM_BANK_SIZE)
+        return;
+
+    if (current_bank() == 0) {
+        switch (reg) {
+        case REG(IMU_PWR_MGMT_1):
+            if (value & IMU_BIT_DEVICE_RESET) {
+                // the reset bit clears itself once the reset has completed
+                sim_reset();
+                return;
+            }
+            if ((dev->regs[0][reg] & IMU_BIT_SLEEP) && !(value & IMU_BIT_SLEEP))
+                dev->next_sample_ns = now_ns + sample_period_ns();
+            break;
+        case REG(IMU_FIFO_RST):
+            if (value & 0x1f) {
+                stats.fifo_bytes_lost += dev->fifo_count;
+                dev->fifo_head = 0;
+                dev->fifo_count = 0;
+            }
+            break;
+        case REG(IMU_USER_CTRL):
+            if (value & IMU_BIT_DMP_RST)
+                dev->dmp_samples = 0;
+            // the reset bits clear themselves
+            value &= ~(IMU_BIT_DMP_RST | IMU_BIT_SRAM_RST | IMU_BIT_I2C_MST_RST);
+            break;
+        case REG(IMU_MEM_R_W):
+            *dmp_mem_ptr() = value;
+            dmp_mem_next();
+            return;
+        case REG(IMU_FIFO_R_W):
+        case REG(IMU_WHO_AM_I):
+            return;
+        default:
+            break;
+        }
+    }
+
+    dev->regs[current_bank()][reg] = value;
+
+    if ((current_bank() == 3) && (reg == REG(IMU_I2C_SLV4_CTRL)) && (value & IMU_BIT_I2C_SLV_EN))
+        i2c_master_slv4_transfer();
+}
+
+// Burst accesses auto-increment the register address, except for the
+// FIFO_R_W and MEM_R_W data ports.
+static bool auto_increment(uint8_t reg)
+{
+    return !((current_bank() == 0) && ((reg == REG(IMU_FIFO_R_W)) || (reg == REG(IMU_MEM_R_W))));
+}
+
+void icm20948_sim_read_block(uint8_t reg, uint8_t *block, uint32_t count)
+{
+    bool increment = auto_increment(reg);
+    while (count--) {
+        *block++ = icm20948_sim_read(reg);
+        if (increment)
+            reg++;
+    }
+}
+
+void icm20948_sim_write_block(uint8_t reg, const uint8_t *block, uint32_t count)
+{
+    bool increment = auto_increment(reg);
+    while (count--) {
+        icm20948_sim_write(reg, *block++);
+        if (increment)
+            reg++;
+    }
+}
+
+icm20948_sim_stats *icm20948_sim_get_stats(void)
+{
+    return &stats;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* ICM-20948 register level simulator                                  */
+/*                                                                     */
+/***********************************************************************/
+
+#ifndef ICM20948_SIM_H__
+#define ICM20948_SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bus and data flow counters collected while the driver runs against the simulator.
+typedef struct _icm20948_sim_stats {
+        uint32_t transactions;          // bus transactions (one per START ... STOP or nCS assertion)
+        uint32_t bus_bytes;             // bytes on the wire, including address and register bytes
+        uint64_t bus_time_ns;           // time the bus was busy
+        uint32_t frames_produced;       // frames written into the FIFO by the sensor
+        uint32_t fifo_bytes_read;       // bytes popped from FIFO_R_W
+        uint32_t fifo_bytes_lost;       // bytes overwritten on overflow or discarded by FIFO_RST
+        uint32_t interrupts;            // INT pin assertions of the sensor at IMU_ADDR
+} icm20948_sim_stats;
+
+// How the driver reaches the sensor, only the framing on the wire differs.
+typedef enum {
+        SIM_BUS_I2C,
+        SIM_BUS_SPI
+} icm20948_sim_bus_e;
+
+void     icm20948_sim_init(uint32_t bus_hz, icm20948_sim_bus_e bus_type, uint8_t count);
+bool     icm20948_sim_select(uint8_t addr);
+void     icm20948_sim_advance_ns(uint64_t ns);
+uint64_t icm20948_sim_time_ns(void);
+uint64_t icm20948_sim_next_sample_ns(void);
+uint64_t icm20948_sim_int_time_ns(void);
+icm20948_sim_bus_e icm20948_sim_bus(void);
+bool     icm20948_sim_int_pending(void);
+uint16_t icm20948_sim_frame_size(void);
+
+void     icm20948_sim_bus_transaction(uint32_t bytes);
+uint8_t  icm20948_sim_read(uint8_t reg);
+void     icm20948_sim_write(uint8_t reg, uint8_t value);
+void     icm20948_sim_read_block(uint8_t reg, uint8_t *block, uint32_t count);
+void     icm20948_sim_write_block(uint8_t reg, const uint8_t *block, uint32_t count);
+
+icm20948_sim_stats *icm20948_sim_get_stats(void);
+
+// hal_sim.c
+bool     hal_sim_capture_pulse(void);
+void     hal_sim_fail_every(uint32_t n);
+void     hal_sim_late_every(uint32_t n);
+
+#endif // ICM20948_SIM_H__
@@ -0,0 +1,40 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host build stand-in for the nRF5 SDK logger.  Log output goes to stdout
+// when SIM_VERBOSE is defined and is discarded otherwise.
+
+#ifndef NRF_LOG_H__
+#define NRF_LOG_H__
+
+#include <stdio.h>
+
+#ifdef SIM_VERBOSE
+#define NRF_LOG_PRINT(level, ...)   do { printf("<%s> app: ", level); printf(__VA_ARGS__); printf("\n"); } while (0)
+#else
+#define NRF_LOG_PRINT(level, ...)   do { } while (0)
+#endif
+
+#define NRF_LOG_ERROR(...)          NRF_LOG_PRINT("error", __VA_ARGS__)
+#define NRF_LOG_WARNING(...)        NRF_LOG_PRINT("warning", __VA_ARGS__)
+#define NRF_LOG_INFO(...)           NRF_LOG_PRINT("info", __VA_ARGS__)
+#define NRF_LOG_DEBUG(...)          NRF_LOG_PRINT("debug", __VA_ARGS__)
+
+#endif // NRF_LOG_H__
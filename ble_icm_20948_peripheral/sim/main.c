@@ -0,0 +1,622 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Simulator harness -- runs the unmodified imu.c driver against the   */
+/*        ICM-20948 simulator and reports bus transactions, bytes      */
+/*        moved and delivered/lost frames per second of simulated time */
+/*                                                                     */
+/***********************************************************************/
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "imu.h"
+#include "imu_wire.h"
+#include "hal.h"
+#include "trace.h"
+#include "icm20948_sim.h"
+
+#define SIM_BATCH_SIZE          64      // frames drained per call in batch mode
+#define SIM_DMP_IMAGE_SIZE      14301   // size of the InvenSense DMP3 image
+#define SIM_WIRE_PACKET_LEN     244     // notification payload with a 247 byte ATT MTU
+
+typedef enum _sim_read_mode_e {
+        SIM_READ_SINGLE,                // inv_icm20948_read_imu_fifo() per wakeup
+        SIM_READ_BATCH,                 // inv_icm20948_read_imu_fifo_batch() until empty
+        SIM_READ_ASYNC,                 // the same through the non-blocking drain
+        SIM_READ_CAPTURE                // one frame read per INT pulse, decoded per half
+} sim_read_mode_e;
+
+// the sensor at IMU_ADDR has its INT pin wired to the MCU, the one at
+// IMU_ADDR_AD0 is read along with it by the drain scheduler
+static inv_icm20948_chip_config configs[INV_ICM20948_SENSORS_MAX];
+static inv_icm20948_state sensors[INV_ICM20948_SENSORS_MAX];
+static inv_icm20948_state *st = &sensors[0];
+static uint8_t sensor_count = 1;
+static inv_icm20948_sched sched;
+
+static IMU_QUAT last_quat;
+
+// deviation of the frame timestamps from a regular grid at the FIFO rate,
+// per sensor
+static uint32_t last_time_stamp[INV_ICM20948_SENSORS_MAX];
+static uint32_t time_stamps[INV_ICM20948_SENSORS_MAX];
+static double   max_jitter_us[INV_ICM20948_SENSORS_MAX];
+
+// bus trace records go here for trace_decode, if -T was given
+static FILE *trace_file;
+
+// drained samples go here for wire_bench, if -R was given
+static FILE *record_file;
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-m single|batch|async|capture] [-d 6|9] [-p full|accel|lp] [-n watermark] [-r rate_hz] [-s] [-b bus_hz] [-t seconds] [-w wake_us] [-L max_lost] [-T trace_file] [-R sample_file] [-e n] [-l n] [-i sensors]\n", name);
+    printf("  -m  FIFO read strategy (default batch)\n");
+    printf("  -d  upload a dummy DMP image and stream 6 or 9-axis quaternions\n");
+    printf("  -p  power profile: everything on, accel only, or duty cycled accel (default full)\n");
+    printf("  -n  frames per wake-up, counted like the nRF's INT pulse counter (default 1)\n");
+    printf("  -r  requested sample rate in Hz (default %d)\n", INV_ICM20948_INIT_SAMPLE_RATE);
+    printf("  -s  talk to the sensor over SPI instead of I2C\n");
+    printf("  -b  bus clock in Hz (default 250000 for I2C, 4000000 for SPI)\n");
+    printf("  -t  simulated run time in seconds (default 10)\n");
+    printf("  -w  service the FIFO every wake_us instead of on each interrupt\n");
+    printf("  -L  exit with an error if more than max_lost frames are lost\n");
+    printf("  -T  write the bus trace to trace_file, see trace_decode\n");
+    printf("  -R  write the samples to sample_file as the central prints them, see wire_bench\n");
+    printf("  -e  fail every n'th bus transfer once the sensor is set up\n");
+    printf("  -l  make every n'th capture re-arm late, with -m capture\n");
+    printf("  -i  sensors on the bus, up to %d, I2C in batch and async modes only (default 1)\n", INV_ICM20948_SENSORS_MAX);
+}
+
+// Empty the trace ring the way the firmware's main loop does.
+static void save_trace(void)
+{
+    trace_record_t records[64];
+    uint32_t count;
+
+    while ((count = trace_peek(records, 64)) > 0) {
+        if (trace_file != NULL)
+            fwrite(records, sizeof(records[0]), count, trace_file);
+        trace_consume(count);
+    }
+}
+
+static void check_time_stamp(uint16_t sensor, uint32_t time_stamp)
+{
+    double period_us = 1e9 / st->chip_config->fifo_rate_mhz;
+    double step_us, jitter_us;
+
+    if (sensor >= sensor_count) {
+        printf("frame of sensor %u, there are %u\n", sensor, sensor_count);
+        exit(1);
+    }
+
+    // frames dropped by a FIFO reset leave a gap of whole periods
+    if (time_stamps[sensor]++ > 0) {
+        step_us = (double)(uint32_t)(time_stamp - last_time_stamp[sensor]);
+        jitter_us = fabs(step_us - period_us * floor(step_us / period_us + 0.5));
+        if (jitter_us > max_jitter_us[sensor])
+            max_jitter_us[sensor] = jitter_us;
+    }
+    last_time_stamp[sensor] = time_stamp;
+}
+
+static IMU_DATA imu_data[INV_ICM20948_SENSORS_MAX][SIM_BATCH_SIZE];
+static IMU_QUAT imu_quat[INV_ICM20948_SENSORS_MAX][SIM_BATCH_SIZE];
+static int16_t  async_count;
+
+static void async_handler(inv_icm20948_state *p_st, int16_t count)
+{
+    (void)p_st;
+    async_count = count;
+}
+
+// The simulated bus completes transfers on the spot, so the drain has
+// finished by the time the call returns.
+static int16_t read_fifo_async(inv_icm20948_state *p_st)
+{
+    int16_t result;
+
+    async_count = -1;
+    if (p_st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF)
+        result = inv_icm20948_read_dmp_fifo_batch_async(p_st, imu_quat[p_st->index], SIM_BATCH_SIZE, async_handler);
+    else
+        result = inv_icm20948_read_imu_fifo_batch_async(p_st, imu_data[p_st->index], SIM_BATCH_SIZE, async_handler);
+    if (result || p_st->fifo_read.busy)
+        return -1;
+    return async_count;
+}
+
+// what the frames cost on air in the imu_wire format
+static uint32_t wire_packets;
+static uint32_t wire_samples;
+static uint32_t wire_bytes;
+
+// the channels the peripheral puts on air for a configuration
+static uint8_t wire_channels(const inv_icm20948_chip_config *config)
+{
+    if (config->dmp_mode != INV_ICM20948_DMP_OFF)
+        return IMU_WIRE_QUAT | ((config->dmp_mode == INV_ICM20948_DMP_RV) ? IMU_WIRE_ACCURACY : 0);
+    return (config->accl_fifo_enable ? IMU_WIRE_ACCEL : 0) | (config->gyro_fifo_enable ? IMU_WIRE_GYRO : 0)
+         | (config->magn_fifo_enable ? IMU_WIRE_MAGN : 0) | (config->temp_fifo_enable ? IMU_WIRE_TEMP : 0);
+}
+
+static int wire_data_equal(const IMU_DATA *a, const IMU_DATA *b, uint8_t channels)
+{
+    if ((a->time_stamp != b->time_stamp) || (a->sensor != b->sensor))
+        return 0;
+    if ((channels & IMU_WIRE_ACCEL) && ((a->ax != b->ax) || (a->ay != b->ay) || (a->az != b->az)))
+        return 0;
+    if ((channels & IMU_WIRE_GYRO) && ((a->gx != b->gx) || (a->gy != b->gy) || (a->gz != b->gz)))
+        return 0;
+    if ((channels & IMU_WIRE_MAGN) && ((a->mx != b->mx) || (a->my != b->my) || (a->mz != b->mz)))
+        return 0;
+    if ((channels & IMU_WIRE_TEMP) && (a->temperature != b->temperature))
+        return 0;
+    return 1;
+}
+
+static int wire_quat_equal(const IMU_QUAT *a, const IMU_QUAT *b, uint8_t channels)
+{
+    if ((a->time_stamp != b->time_stamp) || (a->sensor != b->sensor))
+        return 0;
+    if ((a->q0 != b->q0) || (a->q1 != b->q1) || (a->q2 != b->q2) || (a->q3 != b->q3))
+        return 0;
+    if ((channels & IMU_WIRE_ACCURACY) && (a->accuracy != b->accuracy))
+        return 0;
+    return 1;
+}
+
+// one line per sample, the way the central prints them
+static void record_data(const IMU_DATA *d, uint8_t channels)
+{
+    fprintf(record_file, "%u %u", d->sensor, d->time_stamp);
+    if (channels & IMU_WIRE_ACCEL)
+        fprintf(record_file, " a %d %d %d", d->ax, d->ay, d->az);
+    if (channels & IMU_WIRE_GYRO)
+        fprintf(record_file, " g %d %d %d", d->gx, d->gy, d->gz);
+    if (channels & IMU_WIRE_MAGN)
+        fprintf(record_file, " m %d %d %d", d->mx, d->my, d->mz);
+    if (channels & IMU_WIRE_TEMP)
+        fprintf(record_file, " t %d", d->temperature);
+    fprintf(record_file, "\n");
+}
+
+static void record_quat(const IMU_QUAT *q, uint8_t channels)
+{
+    fprintf(record_file, "%u %u q %d %d %d %d", q->sensor, q->time_stamp, q->q0, q->q1, q->q2, q->q3);
+    if (channels & IMU_WIRE_ACCURACY)
+        fprintf(record_file, " acc %d", q->accuracy);
+    fprintf(record_file, "\n");
+}
+
+// Encode the frames the way the peripheral sends them and decode them the
+// way the central does; they have to come back unchanged.
+static void check_wire(uint8_t sensor, int16_t count)
+{
+    const inv_icm20948_chip_config *config = sensors[sensor].chip_config;
+    uint8_t channels = wire_channels(config);
+    uint32_t period_us = (uint32_t)(1e9 / config->fifo_rate_mhz + 0.5);
+    static IMU_DATA data[SIM_BATCH_SIZE];
+    static IMU_QUAT quat[SIM_BATCH_SIZE];
+    uint8_t packet[SIM_WIRE_PACKET_LEN];
+    uint16_t len, used;
+    int16_t done = 0;
+    int decoded, i;
+
+    while (done < count) {
+        if (channels & IMU_WIRE_QUAT) {
+            len = imu_wire_encode_quat(packet, sizeof(packet), channels, period_us,
+                                       &imu_quat[sensor][done], count - done, &used);
+            decoded = imu_wire_decode_quat(packet, len, quat, SIM_BATCH_SIZE);
+        } else {
+            len = imu_wire_encode_data(packet, sizeof(packet), channels, period_us,
+                                       &imu_data[sensor][done], count - done, &used);
+            decoded = imu_wire_decode_data(packet, len, data, SIM_BATCH_SIZE);
+        }
+        if ((len == 0) || (decoded != used)) {
+            printf("wire format: %u of %d frames encoded in %u bytes, %d decoded\n", used, count - done, len, decoded);
+            exit(1);
+        }
+        for (i = 0; i < decoded; i++) {
+            if ((channels & IMU_WIRE_QUAT) ? !wire_quat_equal(&quat[i], &imu_quat[sensor][done + i], channels)
+                                           : !wire_data_equal(&data[i], &imu_data[sensor][done + i], channels)) {
+                printf("wire format: frame %d of sensor %u does not decode to what was sent\n", done + i, sensor);
+                exit(1);
+            }
+        }
+        if (record_file != NULL) {
+            for (i = 0; i < decoded; i++) {
+                if (channels & IMU_WIRE_QUAT)
+                    record_quat(&quat[i], channels);
+                else
+                    record_data(&data[i], channels);
+            }
+        }
+        wire_packets++;
+        wire_samples += used;
+        wire_bytes += len;
+        done += used;
+    }
+}
+
+static void check_frames(uint8_t sensor, int16_t count)
+{
+    int16_t i;
+
+    check_wire(sensor, count);
+
+    if (st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF) {
+        for (i = 0; i < count; i++)
+            check_time_stamp(imu_quat[sensor][i].sensor, imu_quat[sensor][i].time_stamp);
+        if ((count > 0) && (sensor == 0))
+            last_quat = imu_quat[sensor][count - 1];
+    } else {
+        for (i = 0; i < count; i++)
+            check_time_stamp(imu_data[sensor][i].sensor, imu_data[sensor][i].time_stamp);
+    }
+}
+
+static void sched_handler(inv_icm20948_sched *p_sched)
+{
+    (void)p_sched;
+}
+
+// All sensors in one round of the drain scheduler, again while any of
+// them had more frames than fit.
+static void service_sched(void)
+{
+    uint8_t i;
+    bool more;
+
+    do {
+        if (inv_icm20948_sched_start(&sched) || sched.busy)
+            return;
+        more = false;
+        for (i = 0; i < sensor_count; i++) {
+            check_frames(i, sched.count[i]);
+            if (sched.count[i] == SIM_BATCH_SIZE)
+                more = true;
+        }
+    } while (more);
+}
+
+static void service_fifo(sim_read_mode_e mode)
+{
+    int16_t count;
+    uint8_t i;
+
+    if ((sensor_count > 1) && (mode == SIM_READ_ASYNC)) {
+        service_sched();
+    } else if (mode == SIM_READ_CAPTURE) {
+        count = inv_icm20948_capture_read(st, imu_data[0]);
+        check_frames(0, count);
+    } else if ((mode == SIM_READ_SINGLE) && (st->chip_config->dmp_mode == INV_ICM20948_DMP_OFF)) {
+        // single reads discard the rest of the FIFO, there is no grid to check
+        inv_icm20948_read_imu_fifo(st, &imu_data[0][0]);
+    } else {
+        for (i = 0; i < sensor_count; i++) {
+            do {
+                if (mode == SIM_READ_ASYNC)
+                    count = read_fifo_async(&sensors[i]);
+                else if (st->chip_config->dmp_mode != INV_ICM20948_DMP_OFF)
+                    count = inv_icm20948_read_dmp_fifo_batch(&sensors[i], imu_quat[i], SIM_BATCH_SIZE);
+                else
+                    count = inv_icm20948_read_imu_fifo_batch(&sensors[i], imu_data[i], SIM_BATCH_SIZE);
+                check_frames(i, count);
+            } while (count == SIM_BATCH_SIZE);
+        }
+    }
+}
+
+// The real image is InvenSense's and is not distributed, the simulator does
+// not execute it anyway; any content exercises the upload and verify path.
+static int load_dummy_dmp(inv_icm20948_state *p_st, inv_icm20948_dmp_mode_e dmp_mode)
+{
+    static uint8_t image[SIM_DMP_IMAGE_SIZE];
+    uint32_t i, seed = 12345;
+
+    for (i = 0; i < sizeof(image); i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = (uint8_t)(seed >> 16);
+    }
+    if (inv_icm20948_load_dmp(p_st, image, sizeof(image)))
+        return -1;
+    return inv_icm20948_enable_dmp(p_st, dmp_mode);
+}
+
+static void print_row(const char *label, double seconds, icm20948_sim_stats *now, icm20948_sim_stats *last, uint16_t frame_size)
+{
+    double bus_util = 100.0 * (double)(now->bus_time_ns - last->bus_time_ns) / (seconds * 1e9);
+
+    printf("%8s %8.0f %8.0f %6.1f%% %8.0f %8.0f %8.0f\n",
+           label,
+           (now->transactions - last->transactions) / seconds,
+           (now->bus_bytes - last->bus_bytes) / seconds,
+           bus_util,
+           (now->frames_produced - last->frames_produced) / seconds,
+           (double)((now->fifo_bytes_read - last->fifo_bytes_read) / frame_size) / seconds,
+           (double)((now->fifo_bytes_lost - last->fifo_bytes_lost) / frame_size) / seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    sim_read_mode_e mode = SIM_READ_BATCH;
+    inv_icm20948_dmp_mode_e dmp_mode = INV_ICM20948_DMP_OFF;
+    inv_icm20948_power_profile_e profile = INV_ICM20948_POWER_FULL;
+    static const char *profile_names[] = { "full", "accel", "lp" };
+    uint32_t rate = INV_ICM20948_INIT_SAMPLE_RATE;
+    icm20948_sim_bus_e bus = SIM_BUS_I2C;
+    uint32_t bus_hz = 0;
+    uint32_t seconds = 10;
+    uint32_t wake_us = 0;
+    long max_lost = -1;
+    uint16_t watermark = 1;
+    uint32_t fail_every = 0;
+    uint32_t late_every = 0;
+    inv_icm20948_i2c_errors errors;
+    uint32_t counted, wakeups = 0;
+    icm20948_sim_stats first, last, *stats;
+    uint64_t start_ns, end_ns, report_ns, wake_ns;
+    uint16_t frame_size;
+    uint32_t lost;
+    uint8_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:d:p:n:r:sb:t:w:L:T:R:e:l:i:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "single") == 0)
+                mode = SIM_READ_SINGLE;
+            else if (strcmp(optarg, "batch") == 0)
+                mode = SIM_READ_BATCH;
+            else if (strcmp(optarg, "async") == 0)
+                mode = SIM_READ_ASYNC;
+            else if (strcmp(optarg, "capture") == 0)
+                mode = SIM_READ_CAPTURE;
+            else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'd':
+            if (strcmp(optarg, "6") == 0)
+                dmp_mode = INV_ICM20948_DMP_GAME_RV;
+            else if (strcmp(optarg, "9") == 0)
+                dmp_mode = INV_ICM20948_DMP_RV;
+            else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "full") == 0)
+                profile = INV_ICM20948_POWER_FULL;
+            else if (strcmp(optarg, "accel") == 0)
+                profile = INV_ICM20948_POWER_ACCEL_ONLY;
+            else if (strcmp(optarg, "lp") == 0)
+                profile = INV_ICM20948_POWER_ACCEL_LP;
+            else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'n': watermark = strtoul(optarg, NULL, 0); break;
+        case 'r': rate = strtoul(optarg, NULL, 0); break;
+        case 's': bus = SIM_BUS_SPI; break;
+        case 'b': bus_hz = strtoul(optarg, NULL, 0); break;
+        case 't': seconds = strtoul(optarg, NULL, 0); break;
+        case 'w': wake_us = strtoul(optarg, NULL, 0); break;
+        case 'L': max_lost = strtol(optarg, NULL, 0); break;
+        case 'e': fail_every = strtoul(optarg, NULL, 0); break;
+        case 'l': late_every = strtoul(optarg, NULL, 0); break;
+        case 'i': sensor_count = strtoul(optarg, NULL, 0); break;
+        case 'T':
+            trace_file = fopen(optarg, "wb");
+            if (trace_file == NULL) {
+                perror(optarg);
+                return 2;
+            }
+            break;
+        case 'R':
+            record_file = fopen(optarg, "w");
+            if (record_file == NULL) {
+                perror(optarg);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (bus_hz == 0)
+        bus_hz = (bus == SIM_BUS_SPI) ? 4000000 : 250000;
+    if ((rate == 0) || (seconds == 0) || ((mode == SIM_READ_CAPTURE) && wake_us) ||
+        (sensor_count < 1) || (sensor_count > INV_ICM20948_SENSORS_MAX) ||
+        ((sensor_count > 1) && (((mode != SIM_READ_BATCH) && (mode != SIM_READ_ASYNC)) || (bus == SIM_BUS_SPI)))) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    icm20948_sim_init(bus_hz, bus, sensor_count);
+
+    inv_icm20948_sched_init(&sched, SIM_BATCH_SIZE, sched_handler);
+    for (i = 0; i < sensor_count; i++) {
+        inv_icm20948_init_state(&sensors[i], &configs[i], IMU_ADDR + i, i, i == 0);
+        configs[i].sample_rate = rate;
+        if (inv_check_and_setup_chip(&sensors[i])) {
+            printf("inv_check_and_setup_chip() failed on sensor %u\n", i);
+            return 1;
+        }
+
+        if ((profile != INV_ICM20948_POWER_FULL) && inv_icm20948_set_power_profile(&sensors[i], profile, INV_ICM20948_ACCEL_AVG_4)) {
+            printf("inv_icm20948_set_power_profile() failed\n");
+            return 1;
+        }
+
+        if ((dmp_mode != INV_ICM20948_DMP_OFF) && load_dummy_dmp(&sensors[i], dmp_mode)) {
+            printf("DMP upload failed\n");
+            return 1;
+        }
+        // only the first sensor's INT pulses are counted, the rest are
+        // read along with it
+        inv_icm20948_set_fifo_watermark(&sensors[i], watermark);
+        if (inv_icm20948_sched_add(&sched, &sensors[i], (dmp_mode != INV_ICM20948_DMP_OFF) ?
+                                   (void *)imu_quat[i] : (void *)imu_data[i])) {
+            printf("inv_icm20948_sched_add() failed\n");
+            return 1;
+        }
+    }
+    if (dmp_mode != INV_ICM20948_DMP_OFF)
+        printf("DMP upload and setup: %u transactions, %u bytes\n",
+               icm20948_sim_get_stats()->transactions, icm20948_sim_get_stats()->bus_bytes);
+
+    watermark = inv_icm20948_get_fifo_watermark(st);
+    icm20948_sim_select(IMU_ADDR);
+    frame_size = icm20948_sim_frame_size();
+    if (frame_size == 0) {
+        printf("FIFO is not enabled\n");
+        return 1;
+    }
+    if ((mode == SIM_READ_CAPTURE) && inv_icm20948_capture_start(st, watermark)) {
+        printf("inv_icm20948_capture_start() failed\n");
+        return 1;
+    }
+
+    printf("mode %s, power %s, requested rate %u Hz, %s bus %u Hz, %u byte frames\n",
+           (dmp_mode == INV_ICM20948_DMP_GAME_RV) ? "dmp 6-axis" :
+           (dmp_mode == INV_ICM20948_DMP_RV) ? "dmp 9-axis" :
+           (mode == SIM_READ_SINGLE) ? "single" : (mode == SIM_READ_ASYNC) ? "async" :
+           (mode == SIM_READ_CAPTURE) ? "capture" : "batch", profile_names[profile], rate, (bus == SIM_BUS_SPI) ? "spi" : "i2c", bus_hz, frame_size);
+    if (sensor_count > 1)
+        printf("%u sensors, drained %s\n", sensor_count, (mode == SIM_READ_ASYNC) ? "by the scheduler" : "in turn");
+    printf("achieved rate gyro %.3f Hz, accel %.3f Hz, %u frames per wake-up\n",
+           st->chip_config->gyro_rate_mhz / 1000.0, st->chip_config->accel_rate_mhz / 1000.0, watermark);
+    printf("reset to configured in %u us, last configuration sequence took %u us on the bus\n",
+           st->bringup.time_us, st->config_apply_us);
+    printf("%8s %8s %8s %7s %8s %8s %8s\n",
+           "second", "xfers/s", "bytes/s", "bus", "frames/s", "read/s", "lost/s");
+
+    hal_sim_fail_every(fail_every);
+    hal_sim_late_every(late_every);
+
+    // discard anything produced during bring-up
+    stats = icm20948_sim_get_stats();
+    first = *stats;
+    last = first;
+    counted = first.interrupts;
+    start_ns = icm20948_sim_time_ns();
+    end_ns = start_ns + (uint64_t)seconds * 1000000000ULL;
+    report_ns = start_ns + 1000000000ULL;
+    wake_ns = start_ns + (uint64_t)wake_us * 1000;
+
+    while (icm20948_sim_time_ns() < end_ns) {
+        if (wake_us) {
+            if (wake_ns > icm20948_sim_time_ns())
+                icm20948_sim_advance_ns(wake_ns - icm20948_sim_time_ns());
+            wake_ns += (uint64_t)wake_us * 1000;
+            icm20948_sim_int_pending();
+            service_fifo(mode);
+            wakeups++;
+        } else {
+            if (icm20948_sim_next_sample_ns() >= icm20948_sim_time_ns())
+                icm20948_sim_advance_ns(icm20948_sim_next_sample_ns() - icm20948_sim_time_ns() + 1);
+            // INT pulses are counted in hardware even while the MCU is busy
+            // reading, it only wakes up once watermark of them have arrived
+            icm20948_sim_int_pending();
+            if (mode == SIM_READ_CAPTURE) {
+                // every pulse starts a read in hardware, the MCU only wakes
+                // up once a half of the capture buffer is full
+                while (counted != stats->interrupts) {
+                    counted++;
+                    if (hal_sim_capture_pulse()) {
+                        inv_icm20948_capture_next(st);
+                        service_fifo(mode);
+                        wakeups++;
+                    }
+                }
+            } else if ((stats->interrupts - counted) >= watermark) {
+                counted += watermark;
+                service_fifo(mode);
+                wakeups++;
+            }
+        }
+
+        save_trace();
+
+        while ((icm20948_sim_time_ns() >= report_ns) && (report_ns <= end_ns)) {
+            char label[16];
+            snprintf(label, sizeof(label), "%llu", (unsigned long long)((report_ns - start_ns) / 1000000000ULL));
+            print_row(label, 1.0, stats, &last, frame_size);
+            last = *stats;
+            report_ns += 1000000000ULL;
+        }
+    }
+
+    // totals are measured from the start of the run, not from bring-up
+    print_row("total", (double)(icm20948_sim_time_ns() - start_ns) / 1e9, stats, &first, frame_size);
+
+    if (dmp_mode != INV_ICM20948_DMP_OFF)
+        printf("last quaternion w %.4f x %.4f y %.4f z %.4f, accuracy %d\n",
+               last_quat.q0 / 1073741824.0, last_quat.q1 / 1073741824.0,
+               last_quat.q2 / 1073741824.0, last_quat.q3 / 1073741824.0, last_quat.accuracy);
+
+    if (wire_samples > 0)
+        printf("wire format: %u frames in %u packets, %.1f bytes per frame against a %u byte record\n",
+               wire_samples, wire_packets, (double)wire_bytes / wire_samples,
+               (unsigned)((dmp_mode != INV_ICM20948_DMP_OFF) ? sizeof(IMU_QUAT) : sizeof(IMU_DATA)));
+
+    printf("%u wake-ups\n", wakeups);
+    if (mode == SIM_READ_CAPTURE)
+        printf("%u capture overruns, %u late re-arms\n", st->capture.overruns, st->capture.late_rearms);
+    for (i = 0; i < sensor_count; i++) {
+        if (sensor_count > 1)
+            printf("sensor %u%s: ", i, sensors[i].int_pin ? "" : " (estimated)");
+        printf("%u FIFO overflows, %u timestamps, max %.1f us off the %.1f us frame period\n",
+               sensors[i].fifo_overflows, time_stamps[i], max_jitter_us[i], 1e9 / sensors[i].chip_config->fifo_rate_mhz);
+    }
+
+    inv_icm20948_i2c_get_errors(&errors);
+    if (fail_every)
+        printf("%u NACKs, %u timeouts\n", errors.nacks, errors.timeouts);
+
+    if (record_file != NULL)
+        fclose(record_file);
+
+    if (trace_file != NULL) {
+        save_trace();
+        fclose(trace_file);
+        printf("%u trace records dropped\n", trace_dropped());
+    }
+
+    lost = (stats->fifo_bytes_lost - first.fifo_bytes_lost) / frame_size;
+    if ((max_lost >= 0) && (lost > (uint32_t)max_lost)) {
+        printf("%u frames lost, limit is %ld\n", lost, max_lost);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Trace decoder -- reads the bus trace records of trace.h, as sent by */
+/*        the firmware's trace characteristic or written by the        */
+/*        simulator's -T option, and prints where the bus time went:   */
+/*        transfers, bytes and busy time per register, and the bus     */
+/*        utilisation over the traced interval.                        */
+/*                                                                     */
+/***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imu.h"
+#include "trace.h"
+
+typedef struct {
+        uint16_t reg;           // bank << 8 | register, as in imu.h
+        uint32_t reads;
+        uint32_t writes;
+        uint32_t errors;
+        uint64_t bytes;
+        uint64_t busy_us;
+} reg_stats;
+
+static const struct {
+        uint16_t reg;
+        const char *name;
+} reg_names[] = {
+        { IMU_WHO_AM_I,         "WHO_AM_I" },
+        { IMU_USER_CTRL,        "USER_CTRL" },
+        { IMU_LP_CONFIG,        "LP_CONFIG" },
+        { IMU_PWR_MGMT_1,       "PWR_MGMT_1" },
+        { IMU_PWR_MGMT_2,       "PWR_MGMT_2" },
+        { IMU_INT_ENABLE,       "INT_ENABLE" },
+        { IMU_INT_ENABLE_1,     "INT_ENABLE_1" },
+        { IMU_INT_ENABLE_2,     "INT_ENABLE_2" },
+        { IMU_INT_ENABLE_3,     "INT_ENABLE_3" },
+        { IMU_I2C_MST_STATUS,   "I2C_MST_STATUS" },
+        { IMU_INT_STATUS_2,     "INT_STATUS_2" },
+        { IMU_ACCEL_XOUT_H,     "ACCEL_XOUT_H" },
+        { IMU_GYRO_XOUT_H,      "GYRO_XOUT_H" },
+        { IMU_TEMP_OUT_H,       "TEMP_OUT_H" },
+        { IMU_EXT_SLV_SENS_DATA_00, "EXT_SLV_SENS_DATA_00" },
+        { IMU_FIFO_EN_1,        "FIFO_EN_1" },
+        { IMU_FIFO_EN_2,        "FIFO_EN_2" },
+        { IMU_FIFO_RST,         "FIFO_RST" },
+        { IMU_FIFO_MODE,        "FIFO_MODE" },
+        { IMU_FIFO_COUNTH,      "FIFO_COUNTH" },
+        { IMU_FIFO_R_W,         "FIFO_R_W" },
+        { IMU_FIFO_CFG,         "FIFO_CFG" },
+        { IMU_MEM_START_ADDR,   "MEM_START_ADDR" },
+        { IMU_MEM_R_W,          "MEM_R_W" },
+        { IMU_MEM_BANK_SEL,     "MEM_BANK_SEL" },
+        { IMU_GYRO_SMPLRT_DIV,  "GYRO_SMPLRT_DIV" },
+        { IMU_GYRO_CONFIG_1,    "GYRO_CONFIG_1" },
+        { IMU_ACCEL_SMPLRT_DIV_1, "ACCEL_SMPLRT_DIV_1" },
+        { IMU_ACCEL_CONFIG,     "ACCEL_CONFIG" },
+        { IMU_I2C_SLV0_ADDR,    "I2C_SLV0_ADDR" },
+        { IMU_I2C_SLV4_ADDR,    "I2C_SLV4_ADDR" },
+        { IMU_I2C_SLV4_CTRL,    "I2C_SLV4_CTRL" },
+};
+
+static reg_stats regs[4 * 256];
+
+static const char *reg_name(uint16_t reg)
+{
+    size_t i;
+
+    if ((reg & 0xff) == IMU_REG_BANK_SEL)
+        return "REG_BANK_SEL";
+    for (i = 0; i < sizeof(reg_names) / sizeof(reg_names[0]); i++)
+        if (reg_names[i].reg == reg)
+            return reg_names[i].name;
+    return "";
+}
+
+static int by_busy_time(const void *a, const void *b)
+{
+    const reg_stats *x = a, *y = b;
+
+    if (x->busy_us != y->busy_us)
+        return (x->busy_us < y->busy_us) ? 1 : -1;
+    return (int)x->reg - (int)y->reg;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in = stdin;
+    trace_record_t rec;
+    uint64_t records = 0, dropped = 0, errors = 0, busy_us = 0;
+    uint32_t first_us = 0, last_end_us = 0;
+    uint8_t seq = 0;
+    reg_stats *r;
+    size_t i, used;
+
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+        printf("usage: %s [trace_file]\n", argv[0]);
+        printf("  reads trace_record_t records (trace.h) from the file or stdin\n");
+        return 2;
+    }
+    if (argc == 2 && (in = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 2;
+    }
+
+    for (i = 0; i < sizeof(regs) / sizeof(regs[0]); i++)
+        regs[i].reg = i;
+
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        if (records == 0)
+            first_us = rec.start_us;
+        else
+            dropped += (uint8_t)(rec.seq - seq - 1);
+        seq = rec.seq;
+        records++;
+
+        // REG_BANK_SEL is in every bank, it is counted once
+        if (rec.reg == IMU_REG_BANK_SEL)
+            r = &regs[IMU_REG_BANK_SEL];
+        else
+            r = &regs[((rec.flags & TRACE_FLAG_BANK_MASK) >> TRACE_FLAG_BANK_SHIFT) * 256 + rec.reg];
+        if (rec.flags & TRACE_FLAG_READ)
+            r->reads++;
+        else
+            r->writes++;
+        if (rec.result != 0) {
+            r->errors++;
+            errors++;
+        }
+        r->bytes += rec.length;
+        r->busy_us += rec.duration_us;
+        busy_us += rec.duration_us;
+        last_end_us = rec.start_us + rec.duration_us;
+    }
+    if (in != stdin)
+        fclose(in);
+
+    if (records == 0) {
+        printf("no trace records\n");
+        return 1;
+    }
+
+    qsort(regs, sizeof(regs) / sizeof(regs[0]), sizeof(regs[0]), by_busy_time);
+    for (used = 0; used < sizeof(regs) / sizeof(regs[0]); used++)
+        if ((regs[used].reads + regs[used].writes) == 0)
+            break;
+
+    printf("%-6s %-20s %8s %8s %10s %12s %6s %6s\n",
+           "reg", "name", "reads", "writes", "bytes", "busy us", "bus", "errors");
+    for (i = 0; i < used; i++) {
+        r = &regs[i];
+        printf("%u:0x%02x %-20s %8u %8u %10llu %12llu %5.1f%% %6u\n",
+               r->reg >> 8, r->reg & 0xff, reg_name(r->reg), r->reads, r->writes,
+               (unsigned long long)r->bytes, (unsigned long long)r->busy_us,
+               100.0 * r->busy_us / busy_us, r->errors);
+    }
+
+    // seq is eight bits, a gap of more than 255 records looks shorter
+    printf("%llu transfers, at least %llu dropped, %llu failed\n",
+           (unsigned long long)records, (unsigned long long)dropped, (unsigned long long)errors);
+    printf("bus busy %llu us of %u us traced, %.1f%% utilisation\n",
+           (unsigned long long)busy_us, last_end_us - first_us,
+           (last_end_us != first_us) ? 100.0 * busy_us / (uint32_t)(last_end_us - first_us) : 0.0);
+    return 0;
+}
@@ -0,0 +1,375 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Wire benchmark -- reads recorded samples, one per line as the       */
+/*        central prints them or the simulator's -R option writes      */
+/*        them, sends them through the imu_wire encoder in batches     */
+/*        the way the peripheral does and back through the decoder,    */
+/*        and reports the bytes on air, the compression against the    */
+/*        unpacked format and the time the codec takes per sample.     */
+/*        Before that it round trips streams that swing full scale,    */
+/*        which smooth recorded motion does not exercise.              */
+/*                                                                     */
+/***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "imu.h"
+#include "imu_wire.h"
+
+#define BENCH_SAMPLES_MAX       1000000
+#define BENCH_REPEAT            20      // codec runs over the recording, for the timing
+#define BENCH_STRESS_SAMPLES    2000    // samples of each full scale stream
+
+typedef struct {
+        IMU_DATA *samples;
+        uint32_t count;
+        uint8_t channels;
+} bench_stream;
+
+static bench_stream streams[INV_ICM20948_SENSORS_MAX];
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-n batch] [-l packet_len] [sample_file]\n", name);
+    printf("  -n  samples handed to the encoder at a time, the FIFO watermark (default 255)\n");
+    printf("  -l  notification payload in bytes (default 244, a 247 byte ATT MTU)\n");
+}
+
+// cycles where the CPU has a counter the benchmark can read, else ns
+static uint64_t bench_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static const char *bench_unit(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return "cycles";
+#else
+    return "ns";
+#endif
+}
+
+// Parse a line of "sensor time_us a x y z g x y z m x y z t temp".
+// Returns the channels it holds, 0 for quaternions or anything else.
+static uint8_t parse_line(char *line, IMU_DATA *d)
+{
+    char *token, *end;
+    uint8_t channels = 0;
+    int16_t *fields = NULL;
+    int n = 0, i;
+
+    memset(d, 0, sizeof(*d));
+    token = strtok(line, " \t\r\n");
+    if (token == NULL)
+        return 0;
+    d->sensor = (uint16_t)strtoul(token, &end, 10);
+    if ((*end != '\0') || (d->sensor >= INV_ICM20948_SENSORS_MAX))
+        return 0;
+    token = strtok(NULL, " \t\r\n");
+    if (token == NULL)
+        return 0;
+    d->time_stamp = (uint32_t)strtoul(token, &end, 10);
+    if (*end != '\0')
+        return 0;
+
+    while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+        if (strcmp(token, "a") == 0) {
+            channels |= IMU_WIRE_ACCEL;
+            fields = &d->ax;
+            n = 3;
+        } else if (strcmp(token, "g") == 0) {
+            channels |= IMU_WIRE_GYRO;
+            fields = &d->gx;
+            n = 3;
+        } else if (strcmp(token, "m") == 0) {
+            channels |= IMU_WIRE_MAGN;
+            fields = &d->mx;
+            n = 3;
+        } else if (strcmp(token, "t") == 0) {
+            channels |= IMU_WIRE_TEMP;
+            fields = &d->temperature;
+            n = 1;
+        } else {
+            return 0;
+        }
+        for (i = 0; i < n; i++) {
+            token = strtok(NULL, " \t\r\n");
+            if (token == NULL)
+                return 0;
+            fields[i] = (int16_t)strtol(token, &end, 10);
+            if (*end != '\0')
+                return 0;
+        }
+    }
+    return channels;
+}
+
+// The nominal period the peripheral would send, from the recorded times.
+static uint32_t period_of(const IMU_DATA *samples, uint32_t count)
+{
+    if (count < 2)
+        return 0;
+    return ((samples[count - 1].time_stamp - samples[0].time_stamp + (count - 1) / 2) / (count - 1));
+}
+
+// Send a stream through the encoder and decoder.  Returns the bytes on
+// air, or 0 if a sample did not come back unchanged.
+static uint32_t run_stream(const bench_stream *stream, uint16_t batch, uint16_t packet_len, uint32_t *p_unpacked,
+                           uint32_t *p_packets, uint32_t *p_packed, uint64_t *p_encode, uint64_t *p_decode)
+{
+    static uint8_t packet[UINT16_MAX];
+    static IMU_DATA decoded[UINT8_MAX];
+    uint32_t period_us = period_of(stream->samples, stream->count);
+    uint16_t sample_size = imu_wire_sample_size(stream->channels, false);
+    uint32_t per_packet = (packet_len - IMU_WIRE_HEADER_SIZE + 1) / sample_size;
+    uint32_t done, bytes = 0;
+    uint64_t start;
+
+    for (done = 0; done < stream->count; ) {
+        uint16_t n = (stream->count - done < batch) ? stream->count - done : batch;
+        uint16_t sent = 0;
+
+        // the same batch with an 8 bit time delta a sample and no packing
+        if (per_packet > UINT8_MAX)
+            per_packet = UINT8_MAX;
+        if (per_packet > 0) {
+            *p_unpacked += (n / per_packet) * (IMU_WIRE_HEADER_SIZE + per_packet * sample_size - 1);
+            if (n % per_packet)
+                *p_unpacked += IMU_WIRE_HEADER_SIZE + (n % per_packet) * sample_size - 1;
+        }
+
+        while (sent < n) {
+            uint16_t len, used;
+            int count, i;
+
+            start = bench_now();
+            len = imu_wire_encode_data(packet, packet_len, stream->channels, period_us,
+                                       &stream->samples[done + sent], n - sent, &used);
+            *p_encode += bench_now() - start;
+            if (len == 0) {
+                printf("a sample does not fit a %u byte packet\n", packet_len);
+                return 0;
+            }
+
+            start = bench_now();
+            count = imu_wire_decode_data(packet, len, decoded, UINT8_MAX);
+            *p_decode += bench_now() - start;
+            if (count != used)
+                return 0;
+            for (i = 0; i < count; i++) {
+                const IMU_DATA *d = &stream->samples[done + sent + i];
+
+                if ((decoded[i].time_stamp != d->time_stamp) || (decoded[i].sensor != d->sensor) ||
+                    (decoded[i].ax != d->ax) || (decoded[i].ay != d->ay) || (decoded[i].az != d->az) ||
+                    (decoded[i].gx != d->gx) || (decoded[i].gy != d->gy) || (decoded[i].gz != d->gz) ||
+                    (decoded[i].mx != d->mx) || (decoded[i].my != d->my) || (decoded[i].mz != d->mz) ||
+                    (decoded[i].temperature != d->temperature)) {
+                    printf("sample %u of sensor %u does not decode to what was sent\n",
+                           done + sent + i, d->sensor);
+                    return 0;
+                }
+            }
+            if (packet[2] & IMU_WIRE_PACKED)
+                (*p_packed)++;
+            (*p_packets)++;
+            bytes += len;
+            sent += used;
+        }
+        done += n;
+    }
+    return bytes;
+}
+
+// Sample i of a full scale stream: pattern 0 swings every channel between
+// the rails, 1 alternates +-12000 on the accel under a slow gyro, 2 takes
+// random steps anywhere in the range, 3 steps by 8192 and more.  The time
+// stamps stray off the period and jump ahead now and then.
+static void stress_sample(int pattern, uint32_t i, uint32_t *p_seed, IMU_DATA *d)
+{
+    int16_t *fields = &d->ax;
+    uint32_t time_stamp = d->time_stamp;
+    int f;
+
+    *p_seed = *p_seed * 1103515245u + 12345u;
+    memset(d, 0, sizeof(*d));
+    d->time_stamp = time_stamp + 1000 + (*p_seed >> 24) % 64;
+    if ((i % 97) == 0)
+        d->time_stamp += 30000;
+    for (f = 0; f < 10; f++) {
+        *p_seed = *p_seed * 1103515245u + 12345u;
+        switch (pattern) {
+        case 0: fields[f] = ((i + f) & 1) ? INT16_MAX : INT16_MIN; break;
+        case 1: fields[f] = (f < 3) ? ((i & 1) ? 12000 : -12000) : (int16_t)(3 * i); break;
+        case 2: fields[f] = (int16_t)(*p_seed >> 16); break;
+        default: fields[f] = (int16_t)((i * (8192 + f * 1000)) & 0xffff); break;
+        }
+    }
+}
+
+// Round trip streams with the largest steps the sensor can produce, which
+// recorded motion rarely has.  Returns 0 if every sample came back.
+static int stress_check(uint16_t batch, uint16_t packet_len)
+{
+    static const uint8_t channels[] = {
+        IMU_WIRE_DATA_CHANNELS, IMU_WIRE_ACCEL | IMU_WIRE_GYRO, IMU_WIRE_ACCEL, IMU_WIRE_GYRO | IMU_WIRE_TEMP
+    };
+    bench_stream stream;
+    uint64_t encode = 0, decode = 0;
+    uint32_t unpacked = 0, packets = 0, packed = 0;
+    uint32_t seed = 1, i;
+    int pattern, c;
+
+    stream.samples = malloc(BENCH_STRESS_SAMPLES * sizeof(IMU_DATA));
+    stream.count = BENCH_STRESS_SAMPLES;
+    for (pattern = 0; pattern < 4; pattern++) {
+        for (c = 0; c < (int)(sizeof(channels) / sizeof(channels[0])); c++) {
+            stream.channels = channels[c];
+            if (IMU_WIRE_HEADER_SIZE + imu_wire_sample_size(stream.channels, true) > packet_len)
+                continue;
+            memset(&stream.samples[0], 0, sizeof(IMU_DATA));
+            for (i = 0; i < stream.count; i++) {
+                if (i > 0)
+                    stream.samples[i] = stream.samples[i - 1];
+                stress_sample(pattern, i, &seed, &stream.samples[i]);
+                // channels the stream does not carry decode as 0
+                if (!(stream.channels & IMU_WIRE_ACCEL))
+                    memset(&stream.samples[i].ax, 0, 3 * sizeof(int16_t));
+                if (!(stream.channels & IMU_WIRE_GYRO))
+                    memset(&stream.samples[i].gx, 0, 3 * sizeof(int16_t));
+                if (!(stream.channels & IMU_WIRE_MAGN))
+                    memset(&stream.samples[i].mx, 0, 3 * sizeof(int16_t));
+                if (!(stream.channels & IMU_WIRE_TEMP))
+                    stream.samples[i].temperature = 0;
+            }
+            if (run_stream(&stream, batch, packet_len, &unpacked, &packets, &packed, &encode, &decode) == 0) {
+                printf("full scale pattern %d, channels 0x%02x: the codec failed\n", pattern, channels[c]);
+                free(stream.samples);
+                return 1;
+            }
+        }
+    }
+    printf("full scale round trip: %u packets, %u of them packed\n", packets, packed);
+    free(stream.samples);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in = stdin;
+    char line[256];
+    IMU_DATA sample;
+    uint32_t skipped = 0;
+    unsigned long batch = UINT8_MAX;
+    unsigned long packet_len = 244;
+    int opt, s;
+
+    while ((opt = getopt(argc, argv, "n:l:h")) != -1) {
+        switch (opt) {
+        case 'n': batch = strtoul(optarg, NULL, 0); break;
+        case 'l': packet_len = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((optind < argc - 1) || (batch == 0) || (packet_len == 0) || (packet_len > UINT16_MAX)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if ((optind == argc - 1) && (in = fopen(argv[optind], "r")) == NULL) {
+        perror(argv[optind]);
+        return 2;
+    }
+
+    if (stress_check((uint16_t)(batch < UINT8_MAX ? batch : UINT8_MAX), (uint16_t)packet_len))
+        return 1;
+
+    for (s = 0; s < INV_ICM20948_SENSORS_MAX; s++)
+        streams[s].samples = malloc(BENCH_SAMPLES_MAX * sizeof(IMU_DATA));
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        uint8_t channels = parse_line(line, &sample);
+        bench_stream *stream;
+
+        if (channels == 0) {
+            skipped++;
+            continue;
+        }
+        // a stream keeps the channels of its first sample
+        stream = &streams[sample.sensor];
+        if (((stream->count > 0) && (channels != stream->channels)) || (stream->count == BENCH_SAMPLES_MAX)) {
+            skipped++;
+            continue;
+        }
+        stream->channels = channels;
+        stream->samples[stream->count++] = sample;
+    }
+    if (in != stdin)
+        fclose(in);
+
+    printf("batches of %lu samples, %lu byte packets, %s per sample\n", batch, packet_len, bench_unit());
+    printf("%6s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+           "sensor", "samples", "bytes", "per smpl", "unpacked", "ratio", "per pkt", "encode", "decode");
+    for (s = 0; s < INV_ICM20948_SENSORS_MAX; s++) {
+        const bench_stream *stream = &streams[s];
+        uint64_t encode = 0, decode = 0;
+        uint32_t packets = 0, packed = 0, bytes = 0, unpacked = 0;
+        int r;
+
+        if (stream->count == 0)
+            continue;
+        for (r = 0; r < BENCH_REPEAT; r++) {
+            packets = packed = unpacked = 0;
+            bytes = run_stream(stream, (uint16_t)(batch < UINT8_MAX ? batch : UINT8_MAX), (uint16_t)packet_len,
+                               &unpacked, &packets, &packed, &encode, &decode);
+            if (bytes == 0) {
+                printf("sensor %d: the codec failed\n", s);
+                return 1;
+            }
+        }
+        printf("%6d %8u %8u %8.2f %8.2f %7.2fx %8.1f %8.1f %8.1f\n", s, stream->count, bytes,
+               (double)bytes / stream->count, (double)unpacked / stream->count, (double)unpacked / bytes,
+               (double)stream->count / packets,
+               (double)encode / BENCH_REPEAT / stream->count, (double)decode / BENCH_REPEAT / stream->count);
+        if (packed != packets)
+            printf("       %u of %u packets were not packed\n", packets - packed, packets);
+    }
+    if (skipped)
+        printf("%u lines skipped, quaternions, other channels or not samples\n", skipped);
+    return 0;
+}
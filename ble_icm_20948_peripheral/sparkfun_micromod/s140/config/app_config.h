@@ -24,7 +24,47 @@
 #define SCL_PIN 11
 #define SDA_PIN  8
 
+// Talk to the ICM-20948 over SPI instead of I2C.  SCL_PIN and SDA_PIN then
+// drive SCLK and SDI, the sensor's SDO and nCS go to IMU_MISO_PIN and
+// IMU_CS_PIN.  SPIM1 is used, so SPI1 is switched on here.
+#define IMU_SPI_ENABLED 0
+#define IMU_MISO_PIN 2
+#define IMU_CS_PIN 20
+
+#if IMU_SPI_ENABLED
+#define SPI_ENABLED 1
+#define SPI1_ENABLED 1
+#define SPI1_USE_EASY_DMA 1
+#endif
+
 #define INV_INT_PIN 15
 #define PIN_OUT 14
 
+// Stream the DMP's orientation quaternion instead of the raw samples.  The
+// InvenSense DMP image is not distributed with this project; copy
+// icm20948_img.dmp3a.h from the InvenSense eMD release into
+// ble_icm_20948_peripheral before setting IMU_DMP_ENABLED to 1.
+#define IMU_DMP_ENABLED 0
+#define IMU_DMP_MODE INV_ICM20948_DMP_GAME_RV
+
+// Read every raw sample as it arrives, started by the INT pulse through PPI
+// without the CPU, which only wakes up once per IMU_FIFO_WATERMARK samples.
+// The bus is then reserved for the samples.  Ignored with the DMP.
+#define IMU_CAPTURE_ENABLED 0
+
+// ICM-20948s on the I2C bus, 1 or 2.  The second one has AD0 high and is
+// read along with the first, its INT pin need not be wired; its samples
+// are timestamped from when they are read.  Not with SPI, and capture
+// only works with one.
+#define IMU_SENSORS 1
+
+// Samples wait in a ring per sensor (SAMPLE_RING_SIZE, sample_ring.h) until
+// the SoftDevice takes them.  When the link falls behind far enough to fill
+// it, SAMPLE_RING_DROP_OLDEST gives up the oldest samples for the new ones,
+// SAMPLE_RING_DROP_NEWEST keeps the queued ones.  IMU_HVN_TX_QUEUE_SIZE is
+// the notifications the SoftDevice queues, each connection event can send
+// that many.
+#define IMU_TX_RING_POLICY SAMPLE_RING_DROP_OLDEST
+#define IMU_HVN_TX_QUEUE_SIZE 8
+
 #endif // APP_CONFIG_H__
@@ -0,0 +1,475 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* SPI -- register block transfers on SPIM1 (EasyDMA), selected with   */
+/*        IMU_SPI_ENABLED in app_config.h.  The queue works like the   */
+/*        one in twi.c.  A read sends the register address with the    */
+/*        read bit set and clocks the block in behind it, so the first */
+/*        byte received is dropped.  Register writes run at 1MHz, the  */
+/*        ICM-20948's limit for configuration registers, reads at the  */
+/*        faster rate it allows for the sensor data and the FIFO.      */
+/*                                                                     */
+/*        nCS is driven here rather than by the SPIM driver, which     */
+/*        leaves it low for a read that PPI starts.  For capture the   */
+/*        pin is handed to a GPIOTE task: an EGU event pulls nCS low   */
+/*        and starts the read, the end of the read raises it again.    */
+/*                                                                     */
+/*        A transfer that never ends is retired by spi_check() as in   */
+/*        twi.c; the SPIM is set up again.                             */
+/*                                                                     */
+/***********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "nrf_egu.h"
+
+#include "spi.h"
+#include "trace.h"
+#include "imu.h"
+#include "imu_int.h"
+
+#if IMU_SPI_ENABLED
+
+#define SPI_READ_BIT        0x80
+#define SPI_FREQ_WRITE      NRF_SPIM_FREQ_1M
+#define SPI_FREQ_READ       NRF_SPIM_FREQ_4M    // 8MHz is above the 7MHz the part allows
+#define SPI_CAPTURE_EGU     NRF_EGU3            // EGU0..2 and 5 are taken by the SoftDevice and the SDK
+#define SPI_BYTE_US         8                   // at the 1MHz write clock, reads are faster
+#define SPI_STALL_US        2000                // on top of the bytes, for interrupt latency
+
+typedef struct
+{
+    spi_xfer_t xfer;
+    bool       chained;                 // more transfers of the same list follow
+    uint8_t    tx[1 + SPI_MAX_WRITE];   // register address, then write data
+} spi_slot_t;
+
+static const nrf_drv_spi_t m_spi = NRF_DRV_SPI_INSTANCE(1);
+
+static spi_slot_t       m_queue[SPI_QUEUE_SIZE];
+static volatile uint8_t m_head;         // transfer on the bus, if m_busy
+static volatile uint8_t m_count;        // transfers queued, including the one on the bus
+static volatile bool    m_busy;
+static uint8_t          m_rx[1 + SPI_MAX_READ];    // the byte clocked in with the address, then the block
+static volatile bool    m_capture;
+static uint8_t          m_capture_tx;
+static uint8_t          m_capture_length;
+static nrf_ppi_channel_t m_capture_start_channel;
+static nrf_ppi_channel_t m_capture_end_channel;
+static uint32_t         m_start_us;     // when the transfer at the head went on the bus
+static ret_code_t       m_start_error;  // the driver refused the transfer at the head
+static spi_errors_t     m_errors;
+
+// Put the transfer at the head of the queue on the bus.
+static void spi_start(void)
+{
+    spi_slot_t * p_slot = &m_queue[m_head];
+    ret_code_t   err_code;
+
+    m_start_us = imu_int_time_us();
+    nrf_drv_gpiote_out_clear(IMU_CS_PIN);
+    if (p_slot->xfer.read)
+    {
+        nrf_spim_frequency_set(m_spi.u.spim.p_reg, SPI_FREQ_READ);
+        err_code = nrf_drv_spi_transfer(&m_spi, p_slot->tx, 1, m_rx, p_slot->xfer.length + 1);
+    }
+    else
+    {
+        nrf_spim_frequency_set(m_spi.u.spim.p_reg, SPI_FREQ_WRITE);
+        err_code = nrf_drv_spi_transfer(&m_spi, p_slot->xfer.prefixed ? p_slot->xfer.p_data : p_slot->tx,
+                                        p_slot->xfer.length + 1, NULL, 0);
+    }
+
+    // left on the queue, spi_check() retires it like a stalled transfer
+    m_start_error = err_code;
+}
+
+// Trace the transfer at the head of the queue, from the SPI interrupt or
+// with it held off, as in twi.c.  SPI only reaches the sensor at IMU_ADDR.
+static void spi_trace(ret_code_t result)
+{
+    spi_slot_t * p_slot = &m_queue[m_head];
+    spi_xfer_t * p_xfer = &p_slot->xfer;
+
+    trace_bus(IMU_ADDR, p_xfer->reg, p_xfer->prefixed ? &p_xfer->p_data[1] : &p_slot->tx[1], p_xfer->length,
+              TRACE_FLAG_SPI | (p_xfer->read ? TRACE_FLAG_READ : 0) | (p_xfer->prefixed ? TRACE_FLAG_PREFIXED : 0),
+              m_start_us, imu_int_time_us(), result);
+}
+
+// Retire the transfer at the head of the queue, once traced, and start the
+// next one.  Only a stall fails a transfer; the rest of its list is retired
+// with it, as in twi.c.
+static void spi_complete(ret_code_t result)
+{
+    spi_xfer_t xfer = m_queue[m_head].xfer;
+    bool       chained;
+
+    nrf_drv_gpiote_out_set(IMU_CS_PIN);
+
+    // m_rx is reused by the next transfer
+    if (xfer.read && (result == NRF_SUCCESS))
+    {
+        memcpy(xfer.p_data, &m_rx[1], xfer.length);
+    }
+
+    do
+    {
+        xfer    = m_queue[m_head].xfer;
+        chained = m_queue[m_head].chained;
+
+        CRITICAL_REGION_ENTER();
+        m_head = (m_head + 1) % SPI_QUEUE_SIZE;
+        m_count--;
+        m_busy = (m_count > 0);
+        if (m_busy && ((result == NRF_SUCCESS) || !chained))
+        {
+            spi_start();
+        }
+        CRITICAL_REGION_EXIT();
+
+        // the callback may queue the next step of its own sequence
+        if (xfer.callback != NULL)
+        {
+            xfer.callback(result, xfer.p_context);
+        }
+    } while ((result != NRF_SUCCESS) && chained);
+}
+
+void spi_handler(nrf_drv_spi_evt_t const * p_event, void * p_context)
+{
+    if (!m_capture && (p_event->type == NRF_DRV_SPI_EVENT_DONE))
+    {
+        spi_trace(NRF_SUCCESS);
+        spi_complete(NRF_SUCCESS);
+    }
+}
+
+static void spi_bus_init(void)
+{
+    ret_code_t err_code;
+
+    nrf_drv_spi_config_t config = NRF_DRV_SPI_DEFAULT_CONFIG;
+    config.sck_pin      = SCL_PIN;
+    config.mosi_pin     = SDA_PIN;
+    config.miso_pin     = IMU_MISO_PIN;
+    config.ss_pin       = NRF_DRV_SPI_PIN_NOT_USED;
+    config.irq_priority = APP_IRQ_PRIORITY_HIGH;
+    config.frequency    = NRF_DRV_SPI_FREQ_1M;
+    config.mode         = NRF_DRV_SPI_MODE_3;
+    config.bit_order    = NRF_DRV_SPI_BIT_ORDER_MSB_FIRST;
+
+    err_code = nrf_drv_spi_init(&m_spi, &config, spi_handler, NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+void spi_init(void)
+{
+    ret_code_t err_code;
+    nrf_drv_gpiote_out_config_t cs_config = GPIOTE_CONFIG_OUT_TASK_TOGGLE(true);
+
+    if (!nrf_drv_gpiote_is_init())
+    {
+        err_code = nrf_drv_gpiote_init();
+        APP_ERROR_CHECK(err_code);
+    }
+    // the task is only enabled while capturing, until then the pin is a plain output
+    err_code = nrf_drv_gpiote_out_init(IMU_CS_PIN, &cs_config);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = nrf_drv_ppi_init();
+    if (err_code != NRF_ERROR_MODULE_ALREADY_INITIALIZED)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+    err_code = nrf_drv_ppi_channel_alloc(&m_capture_start_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_alloc(&m_capture_end_channel);
+    APP_ERROR_CHECK(err_code);
+
+    spi_bus_init();
+}
+
+// Queue a list of transfers back to back, they start right away if the bus
+// is idle.  Either the whole list is queued or nothing is.
+ret_code_t spi_schedule_list(spi_xfer_t const * p_list, uint8_t count)
+{
+    spi_slot_t * p_slot;
+    ret_code_t   err_code = NRF_SUCCESS;
+    uint8_t      i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (p_list[i].length > (p_list[i].read ? SPI_MAX_READ : p_list[i].prefixed ? SPI_MAX_PREFIXED : SPI_MAX_WRITE))
+        {
+            return NRF_ERROR_INVALID_LENGTH;
+        }
+    }
+
+    CRITICAL_REGION_ENTER();
+    if ((count == 0) || (count > SPI_QUEUE_SIZE - m_count))
+    {
+        err_code = NRF_ERROR_NO_MEM;
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            p_slot = &m_queue[(m_head + m_count) % SPI_QUEUE_SIZE];
+            p_slot->xfer    = p_list[i];
+            p_slot->chained = (i < count - 1);
+            if (p_list[i].read)
+            {
+                p_slot->tx[0] = p_list[i].reg | SPI_READ_BIT;
+            }
+            else if (p_list[i].prefixed)
+            {
+                p_list[i].p_data[0] = p_list[i].reg;
+            }
+            else
+            {
+                p_slot->tx[0] = p_list[i].reg;
+                memcpy(&p_slot->tx[1], p_list[i].p_data, p_list[i].length);
+            }
+            m_count++;
+        }
+        if (!m_busy)
+        {
+            m_busy = true;
+            spi_start();
+        }
+    }
+    CRITICAL_REGION_EXIT();
+
+    return err_code;
+}
+
+ret_code_t spi_schedule(spi_xfer_t const * p_xfer)
+{
+    return spi_schedule_list(p_xfer, 1);
+}
+
+bool spi_idle(void)
+{
+    return !m_busy;
+}
+
+bool spi_check(void)
+{
+    spi_slot_t * p_slot;
+    uint32_t     start_us, limit_us;
+    bool         stalled = false;
+
+    CRITICAL_REGION_ENTER();
+    if (m_busy && !m_capture)
+    {
+        p_slot   = &m_queue[m_head];
+        limit_us = 2 * (p_slot->xfer.length + 1) * SPI_BYTE_US + SPI_STALL_US;
+        stalled  = (m_start_error != NRF_SUCCESS) || (imu_int_time_us() - m_start_us > limit_us);
+    }
+    if (stalled)
+    {
+        start_us = imu_int_time_us();
+        nrf_drv_spi_uninit(&m_spi);
+        spi_bus_init();
+        m_start_error = NRF_SUCCESS;
+        m_errors.timeouts++;
+        m_errors.recoveries++;
+        if (imu_int_time_us() - start_us > m_errors.recovery_us)
+        {
+            m_errors.recovery_us = imu_int_time_us() - start_us;
+        }
+        spi_trace(NRF_ERROR_TIMEOUT);
+    }
+    CRITICAL_REGION_EXIT();
+
+    if (stalled)
+    {
+        // spi_complete() raises nCS and starts the next transfer
+        spi_complete(NRF_ERROR_TIMEOUT);
+    }
+    return stalled;
+}
+
+void spi_errors_get(spi_errors_t * p_errors)
+{
+    CRITICAL_REGION_ENTER();
+    *p_errors = m_errors;
+    CRITICAL_REGION_EXIT();
+}
+
+ret_code_t spi_capture_arm(uint8_t reg, uint8_t * p_buffer, uint8_t length,
+                           uint32_t * p_start_task, uint32_t * p_done_event)
+{
+    nrf_drv_spi_xfer_desc_t xfer;
+    uint32_t                end_event;
+    ret_code_t              err_code = NRF_SUCCESS;
+
+    if (length > SPI_MAX_READ)
+    {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+
+    CRITICAL_REGION_ENTER();
+    if (m_busy)
+    {
+        err_code = NRF_ERROR_BUSY;
+    }
+    else
+    {
+        m_busy    = true;
+        m_capture = true;
+    }
+    CRITICAL_REGION_EXIT();
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    m_capture_tx     = reg | SPI_READ_BIT;
+    m_capture_length = length;
+    nrf_spim_frequency_set(m_spi.u.spim.p_reg, SPI_FREQ_READ);
+    xfer = (nrf_drv_spi_xfer_desc_t)NRF_DRV_SPI_XFER_TRX(&m_capture_tx, 1, p_buffer, length + 1);
+    err_code = nrf_drv_spi_xfer(&m_spi, &xfer, NRF_DRV_SPI_FLAG_HOLD_XFER | NRF_DRV_SPI_FLAG_REPEATED_XFER |
+                                                NRF_DRV_SPI_FLAG_RX_POSTINC | NRF_DRV_SPI_FLAG_NO_XFER_EVT_HANDLER);
+    if (err_code != NRF_SUCCESS)
+    {
+        spi_capture_disarm();
+        return err_code;
+    }
+
+    end_event = nrf_drv_spi_end_event_get(&m_spi);
+    nrf_egu_event_clear(SPI_CAPTURE_EGU, NRF_EGU_EVENT_TRIGGERED0);
+    APP_ERROR_CHECK(nrf_drv_ppi_channel_assign(m_capture_start_channel,
+                                               nrf_egu_event_address_get(SPI_CAPTURE_EGU, NRF_EGU_EVENT_TRIGGERED0),
+                                               nrf_drv_gpiote_clr_task_addr_get(IMU_CS_PIN)));
+    APP_ERROR_CHECK(nrf_drv_ppi_channel_fork_assign(m_capture_start_channel, nrf_drv_spi_start_task_get(&m_spi)));
+    APP_ERROR_CHECK(nrf_drv_ppi_channel_assign(m_capture_end_channel, end_event,
+                                               nrf_drv_gpiote_set_task_addr_get(IMU_CS_PIN)));
+    nrf_drv_gpiote_out_task_enable(IMU_CS_PIN);
+    APP_ERROR_CHECK(nrf_drv_ppi_channel_enable(m_capture_start_channel));
+    APP_ERROR_CHECK(nrf_drv_ppi_channel_enable(m_capture_end_channel));
+
+    *p_start_task = nrf_egu_task_address_get(SPI_CAPTURE_EGU, NRF_EGU_TASK_TRIGGER0);
+    *p_done_event = end_event;
+    return NRF_SUCCESS;
+}
+
+void spi_capture_rearm(uint8_t * p_buffer)
+{
+    nrf_spim_rx_buffer_set(m_spi.u.spim.p_reg, p_buffer, m_capture_length + 1);
+}
+
+// As twi_capture_disarm(), the last read has to be over.
+void spi_capture_disarm(void)
+{
+    nrf_drv_ppi_channel_disable(m_capture_start_channel);
+    nrf_drv_ppi_channel_disable(m_capture_end_channel);
+    nrf_drv_gpiote_out_task_disable(IMU_CS_PIN);
+    nrf_drv_gpiote_out_set(IMU_CS_PIN);
+
+    CRITICAL_REGION_ENTER();
+    m_capture = false;
+    m_busy    = (m_count > 0);
+    if (m_busy)
+    {
+        spi_start();
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+static void spi_blocking_handler(ret_code_t result, void * p_context)
+{
+    *(volatile ret_code_t *)p_context = result;
+}
+
+// Queue the list and wait for its last transfer, the bus interrupt does the
+// work.  The callback of the last transfer is replaced.
+ret_code_t spi_transfer_list(spi_xfer_t * p_list, uint8_t count)
+{
+    volatile ret_code_t result = NRF_ERROR_BUSY;
+    ret_code_t          err_code;
+
+    if ((count == 0) || (count > SPI_QUEUE_SIZE))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    p_list[count - 1].callback  = spi_blocking_handler;
+    p_list[count - 1].p_context = (void *)&result;
+
+    do
+    {
+        err_code = spi_schedule_list(p_list, count);
+        if (err_code == NRF_ERROR_NO_MEM)
+        {
+            (void)spi_check();
+        }
+    } while (err_code == NRF_ERROR_NO_MEM);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // bounded: a stall is retired, and its callback ends the wait
+    while (result == NRF_ERROR_BUSY)
+    {
+        (void)spi_check();
+    }
+    return result;
+}
+
+static ret_code_t spi_transfer(uint8_t reg, uint8_t *block, uint8_t count, bool read)
+{
+    spi_xfer_t xfer =
+    {
+        .reg       = reg,
+        .p_data    = block,
+        .length    = count,
+        .read      = read
+    };
+
+    return spi_transfer_list(&xfer, 1);
+}
+
+void spi_write_register(uint8_t reg, uint8_t value)
+{
+    spi_write_register_block(reg, &value, 1);
+}
+
+void spi_write_register_block(uint8_t reg, uint8_t *block, uint8_t count)
+{
+    spi_transfer(reg, block, count, false);
+}
+
+uint8_t spi_read_register(uint8_t reg)
+{
+    uint8_t block;
+    spi_read_register_block(reg, &block, 1);
+    return block;
+}
+
+void spi_read_register_block(uint8_t reg, uint8_t *block, uint8_t count)
+{
+    spi_transfer(reg, block, count, true);
+}
+
+#endif // IMU_SPI_ENABLED
@@ -0,0 +1,91 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SPI_H__
+#define SPI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "nrf_drv_spi.h"
+#include "nrf_drv_gpiote.h"
+#include "nrf_drv_ppi.h"
+#include "app_util_platform.h"
+
+#define SPI_QUEUE_SIZE      8       // transfers that can be waiting at once
+#define SPI_MAX_WRITE       16      // bytes per register block write that is copied
+#define SPI_MAX_PREFIXED    254     // bytes per prefixed write, EasyDMA MAXCNT less the register byte
+#define SPI_MAX_READ        254     // bytes per register block read, EasyDMA MAXCNT less the command byte
+
+// Called from the SPI interrupt once a transfer has completed, result is
+// NRF_SUCCESS or an error code, NRF_ERROR_TIMEOUT for a transfer that
+// spi_check() retired.
+typedef void (*spi_callback_t)(ret_code_t result, void * p_context);
+
+// A register block access, the same as twi_xfer_t without the slave address.
+// Write data is copied when the transfer is scheduled, the buffer of a read
+// or of a prefixed write (see twi_xfer_t) has to stay valid until the
+// callback.
+typedef struct
+{
+    uint8_t         reg;
+    uint8_t       * p_data;
+    uint8_t         length;
+    bool            read;
+    bool            prefixed;
+    spi_callback_t  callback;       // may be NULL
+    void          * p_context;
+} spi_xfer_t;
+
+// Bus errors since boot, as twi_errors_t.  SPI has no acknowledge.
+typedef struct
+{
+    uint32_t timeouts;          // transfers that stalled and were retired
+    uint32_t recoveries;        // SPIM set-ups after a stall
+    uint32_t recovery_us;       // longest recovery
+} spi_errors_t;
+
+void spi_handler(nrf_drv_spi_evt_t const * p_event, void * p_context);
+void spi_init(void);
+
+ret_code_t spi_schedule(spi_xfer_t const * p_xfer);
+ret_code_t spi_schedule_list(spi_xfer_t const * p_list, uint8_t count);
+bool       spi_idle(void);
+
+// As twi_check(), without the clock-out: nCS going high ends any transfer.
+bool       spi_check(void);
+void       spi_errors_get(spi_errors_t * p_errors);
+
+// The blocking functions wait for every transfer queued before them, so they
+// must not be called from an interrupt at or above the SPI's priority.
+ret_code_t spi_transfer_list(spi_xfer_t * p_list, uint8_t count);
+
+// Capture, as twi_capture_arm().  Each slot of p_buffer is length + 1
+// bytes, the data starts at the second byte.
+ret_code_t spi_capture_arm(uint8_t reg, uint8_t * p_buffer, uint8_t length,
+                           uint32_t * p_start_task, uint32_t * p_done_event);
+void       spi_capture_rearm(uint8_t * p_buffer);
+void       spi_capture_disarm(void);
+
+void    spi_write_register(uint8_t reg, uint8_t value);
+void    spi_write_register_block(uint8_t reg, uint8_t *block, uint8_t count);
+uint8_t spi_read_register(uint8_t reg);
+void    spi_read_register_block(uint8_t reg, uint8_t *block, uint8_t count);
+
+#endif // SPI_H__
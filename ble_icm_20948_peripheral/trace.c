@@ -0,0 +1,99 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Bus trace -- the ring is filled by the bus transport, usually from  */
+/*        its interrupt, and drained by the main loop.  Each side only */
+/*        writes its own index, so neither has to lock the other out.  */
+/*        Records are dropped, not overwritten, when the ring is full. */
+/*                                                                     */
+/***********************************************************************/
+
+#include <string.h>
+
+#include "trace.h"
+#include "imu.h"
+
+static trace_record_t    m_ring[TRACE_RING_SIZE];
+static volatile uint32_t m_head;        // next record to write, only written by trace_bus()
+static volatile uint32_t m_tail;        // next record to read, only written by trace_consume()
+static volatile uint32_t m_dropped;
+static uint8_t           m_seq;
+static uint8_t           m_bank[2];     // as last written to REG_BANK_SEL of IMU_ADDR and IMU_ADDR_AD0
+
+void trace_bus(uint8_t addr, uint8_t reg, const uint8_t * p_data, uint8_t length, uint8_t flags,
+               uint32_t start_us, uint32_t end_us, uint32_t result)
+{
+    trace_record_t * p_record;
+    uint32_t         duration = end_us - start_us;
+    uint8_t        * p_bank = &m_bank[(addr == IMU_ADDR_AD0) ? 1 : 0];
+
+    flags = (flags & ~TRACE_FLAG_BANK_MASK) | (*p_bank << TRACE_FLAG_BANK_SHIFT);
+    if (!(flags & TRACE_FLAG_READ) && (reg == IMU_REG_BANK_SEL) && (p_data != NULL) && (length > 0)
+        && (result == 0))
+    {
+        *p_bank = (p_data[0] >> 4) & 0x03;
+    }
+
+    if (m_head - m_tail >= TRACE_RING_SIZE)
+    {
+        m_dropped++;
+        m_seq++;
+        return;
+    }
+
+    p_record = &m_ring[m_head % TRACE_RING_SIZE];
+    p_record->start_us    = start_us;
+    p_record->duration_us = (duration > UINT16_MAX) ? UINT16_MAX : duration;
+    p_record->result      = result;
+    p_record->reg         = reg;
+    p_record->flags       = flags;
+    p_record->length      = length;
+    p_record->seq         = m_seq++;
+    __sync_synchronize();   // the record is complete before it is published
+    m_head++;
+}
+
+uint32_t trace_peek(trace_record_t * p_records, uint32_t max)
+{
+    uint32_t tail = m_tail, count = m_head - tail, i;
+
+    if (count > max)
+    {
+        count = max;
+    }
+    for (i = 0; i < count; i++)
+    {
+        p_records[i] = m_ring[(tail + i) % TRACE_RING_SIZE];
+    }
+    return count;
+}
+
+void trace_consume(uint32_t count)
+{
+    __sync_synchronize();   // the records have been copied before the slots are handed back
+    m_tail += count;
+}
+
+uint32_t trace_dropped(void)
+{
+    return m_dropped;
+}
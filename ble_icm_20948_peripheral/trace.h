@@ -0,0 +1,69 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* Bus trace -- one binary record per transfer on the sensor bus, kept */
+/*        in a ring until the application sends it off the device.    */
+/*                                                                     */
+/***********************************************************************/
+
+#ifndef TRACE_H__
+#define TRACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_RING_SIZE         256     // records, a power of two
+
+#define TRACE_FLAG_READ         0x01
+#define TRACE_FLAG_PREFIXED     0x02    // write sent from the caller's buffer
+#define TRACE_FLAG_SPI          0x04
+#define TRACE_FLAG_BANK_SHIFT   4       // register bank selected at the time
+#define TRACE_FLAG_BANK_MASK    0x30
+
+// One transfer, twelve bytes in the byte order of the nRF52 (little
+// endian).  This is also the format on the diagnostics characteristic and
+// what sim/trace_decode reads.
+typedef struct
+{
+    uint32_t start_us;          // imu_int_time_us() when the transfer went on the bus
+    uint16_t duration_us;       // saturates at 65535
+    uint16_t result;            // low half of the ret_code_t, 0 on success
+    uint8_t  reg;               // register, without the bank or the SPI read bit
+    uint8_t  flags;             // TRACE_FLAG_*
+    uint8_t  length;            // data bytes, without the register byte
+    uint8_t  seq;               // counts every record, a gap shows records dropped
+} trace_record_t;
+
+// Record a finished transfer to the slave at addr.  p_data is the data of a
+// write, so that the bank changes of each sensor can be followed, and may be
+// NULL for a read.  Called by the bus transport; there must be only one
+// caller at a time.
+void     trace_bus(uint8_t addr, uint8_t reg, const uint8_t * p_data, uint8_t length, uint8_t flags,
+                   uint32_t start_us, uint32_t end_us, uint32_t result);
+
+// Consumer side, for a single reader.  trace_peek() copies out up to max of
+// the oldest records without removing them, trace_consume() removes them.
+uint32_t trace_peek(trace_record_t * p_records, uint32_t max);
+void     trace_consume(uint32_t count);
+uint32_t trace_dropped(void);
+
+#endif // TRACE_H__
@@ -18,13 +18,165 @@
  * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+/***********************************************************************/
+/*                                                                     */
+/* TWI -- register block transfers on TWIM0 (EasyDMA).  Transfers are  */
+/*        queued and run from the TWI interrupt one after the other,   */
+/*        so the CPU is free while the bus is busy.  A read is a       */
+/*        single TXRX transfer, and a list of transfers is queued as   */
+/*        a whole so that nothing else runs in between.  Short writes  */
+/*        are copied into the queue, long ones go out of the caller's  */
+/*        buffer.  The blocking functions queue their transfers and    */
+/*        wait for the callback.                                       */
+/*                                                                     */
+/*        For capture the queue is held and the TWIM is left armed     */
+/*        with a repeated TXRX read, which PPI starts on every INT     */
+/*        pulse without the CPU.                                       */
+/*                                                                     */
+/*        A transfer that never finishes, typically a sensor holding   */
+/*        SDA low after a reset in the middle of a byte, is retired    */
+/*        with NRF_ERROR_TIMEOUT by twi_check(); SCL is clocked until  */
+/*        SDA is released and the TWIM is set up again.                */
+/*                                                                     */
+/***********************************************************************/
+
 #include <stdio.h>
 #include <string.h>
 
+#include "nrf_delay.h"
+#include "nrf_gpio.h"
+
 #include "twi.h"
+#include "trace.h"
+#include "imu_int.h"
+
+#define TWI_BYTE_US         36      // 9 bits at 250kHz
+#define TWI_STALL_US        2000    // on top of the bytes, for clock stretching and interrupt latency
+#define TWI_RECOVER_CLOCKS  9       // a slave holding SDA lets go within one byte and its ACK
+#define TWI_RECOVER_HALF_US 5       // half an SCL period of the clock-out, 100kHz
+
+typedef struct
+{
+    twi_xfer_t xfer;
+    bool       chained;                 // more transfers of the same list follow
+    uint8_t    tx[1 + TWI_MAX_WRITE];   // register address, then write data
+} twi_slot_t;
 
 static const nrf_drv_twi_t m_twi = NRF_DRV_TWI_INSTANCE(0);
 
+static twi_slot_t       m_queue[TWI_QUEUE_SIZE];
+static volatile uint8_t m_head;         // transfer on the bus, if m_busy
+static volatile uint8_t m_count;        // transfers queued, including the one on the bus
+static volatile bool    m_busy;
+static volatile bool    m_capture;      // the TWIM belongs to the capture read
+static uint8_t          m_capture_reg;  // EasyDMA cannot send from the stack
+static uint8_t          m_capture_length;
+static uint32_t         m_start_us;     // when the transfer at the head went on the bus
+static ret_code_t       m_start_error;  // the driver refused the transfer at the head
+static twi_errors_t     m_errors;
+
+// Put the transfer at the head of the queue on the bus.  A read sends the
+// register address and reads the block after a repeated start.
+static void twi_start(void)
+{
+    twi_slot_t              * p_slot = &m_queue[m_head];
+    nrf_drv_twi_xfer_desc_t   xfer;
+    ret_code_t                err_code;
+
+    if (p_slot->xfer.read)
+    {
+        xfer = (nrf_drv_twi_xfer_desc_t)NRF_DRV_TWI_XFER_DESC_TXRX(p_slot->xfer.addr, p_slot->tx, 1,
+                                                                   p_slot->xfer.p_data, p_slot->xfer.length);
+    }
+    else
+    {
+        xfer = (nrf_drv_twi_xfer_desc_t)NRF_DRV_TWI_XFER_DESC_TX(p_slot->xfer.addr,
+                                                                 p_slot->xfer.prefixed ? p_slot->xfer.p_data : p_slot->tx,
+                                                                 p_slot->xfer.length + 1);
+    }
+    m_start_us = imu_int_time_us();
+    err_code = nrf_drv_twi_xfer(&m_twi, &xfer, 0);
+
+    // left on the queue, twi_check() retires it like a stalled transfer
+    m_start_error = err_code;
+}
+
+// Trace the transfer at the head of the queue.  trace_bus() takes one
+// caller at a time, so this runs in the TWI interrupt or with it held off.
+static void twi_trace(ret_code_t result)
+{
+    twi_slot_t * p_slot = &m_queue[m_head];
+
+    trace_bus(p_slot->xfer.addr, p_slot->xfer.reg, p_slot->xfer.prefixed ? &p_slot->xfer.p_data[1] : &p_slot->tx[1],
+              p_slot->xfer.length, (p_slot->xfer.read ? TRACE_FLAG_READ : 0) | (p_slot->xfer.prefixed ? TRACE_FLAG_PREFIXED : 0),
+              m_start_us, imu_int_time_us(), result);
+}
+
+// Retire the transfer at the head of the queue, once traced, and start the
+// next one.  After a failure the rest of its list is retired with the same
+// result; it never reaches the bus, so it is not traced.
+static void twi_complete(ret_code_t result)
+{
+    twi_xfer_t xfer;
+    bool       chained;
+
+    do
+    {
+        xfer    = m_queue[m_head].xfer;
+        chained = m_queue[m_head].chained;
+
+        CRITICAL_REGION_ENTER();
+        m_head = (m_head + 1) % TWI_QUEUE_SIZE;
+        m_count--;
+        m_busy = (m_count > 0);
+        if (m_busy && ((result == NRF_SUCCESS) || !chained))
+        {
+            twi_start();
+        }
+        CRITICAL_REGION_EXIT();
+
+        // the callback may queue the next step of its own sequence
+        if (xfer.callback != NULL)
+        {
+            xfer.callback(result, xfer.p_context);
+        }
+    } while ((result != NRF_SUCCESS) && chained);
+}
+
+void twi_handler(nrf_drv_twi_evt_t const * p_event, void * p_context)
+{
+    ret_code_t result;
+
+    // only errors are reported while capturing, a failed read leaves its
+    // slot as it was
+    if (m_capture)
+    {
+        return;
+    }
+
+    switch (p_event->type)
+    {
+        case NRF_DRV_TWI_EVT_DONE:
+            result = NRF_SUCCESS;
+            break;
+
+        case NRF_DRV_TWI_EVT_ADDRESS_NACK:
+            m_errors.nacks++;
+            result = NRF_ERROR_DRV_TWI_ERR_ANACK;
+            break;
+
+        case NRF_DRV_TWI_EVT_DATA_NACK:
+            m_errors.nacks++;
+            result = NRF_ERROR_DRV_TWI_ERR_DNACK;
+            break;
+
+        default:
+            return;
+    }
+    twi_trace(result);
+    twi_complete(result);
+}
+
 void twi_init (void)
 {
     ret_code_t err_code;
@@ -37,7 +189,7 @@ void twi_init (void)
        .interrupt_priority = APP_IRQ_PRIORITY_HIGH
     };
 
-    err_code = nrf_drv_twi_init(&m_twi, &config, NULL, NULL);
+    err_code = nrf_drv_twi_init(&m_twi, &config, twi_handler, NULL);
     APP_ERROR_CHECK(err_code);
 
     nrf_drv_twi_enable(&m_twi);
@@ -51,25 +203,272 @@ void twi_enable(bool isEnabled)
 		nrf_drv_twi_disable(&m_twi);
 }
 
-void twi_write_register(uint8_t addr, uint8_t reg, uint8_t value)
+// Queue a list of transfers back to back, they start right away if the bus
+// is idle.  Either the whole list is queued or nothing is.
+ret_code_t twi_schedule_list(twi_xfer_t const * p_list, uint8_t count)
+{
+    twi_slot_t * p_slot;
+    ret_code_t   err_code = NRF_SUCCESS;
+    uint8_t      i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!p_list[i].read && (p_list[i].length > (p_list[i].prefixed ? TWI_MAX_PREFIXED : TWI_MAX_WRITE)))
+        {
+            return NRF_ERROR_INVALID_LENGTH;
+        }
+    }
+
+    CRITICAL_REGION_ENTER();
+    if ((count == 0) || (count > TWI_QUEUE_SIZE - m_count))
+    {
+        err_code = NRF_ERROR_NO_MEM;
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            p_slot = &m_queue[(m_head + m_count) % TWI_QUEUE_SIZE];
+            p_slot->xfer    = p_list[i];
+            p_slot->chained = (i < count - 1);
+            p_slot->tx[0]   = p_list[i].reg;
+            if (!p_list[i].read && p_list[i].prefixed)
+            {
+                p_list[i].p_data[0] = p_list[i].reg;
+            }
+            else if (!p_list[i].read)
+            {
+                memcpy(&p_slot->tx[1], p_list[i].p_data, p_list[i].length);
+            }
+            m_count++;
+        }
+        if (!m_busy)
+        {
+            m_busy = true;
+            twi_start();
+        }
+    }
+    CRITICAL_REGION_EXIT();
+
+    return err_code;
+}
+
+ret_code_t twi_schedule(twi_xfer_t const * p_xfer)
+{
+    return twi_schedule_list(p_xfer, 1);
+}
+
+bool twi_idle(void)
+{
+    return !m_busy;
+}
+
+// Clock SCL until a slave stuck in the middle of a byte releases SDA, then
+// send a STOP.  The pins are open drain like the TWIM drives them, and the
+// clock-out ends after TWI_RECOVER_CLOCKS pulses whatever SDA does, so this
+// takes about 0.1ms plus the TWIM set-up.
+static void twi_bus_recover(void)
+{
+    uint32_t start_us = imu_int_time_us();
+    uint32_t i;
+
+    nrf_drv_twi_uninit(&m_twi);
+
+    nrf_gpio_pin_set(SCL_PIN);
+    nrf_gpio_pin_set(SDA_PIN);
+    nrf_gpio_cfg(SCL_PIN, NRF_GPIO_PIN_DIR_OUTPUT, NRF_GPIO_PIN_INPUT_CONNECT,
+                 NRF_GPIO_PIN_PULLUP, NRF_GPIO_PIN_S0D1, NRF_GPIO_PIN_NOSENSE);
+    nrf_gpio_cfg(SDA_PIN, NRF_GPIO_PIN_DIR_OUTPUT, NRF_GPIO_PIN_INPUT_CONNECT,
+                 NRF_GPIO_PIN_PULLUP, NRF_GPIO_PIN_S0D1, NRF_GPIO_PIN_NOSENSE);
+    nrf_delay_us(TWI_RECOVER_HALF_US);
+
+    for (i = 0; (i < TWI_RECOVER_CLOCKS) && (nrf_gpio_pin_read(SDA_PIN) == 0); i++)
+    {
+        nrf_gpio_pin_clear(SCL_PIN);
+        nrf_delay_us(TWI_RECOVER_HALF_US);
+        nrf_gpio_pin_set(SCL_PIN);
+        nrf_delay_us(TWI_RECOVER_HALF_US);
+    }
+
+    // STOP: SDA rises while SCL is high
+    nrf_gpio_pin_clear(SDA_PIN);
+    nrf_delay_us(TWI_RECOVER_HALF_US);
+    nrf_gpio_pin_set(SDA_PIN);
+    nrf_delay_us(TWI_RECOVER_HALF_US);
+
+    twi_init();
+
+    m_errors.recoveries++;
+    if (imu_int_time_us() - start_us > m_errors.recovery_us)
+    {
+        m_errors.recovery_us = imu_int_time_us() - start_us;
+    }
+}
+
+// A transfer is given twice its time on the wire, plus TWI_STALL_US.  The
+// capture read has no end the CPU sees, so it is left alone.
+bool twi_check(void)
+{
+    twi_slot_t * p_slot;
+    uint32_t     limit_us;
+    bool         stalled = false;
+
+    CRITICAL_REGION_ENTER();
+    if (m_busy && !m_capture)
+    {
+        p_slot   = &m_queue[m_head];
+        limit_us = 2 * (p_slot->xfer.length + 3) * TWI_BYTE_US + TWI_STALL_US;
+        stalled  = (m_start_error != NRF_SUCCESS) || (imu_int_time_us() - m_start_us > limit_us);
+    }
+    if (stalled)
+    {
+        // nothing can complete in between, the TWIM is gone until set up again
+        twi_bus_recover();
+        m_start_error = NRF_SUCCESS;
+        m_errors.timeouts++;
+        twi_trace(NRF_ERROR_TIMEOUT);
+    }
+    CRITICAL_REGION_EXIT();
+
+    if (stalled)
+    {
+        // the rest of its list goes with it, the queue moves on
+        twi_complete(NRF_ERROR_TIMEOUT);
+    }
+    return stalled;
+}
+
+void twi_errors_get(twi_errors_t * p_errors)
 {
-    //uint8_t data[2];
-    //data[0] = reg;
-    //data[1] = value;
-    //nrf_drv_twi_tx(&m_twi, addr, data, 2, false);
+    CRITICAL_REGION_ENTER();
+    *p_errors = m_errors;
+    CRITICAL_REGION_EXIT();
+}
+
+// Arm the capture read.  The queue has to be empty, as it is before the
+// sensor starts streaming.
+ret_code_t twi_capture_arm(uint8_t addr, uint8_t reg, uint8_t * p_buffer, uint8_t length,
+                           uint32_t * p_start_task, uint32_t * p_done_event)
+{
+    nrf_drv_twi_xfer_desc_t xfer;
+    ret_code_t              err_code = NRF_SUCCESS;
+
+    CRITICAL_REGION_ENTER();
+    if (m_busy)
+    {
+        err_code = NRF_ERROR_BUSY;
+    }
+    else
+    {
+        m_busy    = true;
+        m_capture = true;
+    }
+    CRITICAL_REGION_EXIT();
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    m_capture_reg    = reg;
+    m_capture_length = length;
+    xfer = (nrf_drv_twi_xfer_desc_t)NRF_DRV_TWI_XFER_DESC_TXRX(addr, &m_capture_reg, 1, p_buffer, length);
+    err_code = nrf_drv_twi_xfer(&m_twi, &xfer, NRF_DRV_TWI_FLAG_HOLD_XFER | NRF_DRV_TWI_FLAG_REPEATED_XFER |
+                                                NRF_DRV_TWI_FLAG_RX_POSTINC | NRF_DRV_TWI_FLAG_NO_XFER_EVT_HANDLER);
+    if (err_code != NRF_SUCCESS)
+    {
+        twi_capture_disarm();
+        return err_code;
+    }
+
+    *p_start_task = nrf_drv_twi_start_task_get(&m_twi, NRF_DRV_TWI_XFER_TXRX);
+    *p_done_event = nrf_drv_twi_stopped_event_get(&m_twi);
+    return NRF_SUCCESS;
+}
+
+// Point the next capture read back at p_buffer.  The TWIM latches the
+// pointer when a read starts, so this has to happen between two reads.
+void twi_capture_rearm(uint8_t * p_buffer)
+{
+    nrf_twim_rx_buffer_set(m_twi.u.twim.p_twim, p_buffer, m_capture_length);
+}
 
+// Release the bus and run whatever was queued meanwhile.  The PPI channel
+// has to be off already and the last read it started finished, the TWIM
+// has no status that tells.
+void twi_capture_disarm(void)
+{
+    CRITICAL_REGION_ENTER();
+    m_capture = false;
+    m_busy    = (m_count > 0);
+    if (m_busy)
+    {
+        twi_start();
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+static void twi_blocking_handler(ret_code_t result, void * p_context)
+{
+    *(volatile ret_code_t *)p_context = result;
+}
+
+// Queue the list and wait for its last transfer, the bus interrupt does the
+// work.  The callback of the last transfer is replaced.
+ret_code_t twi_transfer_list(twi_xfer_t * p_list, uint8_t count)
+{
+    volatile ret_code_t result = NRF_ERROR_BUSY;
+    ret_code_t          err_code;
+
+    if ((count == 0) || (count > TWI_QUEUE_SIZE))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    p_list[count - 1].callback  = twi_blocking_handler;
+    p_list[count - 1].p_context = (void *)&result;
+
+    do
+    {
+        err_code = twi_schedule_list(p_list, count);
+        if (err_code == NRF_ERROR_NO_MEM)
+        {
+            (void)twi_check();
+        }
+    } while (err_code == NRF_ERROR_NO_MEM);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // bounded: a stall is retired, and its callback ends the wait
+    while (result == NRF_ERROR_BUSY)
+    {
+        (void)twi_check();
+    }
+    return result;
+}
+
+static ret_code_t twi_transfer(uint8_t addr, uint8_t reg, uint8_t *block, uint8_t count, bool read)
+{
+    twi_xfer_t xfer =
+    {
+        .addr      = addr,
+        .reg       = reg,
+        .p_data    = block,
+        .length    = count,
+        .read      = read
+    };
+
+    return twi_transfer_list(&xfer, 1);
+}
+
+void twi_write_register(uint8_t addr, uint8_t reg, uint8_t value)
+{
     twi_write_register_block(addr, reg, &value, 1);
 }
 
 void twi_write_register_block(uint8_t addr, uint8_t reg, uint8_t *block, uint8_t count)
 {
-    uint8_t data[17];
-    data[0] = reg;
-    memcpy(&data[1], block, MIN(count, 16));
-    nrf_drv_twi_tx(&m_twi, addr, &data[0], count+1, false);
-
-    //nrf_drv_twi_tx(&m_twi, addr, &reg, 1, true);
-    //nrf_drv_twi_tx(&m_twi, addr, block, count, false);
+    twi_transfer(addr, reg, block, count, false);
 }
 
 uint8_t twi_read_register(uint8_t addr, uint8_t reg)
@@ -81,7 +480,5 @@ uint8_t twi_read_register(uint8_t addr, uint8_t reg)
 
 void twi_read_register_block(uint8_t addr, uint8_t reg, uint8_t *block, uint8_t count)
 {
-    nrf_drv_twi_tx(&m_twi,addr,&reg,1,true);
-    nrf_drv_twi_rx(&m_twi,addr,block,count);
+    twi_transfer(addr, reg, block, count, true);
 }
-
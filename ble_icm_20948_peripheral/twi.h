@@ -39,12 +39,68 @@ typedef struct
     uint8_t tilt;
 } sample_t;
 
-static volatile bool m_xfer_done = true;
-static volatile bool m_set_mode_done = false;
+#define TWI_QUEUE_SIZE      8       // transfers that can be waiting at once
+#define TWI_MAX_WRITE       16      // bytes per register block write that is copied
+#define TWI_MAX_PREFIXED    254     // bytes per prefixed write, EasyDMA MAXCNT less the register byte
+
+// Called from the TWI interrupt once a transfer has completed, result is
+// NRF_SUCCESS, the NRF_ERROR_DRV_TWI_ERR_* code of the failure, or
+// NRF_ERROR_TIMEOUT for a transfer that twi_check() retired.
+typedef void (*twi_callback_t)(ret_code_t result, void * p_context);
+
+// A register block access.  Write data is copied when the transfer is
+// scheduled, the buffer of a read has to stay valid until the callback.
+// A prefixed write is sent from its own buffer instead, without a copy:
+// p_data[0] is left free for the register address and the length bytes of
+// data follow it.  That buffer also has to stay valid until the callback.
+typedef struct
+{
+    uint8_t         addr;
+    uint8_t         reg;
+    uint8_t       * p_data;
+    uint8_t         length;
+    bool            read;
+    bool            prefixed;
+    twi_callback_t  callback;       // may be NULL
+    void          * p_context;
+} twi_xfer_t;
+
+// Bus errors since boot.
+typedef struct
+{
+    uint32_t nacks;             // transfers the sensor did not acknowledge
+    uint32_t timeouts;          // transfers that stalled and were retired
+    uint32_t recoveries;        // bus clear-outs, each followed by a TWIM set-up
+    uint32_t recovery_us;       // longest recovery
+} twi_errors_t;
 
 void twi_handler(nrf_drv_twi_evt_t const * p_event, void * p_context);
 void twi_init(void);
 
+ret_code_t twi_schedule(twi_xfer_t const * p_xfer);
+ret_code_t twi_schedule_list(twi_xfer_t const * p_list, uint8_t count);
+bool       twi_idle(void);
+
+// Retire the transfer on the bus if it has run far longer than its length
+// allows, or never started, and recover the bus.  The blocking functions
+// call this while they wait; the application calls it while it waits for
+// a non-blocking one.  Returns true if the bus had stalled.
+bool       twi_check(void);
+void       twi_errors_get(twi_errors_t * p_errors);
+
+// The blocking functions wait for every transfer queued before them, so they
+// must not be called from an interrupt at or above the TWI's priority.
+ret_code_t twi_transfer_list(twi_xfer_t * p_list, uint8_t count);
+
+// Capture: a read of length bytes from reg, started by PPI through the
+// returned task every time, that lands in the next length bytes of p_buffer
+// (EasyDMA ArrayList).  The returned event marks the end of each read.  The
+// bus is reserved while armed, transfers queued meanwhile wait for disarm.
+ret_code_t twi_capture_arm(uint8_t addr, uint8_t reg, uint8_t * p_buffer, uint8_t length,
+                           uint32_t * p_start_task, uint32_t * p_done_event);
+void       twi_capture_rearm(uint8_t * p_buffer);
+void       twi_capture_disarm(void);
+
 void    twi_write_register(uint8_t addr, uint8_t reg, uint8_t value);
 void    twi_write_register_block(uint8_t addr, uint8_t reg, uint8_t *block, uint8_t count);
 uint8_t twi_read_register(uint8_t addr, uint8_t reg);
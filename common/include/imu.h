@@ -27,6 +27,7 @@
 #include <stddef.h>
 
 #define IMU_ADDR                0X68
+#define IMU_ADDR_AD0            0x69    // a second sensor, with its AD0 pin high
 
 #define IMU_REG_BANK_SEL        0x7F    // common to all banks
 
@@ -35,7 +36,13 @@
 #define IMU_WHO_AM_I            0x0000
 
 #define IMU_USER_CTRL           0x0003
+#define IMU_BIT_DMP_EN                  0x80
 #define IMU_BIT_FIFO_EN                 0x40
+#define IMU_BIT_I2C_MST_EN              0x20
+#define IMU_BIT_I2C_IF_DIS              0x10
+#define IMU_BIT_DMP_RST                 0x08
+#define IMU_BIT_SRAM_RST                0x04
+#define IMU_BIT_I2C_MST_RST             0x02
 
 #define IMU_LP_CONFIG           0x0005
 #define IMU_I2C_MST_CYCLE               0x40
@@ -45,21 +52,35 @@
 #define IMU_PWR_MGMT_1          0x0006
 #define IMU_BIT_DEVICE_RESET            0x80
 #define IMU_BIT_SLEEP                   0x40
+#define IMU_BIT_LP_EN                   0x20
+#define IMU_BIT_TEMP_DIS                0x08
+
+#define IMU_PWR_MGMT_2          0x0007
+#define IMU_BIT_DISABLE_ACCEL           0x38
+#define IMU_BIT_DISABLE_GYRO            0x07
 
 #define IMU_INT_ENABLE          0x0010
+#define IMU_BIT_DMP_INT1_EN             0x02
 #define IMU_INT_ENABLE_1        0x0011
 #define IMU_BIT_RAW_DATA_0_RDY_EN       0x01
 #define IMU_INT_ENABLE_2        0x0012
+#define IMU_BIT_FIFO_OVERFLOW_EN_0      0x01
 #define IMU_INT_ENABLE_3        0x0013
+#define IMU_I2C_MST_STATUS      0x0017
+#define IMU_BIT_I2C_SLV4_DONE           0x40
+#define IMU_BIT_I2C_SLV4_NACK           0x10
 #define IMU_INT_STATUS          0x0019
 #define IMU_INT_STATUS_1        0x001A
 #define IMU_BIT_RAW_DATA_0_RDY_INT      0X01
 #define IMU_INT_STATUS_2        0x001B
+#define IMU_BIT_FIFO_OVERFLOW_INT_0     0x01
 #define IMU_INT_STATUS_3        0x001C
+#define IMU_SINGLE_FIFO_PRIORITY_SEL 0x0026
 
 #define IMU_ACCEL_XOUT_H        0x002d
 #define IMU_GYRO_XOUT_H         0x0033
 #define IMU_TEMP_OUT_H          0x0039
+#define IMU_EXT_SLV_SENS_DATA_00 0x003b
 
 #define IMU_FIFO_EN_1           0x0066
 #define IMU_BIT_SLV_0_FIFO_EN           0x01
@@ -79,12 +100,152 @@
 #define IMU_BIT_RAW_DATA_RDY            0x0f
 #define IMU_FIFO_CFG            0x0076
 #define IMU_BIT_FIFO_CFG                0x01
+#define IMU_HW_FIX_DISABLE      0x0075
+#define IMU_MEM_START_ADDR      0x007c
+#define IMU_MEM_R_W             0x007d
+#define IMU_MEM_BANK_SEL        0x007e
+
+#define IMU_TIMEBASE_CORRECTION_PLL 0x0128
+
+#define IMU_FIFO_SIZE           512     // FIFO size in bytes
+#define IMU_FIFO_MAX_BURST      254     // largest single FIFO_R_W read (EasyDMA MAXCNT on nRF52832, less the SPI command byte)
+#define IMU_FIFO_FRAME_MAX      20      // accel, gyro, temperature and magnetometer
+#define IMU_CAPTURE_SLOT_MAX    (IMU_FIFO_FRAME_MAX + 1)        // a frame and the SPI command byte
+#define IMU_CAPTURE_FRAMES_MAX  32      // frames per half of the capture buffer
 
 #define IMU_GYRO_SMPLRT_DIV     0x0200
+#define IMU_GYRO_SMPLRT_DIV_MAX         255
 #define IMU_GYRO_CONFIG_1       0x0201
 #define IMU_GYRO_CONFIG_2       0x0202
+#define IMU_ACCEL_SMPLRT_DIV_1  0x0210
+#define IMU_ACCEL_SMPLRT_DIV_2  0x0211
+#define IMU_ACCEL_SMPLRT_DIV_MAX        4095
 #define IMU_ACCEL_CONFIG        0x0214
 #define IMU_ACCEL_CONFIG_2      0x0215
+#define IMU_PRGM_START_ADDRH    0x0250
+
+#define IMU_I2C_MST_ODR_CONFIG  0x0300
+#define IMU_I2C_MST_CTRL        0x0301
+#define IMU_BIT_I2C_MST_P_NSR           0x10
+#define IMU_I2C_MST_CLK_345KHZ          0x07
+#define IMU_I2C_SLV0_ADDR       0x0303
+#define IMU_I2C_SLV0_REG        0x0304
+#define IMU_I2C_SLV0_CTRL       0x0305
+#define IMU_I2C_SLV1_ADDR       0x0307
+#define IMU_I2C_SLV1_REG        0x0308
+#define IMU_I2C_SLV1_CTRL       0x0309
+#define IMU_I2C_SLV1_DO         0x030a
+#define IMU_I2C_SLV4_ADDR       0x0313
+#define IMU_I2C_SLV4_REG        0x0314
+#define IMU_I2C_SLV4_CTRL       0x0315
+#define IMU_I2C_SLV4_DO         0x0316
+#define IMU_I2C_SLV4_DI         0x0317
+#define IMU_BIT_I2C_SLV_READ            0x80    // I2C_SLVx_ADDR: read from the slave
+#define IMU_BIT_I2C_SLV_EN              0x80    // I2C_SLVx_CTRL: enable the slave
+#define IMU_BIT_I2C_SLV_BYTE_SW         0x40    // I2C_SLVx_CTRL: swap the bytes of each pair
+#define IMU_BIT_I2C_SLV_GRP             0x10    // I2C_SLVx_CTRL: pairs end on an even register
+
+// AK09916 magnetometer, reached through the ICM-20948 auxiliary I2C master
+#define AK09916_ADDR            0x0c
+#define AK09916_WIA2            0x01
+#define AK09916_EXPECTED_WIA2   0x09
+#define AK09916_RSV2            0x03    // a burst read from here continues at ST1
+#define AK09916_HXL             0x11    // HXL..HZH, little endian
+#define AK09916_ST2             0x18    // must be read to release the data registers
+#define AK09916_CNTL2           0x31
+#define AK09916_MODE_POWER_DOWN         0x00
+#define AK09916_MODE_SINGLE             0x01
+#define AK09916_MODE_CONT_10HZ          0x02
+#define AK09916_MODE_CONT_20HZ          0x04
+#define AK09916_MODE_CONT_50HZ          0x06
+#define AK09916_MODE_CONT_100HZ         0x08
+#define AK09916_CNTL3           0x32
+#define AK09916_BIT_SRST                0x01
+
+// Digital Motion Processor memory map (byte addresses in DMP memory)
+#define DMP_START_ADDRESS       0x1000  // program counter after DMP reset
+#define DMP_LOAD_START          0x0090  // firmware image load address
+#define DMP_MEM_BANK_SIZE       256
+#define DMP_MAX_SERIAL_WRITE    128     // bytes per MEM_R_W transfer, half a DMP memory bank
+
+#define DMP_DATA_OUT_CTL1       (4 * 16)
+#define DMP_DATA_OUT_CTL2       (4 * 16 + 2)
+#define DMP_DATA_INTR_CTL       (4 * 16 + 12)
+#define DMP_MOTION_EVENT_CTL    (4 * 16 + 14)
+#define DMP_DATA_RDY_STATUS     (8 * 16 + 10)
+#define DMP_ODR_QUAT9           (10 * 16 + 8)
+#define DMP_ODR_QUAT6           (10 * 16 + 12)
+#define DMP_ACCEL_ONLY_GAIN     (16 * 16 + 12)
+#define DMP_GYRO_SF             (19 * 16)
+#define DMP_CPASS_MTX_00        (23 * 16)
+#define DMP_CPASS_MTX_11        (24 * 16)
+#define DMP_CPASS_MTX_22        (25 * 16)
+#define DMP_ACC_SCALE           (30 * 16)
+#define DMP_GYRO_FULLSCALE      (72 * 16 + 12)
+#define DMP_ACC_SCALE2          (79 * 16 + 4)
+#define DMP_ACCEL_ALPHA_VAR     (91 * 16)
+#define DMP_ACCEL_A_VAR         (92 * 16)
+#define DMP_ACCEL_CAL_RATE      (94 * 16 + 4)
+#define DMP_CPASS_TIME_BUFFER   (112 * 16 + 14)
+#define DMP_B2S_MTX_00          (208 * 16)
+#define DMP_B2S_MTX_11          (209 * 16 + 4)
+#define DMP_B2S_MTX_22          (210 * 16 + 8)
+
+// DATA_OUT_CTL1 bits, also the header of each DMP FIFO packet
+#define DMP_HEADER_QUAT6                0x0800  // game rotation vector (6-axis)
+#define DMP_HEADER_QUAT9                0x0400  // rotation vector (9-axis)
+#define DMP_HEADER_BYTES                2
+#define DMP_FOOTER_BYTES                2
+#define DMP_QUAT6_BYTES                 12      // x, y, z as Q30
+#define DMP_QUAT9_BYTES                 14      // x, y, z as Q30 and heading accuracy
+
+// DATA_RDY_STATUS and MOTION_EVENT_CTL bits
+#define DMP_DATA_RDY_GYRO               0x0001
+#define DMP_DATA_RDY_ACCEL              0x0002
+#define DMP_DATA_RDY_COMPASS            0x0008
+#define DMP_MOTION_ACCEL_CALIBR         0x0200
+#define DMP_MOTION_GYRO_CALIBR          0x0100
+#define DMP_MOTION_COMPASS_CALIBR       0x0080
+#define DMP_MOTION_9AXIS                0x0040
+
+#define DMP_RATE_HZ             56      // sensor rate the DMP is run at (1125Hz / 20)
+
+// Writable configuration registers mirrored by the driver's shadow cache,
+// as (register, value after reset, self-clearing bits).  Entries are kept
+// in bank|register order so that a commit walks each bank only once.
+#define IMU_SHADOW_REGISTERS(X)                 \
+        X(IMU_USER_CTRL,        0x00,   0x0e)   \
+        X(IMU_LP_CONFIG,        0x40,   0x00)   \
+        X(IMU_PWR_MGMT_1,       0x41,   0x80)   \
+        X(IMU_PWR_MGMT_2,       0x00,   0x00)   \
+        X(IMU_INT_ENABLE,       0x00,   0x00)   \
+        X(IMU_INT_ENABLE_1,     0x00,   0x00)   \
+        X(IMU_INT_ENABLE_2,     0x00,   0x00)   \
+        X(IMU_INT_ENABLE_3,     0x00,   0x00)   \
+        X(IMU_FIFO_EN_1,        0x00,   0x00)   \
+        X(IMU_FIFO_EN_2,        0x00,   0x00)   \
+        X(IMU_FIFO_MODE,        0x00,   0x00)   \
+        X(IMU_HW_FIX_DISABLE,   0x00,   0x00)   \
+        X(IMU_FIFO_CFG,         0x00,   0x00)   \
+        X(IMU_GYRO_SMPLRT_DIV,  0x00,   0x00)   \
+        X(IMU_GYRO_CONFIG_1,    0x01,   0x00)   \
+        X(IMU_GYRO_CONFIG_2,    0x00,   0x00)   \
+        X(IMU_ACCEL_SMPLRT_DIV_1, 0x00, 0x00)   \
+        X(IMU_ACCEL_SMPLRT_DIV_2, 0x00, 0x00)   \
+        X(IMU_ACCEL_CONFIG,     0x01,   0x00)   \
+        X(IMU_ACCEL_CONFIG_2,   0x00,   0x00)   \
+        X(IMU_I2C_MST_ODR_CONFIG, 0x00, 0x00)   \
+        X(IMU_I2C_MST_CTRL,     0x00,   0x00)   \
+        X(IMU_I2C_SLV0_ADDR,    0x00,   0x00)   \
+        X(IMU_I2C_SLV0_REG,     0x00,   0x00)   \
+        X(IMU_I2C_SLV0_CTRL,    0x00,   0x00)   \
+        X(IMU_I2C_SLV1_ADDR,    0x00,   0x00)   \
+        X(IMU_I2C_SLV1_REG,     0x00,   0x00)   \
+        X(IMU_I2C_SLV1_CTRL,    0x00,   0x00)   \
+        X(IMU_I2C_SLV1_DO,      0x00,   0x00)
+
+#define IMU_SHADOW_COUNT(reg, reset, clear)     + 1
+#define IMU_SHADOW_NUM_REGS     (0 IMU_SHADOW_REGISTERS(IMU_SHADOW_COUNT))
 
 // WHOAMI value for ICM-20948
 #define IMU_EXPECTED_WHOAMI     0xEA
@@ -92,7 +253,7 @@
 
 typedef struct _IMU_DATA {
         uint32_t deviceid;
-        uint32_t time_stamp;
+        uint32_t time_stamp;            // us, when the sample was taken
         int16_t ax;
         int16_t ay;
         int16_t az;
@@ -103,16 +264,49 @@ typedef struct _IMU_DATA {
         int16_t my;
         int16_t mz;
         int16_t temperature;
+        uint16_t sensor;                // index of the ICM-20948 on the node
 } IMU_DATA;
 
 extern IMU_DATA last_sample;
 
+// Orientation computed by the DMP, as a unit quaternion in Q30
+typedef struct _IMU_QUAT {
+        uint32_t deviceid;
+        uint32_t time_stamp;            // us, when the sample was taken
+        int32_t q0;                     // w
+        int32_t q1;                     // x
+        int32_t q2;                     // y
+        int32_t q3;                     // z
+        int16_t accuracy;               // heading accuracy, 9-axis only
+        uint16_t sensor;                // index of the ICM-20948 on the node
+} IMU_QUAT;
+
 /*device enum */
 typedef enum _INV_DEVICES {
         INV_ICM20948,
         INV_NUM_PARTS
 } INV_DEVICES;
 
+typedef enum _inv_icm20948_power_profile_e {
+        INV_ICM20948_POWER_FULL = 0,    // every sensor on, low noise mode
+        INV_ICM20948_POWER_ACCEL_ONLY,  // gyro, temperature and magnetometer off
+        INV_ICM20948_POWER_ACCEL_LP     // accel only and duty cycled at the sample rate
+} inv_icm20948_power_profile_e;
+
+// ACCEL_CONFIG_2 DEC3_CFG, samples averaged per output in accel cycle mode
+typedef enum _inv_icm20948_accel_avg_e {
+        INV_ICM20948_ACCEL_AVG_4 = 0,
+        INV_ICM20948_ACCEL_AVG_8,
+        INV_ICM20948_ACCEL_AVG_16,
+        INV_ICM20948_ACCEL_AVG_32
+} inv_icm20948_accel_avg_e;
+
+typedef enum _inv_icm20948_dmp_mode_e {
+        INV_ICM20948_DMP_OFF = 0,       // raw sensor data in the FIFO
+        INV_ICM20948_DMP_GAME_RV,       // 6-axis game rotation vector
+        INV_ICM20948_DMP_RV             // 9-axis rotation vector
+} inv_icm20948_dmp_mode_e;
+
 /**
  *  inv_icm20948_chip_config - chip configuration data.
  *    accl_fsr:          accelerometer full scale range
@@ -124,9 +318,16 @@ typedef enum _INV_DEVICES {
  *    temp_fifo_enable:  enable temperature data output
  *    enable:            master enable state
       bytes_per_datum:   number of bytes to read from fifo
- *    sample_rate:       sample update rate
+ *    sample_rate:       requested sample update rate in Hz
+ *    gyro_rate_mhz:     gyroscope output data rate achieved, in mHz
+ *    accel_rate_mhz:    accelerometer output data rate achieved, in mHz
+ *    fifo_rate_mhz:     rate frames (or DMP packets) enter the FIFO, in mHz
  *    accel_dlpf:        accelerometer digital low pass filter
  *    gyro_dlpf:         gyroscope digital low pass filter
+ *    dmp_mode:          DMP output, inv_icm20948_dmp_mode_e
+ *    power_profile:     sensors powered, inv_icm20948_power_profile_e
+ *    accel_avg:         accel averaging in cycle mode, inv_icm20948_accel_avg_e
+ *    fifo_watermark:    frames (or DMP packets) collected per wake-up
  */
 typedef struct _inv_icm20948_chip_config {
         unsigned int accl_fsr:2;
@@ -139,21 +340,192 @@ typedef struct _inv_icm20948_chip_config {
         unsigned int enable:1;
         uint16_t bytes_per_datum;
         uint16_t sample_rate;
+        uint32_t gyro_rate_mhz;
+        uint32_t accel_rate_mhz;
+        uint32_t fifo_rate_mhz;
         uint8_t accel_dlpf;
         uint8_t gyro_dlpf;
+        uint8_t dmp_mode;
+        uint8_t power_profile;
+        uint8_t accel_avg;
+        uint16_t fifo_watermark;
 } inv_icm20948_chip_config;
 
 /*
- *  inv_icm20948_state - Driver state variables
+ *  inv_icm20948_shadow - Shadow copy of the configuration registers
+ *    value:             last value written to (or read from) each register
+ *    valid:             bitmap of entries that hold the device's value
+ *    dirty:             bitmap of entries staged but not yet written
+ */
+typedef struct _inv_icm20948_shadow {
+        uint8_t  value[IMU_SHADOW_NUM_REGS];
+        uint32_t valid;
+        uint32_t dirty;
+} inv_icm20948_shadow;
+
+/*
+ *  inv_icm20948_state - Driver state variables, one per sensor
  *    chip_config:       cached attribute information
  *    chip_type:         chip type
+ *    addr:              I2C address, IMU_ADDR or IMU_ADDR_AD0
+ *    bank:              register bank the sensor has selected, 0xff if unknown
+ *    index:             sensor number on the node, carried into every sample
+ *    int_pin:           the MCU captures the time of this sensor's INT pulses
+ *    shadow:            configuration register cache
+ *    config_apply_us:   bus time of the last configuration sequence, in us
+ *    config_list:       configuration sequence being built, NULL if none
+ *    bringup:           reset and configuration progress
+ *    fifo_overflows:    number of times the FIFO overflowed and was reset
+ *    decode_fifo:       decoder for the FIFO frame layout in use
+ *    fifo_read:         non-blocking FIFO drain in progress
+ *    capture:           FIFO reads started by the INT pulse
  */
+typedef void (*inv_icm20948_fifo_decoder_t)(const uint8_t *frame, IMU_DATA *imu_data);
+
+struct _inv_icm20948_state;
+
+// Called from the bus interrupt when a non-blocking drain has finished, with
+// the number of frames read or -1 if the bus failed.
+typedef void (*inv_icm20948_fifo_callback_t)(struct _inv_icm20948_state *st, int16_t count);
+
+/*
+ *  inv_icm20948_fifo_read - Progress of a non-blocking FIFO drain
+ *    frames:            IMU_DATA, or IMU_QUAT in DMP mode, array being filled
+ *    max:               size of frames
+ *    total:             frames to read in this drain
+ *    done:              frames decoded so far
+ *    int_time:          INT capture the FIFO count was read against
+ *    time_stamp:        timestamp of the first frame
+ *    count:             FIFO_COUNTH/L as read
+ *    data_blk:          FIFO_R_W data, at most the whole FIFO
+ *    result:            what the drain finishes with once a FIFO reset is done
+ *    callback:          called when the drain has finished
+ *    context:           for the caller, e.g. the scheduler that started it
+ *    busy:              a drain is in progress
+ */
+typedef struct _inv_icm20948_fifo_read {
+        void *frames;
+        size_t max;
+        uint16_t total;
+        uint16_t done;
+        uint32_t int_time;
+        uint32_t time_stamp;
+        uint8_t count[2];
+        uint8_t data_blk[IMU_FIFO_SIZE];
+        int16_t result;
+        inv_icm20948_fifo_callback_t callback;
+        void *context;
+        volatile bool busy;
+} inv_icm20948_fifo_read;
+
+/*
+ *  inv_icm20948_capture - FIFO reads started by the INT pulse in hardware,
+ *        one frame per pulse, into the two halves of data_blk in turn
+ *    frames:            frames per half, the MCU is woken once per half
+ *    stride:            bytes per frame slot
+ *    offset:            start of the frame in its slot
+ *    filled:            halves filled since the capture was armed
+ *    consumed:          halves read by inv_icm20948_capture_read()
+ *    time_stamp:        INT capture of the last frame in the newest half
+ *    overruns:          halves refilled before they were read
+ *    late_rearms:       times the halves fell a frame out of step and the
+ *                       capture was armed again
+ *    late:              a read started before the re-arm, the halves are
+ *                       out of step until the capture is armed again
+ *    active:            the reads are armed
+ *    data_blk:          both halves, and a spare slot for a late re-arm
+ */
+typedef struct _inv_icm20948_capture {
+        uint16_t frames;
+        uint16_t stride;
+        uint16_t offset;
+        volatile uint32_t filled;
+        uint32_t consumed;
+        volatile uint32_t time_stamp;
+        uint32_t overruns;
+        uint32_t late_rearms;
+        volatile bool late;
+        bool active;
+        uint8_t data_blk[(2 * IMU_CAPTURE_FRAMES_MAX + 1) * IMU_CAPTURE_SLOT_MAX];
+} inv_icm20948_capture;
+
+/*
+ *  inv_icm20948_bringup - Progress of a bring-up run one step at a time
+ *    state:             inv_icm20948_bringup_e
+ *    tries:             polls spent in the current state
+ *    start_us:          time the reset was issued
+ *    time_us:           time from the reset to a configured device
+ */
+typedef enum _inv_icm20948_bringup_e {
+        INV_ICM20948_BRINGUP_IDLE = 0,
+        INV_ICM20948_BRINGUP_RESET,     // waiting for DEVICE_RESET to clear
+        INV_ICM20948_BRINGUP_WHOAMI,    // start-up time over, waiting for WHO_AM_I
+        INV_ICM20948_BRINGUP_DONE,
+        INV_ICM20948_BRINGUP_FAILED
+} inv_icm20948_bringup_e;
+
+typedef struct _inv_icm20948_bringup {
+        uint8_t state;
+        uint8_t tries;
+        uint32_t start_us;
+        uint32_t time_us;
+} inv_icm20948_bringup;
+
 typedef struct _inv_icm20948_state {
         inv_icm20948_chip_config *chip_config;
         INV_DEVICES  chip_type;
+        uint8_t addr;
+        uint8_t bank;
+        uint8_t index;
+        bool int_pin;
+        inv_icm20948_shadow shadow;
+        uint32_t config_apply_us;
+        struct _inv_icm20948_config_list *config_list;
+        inv_icm20948_bringup bringup;
+        uint32_t fifo_overflows;
+        inv_icm20948_fifo_decoder_t decode_fifo;
+        inv_icm20948_fifo_read fifo_read;
+        inv_icm20948_capture capture;
 } inv_icm20948_state;
 
+/*
+ *  inv_icm20948_sched - FIFO drains of the sensors sharing a bus, run one
+ *        after the other from the bus interrupt
+ *    sensors:           the sensors, in the order of their index
+ *    frames:            IMU_DATA, or IMU_QUAT in DMP mode, array per sensor
+ *    count:             frames read from each sensor in the last round
+ *    max:               size of each frames array
+ *    num:               number of sensors
+ *    first:             sensor the next round starts with
+ *    done:              sensors drained so far in this round
+ *    callback:          called when a round has finished
+ *    busy:              a round is in progress
+ */
+#define INV_ICM20948_SENSORS_MAX              2       // IMU_ADDR and IMU_ADDR_AD0
+
+struct _inv_icm20948_sched;
+typedef void (*inv_icm20948_sched_callback_t)(struct _inv_icm20948_sched *sched);
+
+typedef struct _inv_icm20948_sched {
+        inv_icm20948_state *sensors[INV_ICM20948_SENSORS_MAX];
+        void *frames[INV_ICM20948_SENSORS_MAX];
+        int16_t count[INV_ICM20948_SENSORS_MAX];
+        size_t max;
+        uint8_t num;
+        uint8_t first;
+        uint8_t done;
+        inv_icm20948_sched_callback_t callback;
+        volatile bool busy;
+} inv_icm20948_sched;
+
 #define INV_ICM20948_INIT_SAMPLE_RATE         10
+#define INV_ICM20948_INTERNAL_SAMPLE_RATE     1125    // ODR = 1125Hz / (1 + divider)
+
+#define INV_ICM20948_RESET_POLL_US            1000    // DEVICE_RESET poll interval
+#define INV_ICM20948_RESET_POLLS              10
+#define INV_ICM20948_STARTUP_US               100000  // start-up time after a reset
+#define INV_ICM20948_WHOAMI_POLL_US           1000    // WHO_AM_I retry interval
+#define INV_ICM20948_WHOAMI_POLLS             10
 
 typedef enum _inv_icm20948_accl_fsr_e {
 	INV_ICM20948_ACCEL_FSR_02G = 0,
@@ -202,29 +574,63 @@ typedef enum _inv_icm20948_accel_filter_e {
         NUM_ICM20948_ACCEL_FILTER
 } inv_icm20948_accel_filter_e;
 
+void inv_icm20948_init_state(inv_icm20948_state *st, inv_icm20948_chip_config *chip_config,
+                             uint8_t addr, uint8_t index, bool int_pin);
 int16_t inv_check_and_setup_chip(inv_icm20948_state *st);
+int32_t inv_icm20948_bringup_start(inv_icm20948_state *st);
+int32_t inv_icm20948_bringup_step(inv_icm20948_state *st);
 
-int16_t inv_icm20948_init(inv_icm20948_state *st);
-int16_t inv_icm20948_set_sleep_mode(bool sleep_mode);
-int16_t inv_icm20948_set_sample_frequency(uint16_t rate);
-uint8_t inv_icm20948_get_device_id(void);
+int16_t inv_icm20948_set_sleep_mode(inv_icm20948_state *st, bool sleep_mode);
+int16_t inv_icm20948_set_power_profile(inv_icm20948_state *st, uint8_t profile, uint8_t accel_avg);
+int16_t inv_icm20948_set_sample_frequency(inv_icm20948_state *st, uint16_t rate);
+uint8_t inv_icm20948_get_device_id(inv_icm20948_state *st);
 int16_t inv_icm20948_reset_fifo(inv_icm20948_state *st);
-void inv_icm20948_read_accel_xyz(int16_t *x, int16_t *y, int16_t *z);
-void inv_icm20948_read_gyro_xyz(int16_t *gx, int16_t *gy, int16_t *gz);
-void inv_icm20948_read_magn_xyz(int16_t *mx, int16_t *my, int16_t *mz);
-void inv_icm20948_temperature(int16_t *temperature);
-void inv_icm20948_read_imu(IMU_DATA *imu_data);
-int16_t inv_icm20948_set_gyro_dlpf(uint8_t rate);
-int16_t inv_icm20948_set_accel_dlpf(uint8_t rate);
-void inv_icm20948_config_gyro(uint8_t full_scale_select);
-void inv_icm20948_config_accel(uint8_t full_scale_select);
-
-int16_t inv_icm20948_get_fifo_counter(void);
+int16_t inv_icm20948_setup_magn(inv_icm20948_state *st);
+
+int16_t inv_icm20948_write_mems(inv_icm20948_state *st, uint16_t addr, const uint8_t *data, uint32_t size);
+int16_t inv_icm20948_read_mems(inv_icm20948_state *st, uint16_t addr, uint8_t *data, uint32_t size);
+int16_t inv_icm20948_load_dmp(inv_icm20948_state *st, const uint8_t *image, uint32_t size);
+int16_t inv_icm20948_enable_dmp(inv_icm20948_state *st, inv_icm20948_dmp_mode_e mode);
+int16_t inv_icm20948_read_dmp_fifo_batch(inv_icm20948_state *st, IMU_QUAT *imu_quat, size_t max);
+void inv_icm20948_read_accel_xyz(inv_icm20948_state *st, int16_t *x, int16_t *y, int16_t *z);
+void inv_icm20948_read_gyro_xyz(inv_icm20948_state *st, int16_t *gx, int16_t *gy, int16_t *gz);
+void inv_icm20948_read_magn_xyz(inv_icm20948_state *st, int16_t *mx, int16_t *my, int16_t *mz);
+void inv_icm20948_temperature(inv_icm20948_state *st, int16_t *temperature);
+void inv_icm20948_read_imu(inv_icm20948_state *st, IMU_DATA *imu_data);
+int16_t inv_icm20948_set_gyro_dlpf(inv_icm20948_state *st, uint8_t rate);
+int16_t inv_icm20948_set_accel_dlpf(inv_icm20948_state *st, uint8_t rate);
+void inv_icm20948_config_gyro(inv_icm20948_state *st, uint8_t full_scale_select);
+void inv_icm20948_config_accel(inv_icm20948_state *st, uint8_t full_scale_select);
+int16_t inv_icm20948_set_fsr(inv_icm20948_state *st, uint8_t accl_fsr, uint8_t gyro_fsr);
+
+int16_t inv_icm20948_get_fifo_counter(inv_icm20948_state *st);
+uint16_t inv_icm20948_set_fifo_watermark(inv_icm20948_state *st, uint16_t frames);
+uint16_t inv_icm20948_get_fifo_watermark(inv_icm20948_state *st);
 void inv_icm20948_read_imu_fifo(inv_icm20948_state *st, IMU_DATA *imu_data);
+int16_t inv_icm20948_read_imu_fifo_batch(inv_icm20948_state *st, IMU_DATA *imu_data, size_t max);
+int16_t inv_icm20948_read_imu_fifo_batch_async(inv_icm20948_state *st, IMU_DATA *imu_data, size_t max,
+                                               inv_icm20948_fifo_callback_t callback);
+int16_t inv_icm20948_read_dmp_fifo_batch_async(inv_icm20948_state *st, IMU_QUAT *imu_quat, size_t max,
+                                               inv_icm20948_fifo_callback_t callback);
+int16_t inv_icm20948_capture_start(inv_icm20948_state *st, uint16_t frames);
+void inv_icm20948_capture_next(inv_icm20948_state *st);
+int16_t inv_icm20948_capture_read(inv_icm20948_state *st, IMU_DATA *imu_data);
+void inv_icm20948_capture_stop(inv_icm20948_state *st);
+
+void inv_icm20948_sched_init(inv_icm20948_sched *sched, size_t max, inv_icm20948_sched_callback_t callback);
+int16_t inv_icm20948_sched_add(inv_icm20948_sched *sched, inv_icm20948_state *st, void *frames);
+int16_t inv_icm20948_sched_start(inv_icm20948_sched *sched);
+
+uint8_t inv_icm20948_read_register(inv_icm20948_state *st, uint16_t reg);
+int16_t inv_icm20948_read_register_block(inv_icm20948_state *st, uint16_t reg, uint8_t *block, uint8_t count);
+int16_t inv_icm20948_write_register(inv_icm20948_state *st, uint16_t reg, uint8_t value);
+int16_t inv_icm20948_write_register_block(inv_icm20948_state *st, uint16_t reg, uint8_t *block, uint8_t count);
 
-uint8_t inv_icm20948_read_register(uint16_t reg);
-void inv_icm20948_read_register_block(uint16_t reg, uint8_t *block, uint8_t count);
-void inv_icm20948_write_register(uint16_t reg, uint8_t value);
-void inv_icm20948_write_register_block(uint16_t reg, uint8_t *block, uint8_t count);
+void inv_icm20948_shadow_reset(inv_icm20948_state *st);
+void inv_icm20948_shadow_invalidate(inv_icm20948_state *st);
+uint8_t inv_icm20948_read_config(inv_icm20948_state *st, uint16_t reg);
+void inv_icm20948_write_config(inv_icm20948_state *st, uint16_t reg, uint8_t value);
+void inv_icm20948_stage_config(inv_icm20948_state *st, uint16_t reg, uint8_t mask, uint8_t value);
+int16_t inv_icm20948_commit_config(inv_icm20948_state *st);
 
 #endif // IMU_H__
@@ -0,0 +1,60 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* IMU sample packing -- a lossless codec for a block of samples of    */
+/*        up to IMU_PACK_FIELDS_MAX 16 bit fields each.  Every sample  */
+/*        is sent as its difference from the one before, zigzag        */
+/*        folded so small steps either way give small numbers, and    */
+/*        each field is bit packed to the width of its largest step    */
+/*        in the block.  The block starts with those widths, four      */
+/*        bits a field (15 stands for 16), then the steps one sample   */
+/*        after the other, least significant bit first.                */
+/*                                                                     */
+/*        The first sample of a block is the reference the steps start */
+/*        from; the caller sends it some other way.  Integer only, a   */
+/*        few instructions per field on a Cortex-M4.                   */
+/*                                                                     */
+/***********************************************************************/
+
+#ifndef IMU_PACK_H__
+#define IMU_PACK_H__
+
+#include <stdint.h>
+
+#define IMU_PACK_FIELDS_MAX     11      // time, accel, gyro, magn and temperature
+
+// Sample index of a block, 0 being the reference, into values[fields].
+typedef void (*imu_pack_get_t)(const void *context, uint16_t index, int16_t *values);
+typedef void (*imu_pack_put_t)(void *context, uint16_t index, const int16_t *values);
+
+// Pack the steps from sample 0 through as many of samples 1 to count - 1
+// as fit into len bytes.  Returns the bytes written, *p_used receives the
+// samples covered, the reference included.
+uint16_t imu_pack_encode(uint8_t *buffer, uint16_t len, uint8_t fields, imu_pack_get_t get, const void *context,
+                         uint16_t count, uint16_t *p_used);
+
+// Unpack samples 1 to count - 1 from the reference values in first.
+// Returns the bytes read, or -1 if the block is cut short.
+int imu_pack_decode(const uint8_t *buffer, uint16_t len, uint8_t fields, const int16_t *first,
+                    imu_pack_put_t put, void *context, uint16_t count);
+
+#endif // IMU_PACK_H__
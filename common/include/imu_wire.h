@@ -0,0 +1,111 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/***********************************************************************/
+/*                                                                     */
+/* IMU wire format -- how the samples travel in a notification on the  */
+/*        IMU data characteristic.  Shared by the peripheral, which    */
+/*        encodes, and the central, which decodes.                     */
+/*                                                                     */
+/*        All fields are little endian and packed.  The header:        */
+/*                                                                     */
+/*          version     IMU_WIRE_VERSION                               */
+/*          channels    IMU_WIRE_* bitmap of what each sample carries  */
+/*          sensor      index of the ICM-20948, IMU_WIRE_* flags       */
+/*          count       samples that follow                            */
+/*          time_stamp  us, when the first sample was taken (4 bytes)  */
+/*          period_us   the sample period (4 bytes, 2 before version 3)*/
+/*                                                                     */
+/*        Then count samples, each of them the time since the one     */
+/*        before (but for the first) and the channels in bitmap order. */
+/*        The time is a signed byte off period_us, or with             */
+/*        IMU_WIRE_DELTA16 the whole delta in 16 bits.                 */
+/*                                                                     */
+/*        With IMU_WIRE_PACKED only the first sample is sent that way, */
+/*        the rest follow as one imu_pack block (see imu_pack.h) with  */
+/*        the time as field 0, the step of each delta off period_us,   */
+/*        then the 16 bit channels.  Raw samples only, not quaternions.*/
+/*                                                                     */
+/***********************************************************************/
+
+#ifndef IMU_WIRE_H__
+#define IMU_WIRE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "imu.h"
+
+#define IMU_WIRE_VERSION        3
+#define IMU_WIRE_VERSION_MIN    1       // oldest the decoder reads, before IMU_WIRE_PACKED
+#define IMU_WIRE_HEADER_SIZE    12
+#define IMU_WIRE_HEADER_SIZE_V2 10      // up to version 2, with a 16 bit period_us
+
+// channels, in the order they follow each other in a sample
+#define IMU_WIRE_ACCEL          0x01    // ax, ay, az
+#define IMU_WIRE_GYRO           0x02    // gx, gy, gz
+#define IMU_WIRE_MAGN           0x04    // mx, my, mz
+#define IMU_WIRE_TEMP           0x08    // temperature
+#define IMU_WIRE_QUAT           0x10    // q0..q3, 32 bits each
+#define IMU_WIRE_ACCURACY       0x20    // heading accuracy of the quaternion
+#define IMU_WIRE_DATA_CHANNELS  (IMU_WIRE_ACCEL | IMU_WIRE_GYRO | IMU_WIRE_MAGN | IMU_WIRE_TEMP)
+#define IMU_WIRE_QUAT_CHANNELS  (IMU_WIRE_QUAT | IMU_WIRE_ACCURACY)
+
+// in the sensor byte
+#define IMU_WIRE_SENSOR_MASK    0x0f
+#define IMU_WIRE_PACKED         0x40
+#define IMU_WIRE_DELTA16        0x80
+
+typedef struct _imu_wire_header {
+        uint8_t  version;
+        uint8_t  channels;
+        uint8_t  sensor;
+        bool     delta16;
+        bool     packed;
+        uint8_t  count;
+        uint8_t  size;                  // of the header, in bytes
+        uint32_t time_stamp;
+        uint32_t period_us;
+} imu_wire_header;
+
+uint16_t imu_wire_sample_size(uint8_t channels, bool delta16);
+
+// Encode as many of the count records as fit into len bytes of buffer, all
+// of them from the same sensor.  channels is a subset of
+// IMU_WIRE_DATA_CHANNELS for IMU_DATA and of IMU_WIRE_QUAT_CHANNELS with
+// IMU_WIRE_QUAT for IMU_QUAT.  Raw samples are packed when that gets more
+// of them into len bytes.  Returns the bytes of the packet, 0 if not even
+// one record fits; *p_used receives the records it holds.
+uint16_t imu_wire_encode_data(uint8_t *buffer, uint16_t len, uint8_t channels, uint32_t period_us,
+                              const IMU_DATA *imu_data, uint16_t count, uint16_t *p_used);
+uint16_t imu_wire_encode_quat(uint8_t *buffer, uint16_t len, uint8_t channels, uint32_t period_us,
+                              const IMU_QUAT *imu_quat, uint16_t count, uint16_t *p_used);
+
+// Returns 0, or -1 if the packet is not one this version understands or
+// is cut short.
+int imu_wire_decode_header(const uint8_t *buffer, uint16_t len, imu_wire_header *header);
+
+// Decode up to max samples of a packet; channels it does not carry read 0
+// and deviceid is left 0.  Returns the samples, or -1 as above or if the
+// packet holds the other kind of record.
+int imu_wire_decode_data(const uint8_t *buffer, uint16_t len, IMU_DATA *imu_data, uint16_t max);
+int imu_wire_decode_quat(const uint8_t *buffer, uint16_t len, IMU_QUAT *imu_quat, uint16_t max);
+
+#endif // IMU_WIRE_H__
@@ -0,0 +1,161 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "imu_pack.h"
+
+// Map a step to 0, -1, 1, -2, 2... to 0, 1, 2, 3, 4...
+static inline uint16_t imu_pack_zigzag(int16_t step)
+{
+    return (uint16_t)(((uint16_t)step << 1) ^ (uint16_t)(step >> 15));
+}
+
+static inline int16_t imu_pack_unzigzag(uint16_t value)
+{
+    return (int16_t)((value >> 1) ^ (uint16_t)-(int16_t)(value & 1));
+}
+
+// Bits needed for value; a width of 15 is sent as 16 to fit a nibble.
+static inline uint8_t imu_pack_width(uint16_t value)
+{
+    uint8_t width = value ? (uint8_t)(32 - __builtin_clz(value)) : 0;
+
+    return (width == 15) ? 16 : width;
+}
+
+// The nibble that carries a width, 16 goes as 15.
+static inline uint8_t imu_pack_width_nibble(uint8_t width)
+{
+    return (width == 16) ? 15 : width;
+}
+
+static inline uint16_t imu_pack_width_bytes(uint8_t fields)
+{
+    return (fields + 1) / 2;
+}
+
+uint16_t imu_pack_encode(uint8_t *buffer, uint16_t len, uint8_t fields, imu_pack_get_t get, const void *context,
+                         uint16_t count, uint16_t *p_used)
+{
+    int16_t prev[IMU_PACK_FIELDS_MAX], next[IMU_PACK_FIELDS_MAX];
+    uint16_t or_steps[IMU_PACK_FIELDS_MAX] = {0};
+    uint8_t width[IMU_PACK_FIELDS_MAX] = {0};
+    uint8_t *p = buffer;
+    uint32_t acc = 0;
+    uint8_t acc_bits = 0;
+    uint16_t n, i;
+    uint8_t f;
+
+    *p_used = 0;
+    if ((count == 0) || (fields == 0) || (fields > IMU_PACK_FIELDS_MAX) || (len < imu_pack_width_bytes(fields)))
+        return 0;
+
+    // widen the fields sample by sample for as long as the block fits;
+    // or-ing the steps gives the same width as their largest
+    get(context, 0, prev);
+    for (n = 1; n < count; n++) {
+        uint16_t try_steps[IMU_PACK_FIELDS_MAX];
+        uint32_t try_bits = 0;
+
+        get(context, n, next);
+        for (f = 0; f < fields; f++) {
+            try_steps[f] = or_steps[f] | imu_pack_zigzag((int16_t)(uint16_t)(next[f] - prev[f]));
+            try_bits += imu_pack_width(try_steps[f]);
+        }
+        if (imu_pack_width_bytes(fields) + (n * try_bits + 7) / 8 > len)
+            break;
+        memcpy(or_steps, try_steps, sizeof(or_steps));
+        memcpy(prev, next, sizeof(prev));
+    }
+
+    for (f = 0; f < fields; f++)
+        width[f] = imu_pack_width(or_steps[f]);
+    for (f = 0; f < fields; f += 2) {
+        uint8_t high = (f + 1 < fields) ? imu_pack_width_nibble(width[f + 1]) : 0;
+
+        *p++ = imu_pack_width_nibble(width[f]) | (high << 4);
+    }
+
+    get(context, 0, prev);
+    for (i = 1; i < n; i++) {
+        get(context, i, next);
+        for (f = 0; f < fields; f++) {
+            acc |= (uint32_t)imu_pack_zigzag((int16_t)(uint16_t)(next[f] - prev[f])) << acc_bits;
+            acc_bits += width[f];
+            while (acc_bits >= 8) {
+                *p++ = (uint8_t)acc;
+                acc >>= 8;
+                acc_bits -= 8;
+            }
+        }
+        memcpy(prev, next, sizeof(prev));
+    }
+    if (acc_bits > 0)
+        *p++ = (uint8_t)acc;
+
+    *p_used = n;
+    return (uint16_t)(p - buffer);
+}
+
+int imu_pack_decode(const uint8_t *buffer, uint16_t len, uint8_t fields, const int16_t *first,
+                    imu_pack_put_t put, void *context, uint16_t count)
+{
+    int16_t values[IMU_PACK_FIELDS_MAX];
+    uint8_t width[IMU_PACK_FIELDS_MAX];
+    uint32_t bits_per_sample = 0;
+    const uint8_t *p = buffer;
+    uint32_t acc = 0;
+    uint8_t acc_bits = 0;
+    uint16_t i;
+    uint8_t f;
+
+    if ((fields == 0) || (fields > IMU_PACK_FIELDS_MAX))
+        return -1;
+    if (count <= 1)
+        return 0;
+    if (len < imu_pack_width_bytes(fields))
+        return -1;
+
+    for (f = 0; f < fields; f++) {
+        width[f] = (buffer[f / 2] >> ((f & 1) * 4)) & 0x0f;
+        if (width[f] == 15)
+            width[f] = 16;
+        bits_per_sample += width[f];
+    }
+    p += imu_pack_width_bytes(fields);
+    if (len < imu_pack_width_bytes(fields) + ((count - 1) * bits_per_sample + 7) / 8)
+        return -1;
+
+    memcpy(values, first, fields * sizeof(values[0]));
+    for (i = 1; i < count; i++) {
+        for (f = 0; f < fields; f++) {
+            while (acc_bits < width[f]) {
+                acc |= (uint32_t)*p++ << acc_bits;
+                acc_bits += 8;
+            }
+            values[f] = (int16_t)(uint16_t)(values[f] + imu_pack_unzigzag((uint16_t)(acc & ((1UL << width[f]) - 1))));
+            acc >>= width[f];
+            acc_bits -= width[f];
+        }
+        put(context, i, values);
+    }
+    return (int)(p - buffer);
+}
@@ -0,0 +1,497 @@
+/*
+ * Copyright(c) 2021 - Jim Newman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stddef.h>
+
+#include "imu_wire.h"
+#include "imu_pack.h"
+
+// the encoder and decoder find the time of either kind of record here
+typedef char imu_wire_time_stamp_offset[(offsetof(IMU_DATA, time_stamp) == offsetof(IMU_QUAT, time_stamp)) ? 1 : -1];
+
+typedef uint8_t *(*imu_wire_put_t)(uint8_t *p, const void *record, uint8_t channels);
+typedef const uint8_t *(*imu_wire_get_t)(const uint8_t *p, void *record, uint8_t channels);
+
+static uint8_t *imu_wire_put16(uint8_t *p, int16_t value)
+{
+    *p++ = (uint8_t)value;
+    *p++ = (uint8_t)((uint16_t)value >> 8);
+    return p;
+}
+
+static uint8_t *imu_wire_put32(uint8_t *p, int32_t value)
+{
+    p = imu_wire_put16(p, (int16_t)value);
+    return imu_wire_put16(p, (int16_t)((uint32_t)value >> 16));
+}
+
+static const uint8_t *imu_wire_get16(const uint8_t *p, int16_t *value)
+{
+    *value = (int16_t)(p[0] | (p[1] << 8));
+    return p + 2;
+}
+
+static const uint8_t *imu_wire_get32(const uint8_t *p, int32_t *value)
+{
+    *value = (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+    return p + 4;
+}
+
+// bytes of a sample, less its time
+static uint16_t imu_wire_channel_size(uint8_t channels)
+{
+    uint16_t size = 0;
+
+    if (channels & IMU_WIRE_ACCEL)
+        size += 6;
+    if (channels & IMU_WIRE_GYRO)
+        size += 6;
+    if (channels & IMU_WIRE_MAGN)
+        size += 6;
+    if (channels & IMU_WIRE_TEMP)
+        size += 2;
+    if (channels & IMU_WIRE_QUAT)
+        size += 16;
+    if (channels & IMU_WIRE_ACCURACY)
+        size += 2;
+    return size;
+}
+
+uint16_t imu_wire_sample_size(uint8_t channels, bool delta16)
+{
+    return imu_wire_channel_size(channels) + (delta16 ? 2 : 1);
+}
+
+static uint8_t *imu_wire_put_data(uint8_t *p, const void *record, uint8_t channels)
+{
+    const IMU_DATA *d = record;
+
+    if (channels & IMU_WIRE_ACCEL) {
+        p = imu_wire_put16(p, d->ax);
+        p = imu_wire_put16(p, d->ay);
+        p = imu_wire_put16(p, d->az);
+    }
+    if (channels & IMU_WIRE_GYRO) {
+        p = imu_wire_put16(p, d->gx);
+        p = imu_wire_put16(p, d->gy);
+        p = imu_wire_put16(p, d->gz);
+    }
+    if (channels & IMU_WIRE_MAGN) {
+        p = imu_wire_put16(p, d->mx);
+        p = imu_wire_put16(p, d->my);
+        p = imu_wire_put16(p, d->mz);
+    }
+    if (channels & IMU_WIRE_TEMP)
+        p = imu_wire_put16(p, d->temperature);
+    return p;
+}
+
+static uint8_t *imu_wire_put_quat(uint8_t *p, const void *record, uint8_t channels)
+{
+    const IMU_QUAT *q = record;
+
+    p = imu_wire_put32(p, q->q0);
+    p = imu_wire_put32(p, q->q1);
+    p = imu_wire_put32(p, q->q2);
+    p = imu_wire_put32(p, q->q3);
+    if (channels & IMU_WIRE_ACCURACY)
+        p = imu_wire_put16(p, q->accuracy);
+    return p;
+}
+
+static const uint8_t *imu_wire_get_data(const uint8_t *p, void *record, uint8_t channels)
+{
+    IMU_DATA *d = record;
+
+    if (channels & IMU_WIRE_ACCEL) {
+        p = imu_wire_get16(p, &d->ax);
+        p = imu_wire_get16(p, &d->ay);
+        p = imu_wire_get16(p, &d->az);
+    }
+    if (channels & IMU_WIRE_GYRO) {
+        p = imu_wire_get16(p, &d->gx);
+        p = imu_wire_get16(p, &d->gy);
+        p = imu_wire_get16(p, &d->gz);
+    }
+    if (channels & IMU_WIRE_MAGN) {
+        p = imu_wire_get16(p, &d->mx);
+        p = imu_wire_get16(p, &d->my);
+        p = imu_wire_get16(p, &d->mz);
+    }
+    if (channels & IMU_WIRE_TEMP)
+        p = imu_wire_get16(p, &d->temperature);
+    return p;
+}
+
+static const uint8_t *imu_wire_get_quat(const uint8_t *p, void *record, uint8_t channels)
+{
+    IMU_QUAT *q = record;
+
+    p = imu_wire_get32(p, &q->q0);
+    p = imu_wire_get32(p, &q->q1);
+    p = imu_wire_get32(p, &q->q2);
+    p = imu_wire_get32(p, &q->q3);
+    if (channels & IMU_WIRE_ACCURACY)
+        p = imu_wire_get16(p, &q->accuracy);
+    return p;
+}
+
+// How many of the records go into a packet of len bytes with the time
+// carried in delta bytes each.  Stops at a time that does not fit.
+static uint16_t imu_wire_fit(uint16_t len, uint16_t channel_size, uint32_t period_us, const uint32_t *times,
+                             size_t stride, uint16_t count, bool delta16)
+{
+    uint16_t n;
+    uint16_t used = IMU_WIRE_HEADER_SIZE + channel_size;
+
+    if ((count == 0) || (len < used))
+        return 0;
+    for (n = 1; (n < count) && (n < UINT8_MAX); n++) {
+        const uint32_t *prev = (const uint32_t *)((const uint8_t *)times + (n - 1) * stride);
+        const uint32_t *next = (const uint32_t *)((const uint8_t *)times + n * stride);
+        uint32_t delta = *next - *prev;
+        int32_t deviation = (int32_t)(delta - period_us);
+
+        if (delta16 ? (delta > UINT16_MAX) : ((deviation < INT8_MIN) || (deviation > INT8_MAX)))
+            break;
+        used += channel_size + (delta16 ? 2 : 1);
+        if (used > len)
+            break;
+    }
+    return n;
+}
+
+static uint16_t imu_wire_encode(uint8_t *buffer, uint16_t len, uint8_t channels, uint32_t period_us,
+                                const void *records, size_t stride, uint16_t sensor, uint16_t count,
+                                uint16_t *p_used, imu_wire_put_t put)
+{
+    uint16_t channel_size = imu_wire_channel_size(channels);
+    const uint32_t *times = (const uint32_t *)((const uint8_t *)records + offsetof(IMU_DATA, time_stamp));
+    uint16_t n8 = imu_wire_fit(len, channel_size, period_us, times, stride, count, false);
+    uint16_t n16 = imu_wire_fit(len, channel_size, period_us, times, stride, count, true);
+    bool delta16 = n16 > n8;
+    uint16_t n = delta16 ? n16 : n8;
+    uint8_t *p = buffer;
+    uint32_t last;
+    uint16_t i;
+
+    *p_used = n;
+    if (n == 0)
+        return 0;
+
+    last = times[0];
+    *p++ = IMU_WIRE_VERSION;
+    *p++ = channels;
+    *p++ = (sensor & IMU_WIRE_SENSOR_MASK) | (delta16 ? IMU_WIRE_DELTA16 : 0);
+    *p++ = (uint8_t)n;
+    p = imu_wire_put32(p, (int32_t)last);
+    p = imu_wire_put32(p, (int32_t)period_us);
+
+    for (i = 0; i < n; i++) {
+        const uint8_t *record = (const uint8_t *)records + i * stride;
+        uint32_t time_stamp = *(const uint32_t *)(record + offsetof(IMU_DATA, time_stamp));
+
+        if (i > 0) {
+            if (delta16)
+                p = imu_wire_put16(p, (int16_t)(time_stamp - last));
+            else
+                *p++ = (uint8_t)(int8_t)((int32_t)(time_stamp - last - period_us));
+        }
+        last = time_stamp;
+        p = put(p, record, channels);
+    }
+    return (uint16_t)(p - buffer);
+}
+
+// A packed packet carries the first sample as usual, then the rest through
+// imu_pack.  Field 0 is the time off the grid of periods from the first
+// sample, kept to 16 bits: only its steps, the deviation of each delta
+// from the period, need to be exact.
+typedef struct _imu_wire_pack {
+        const IMU_DATA *records;        // encoding
+        IMU_DATA *out;                  // decoding
+        uint16_t max;
+        uint8_t channels;
+        uint32_t period_us;
+        uint32_t time_stamp;            // of the sample before
+        int16_t offset;                 // and its field 0
+} imu_wire_pack;
+
+static uint8_t imu_wire_fields(uint8_t channels)
+{
+    return 1 + imu_wire_channel_size(channels & IMU_WIRE_DATA_CHANNELS) / 2;
+}
+
+static void imu_wire_pack_get(const void *context, uint16_t index, int16_t *values)
+{
+    const imu_wire_pack *pack = context;
+    const IMU_DATA *d = &pack->records[index];
+
+    *values++ = (int16_t)(uint16_t)(d->time_stamp - pack->records[0].time_stamp - (uint32_t)index * pack->period_us);
+    if (pack->channels & IMU_WIRE_ACCEL) {
+        *values++ = d->ax;
+        *values++ = d->ay;
+        *values++ = d->az;
+    }
+    if (pack->channels & IMU_WIRE_GYRO) {
+        *values++ = d->gx;
+        *values++ = d->gy;
+        *values++ = d->gz;
+    }
+    if (pack->channels & IMU_WIRE_MAGN) {
+        *values++ = d->mx;
+        *values++ = d->my;
+        *values++ = d->mz;
+    }
+    if (pack->channels & IMU_WIRE_TEMP)
+        *values++ = d->temperature;
+}
+
+static void imu_wire_pack_put(void *context, uint16_t index, const int16_t *values)
+{
+    imu_wire_pack *pack = context;
+    IMU_DATA *d = &pack->out[index];
+
+    pack->time_stamp += pack->period_us + (int16_t)(uint16_t)(values[0] - pack->offset);
+    pack->offset = *values++;
+    if (index >= pack->max)
+        return;
+    memset(d, 0, sizeof(*d));
+    d->time_stamp = pack->time_stamp;
+    if (pack->channels & IMU_WIRE_ACCEL) {
+        d->ax = *values++;
+        d->ay = *values++;
+        d->az = *values++;
+    }
+    if (pack->channels & IMU_WIRE_GYRO) {
+        d->gx = *values++;
+        d->gy = *values++;
+        d->gz = *values++;
+    }
+    if (pack->channels & IMU_WIRE_MAGN) {
+        d->mx = *values++;
+        d->my = *values++;
+        d->mz = *values++;
+    }
+    if (pack->channels & IMU_WIRE_TEMP)
+        d->temperature = *values++;
+}
+
+static uint16_t imu_wire_encode_packed(uint8_t *buffer, uint16_t len, uint8_t channels, uint32_t period_us,
+                                       const IMU_DATA *imu_data, uint16_t count, uint16_t *p_used)
+{
+    imu_wire_pack pack = { .records = imu_data, .channels = channels, .period_us = period_us };
+    uint16_t channel_size = imu_wire_channel_size(channels);
+    uint16_t n, size;
+    uint8_t *p = buffer;
+
+    *p_used = 0;
+    if ((count < 2) || (len < IMU_WIRE_HEADER_SIZE + channel_size))
+        return 0;
+
+    // the time steps have to fit field 0
+    for (n = 1; (n < count) && (n < UINT8_MAX); n++) {
+        int32_t deviation = (int32_t)(imu_data[n].time_stamp - imu_data[n - 1].time_stamp - period_us);
+
+        if ((deviation < INT16_MIN) || (deviation > INT16_MAX))
+            break;
+    }
+
+    *p++ = IMU_WIRE_VERSION;
+    *p++ = channels;
+    *p++ = (imu_data[0].sensor & IMU_WIRE_SENSOR_MASK) | IMU_WIRE_PACKED;
+    p++;
+    p = imu_wire_put32(p, (int32_t)imu_data[0].time_stamp);
+    p = imu_wire_put32(p, (int32_t)period_us);
+    p = imu_wire_put_data(p, imu_data, channels);
+    size = imu_pack_encode(p, len - (uint16_t)(p - buffer), imu_wire_fields(channels), imu_wire_pack_get, &pack,
+                           n, p_used);
+    if (*p_used == 0)
+        return 0;
+    buffer[3] = (uint8_t)*p_used;
+    return (uint16_t)(p - buffer) + size;
+}
+
+uint16_t imu_wire_encode_data(uint8_t *buffer, uint16_t len, uint8_t channels, uint32_t period_us,
+                              const IMU_DATA *imu_data, uint16_t count, uint16_t *p_used)
+{
+    uint16_t packed_len, packed_used;
+
+    channels &= IMU_WIRE_DATA_CHANNELS;
+
+    // packed if that gets more samples into the packet, or the same in
+    // fewer bytes
+    packed_len = imu_wire_encode_packed(buffer, len, channels, period_us, imu_data, count, &packed_used);
+    if (packed_len > 0) {
+        uint16_t channel_size = imu_wire_channel_size(channels);
+        const uint32_t *times = &imu_data[0].time_stamp;
+        uint16_t n8 = imu_wire_fit(len, channel_size, period_us, times, sizeof(IMU_DATA), count, false);
+        uint16_t n16 = imu_wire_fit(len, channel_size, period_us, times, sizeof(IMU_DATA), count, true);
+        uint16_t n = (n16 > n8) ? n16 : n8;
+
+        if ((packed_used > n) ||
+            ((packed_used == n) && (packed_len < IMU_WIRE_HEADER_SIZE + n * channel_size + (n - 1) * ((n16 > n8) ? 2 : 1)))) {
+            *p_used = packed_used;
+            return packed_len;
+        }
+    }
+    return imu_wire_encode(buffer, len, channels, period_us, imu_data, sizeof(IMU_DATA),
+                           count ? imu_data[0].sensor : 0, count, p_used, imu_wire_put_data);
+}
+
+uint16_t imu_wire_encode_quat(uint8_t *buffer, uint16_t len, uint8_t channels, uint32_t period_us,
+                              const IMU_QUAT *imu_quat, uint16_t count, uint16_t *p_used)
+{
+    channels = (channels & IMU_WIRE_QUAT_CHANNELS) | IMU_WIRE_QUAT;
+    return imu_wire_encode(buffer, len, channels, period_us, imu_quat, sizeof(IMU_QUAT),
+                           count ? imu_quat[0].sensor : 0, count, p_used, imu_wire_put_quat);
+}
+
+int imu_wire_decode_header(const uint8_t *buffer, uint16_t len, imu_wire_header *header)
+{
+    const uint8_t *p = buffer;
+    int32_t time_stamp;
+    uint16_t channel_size;
+
+    if ((len < IMU_WIRE_HEADER_SIZE_V2) || (buffer[0] < IMU_WIRE_VERSION_MIN) || (buffer[0] > IMU_WIRE_VERSION))
+        return -1;
+    header->size = (buffer[0] < 3) ? IMU_WIRE_HEADER_SIZE_V2 : IMU_WIRE_HEADER_SIZE;
+    if (len < header->size)
+        return -1;
+    header->version = *p++;
+    header->channels = *p++;
+    header->sensor = *p & IMU_WIRE_SENSOR_MASK;
+    header->delta16 = (*p & IMU_WIRE_DELTA16) != 0;
+    header->packed = (*p++ & IMU_WIRE_PACKED) != 0;
+    header->count = *p++;
+    p = imu_wire_get32(p, &time_stamp);
+    header->time_stamp = (uint32_t)time_stamp;
+    if (header->size == IMU_WIRE_HEADER_SIZE_V2) {
+        int16_t period_us;
+
+        imu_wire_get16(p, &period_us);
+        header->period_us = (uint16_t)period_us;
+    } else {
+        int32_t period_us;
+
+        imu_wire_get32(p, &period_us);
+        header->period_us = (uint32_t)period_us;
+    }
+
+    // unknown channels would leave us unable to find the next sample
+    if (header->channels & ~(IMU_WIRE_DATA_CHANNELS | IMU_WIRE_QUAT_CHANNELS))
+        return -1;
+    // imu_pack checks the rest of a packed packet
+    if (header->packed && (header->channels & IMU_WIRE_QUAT))
+        return -1;
+    channel_size = imu_wire_channel_size(header->channels);
+    if (header->packed && (header->count > 0) && (len < header->size + channel_size))
+        return -1;
+    if (!header->packed && (header->count > 0) &&
+        (len < header->size + header->count * channel_size + (header->count - 1) * (header->delta16 ? 2 : 1)))
+        return -1;
+    return 0;
+}
+
+static int imu_wire_decode(const uint8_t *buffer, uint16_t len, void *records, size_t stride, uint16_t max,
+                           bool quat, imu_wire_get_t get)
+{
+    imu_wire_header header;
+    const uint8_t *p;
+    uint32_t time_stamp;
+    uint16_t i;
+
+    if (imu_wire_decode_header(buffer, len, &header) != 0)
+        return -1;
+    p = buffer + header.size;
+    if (((header.channels & IMU_WIRE_QUAT) != 0) != quat)
+        return -1;
+
+    time_stamp = header.time_stamp;
+    for (i = 0; (i < header.count) && (i < max); i++) {
+        uint8_t *record = (uint8_t *)records + i * stride;
+
+        if (i > 0) {
+            if (header.delta16) {
+                int16_t delta;
+
+                p = imu_wire_get16(p, &delta);
+                time_stamp += (uint16_t)delta;
+            } else {
+                time_stamp += header.period_us + (int8_t)*p++;
+            }
+        }
+        memset(record, 0, stride);
+        p = get(p, record, header.channels);
+        *(uint32_t *)(record + offsetof(IMU_DATA, time_stamp)) = time_stamp;
+    }
+    return i;
+}
+
+static int imu_wire_decode_packed(const uint8_t *buffer, uint16_t len, const imu_wire_header *header,
+                                  IMU_DATA *imu_data, uint16_t max)
+{
+    imu_wire_pack pack = { .out = imu_data, .max = max, .channels = header->channels,
+                           .period_us = header->period_us, .time_stamp = header->time_stamp };
+    IMU_DATA first = {0};
+    int16_t values[IMU_PACK_FIELDS_MAX];
+    const uint8_t *p = buffer + header->size;
+
+    if ((header->count == 0) || (max == 0))
+        return 0;
+    p = imu_wire_get_data(p, &first, header->channels);
+    first.time_stamp = header->time_stamp;
+    pack.records = &first;
+    imu_wire_pack_get(&pack, 0, values);
+    if (imu_pack_decode(p, len - (uint16_t)(p - buffer), imu_wire_fields(header->channels), values,
+                        imu_wire_pack_put, &pack, header->count) < 0)
+        return -1;
+    imu_data[0] = first;
+    return (header->count < max) ? header->count : max;
+}
+
+int imu_wire_decode_data(const uint8_t *buffer, uint16_t len, IMU_DATA *imu_data, uint16_t max)
+{
+    imu_wire_header header;
+    int count;
+    int i;
+
+    if (imu_wire_decode_header(buffer, len, &header) != 0)
+        return -1;
+    if (header.packed)
+        count = imu_wire_decode_packed(buffer, len, &header, imu_data, max);
+    else
+        count = imu_wire_decode(buffer, len, imu_data, sizeof(IMU_DATA), max, false, imu_wire_get_data);
+
+    for (i = 0; i < count; i++)
+        imu_data[i].sensor = buffer[2] & IMU_WIRE_SENSOR_MASK;
+    return count;
+}
+
+int imu_wire_decode_quat(const uint8_t *buffer, uint16_t len, IMU_QUAT *imu_quat, uint16_t max)
+{
+    int count = imu_wire_decode(buffer, len, imu_quat, sizeof(IMU_QUAT), max, true, imu_wire_get_quat);
+    int i;
+
+    for (i = 0; i < count; i++)
+        imu_quat[i].sensor = buffer[2] & IMU_WIRE_SENSOR_MASK;
+    return count;
+}